@@ -0,0 +1,182 @@
+//////////////////////////////////////////////////////////////////////
+//
+// Asset Loader Class
+//
+// AssetLoader.cpp: implementation of the AssetLoader class.
+//
+//////////////////////////////////////////////////////////////////////
+
+#include "AssetLoader.h"
+#include "WorkerPool.h"
+
+#include <string>
+#include <thread>
+
+//////////////////////////////////////////////////////////////////////
+// Construction/Destruction
+//////////////////////////////////////////////////////////////////////
+
+AssetLoader::AssetLoader()
+{
+	pending = 0;
+}
+
+AssetLoader::~AssetLoader()
+{
+	// The workers may still be writing into the jobs
+	for (;;)
+	{
+		bool busy = false;
+
+		{
+			std::lock_guard<std::mutex> guard(lock);
+
+			for (size_t i = 0; i < jobs.size() && !busy; i++)
+				busy = (jobs[i]->state == QUEUED);
+		}
+
+		if (!busy)
+			break;
+
+		std::this_thread::yield();
+	}
+
+	for (size_t i = 0; i < jobs.size(); i++)
+		delete jobs[i];
+}
+
+AssetLoader::Handle AssetLoader::LoadModel(Model_3DS *model, const char *name)
+{
+	std::string file = name;
+	TextureAtlas *atlas = model->atlas;
+
+	// The atlas builds its changed pages once every model queued on
+	// it placed its textures, on the worker that finished last
+	if (atlas)
+		atlas->Hold();
+
+	return LoadJob(
+		[model, file, atlas]()
+		{
+			bool ok = model->Decode(file.c_str());
+
+			if (atlas)
+				atlas->Release();
+
+			return ok;
+		},
+		[model](size_t &budget) { return model->FinalizeSome(budget); });
+}
+
+AssetLoader::Handle AssetLoader::LoadTexture(GLTexture *tex, const char *name)
+{
+	std::string file = name;
+
+	return LoadJob(
+		[tex, file]() { return tex->Decode(file.c_str()); },
+		[tex](size_t &budget)
+		{
+			size_t bytes = (size_t)tex->width * tex->height * (tex->format == GL_RGBA ? 4 : 3);
+
+			budget = (bytes >= budget) ? 0 : budget - bytes;
+			tex->Upload();
+			return true;
+		});
+}
+
+AssetLoader::Handle AssetLoader::LoadJob(const DecodeFunc &decode, const FinalizeFunc &finalize)
+{
+	Job *job = new Job;
+	job->decode = decode;
+	job->finalize = finalize;
+	job->state = QUEUED;
+
+	Handle h;
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		h = (Handle)jobs.size();
+		jobs.push_back(job);
+		pending++;
+	}
+
+	// The job pointer stays valid until the loader is destroyed
+	WorkerPool::Shared().Submit([this, job, h]()
+		{
+			bool ok = job->decode ? job->decode() : true;
+
+			std::lock_guard<std::mutex> guard(lock);
+
+			if (ok)
+			{
+				job->state = DECODED;
+				decoded.push_back(h);
+			}
+			else
+			{
+				job->state = FAILED;
+				pending--;
+			}
+		});
+
+	return h;
+}
+
+void AssetLoader::Update(size_t budget)
+{
+	// Pick up what the workers finished since last frame
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		while (!decoded.empty())
+		{
+			finalizing.push_back(decoded.front());
+			decoded.pop_front();
+		}
+	}
+
+	// Always make some progress, even with a tiny budget
+	if (budget == 0)
+		budget = 1;
+
+	while (!finalizing.empty() && budget > 0)
+	{
+		Job *job = jobs[finalizing.front()];
+
+		if (job->finalize && !job->finalize(budget))
+			break;
+
+		std::lock_guard<std::mutex> guard(lock);
+		job->state = READY;
+		pending--;
+		finalizing.pop_front();
+	}
+}
+
+void AssetLoader::FinishAll()
+{
+	while (Pending() > 0)
+	{
+		Update((size_t)-1);
+
+		// Give the workers a moment if they are still decoding
+		if (Pending() > 0)
+			std::this_thread::yield();
+	}
+}
+
+AssetLoader::State AssetLoader::GetState(Handle h)
+{
+	std::lock_guard<std::mutex> guard(lock);
+
+	if (h < 0 || h >= (Handle)jobs.size())
+		return FAILED;
+
+	return jobs[h]->state;
+}
+
+int AssetLoader::Pending()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return pending;
+}
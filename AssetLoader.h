@@ -0,0 +1,93 @@
+//////////////////////////////////////////////////////////////////////
+//
+// Asset Loader Class
+//
+// AssetLoader.h: interface for the AssetLoader class.
+// This class streams the game's assets in the background so
+// the window can open and render right away. Every request
+// returns a handle at once. The file reading and decoding
+// happens on the shared WorkerPool, and the GL side of each
+// asset is finished on the GL thread by Update, which the
+// main loop calls once per frame with a budget of how many
+// bytes it may upload that frame.
+//
+// Models that are still loading draw nothing, and then a wire
+// box, until they are ready (see Model_3DS::Draw).
+//
+// Usage:
+// AssetLoader loader;
+//
+// AssetLoader::Handle h = loader.LoadModel(&model, "model.3ds");
+// loader.LoadTexture(&tex, "texture.bmp");
+//
+// // Any CPU work can be queued with an optional GL step
+// loader.LoadJob(decode, finalize);
+//
+// // Once per frame on the GL thread
+// loader.Update(4 * 1024 * 1024);	// Upload at most ~4 MB this frame
+//
+// if (loader.IsReady(h))			// The model is fully loaded
+//     ...
+// if (loader.Pending() == 0)		// Everything is loaded
+//     ...
+//
+//////////////////////////////////////////////////////////////////////
+
+#ifndef ASSETLOADER_H
+#define ASSETLOADER_H
+
+#include "Model_3DS.h"
+#include "GLTexture.h"
+
+#include <functional>
+#include <vector>
+#include <deque>
+#include <mutex>
+
+class AssetLoader
+{
+public:
+	typedef int Handle;
+
+	enum State {
+		QUEUED,		// Waiting for a worker
+		DECODED,	// The CPU work is done, waiting for Update
+		READY,		// Fully loaded
+		FAILED		// The CPU work failed
+	};
+
+	// The CPU part of a job, runs on a worker and returns false if it failed
+	typedef std::function<bool()> DecodeFunc;
+	// The GL part of a job, runs in Update. It spends the byte budget
+	// it is given and returns true once it is completely done
+	typedef std::function<bool(size_t &budget)> FinalizeFunc;
+
+	Handle LoadModel(Model_3DS *model, const char *name);	// Streams in a model and its textures
+	Handle LoadTexture(GLTexture *tex, const char *name);	// Streams in a texture
+	Handle LoadJob(const DecodeFunc &decode, const FinalizeFunc &finalize);	// Streams in anything else
+	void Update(size_t budget);								// Finishes decoded assets, call once per frame
+	void FinishAll();										// Blocks until everything is loaded
+	State GetState(Handle h);								// Where an asset is at
+	bool IsReady(Handle h) { return GetState(h) == READY; }
+	int Pending();											// The number of assets that are not ready or failed
+	AssetLoader();											// Constructor
+	virtual ~AssetLoader();									// Destructor
+
+private:
+	struct Job {
+		DecodeFunc decode;
+		FinalizeFunc finalize;
+		State state;
+	};
+
+	std::vector<Job *> jobs;		// Every job ever queued, indexed by handle
+	std::deque<Handle> decoded;		// Jobs the workers finished, guarded by lock
+	std::deque<Handle> finalizing;	// Jobs Update is working through, GL thread only
+	std::mutex lock;				// Guards decoded and the job states
+	int pending;					// Jobs that are not ready or failed
+
+	AssetLoader(const AssetLoader &);
+	AssetLoader &operator=(const AssetLoader &);
+};
+
+#endif ASSETLOADER_H
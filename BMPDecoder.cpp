@@ -0,0 +1,354 @@
+//////////////////////////////////////////////////////////////////////
+//
+// Bitmap Decoder Class
+//
+// BMPDecoder.cpp: implementation of the BMPDecoder class.
+//
+//////////////////////////////////////////////////////////////////////
+
+#include "BMPDecoder.h"
+#include "ImageKernels.h"
+#include "MappedFile.h"
+#include "PixelPool.h"
+
+#include <string.h>
+
+#define BMP_RGB			0		// No compression
+#define BMP_RLE8		1		// Runs of 8 bit palette indices
+#define BMP_BITFIELDS	3		// Uncompressed with masks for the channels
+#define BMP_MAX_SIZE	32768	// Bigger than any texture a card takes
+
+// The file is little endian, and may not be aligned
+static unsigned int ReadU16(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static unsigned int ReadU32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+// True if the set bits of mask are all next to each other
+static bool ContiguousMask(unsigned int mask)
+{
+	if (mask == 0)
+		return false;
+
+	while ((mask & 1) == 0)
+		mask >>= 1;
+
+	return (mask & (mask + 1)) == 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Headers
+//////////////////////////////////////////////////////////////////////
+
+bool BMPDecoder::ReadInfo(const unsigned char *data, size_t size, Info &info)
+{
+	memset(&info, 0, sizeof(info));
+
+	// The file header and the size of the info header
+	if (data == NULL || size < 18 || data[0] != 'B' || data[1] != 'M')
+		return false;
+
+	size_t headerSize = ReadU32(data + 14);
+
+	// The old OS/2 header isn't worth the trouble
+	if (headerSize < 40 || size < 14 + headerSize)
+		return false;
+
+	const unsigned char *h = data + 14;
+	int width = (int)ReadU32(h + 4);
+	int height = (int)ReadU32(h + 8);
+	unsigned int colorsUsed = ReadU32(h + 32);
+
+	info.bitsPerPixel = (int)ReadU16(h + 14);
+	info.compression = (int)ReadU32(h + 16);
+	info.dataOffset = ReadU32(data + 10);
+	info.topDown = height < 0;
+	info.width = width;
+	info.height = height < 0 ? -height : height;
+
+	if (info.width <= 0 || info.height <= 0 || info.width > BMP_MAX_SIZE || info.height > BMP_MAX_SIZE)
+		return false;
+
+	// Only the combinations this decodes
+	switch (info.bitsPerPixel)
+	{
+		case 8	:
+			// A compressed image is always stored bottom up
+			if (info.compression != BMP_RGB && !(info.compression == BMP_RLE8 && !info.topDown))
+				return false;
+			break;
+		case 24	:
+			if (info.compression != BMP_RGB)
+				return false;
+			break;
+		case 32	:
+			if (info.compression != BMP_RGB && info.compression != BMP_BITFIELDS)
+				return false;
+			break;
+		default	:
+			return false;
+	}
+
+	// Where the palette or the masks are
+	size_t after = 14 + headerSize;
+
+	if (info.bitsPerPixel == 32)
+	{
+		// Without bit fields the pixels are BGRx
+		info.masks[0] = 0x00FF0000;
+		info.masks[1] = 0x0000FF00;
+		info.masks[2] = 0x000000FF;
+		info.masks[3] = 0;
+
+		if (info.compression == BMP_BITFIELDS)
+		{
+			// The newer headers hold the masks, the oldest is followed by them
+			const unsigned char *m = h + 40;
+
+			if (headerSize == 40)
+			{
+				if (size < after + 12)
+					return false;
+
+				m = data + after;
+			}
+
+			info.masks[0] = ReadU32(m);
+			info.masks[1] = ReadU32(m + 4);
+			info.masks[2] = ReadU32(m + 8);
+			info.masks[3] = headerSize >= 56 ? ReadU32(h + 52) : 0;
+
+			for (int i = 0; i < 3; i++)
+			{
+				if (!ContiguousMask(info.masks[i]))
+					return false;
+			}
+
+			if (info.masks[3] != 0 && !ContiguousMask(info.masks[3]))
+				info.masks[3] = 0;
+		}
+
+		info.alpha = info.masks[3] != 0;
+	}
+	else if (info.bitsPerPixel == 8)
+	{
+		info.paletteSize = (colorsUsed > 0 && colorsUsed < 256) ? (int)colorsUsed : 256;
+
+		// Some writers leave the palette short, keep what is there
+		if (size < after + 4)
+			return false;
+
+		if (after + info.paletteSize * 4 > size)
+			info.paletteSize = (int)((size - after) / 4);
+
+		info.palette = data + after;
+	}
+
+	if (info.dataOffset >= size)
+		return false;
+
+	// The uncompressed rows are padded to 4 bytes, all of them have to be there
+	if (info.compression != BMP_RLE8)
+	{
+		size_t stride = (((size_t)info.width * info.bitsPerPixel + 31) / 32) * 4;
+
+		if (info.dataOffset + stride * info.height > size)
+			return false;
+	}
+
+	return true;
+}
+
+size_t BMPDecoder::ImageSize(const Info &info)
+{
+	return (size_t)info.width * info.height * (info.alpha ? 4 : 3);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Pixels
+//////////////////////////////////////////////////////////////////////
+
+// One channel of a bit field pixel scaled to 8 bits
+static unsigned char Channel(unsigned int pixel, unsigned int mask)
+{
+	int shift = 0;
+
+	while (((mask >> shift) & 1) == 0)
+		shift++;
+
+	unsigned int max = mask >> shift;
+	unsigned int v = (pixel & mask) >> shift;
+
+	if (max == 255)
+		return (unsigned char)v;
+
+	return (unsigned char)((v * 255 + max / 2) / max);
+}
+
+// A palette entry as RGB
+static void PaletteColor(const BMPDecoder::Info &info, int index, unsigned char *out)
+{
+	if (index >= info.paletteSize)
+	{
+		out[0] = out[1] = out[2] = 0;
+		return;
+	}
+
+	const unsigned char *c = info.palette + index * 4;
+
+	out[0] = c[2];
+	out[1] = c[1];
+	out[2] = c[0];
+}
+
+static void DecodeRLE8(const unsigned char *p, const unsigned char *end, const BMPDecoder::Info &info, unsigned char *out)
+{
+	int x = 0;
+	int y = 0;
+
+	// Pixels the runs skip over stay black
+	memset(out, 0, (size_t)info.width * info.height * 3);
+
+	while (p + 2 <= end && y < info.height)
+	{
+		int count = p[0];
+		int value = p[1];
+		p += 2;
+
+		if (count > 0)
+		{
+			// A run of one color
+			unsigned char color[3];
+			PaletteColor(info, value, color);
+
+			for (; count > 0 && x < info.width; count--, x++)
+				memcpy(out + ((size_t)y * info.width + x) * 3, color, 3);
+		}
+		else if (value == 0)
+		{
+			// End of the line
+			x = 0;
+			y++;
+		}
+		else if (value == 1)
+		{
+			// End of the image
+			break;
+		}
+		else if (value == 2)
+		{
+			// Move right and up
+			if (p + 2 > end)
+				break;
+
+			x += p[0];
+			y += p[1];
+			p += 2;
+		}
+		else
+		{
+			// value indices as they are, padded to 2 bytes
+			if (p + value > end)
+				break;
+
+			for (int i = 0; i < value; i++, x++)
+			{
+				if (x < info.width)
+					PaletteColor(info, p[i], out + ((size_t)y * info.width + x) * 3);
+			}
+
+			p += value + (value & 1);
+		}
+	}
+}
+
+bool BMPDecoder::Decode(const unsigned char *data, size_t size, const Info &info, unsigned char *out)
+{
+	if (out == NULL)
+		return false;
+
+	const unsigned char *pixels = data + info.dataOffset;
+
+	if (info.compression == BMP_RLE8)
+	{
+		DecodeRLE8(pixels, data + size, info, out);
+		return true;
+	}
+
+	size_t stride = (((size_t)info.width * info.bitsPerPixel + 31) / 32) * 4;
+	size_t outStride = (size_t)info.width * (info.alpha ? 4 : 3);
+
+	// The plain BGR(A) layouts go through the SIMD swizzles
+	bool bgra = info.masks[0] == 0x00FF0000 && info.masks[1] == 0x0000FF00 && info.masks[2] == 0x000000FF &&
+		(info.masks[3] == 0 || info.masks[3] == 0xFF000000);
+
+	for (int r = 0; r < info.height; r++)
+	{
+		const unsigned char *src = pixels + stride * r;
+
+		// The rows go out bottom first
+		unsigned char *dst = out + outStride * (info.topDown ? info.height - 1 - r : r);
+
+		if (info.bitsPerPixel == 24)
+			ImageKernels::SwapRedBlue24(src, dst, info.width);
+		else if (info.bitsPerPixel == 32 && bgra)
+		{
+			if (info.alpha)
+				ImageKernels::SwapRedBlue32(src, dst, info.width);
+			else
+				ImageKernels::DropAlpha32(src, dst, info.width);
+		}
+		else if (info.bitsPerPixel == 32)
+		{
+			for (int x = 0; x < info.width; x++, dst += info.alpha ? 4 : 3)
+			{
+				unsigned int pixel = ReadU32(src + x * 4);
+
+				dst[0] = Channel(pixel, info.masks[0]);
+				dst[1] = Channel(pixel, info.masks[1]);
+				dst[2] = Channel(pixel, info.masks[2]);
+
+				if (info.alpha)
+					dst[3] = Channel(pixel, info.masks[3]);
+			}
+		}
+		else
+		{
+			for (int x = 0; x < info.width; x++)
+				PaletteColor(info, src[x], dst + x * 3);
+		}
+	}
+
+	return true;
+}
+
+unsigned char *BMPDecoder::Load(const char *name, int &width, int &height, bool &alpha)
+{
+	MappedFile file;
+	Info info;
+
+	if (!file.Open(name))
+		return NULL;
+
+	if (!ReadInfo(file.data, file.size, info))
+		return NULL;
+
+	unsigned char *pixels = PixelPool::Alloc(ImageSize(info));
+
+	if (!Decode(file.data, file.size, info, pixels))
+	{
+		PixelPool::Free(pixels);
+		return NULL;
+	}
+
+	width = info.width;
+	height = info.height;
+	alpha = info.alpha;
+
+	return pixels;
+}
@@ -0,0 +1,66 @@
+//////////////////////////////////////////////////////////////////////
+//
+// Bitmap Decoder Class
+//
+// BMPDecoder.h: interface for the BMPDecoder class.
+// This class reads Windows bitmaps without glaux. It takes
+// 24 and 32 bit images, uncompressed or with bit fields, and
+// 8 bit images with a palette, uncompressed or RLE8. The rows
+// come out tightly packed, red first and bottom row first the
+// way OpenGL wants them, whichever way up the file stored them.
+// 32 bit images keep their alpha only if the file says it has
+// one, otherwise they come out as RGB.
+//
+// Load maps the file and decodes it straight into a PixelPool
+// buffer, so the only copy of the image is the one GL gets.
+// Decode fills a buffer the caller already has.
+//
+// Usage:
+// int width, height;
+// bool alpha;
+// unsigned char *pixels = BMPDecoder::Load("ground.bmp", width, height, alpha);
+// ...
+// PixelPool::Free(pixels);
+//
+// // Or into your own buffer
+// BMPDecoder::Info info;
+// if (BMPDecoder::ReadInfo(data, size, info))
+// {
+//     std::vector<unsigned char> image(BMPDecoder::ImageSize(info));
+//     BMPDecoder::Decode(data, size, info, &image[0]);
+// }
+//
+//////////////////////////////////////////////////////////////////////
+
+#ifndef BMPDECODER_H
+#define BMPDECODER_H
+
+#include <stddef.h>
+
+class BMPDecoder
+{
+public:
+	struct Info {
+		int width;					// The image's width in pixels
+		int height;					// The image's height in pixels, always positive
+		int bitsPerPixel;			// 8, 24 or 32
+		int compression;			// 0 none, 1 RLE8, 3 bit fields
+		bool topDown;				// True: the file's first row is the top one
+		bool alpha;					// True: the pixels come out as RGBA
+		size_t dataOffset;			// Where the pixels start in the file
+		const unsigned char *palette;	// The BGRx palette of an 8 bit image
+		int paletteSize;			// The entries in it
+		unsigned int masks[4];		// The red, green, blue and alpha bits of a 32 bit pixel
+	};
+
+	// Checks the headers and fills info, false if the file is no bitmap this can read
+	static bool ReadInfo(const unsigned char *data, size_t size, Info &info);
+	// The bytes Decode writes
+	static size_t ImageSize(const Info &info);
+	// Decodes the pixels into out, which has room for ImageSize bytes
+	static bool Decode(const unsigned char *data, size_t size, const Info &info, unsigned char *out);
+	// Maps and decodes a file into a PixelPool buffer, NULL if it can't
+	static unsigned char *Load(const char *name, int &width, int &height, bool &alpha);
+};
+
+#endif BMPDECODER_H
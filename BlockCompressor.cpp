@@ -0,0 +1,761 @@
+//////////////////////////////////////////////////////////////////////
+//
+// Block Compressor Class
+//
+// BlockCompressor.cpp: implementation of the BlockCompressor class.
+//
+//////////////////////////////////////////////////////////////////////
+
+#include "BlockCompressor.h"
+#include "MipChain.h"
+#include "PixelPool.h"
+#include "WorkerPool.h"
+
+#include <string.h>
+
+#define BAND_BLOCKS		1024		// The blocks of a level one job compresses
+
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT		0x83F0
+#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT	0x83F3
+#endif
+
+// GL 1.3, which opengl32.dll doesn't export
+#ifdef _WIN32
+typedef void (APIENTRY *CompressedTexImage2DProc)(GLenum target, GLint level, GLenum internalformat,
+	GLsizei width, GLsizei height, GLint border, GLsizei imageSize, const GLvoid *data);
+#else
+typedef void (*CompressedTexImage2DProc)(GLenum target, GLint level, GLenum internalformat,
+	GLsizei width, GLsizei height, GLint border, GLsizei imageSize, const GLvoid *data);
+#endif
+
+static BlockCompressor::Quality quality = BlockCompressor::OFF;
+
+// What the driver takes, read once on the GL thread
+static int driverS3TC = -1;
+static CompressedTexImage2DProc compressedTexImage2D = NULL;
+
+//////////////////////////////////////////////////////////////////////
+// Sizes
+//////////////////////////////////////////////////////////////////////
+
+size_t BlockCompressor::LevelSize(int width, int height, int channels)
+{
+	return (size_t)((width + 3) / 4) * ((height + 3) / 4) * (channels == 4 ? 16 : 8);
+}
+
+size_t BlockCompressor::ChainSize(int width, int height, int channels)
+{
+	size_t bytes = LevelSize(width, height, channels);
+
+	while (width > 1 || height > 1)
+	{
+		width = width > 1 ? width / 2 : 1;
+		height = height > 1 ? height / 2 : 1;
+		bytes += LevelSize(width, height, channels);
+	}
+
+	return bytes;
+}
+
+BlockCompressor::Quality BlockCompressor::GetQuality()
+{
+	return quality;
+}
+
+void BlockCompressor::SetQuality(Quality q)
+{
+	quality = q;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Colors
+//////////////////////////////////////////////////////////////////////
+
+static int Pack565(int r, int g, int b)
+{
+	return (((r * 31 + 127) / 255) << 11) | (((g * 63 + 127) / 255) << 5) | ((b * 31 + 127) / 255);
+}
+
+static void Unpack565(int c, int *rgb)
+{
+	int r = (c >> 11) & 31;
+	int g = (c >> 5) & 63;
+	int b = c & 31;
+
+	rgb[0] = (r << 3) | (r >> 2);
+	rgb[1] = (g << 2) | (g >> 4);
+	rgb[2] = (b << 3) | (b >> 2);
+}
+
+// The four colors two endpoints give. With fourColor false the
+// third is the middle and the fourth is transparent black
+static void Palette(int c0, int c1, bool fourColor, int palette[4][3])
+{
+	Unpack565(c0, palette[0]);
+	Unpack565(c1, palette[1]);
+
+	for (int c = 0; c < 3; c++)
+	{
+		if (fourColor)
+		{
+			palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+			palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+		}
+		else
+		{
+			palette[2][c] = (palette[0][c] + palette[1][c]) / 2;
+			palette[3][c] = 0;
+		}
+	}
+}
+
+// The nearest of the four colors for each pixel, returns the squared error
+static int PickColors(const int block[16][4], int c0, int c1, unsigned int &indices)
+{
+	int palette[4][3];
+	Palette(c0, c1, true, palette);
+
+	int error = 0;
+	indices = 0;
+
+	for (int i = 0; i < 16; i++)
+	{
+		int best = 0;
+		int bestError = 0x7FFFFFFF;
+
+		for (int k = 0; k < 4; k++)
+		{
+			int dr = block[i][0] - palette[k][0];
+			int dg = block[i][1] - palette[k][1];
+			int db = block[i][2] - palette[k][2];
+			int e = dr * dr + dg * dg + db * db;
+
+			if (e < bestError)
+			{
+				best = k;
+				bestError = e;
+			}
+		}
+
+		indices |= (unsigned int)best << (i * 2);
+		error += bestError;
+	}
+
+	return error;
+}
+
+// FAST: each pixel's place along the line between the two colors,
+// rounded to the nearest of the four points on it
+static unsigned int ProjectColors(const int block[16][4], int c0, int c1)
+{
+	static const unsigned int order[4] = { 1, 3, 2, 0 };	// From c1 to c0
+
+	int palette[4][3];
+	Palette(c0, c1, true, palette);
+
+	int dir[3] = { palette[0][0] - palette[1][0], palette[0][1] - palette[1][1], palette[0][2] - palette[1][2] };
+	int length = dir[0] * dir[0] + dir[1] * dir[1] + dir[2] * dir[2];
+	unsigned int indices = 0;
+
+	if (length == 0)
+		return 0;
+
+	for (int i = 0; i < 16; i++)
+	{
+		int d = (block[i][0] - palette[1][0]) * dir[0] + (block[i][1] - palette[1][1]) * dir[1] + (block[i][2] - palette[1][2]) * dir[2];
+		int step = (d * 3 * 2 + length) / (length * 2);
+
+		step = d < 0 ? 0 : step > 3 ? 3 : step;
+		indices |= order[step] << (i * 2);
+	}
+
+	return indices;
+}
+
+// FAST: the corners of the bounding box, pulled in a little since
+// the ends are rarely hit. The box has four diagonals, the colors'
+// covariance with green says which one they run along
+static void BoxEnds(const int block[16][4], int &c0, int &c1)
+{
+	int lo[3] = { 255, 255, 255 };
+	int hi[3] = { 0, 0, 0 };
+	int mean[3] = { 0, 0, 0 };
+
+	for (int i = 0; i < 16; i++)
+	{
+		for (int c = 0; c < 3; c++)
+		{
+			lo[c] = block[i][c] < lo[c] ? block[i][c] : lo[c];
+			hi[c] = block[i][c] > hi[c] ? block[i][c] : hi[c];
+			mean[c] += block[i][c];
+		}
+	}
+
+	int covRG = 0;
+	int covBG = 0;
+
+	for (int i = 0; i < 16; i++)
+	{
+		int g = block[i][1] * 16 - mean[1];
+
+		covRG += (block[i][0] * 16 - mean[0]) * g;
+		covBG += (block[i][2] * 16 - mean[2]) * g;
+	}
+
+	for (int c = 0; c < 3; c++)
+	{
+		int inset = (hi[c] - lo[c]) >> 4;
+
+		lo[c] += inset;
+		hi[c] -= inset;
+	}
+
+	if (covRG < 0)
+	{
+		int t = lo[0];
+		lo[0] = hi[0];
+		hi[0] = t;
+	}
+
+	if (covBG < 0)
+	{
+		int t = lo[2];
+		lo[2] = hi[2];
+		hi[2] = t;
+	}
+
+	c0 = Pack565(hi[0], hi[1], hi[2]);
+	c1 = Pack565(lo[0], lo[1], lo[2]);
+}
+
+// NORMAL: the two pixels furthest apart along the colors' main axis,
+// found by a few power iterations on their covariance
+static void AxisEnds(const int block[16][4], int &c0, int &c1)
+{
+	float mean[3] = { 0.0f, 0.0f, 0.0f };
+
+	for (int i = 0; i < 16; i++)
+	{
+		for (int c = 0; c < 3; c++)
+			mean[c] += block[i][c] / 16.0f;
+	}
+
+	float cov[6] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+
+	for (int i = 0; i < 16; i++)
+	{
+		float r = block[i][0] - mean[0];
+		float g = block[i][1] - mean[1];
+		float b = block[i][2] - mean[2];
+
+		cov[0] += r * r;
+		cov[1] += r * g;
+		cov[2] += r * b;
+		cov[3] += g * g;
+		cov[4] += g * b;
+		cov[5] += b * b;
+	}
+
+	// Start from the column of the channel that varies most, a fixed
+	// start could be square to the axis
+	float axis[3] = { cov[0], cov[1], cov[2] };
+
+	if (cov[3] > cov[0] && cov[3] >= cov[5])
+	{
+		axis[0] = cov[1];
+		axis[1] = cov[3];
+		axis[2] = cov[4];
+	}
+	else if (cov[5] > cov[0] && cov[5] > cov[3])
+	{
+		axis[0] = cov[2];
+		axis[1] = cov[4];
+		axis[2] = cov[5];
+	}
+
+	for (int n = 0; n < 4; n++)
+	{
+		float x = cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2];
+		float y = cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2];
+		float z = cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2];
+
+		// Keep it from overflowing, the length doesn't matter
+		float m = x < 0 ? -x : x;
+		m = (y < 0 ? -y : y) > m ? (y < 0 ? -y : y) : m;
+		m = (z < 0 ? -z : z) > m ? (z < 0 ? -z : z) : m;
+
+		if (m < 1e-6f)
+			break;
+
+		axis[0] = x / m;
+		axis[1] = y / m;
+		axis[2] = z / m;
+	}
+
+	int lo = 0;
+	int hi = 0;
+	float loDot = 1e30f;
+	float hiDot = -1e30f;
+
+	for (int i = 0; i < 16; i++)
+	{
+		float d = block[i][0] * axis[0] + block[i][1] * axis[1] + block[i][2] * axis[2];
+
+		if (d < loDot)
+		{
+			loDot = d;
+			lo = i;
+		}
+
+		if (d > hiDot)
+		{
+			hiDot = d;
+			hi = i;
+		}
+	}
+
+	c0 = Pack565(block[hi][0], block[hi][1], block[hi][2]);
+	c1 = Pack565(block[lo][0], block[lo][1], block[lo][2]);
+}
+
+// BEST: the ends that fit the picked points best in the least squares
+// sense. False if the picks don't pin them down
+static bool FitEnds(const int block[16][4], unsigned int indices, int &c0, int &c1)
+{
+	static const float weights[4] = { 1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f };
+
+	float aa = 0.0f, ab = 0.0f, bb = 0.0f;
+	float ax[3] = { 0.0f, 0.0f, 0.0f };
+	float bx[3] = { 0.0f, 0.0f, 0.0f };
+
+	for (int i = 0; i < 16; i++)
+	{
+		float a = weights[(indices >> (i * 2)) & 3];
+		float b = 1.0f - a;
+
+		aa += a * a;
+		ab += a * b;
+		bb += b * b;
+
+		for (int c = 0; c < 3; c++)
+		{
+			ax[c] += a * block[i][c];
+			bx[c] += b * block[i][c];
+		}
+	}
+
+	float det = aa * bb - ab * ab;
+
+	if (det < 1e-6f && det > -1e-6f)
+		return false;
+
+	int end0[3], end1[3];
+
+	for (int c = 0; c < 3; c++)
+	{
+		float e0 = (ax[c] * bb - bx[c] * ab) / det;
+		float e1 = (bx[c] * aa - ax[c] * ab) / det;
+
+		end0[c] = e0 < 0.0f ? 0 : e0 > 255.0f ? 255 : (int)(e0 + 0.5f);
+		end1[c] = e1 < 0.0f ? 0 : e1 > 255.0f ? 255 : (int)(e1 + 0.5f);
+	}
+
+	c0 = Pack565(end0[0], end0[1], end0[2]);
+	c1 = Pack565(end1[0], end1[1], end1[2]);
+
+	return true;
+}
+
+static void EncodeColor(const int block[16][4], BlockCompressor::Quality q, unsigned char *out)
+{
+	int c0, c1;
+	unsigned int indices;
+	int error = 0;
+
+	if (q <= BlockCompressor::FAST)
+	{
+		BoxEnds(block, c0, c1);
+		indices = ProjectColors(block, c0, c1);
+	}
+	else
+	{
+		AxisEnds(block, c0, c1);
+		error = PickColors(block, c0, c1, indices);
+	}
+
+	for (int n = 0; q == BlockCompressor::BEST && n < 2 && error > 0; n++)
+	{
+		int f0, f1;
+		unsigned int fit;
+
+		if (!FitEnds(block, indices, f0, f1))
+			break;
+
+		int e = PickColors(block, f0, f1, fit);
+
+		if (e >= error)
+			break;
+
+		c0 = f0;
+		c1 = f1;
+		indices = fit;
+		error = e;
+	}
+
+	// The first color has to be the bigger one or BC1 reads the block
+	// as 3 colors and black, swapping them swaps the picks too
+	if (c0 < c1)
+	{
+		int t = c0;
+		c0 = c1;
+		c1 = t;
+		indices ^= 0x55555555;
+	}
+	else if (c0 == c1)
+		indices = 0;
+
+	out[0] = (unsigned char)c0;
+	out[1] = (unsigned char)(c0 >> 8);
+	out[2] = (unsigned char)c1;
+	out[3] = (unsigned char)(c1 >> 8);
+	out[4] = (unsigned char)indices;
+	out[5] = (unsigned char)(indices >> 8);
+	out[6] = (unsigned char)(indices >> 16);
+	out[7] = (unsigned char)(indices >> 24);
+}
+
+static void DecodeColor(const unsigned char *in, bool alwaysFourColor, int block[16][4])
+{
+	int c0 = in[0] | (in[1] << 8);
+	int c1 = in[2] | (in[3] << 8);
+	unsigned int indices = in[4] | (in[5] << 8) | (in[6] << 16) | ((unsigned int)in[7] << 24);
+	bool fourColor = alwaysFourColor || c0 > c1;
+	int palette[4][3];
+
+	Palette(c0, c1, fourColor, palette);
+
+	for (int i = 0; i < 16; i++)
+	{
+		int k = (indices >> (i * 2)) & 3;
+
+		block[i][0] = palette[k][0];
+		block[i][1] = palette[k][1];
+		block[i][2] = palette[k][2];
+		block[i][3] = (!fourColor && k == 3) ? 0 : 255;
+	}
+}
+
+//////////////////////////////////////////////////////////////////////
+// Alpha
+//////////////////////////////////////////////////////////////////////
+
+// The eight alphas two endpoints give
+static void AlphaPalette(int a0, int a1, int palette[8])
+{
+	palette[0] = a0;
+	palette[1] = a1;
+
+	if (a0 > a1)
+	{
+		for (int k = 2; k < 8; k++)
+			palette[k] = ((8 - k) * a0 + (k - 1) * a1) / 7;
+	}
+	else
+	{
+		for (int k = 2; k < 6; k++)
+			palette[k] = ((6 - k) * a0 + (k - 1) * a1) / 5;
+
+		palette[6] = 0;
+		palette[7] = 255;
+	}
+}
+
+// The block's own range split in seven steps
+static void EncodeAlpha(const int block[16][4], unsigned char *out)
+{
+	int lo = 255;
+	int hi = 0;
+
+	for (int i = 0; i < 16; i++)
+	{
+		lo = block[i][3] < lo ? block[i][3] : lo;
+		hi = block[i][3] > hi ? block[i][3] : hi;
+	}
+
+	int palette[8];
+	AlphaPalette(hi, lo, palette);
+
+	unsigned long long bits = 0;
+
+	for (int i = 0; hi > lo && i < 16; i++)
+	{
+		int best = 0;
+		int bestError = 256;
+
+		for (int k = 0; k < 8; k++)
+		{
+			int e = block[i][3] - palette[k];
+			e = e < 0 ? -e : e;
+
+			if (e < bestError)
+			{
+				best = k;
+				bestError = e;
+			}
+		}
+
+		bits |= (unsigned long long)best << (i * 3);
+	}
+
+	out[0] = (unsigned char)hi;
+	out[1] = (unsigned char)lo;
+
+	for (int i = 0; i < 6; i++)
+		out[2 + i] = (unsigned char)(bits >> (i * 8));
+}
+
+static void DecodeAlpha(const unsigned char *in, int block[16][4])
+{
+	int palette[8];
+	AlphaPalette(in[0], in[1], palette);
+
+	unsigned long long bits = 0;
+
+	for (int i = 0; i < 6; i++)
+		bits |= (unsigned long long)in[2 + i] << (i * 8);
+
+	for (int i = 0; i < 16; i++)
+		block[i][3] = palette[(bits >> (i * 3)) & 7];
+}
+
+//////////////////////////////////////////////////////////////////////
+// Levels
+//////////////////////////////////////////////////////////////////////
+
+// Runs body(row) for every row of blocks, across the workers when
+// the level is big enough to be worth it
+template <class Body>
+static void ForBlockRows(int rows, int blocksPerRow, const Body &body)
+{
+	int bandRows = BAND_BLOCKS / blocksPerRow;
+
+	if (bandRows < 1)
+		bandRows = 1;
+
+	int bands = (rows + bandRows - 1) / bandRows;
+
+	if (bands <= 1)
+	{
+		for (int y = 0; y < rows; y++)
+			body(y);
+
+		return;
+	}
+
+	WorkerPool::Shared().ParallelFor(bands, [&](int band)
+	{
+		for (int y = band * bandRows; y < rows && y < (band + 1) * bandRows; y++)
+			body(y);
+	});
+}
+
+void BlockCompressor::CompressLevel(const unsigned char *pixels, int width, int height, int channels, Quality q, unsigned char *out)
+{
+	int blocksX = (width + 3) / 4;
+	int blocksY = (height + 3) / 4;
+	size_t blockBytes = (channels == 4) ? 16 : 8;
+
+	ForBlockRows(blocksY, blocksX, [&](int by)
+	{
+		for (int bx = 0; bx < blocksX; bx++)
+		{
+			int block[16][4];
+
+			// A block past the edge repeats the last row and column
+			for (int i = 0; i < 16; i++)
+			{
+				int x = bx * 4 + (i & 3);
+				int y = by * 4 + (i >> 2);
+				const unsigned char *p = pixels + ((size_t)(y < height ? y : height - 1) * width + (x < width ? x : width - 1)) * channels;
+
+				block[i][0] = p[0];
+				block[i][1] = p[1];
+				block[i][2] = p[2];
+				block[i][3] = (channels == 4) ? p[3] : 255;
+			}
+
+			unsigned char *dst = out + ((size_t)by * blocksX + bx) * blockBytes;
+
+			if (channels == 4)
+			{
+				EncodeAlpha(block, dst);
+				dst += 8;
+			}
+
+			EncodeColor(block, q, dst);
+		}
+	});
+}
+
+void BlockCompressor::DecompressLevel(const unsigned char *blocks, int width, int height, int channels, unsigned char *out)
+{
+	int blocksX = (width + 3) / 4;
+	int blocksY = (height + 3) / 4;
+	size_t blockBytes = (channels == 4) ? 16 : 8;
+
+	for (int by = 0; by < blocksY; by++)
+	{
+		for (int bx = 0; bx < blocksX; bx++)
+		{
+			const unsigned char *src = blocks + ((size_t)by * blocksX + bx) * blockBytes;
+			int block[16][4];
+
+			// BC3's colors are always read as 4, its alpha comes after them
+			if (channels == 4)
+			{
+				DecodeColor(src + 8, true, block);
+				DecodeAlpha(src, block);
+			}
+			else
+				DecodeColor(src, false, block);
+
+			for (int i = 0; i < 16; i++)
+			{
+				int x = bx * 4 + (i & 3);
+				int y = by * 4 + (i >> 2);
+
+				if (x >= width || y >= height)
+					continue;
+
+				unsigned char *p = out + ((size_t)y * width + x) * channels;
+
+				for (int c = 0; c < channels; c++)
+					p[c] = (unsigned char)block[i][c];
+			}
+		}
+	}
+}
+
+//////////////////////////////////////////////////////////////////////
+// Chains
+//////////////////////////////////////////////////////////////////////
+
+unsigned char *BlockCompressor::Compress(const unsigned char *pixels, const unsigned char *mipmaps, int width, int height, int channels, Quality q)
+{
+	int levels = MipChain::Levels(width, height);
+
+	if (pixels == NULL || (levels > 1 && mipmaps == NULL))
+		return NULL;
+
+	unsigned char *blocks = PixelPool::Alloc(ChainSize(width, height, channels));
+
+	if (blocks == NULL)
+		return NULL;
+
+	const unsigned char *level = pixels;
+	unsigned char *out = blocks;
+
+	for (int i = 0; i < levels; i++)
+	{
+		CompressLevel(level, width, height, channels, q, out);
+
+		out += LevelSize(width, height, channels);
+		level = (i == 0) ? mipmaps : level + (size_t)width * height * channels;
+		width = width > 1 ? width / 2 : 1;
+		height = height > 1 ? height / 2 : 1;
+	}
+
+	return blocks;
+}
+
+bool BlockCompressor::Decompress(const unsigned char *blocks, int width, int height, int channels, unsigned char *&pixels, unsigned char *&mipmaps)
+{
+	size_t chain = MipChain::ChainSize(width, height, channels);
+
+	pixels = PixelPool::Alloc((size_t)width * height * channels);
+	mipmaps = chain > 0 ? PixelPool::Alloc(chain) : NULL;
+
+	if (blocks == NULL || pixels == NULL || (chain > 0 && mipmaps == NULL))
+	{
+		PixelPool::Free(pixels);
+		PixelPool::Free(mipmaps);
+		pixels = mipmaps = NULL;
+		return false;
+	}
+
+	int levels = MipChain::Levels(width, height);
+	unsigned char *level = pixels;
+
+	for (int i = 0; i < levels; i++)
+	{
+		DecompressLevel(blocks, width, height, channels, level);
+
+		blocks += LevelSize(width, height, channels);
+		level = (i == 0) ? mipmaps : level + (size_t)width * height * channels;
+		width = width > 1 ? width / 2 : 1;
+		height = height > 1 ? height / 2 : 1;
+	}
+
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Uploading
+//////////////////////////////////////////////////////////////////////
+
+bool BlockCompressor::Supported()
+{
+	if (driverS3TC >= 0)
+		return driverS3TC != 0;
+
+#ifdef _WIN32
+	compressedTexImage2D = (CompressedTexImage2DProc)wglGetProcAddress("glCompressedTexImage2D");
+
+	if (compressedTexImage2D == NULL)
+		compressedTexImage2D = (CompressedTexImage2DProc)wglGetProcAddress("glCompressedTexImage2DARB");
+#else
+	compressedTexImage2D = glCompressedTexImage2D;
+#endif
+
+	const char *extensions = (const char *)glGetString(GL_EXTENSIONS);
+
+	driverS3TC = compressedTexImage2D != NULL && extensions != NULL &&
+		strstr(extensions, "GL_EXT_texture_compression_s3tc") != NULL;
+
+	return driverS3TC != 0;
+}
+
+bool BlockCompressor::Upload(const unsigned char *blocks, int width, int height, GLenum format)
+{
+	int channels = (format == GL_RGBA) ? 4 : 3;
+
+	if (blocks == NULL || !Supported())
+		return false;
+
+	// The same rule as the uncompressed levels
+	bool powerOfTwo = (width & (width - 1)) == 0 && (height & (height - 1)) == 0;
+
+	if (!powerOfTwo && !MipChain::NonPowerOfTwo())
+		return false;
+
+	GLenum internalFormat = (channels == 4) ? GL_COMPRESSED_RGBA_S3TC_DXT5_EXT : GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+	int levels = MipChain::Levels(width, height);
+	int maxSize = MipChain::MaxSize();
+	int target = 0;
+
+	for (int i = 0; i < levels; i++)
+	{
+		size_t size = LevelSize(width, height, channels);
+
+		// A level too big for the card is left out, the next one is the top
+		if (width <= maxSize && height <= maxSize)
+			compressedTexImage2D(GL_TEXTURE_2D, target++, internalFormat, width, height, 0, (GLsizei)size, blocks);
+
+		blocks += size;
+		width = width > 1 ? width / 2 : 1;
+		height = height > 1 ? height / 2 : 1;
+	}
+
+	return true;
+}
@@ -0,0 +1,90 @@
+//////////////////////////////////////////////////////////////////////
+//
+// Block Compressor Class
+//
+// BlockCompressor.h: interface for the BlockCompressor class.
+// This class turns images into the S3TC block formats the
+// video card samples from directly: BC1 (DXT1, 4 bits a pixel)
+// for opaque images and BC3 (DXT5, 8 bits a pixel) for images
+// with alpha. A 24 bit texture takes a sixth of the memory and
+// of the upload as BC1, a 32 bit one a quarter as BC3.
+//
+// Each 4x4 block gets two colors and picks one of four points
+// between them for every pixel. The presets differ in how they
+// find the two colors:
+//  FAST   - the corners of the block's bounding box
+//  NORMAL - the ends of the colors' main axis
+//  BEST   - NORMAL, then a least squares fit to the picks
+// Big levels are split across the WorkerPool.
+//
+// Upload sends the blocks with glCompressedTexImage2D. On a
+// driver without EXT_texture_compression_s3tc it returns false
+// and Decompress gives the pixels back for a plain upload.
+//
+// GLTexture::Decode compresses what it decodes when a quality
+// is set with SetQuality, it is OFF unless the game sets it.
+//
+// Usage:
+// // Any thread, the image and its mipmaps (see MipChain.h)
+// unsigned char *blocks = BlockCompressor::Compress(pixels, mipmaps, width, height, 3, BlockCompressor::NORMAL);
+//
+// // The GL thread, with the texture bound
+// if (!BlockCompressor::Upload(blocks, width, height, GL_RGB))
+// {
+//     BlockCompressor::Decompress(blocks, width, height, 3, pixels, mipmaps);
+//     MipChain::Upload(pixels, mipmaps, width, height, GL_RGB);
+// }
+// PixelPool::Free(blocks);
+//
+// BlockCompressor::SetQuality(BlockCompressor::FAST);	// Every texture decoded after
+//
+//////////////////////////////////////////////////////////////////////
+
+#ifndef BLOCKCOMPRESSOR_H
+#define BLOCKCOMPRESSOR_H
+
+#ifdef _WIN32
+#include <windows.h>		// Header File For Windows
+#include <gl\gl.h>			// Header File For The OpenGL32 Library
+#else
+#include <GL/gl.h>
+#endif
+
+#include <stddef.h>
+
+class BlockCompressor
+{
+public:
+	enum Quality {
+		OFF,		// GLTexture leaves its images alone
+		FAST,		// Bounding box ends
+		NORMAL,		// Main axis ends
+		BEST		// Main axis, refined
+	};
+
+	// The bytes of one level, 8 per block for BC1 (3 channels), 16 for BC3 (4)
+	static size_t LevelSize(int width, int height, int channels);
+	// The bytes of the image and its levels down to 1x1, one after the other
+	static size_t ChainSize(int width, int height, int channels);
+
+	// One level of 3 (BC1) or 4 (BC3) channel pixels into LevelSize bytes
+	static void CompressLevel(const unsigned char *pixels, int width, int height, int channels, Quality quality, unsigned char *out);
+	// One level of blocks back into width * height * channels bytes
+	static void DecompressLevel(const unsigned char *blocks, int width, int height, int channels, unsigned char *out);
+
+	// The image and the mipmaps below it into one PixelPool buffer of ChainSize bytes,
+	// NULL without memory. mipmaps may be NULL for a 1x1 image
+	static unsigned char *Compress(const unsigned char *pixels, const unsigned char *mipmaps, int width, int height, int channels, Quality quality);
+	// Back into PixelPool buffers for the image and its mipmaps, false without memory
+	static bool Decompress(const unsigned char *blocks, int width, int height, int channels, unsigned char *&pixels, unsigned char *&mipmaps);
+
+	// Uploads the levels to the bound texture, false (and nothing uploaded)
+	// if the driver can't take them. GL thread only
+	static bool Upload(const unsigned char *blocks, int width, int height, GLenum format);
+	static bool Supported();						// True if the driver takes S3TC, GL thread only
+
+	static Quality GetQuality();					// What GLTexture::Decode compresses with
+	static void SetQuality(Quality quality);		// Changes it, set it before any loading starts
+};
+
+#endif BLOCKCOMPRESSOR_H
@@ -5,8 +5,8 @@
 //
 // GLTexture.cpp: implementation of the GLTexture class.
 // This class loads a texture file and prepares it
-// to be used in OpenGL. It can open a bitmap or a
-// targa file. The min filter is set to mipmap b/c
+// to be used in OpenGL. It can open a bitmap, a
+// targa, a JPEG or a PNG file. The min filter is set to mipmap b/c
 // they look better and the performance cost on
 // modern video cards in negligible. I leave all of
 // the texture management to the application. I have
@@ -35,11 +35,69 @@
 //////////////////////////////////////////////////////////////////////
 
 #include "GLTexture.h"
+#include "BMPDecoder.h"
+#include "TGADecoder.h"
+#include "JPEGDecoder.h"
+#include "PNGDecoder.h"
+#include "MipChain.h"
+#include "PixelPool.h"
+#include "LoadStats.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <ctype.h>
+#include <string>
+#include <sys/stat.h>
 
+#ifndef _WIN32
+// The MSVC names for these
+static char *_strdup(const char *s)
+{
+	return strdup(s);
+}
+
+static char *_strlwr(char *s)
+{
+	for (char *c = s; *c; c++)
+		*c = (char)tolower((unsigned char)*c);
+
+	return s;
+}
+#endif
+
+// The baked textures
+#define BAKED_EXTENSION		".tex"
+#define BAKED_MAGIC			"BTEX"
+#define BAKED_VERSION		1
+#define BAKED_ALIGN			16
+#define BAKED_MAX_LEVELS	16
+
+// The baked file starts with this header. The levels follow one
+// after the other, level 0 starts BAKED_ALIGN aligned. Raw levels
+// have no row padding, the levels below 0 start aligned too and
+// follow each other without a gap the way MipChain::Build lays
+// them out. Block compressed levels all follow level 0 the way
+// BlockCompressor::Compress lays them out.
+struct BakedHeader {
+	char magic[4];				// Always BAKED_MAGIC
+	unsigned int version;		// Always BAKED_VERSION
+	int width;					// The size of level 0
+	int height;
+	unsigned int format;		// GL_RGB or GL_RGBA, the image's channels
+	unsigned int quality;		// The BlockCompressor quality, OFF for raw levels
+	unsigned int filter;		// The MipChain filter the levels were made with
+	unsigned int numLevels;		// The levels down to 1x1, level 0 included
+	unsigned int fileSize;		// The size of the whole file
+	unsigned int offset[BAKED_MAX_LEVELS];	// Where each level starts
+	unsigned int size[BAKED_MAX_LEVELS];	// The bytes of each level
+};
+
+// Bake the textures next to their images by default
+static bool baking = true;
+
+// Read the smaller file where there is one
+static bool preferCompressed = true;
 
 //////////////////////////////////////////////////////////////////////
 // Construction/Destruction
@@ -47,30 +105,197 @@
 
 GLTexture::GLTexture()
 {
-
+	texturename = NULL;
+	texture[0] = 0;
+	width = 0;
+	height = 0;
+	pixels = NULL;
+	mipmaps = NULL;
+	blocks = NULL;
+	format = GL_RGB;
 }
 
 GLTexture::~GLTexture()
 {
-
+	// The GL texture is left to the application, the memory is ours
+	FreePixels();
+	free(texturename);
 }
 
 void GLTexture::Load(char *name)
 {
-	// make the texture name all lower case
-	texturename = _strlwr(_strdup(name));
+	if (Decode(name))
+		Upload();
+}
 
-	// strip "'s
-	if (strstr(texturename, "\""))
-		texturename = strtok(texturename, "\"");
+bool GLTexture::Decode(const char *name)
+{
+	// The baked file has the mipmaps and blocks made already
+	if (baking && LoadBaked(name))
+		return true;
 
-	// check the file extension to see what type of texture
+	bool ok = DecodeImage(name);
+
+	// The mipmaps are made here too, off the GL thread
+	if (ok)
+		BuildMipmaps();
+
+	if (ok && BlockCompressor::GetQuality() != BlockCompressor::OFF)
+		Compress(BlockCompressor::GetQuality());
+
+	// Next time we can skip all of the above
+	if (ok && baking)
+		SaveBaked(name);
+
+	return ok;
+}
+
+bool GLTexture::DecodeImage(const char *name)
+{
+	char *file = FileName(name);
+
+	bool ok = false;
+
+	// check the file extension to see what type of texture. Some
+	// JPEGs are named .png and some PNGs .jpg, so each tries the other
 	if(strstr(texturename, ".bmp"))	
-		LoadBMP(texturename);
-	if(strstr(texturename, ".tga"))	
-		LoadTGA(texturename);
+		ok = DecodeBMP(file);
+	else if(strstr(texturename, ".tga"))	
+		ok = DecodeTGA(file);
+	else if(strstr(texturename, ".png"))
+		ok = DecodePNG(file) || DecodeJPEG(file);
+	else if(strstr(texturename, ".jpg") || strstr(texturename, ".jpeg"))
+		ok = DecodeJPEG(file) || DecodePNG(file);
+
+	free(file);
+
+	return ok;
 }
 
+// The size the file's header gives, whatever its extension says.
+// Only the header pages of the mapping are read
+static bool ImageDimensions(const char *name, int &width, int &height)
+{
+	MappedFile file;
+
+	if (!file.Open(name))
+		return false;
+
+	PNGDecoder::Info png;
+	JPEGDecoder::Info jpeg;
+	BMPDecoder::Info bmp;
+	TGADecoder::Info tga;
+
+	// The targa header has no signature, so it goes last
+	if (PNGDecoder::ReadInfo(file.data, file.size, png))
+	{
+		width = png.width;
+		height = png.height;
+	}
+	else if (JPEGDecoder::ReadInfo(file.data, file.size, jpeg))
+	{
+		width = jpeg.width;
+		height = jpeg.height;
+	}
+	else if (BMPDecoder::ReadInfo(file.data, file.size, bmp))
+	{
+		width = bmp.width;
+		height = bmp.height;
+	}
+	else if (TGADecoder::ReadInfo(file.data, file.size, tga))
+	{
+		width = tga.width;
+		height = tga.height;
+	}
+	else
+		return false;
+
+	return true;
+}
+
+void GLTexture::SourceFile(const char *name, std::string &file)
+{
+	static const char *compressed[] = { ".png", ".jpg", ".jpeg", ".PNG", ".JPG", ".JPEG" };
+
+	// strip "'s
+	file.clear();
+
+	for (const char *c = name; *c; c++)
+	{
+		if (*c != '"')
+			file += *c;
+	}
+
+	size_t dot = file.rfind('.');
+
+	if (!preferCompressed || dot == std::string::npos || file.find_first_of("/\\", dot) != std::string::npos)
+		return;
+
+	std::string ext = file.substr(dot);
+
+	for (size_t i = 0; i < ext.size(); i++)
+		ext[i] = (char)tolower((unsigned char)ext[i]);
+
+	if (ext != ".bmp" && ext != ".tga")
+		return;
+
+	// The first of the smaller files that is there and readable. With the
+	// original still there it has to be the same size too, a file that
+	// only shares the name may be another picture entirely. The upper
+	// case ones are for file systems that care
+	int width = 0, height = 0;
+	bool sized = false;
+	bool original = false;
+
+	for (size_t i = 0; i < sizeof(compressed) / sizeof(compressed[0]); i++)
+	{
+		std::string other = file.substr(0, dot) + compressed[i];
+		struct stat st;
+		int otherWidth, otherHeight;
+
+		if (stat(other.c_str(), &st) != 0)
+			continue;
+
+		// The models name their maps in any case, the file on disk may
+		// be all lower case
+		if (!sized)
+		{
+			size_t slash = file.find_last_of("/\\");
+			std::string lower = file;
+
+			for (size_t c = (slash == std::string::npos) ? 0 : slash + 1; c < lower.size(); c++)
+				lower[c] = (char)tolower((unsigned char)lower[c]);
+
+			original = ImageDimensions(file.c_str(), width, height) ||
+				ImageDimensions(lower.c_str(), width, height);
+			sized = true;
+		}
+
+		if (ImageDimensions(other.c_str(), otherWidth, otherHeight) &&
+			(!original || (otherWidth == width && otherHeight == height)))
+		{
+			file = other;
+			return;
+		}
+	}
+}
+
+char *GLTexture::FileName(const char *name)
+{
+	std::string source;
+	SourceFile(name, source);
+
+	char *file = _strdup(source.c_str());
+
+	// make the texture name all lower case, the file keeps
+	// its case for file systems that care
+	free(texturename);
+	texturename = _strlwr(_strdup(file));
+
+	return file;
+}
+
+#ifdef _WIN32
 void GLTexture::LoadFromResource(char *name)
 {
 	// make the texture name all lower case
@@ -82,6 +307,7 @@ void GLTexture::LoadFromResource(char *name)
 	if(strstr(texturename, ".tga"))	
 		LoadTGAResource(name);
 }
+#endif
 
 void GLTexture::Use()
 {
@@ -91,22 +317,26 @@ void GLTexture::Use()
 
 void GLTexture::LoadBMP(char *name)
 {
-	// Create a place to store the texture
-	AUX_RGBImageRec *TextureImage[1];
-
-	// Set the pointer to NULL
-	memset(TextureImage,0,sizeof(void *)*1);
+	if (DecodeBMP(name))
+		Upload();
+}
 
-	// Load the bitmap and assign our pointer to it
-	TextureImage[0] = auxDIBImageLoad(name);
+void GLTexture::LoadTGA(char *name)
+{
+	if (DecodeTGA(name))
+		Upload();
+}
 
-	// If the texture file was not found, return from the function
-	if(!TextureImage[0]) 
+void GLTexture::Upload()
+{
+	// Nothing was decoded
+	if (pixels == NULL && blocks == NULL)
 		return;
 
-	// Just in case we want to use the width and height later
-	width = TextureImage[0]->sizeX;
-	height = TextureImage[0]->sizeY;
+	int channels = (format == GL_RGBA) ? 4 : 3;
+
+	LOADSTATS_FILE(texturename);
+	LOADSTATS_SCOPE("upload", blocks ? BlockCompressor::ChainSize(width, height, channels) : (size_t)width * height * channels);
 
 	// Generate the OpenGL texture id
 	glGenTextures(1, &texture[0]);
@@ -118,112 +348,419 @@ void GLTexture::LoadBMP(char *name)
 	glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER,GL_LINEAR_MIPMAP_NEAREST);
 	glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MAG_FILTER,GL_LINEAR);
 
-	// Generate the mipmaps
-	gluBuild2DMipmaps(GL_TEXTURE_2D, 3, TextureImage[0]->sizeX, TextureImage[0]->sizeY, GL_RGB, GL_UNSIGNED_BYTE, TextureImage[0]->data);
-
-	// Cleanup
-	if (TextureImage[0])
+	// Block compressed levels go up as they are. A driver without S3TC
+	// gets them decompressed and uploaded like any other image
+	if (blocks != NULL)
 	{
-		if (TextureImage[0]->data)
-			free(TextureImage[0]->data);
+		if (BlockCompressor::Upload(blocks, width, height, format))
+		{
+			FreePixels();
+			return;
+		}
+
+		Release(pixels);
+		Release(mipmaps);
+		BlockCompressor::Decompress(blocks, width, height, channels, pixels, mipmaps);
 
-		free(TextureImage[0]);
+		if (pixels == NULL)
+		{
+			FreePixels();
+			return;
+		}
 	}
+
+	// LoadBMP and LoadTGA come here without them
+	if (mipmaps == NULL)
+		BuildMipmaps();
+
+	// Upload the image and its mipmaps, GLU scales a size the driver won't take
+	if (!MipChain::Upload(pixels, mipmaps, width, height, format))
+		gluBuild2DMipmaps(GL_TEXTURE_2D, channels, width, height, format, GL_UNSIGNED_BYTE, pixels);
+
+	// Cleanup
+	FreePixels();
 }
 
-void GLTexture::LoadTGA(char *name)
+void GLTexture::BuildMipmaps()
+{
+	if (pixels == NULL)
+		return;
+
+	int channels = (format == GL_RGBA) ? 4 : 3;
+
+	LOADSTATS_FILE(texturename);
+	LOADSTATS_SCOPE("mipmaps", MipChain::ChainSize(width, height, channels));
+
+	Release(mipmaps);
+	mipmaps = MipChain::Build(pixels, width, height, channels);
+}
+
+bool GLTexture::Compress(BlockCompressor::Quality quality)
+{
+	if (pixels == NULL)
+		return false;
+
+	int channels = (format == GL_RGBA) ? 4 : 3;
+
+	if (mipmaps == NULL)
+		BuildMipmaps();
+
+	LOADSTATS_FILE(texturename);
+	LOADSTATS_SCOPE("compress", BlockCompressor::ChainSize(width, height, channels));
+
+	unsigned char *compressed = BlockCompressor::Compress(pixels, mipmaps, width, height, channels, quality);
+
+	if (compressed == NULL)
+		return false;
+
+	// The blocks are all Upload needs
+	FreePixels();
+	blocks = compressed;
+
+	return true;
+}
+
+void GLTexture::FreePixels()
+{
+	// Back to the pool for the next decode
+	Release(pixels);
+	Release(mipmaps);
+	Release(blocks);
+
+	pixels = NULL;
+	mipmaps = NULL;
+	blocks = NULL;
+
+	// Whatever pointed into the baked file is gone
+	baked.Close();
+}
+
+void GLTexture::Release(unsigned char *p)
 {
-	GLubyte		TGAheader[12]	= {0,0,2,0,0,0,0,0,0,0,0,0};// Uncompressed TGA header
-	GLubyte		TGAcompare[12];								// Used to compare TGA header
-	GLubyte		header[6];									// First 6 useful bytes of the header
-	GLuint		bytesPerPixel;								// Holds the number of bytes per pixel used
-	GLuint		imageSize;									// Used to store the image size
-	GLuint		temp;										// Temporary variable
-	GLuint		type			= GL_RGBA;					// Set the default type to RBGA (32 BPP)
-	GLubyte		*imageData;									// Image data (up to 32 Bits)
-	GLuint		bpp;										// Image color depth in bits per pixel.
-
-	FILE *file = fopen(name, "rb");							// Open the TGA file
-
-	// Load the file and perform checks
-	if(file == NULL ||														// Does file exist?
-	   fread(TGAcompare,1,sizeof(TGAcompare),file) != sizeof(TGAcompare) ||	// Are there 12 bytes to read?
-	   memcmp(TGAheader,TGAcompare,sizeof(TGAheader)) != 0				 ||	// Is it the right format?
-	   fread(header,1,sizeof(header),file) != sizeof(header))				// If so then read the next 6 header bytes
+	// The baked file's levels are unmapped with it
+	if (p >= baked.data && p < baked.data + baked.size)
+		return;
+
+	PixelPool::Free(p);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Baked textures
+//////////////////////////////////////////////////////////////////////
+
+static unsigned int BakedAlign(unsigned int offset)
+{
+	return (offset + BAKED_ALIGN - 1) & ~(unsigned int)(BAKED_ALIGN - 1);
+}
+
+// Where each level goes in a baked file, false if there are too many
+static bool BakedLayout(int width, int height, int channels, BlockCompressor::Quality quality, BakedHeader &header)
+{
+	header.numLevels = (unsigned int)MipChain::Levels(width, height);
+
+	if (header.numLevels > BAKED_MAX_LEVELS)
+		return false;
+
+	unsigned int offset = BakedAlign(sizeof(BakedHeader));
+
+	for (unsigned int level = 0; level < header.numLevels; level++)
 	{
-		if (file == NULL)									// If the file didn't exist then return
-			return;
+		if (quality != BlockCompressor::OFF)
+			header.size[level] = (unsigned int)BlockCompressor::LevelSize(width, height, channels);
 		else
-		{
-			fclose(file);									// If something broke then close the file and return
-			return;
-		}
+			header.size[level] = (unsigned int)width * height * channels;
+
+		// The raw levels below 0 are their own buffer
+		if (level == 1 && quality == BlockCompressor::OFF)
+			offset = BakedAlign(offset);
+
+		header.offset[level] = offset;
+		offset += header.size[level];
+
+		width = width > 1 ? width / 2 : 1;
+		height = height > 1 ? height / 2 : 1;
 	}
 
-	// Determine the TGA width and height (highbyte*256+lowbyte)
-	width  = header[1] * 256 + header[0];
-	height = header[3] * 256 + header[2];
-    
-	// Check to make sure the targa is valid and is 24 bit or 32 bit
-	if(width	<=0	||										// Is the width less than or equal to zero
-	   height	<=0	||										// Is the height less than or equal to zero
-	   (header[4] != 24 && header[4] != 32))				// Is it 24 or 32 bit?
+	header.fileSize = offset;
+	return true;
+}
+
+// Pads the file with zeros up to offset and writes the bytes there
+static bool BakedWrite(FILE *f, unsigned int &at, unsigned int offset, const void *data, size_t bytes)
+{
+	static const unsigned char zeros[BAKED_ALIGN] = { 0 };
+
+	if (offset > at && fwrite(zeros, 1, offset - at, f) != offset - at)
+		return false;
+
+	at = offset + (unsigned int)bytes;
+	return fwrite(data, 1, bytes, f) == bytes;
+}
+
+bool GLTexture::LoadBaked(const char *name)
+{
+	char *file = FileName(name);
+	std::string bakedname = std::string(file) + BAKED_EXTENSION;
+	struct stat source, st;
+
+	// Older than the image means the image changed since. Without the
+	// image the baked file is all there is
+	bool usable = stat(bakedname.c_str(), &st) == 0 &&
+		(stat(file, &source) != 0 || st.st_mtime >= source.st_mtime);
+
+	free(file);
+
+	if (!usable)
+		return false;
+
+	LOADSTATS_FILE(texturename);
+	LOADSTATS_SCOPE("baked", 0);
+
+	FreePixels();
+
+	if (!baked.Open(bakedname.c_str()))
+		return false;
+
+	const BakedHeader *header = (const BakedHeader *)baked.data;
+	BlockCompressor::Quality quality = BlockCompressor::GetQuality();
+	BakedHeader expected;
+
+	// Make sure it holds what Decode would have made now
+	if (baked.size < sizeof(BakedHeader) ||
+		memcmp(header->magic, BAKED_MAGIC, 4) != 0 ||
+		header->version != BAKED_VERSION ||
+		header->fileSize != baked.size ||
+		header->width <= 0 || header->height <= 0 ||
+		(header->format != GL_RGB && header->format != GL_RGBA) ||
+		header->quality != (unsigned int)quality ||
+		header->filter != (unsigned int)MipChain::GetFilter() ||
+		!BakedLayout(header->width, header->height, header->format == GL_RGBA ? 4 : 3, quality, expected) ||
+		memcmp(header->offset, expected.offset, expected.numLevels * sizeof(unsigned int)) != 0 ||
+		memcmp(header->size, expected.size, expected.numLevels * sizeof(unsigned int)) != 0 ||
+		header->numLevels != expected.numLevels ||
+		header->fileSize != expected.fileSize)
 	{
-		fclose(file);										// If anything didn't check out then close the file and return
-		return;
+		baked.Close();
+		return false;
 	}
 
-	bpp				= header[4];							// Grab the bits per pixel
-	bytesPerPixel	= bpp / 8;								// Divide by 8 to get the bytes per pixel
-	imageSize		= width * height * bytesPerPixel;		// Calculate the memory required for the data
+	LOADSTATS_BYTES(baked.size);
 
-	// Allocate the memory for the image data
-	imageData		= new GLubyte[imageSize];
+	// The levels stay in the mapped file until Upload hands them
+	// to GL, nothing writes to them
+	unsigned char *data = (unsigned char *)baked.data;
 
-	// Make sure the data is allocated write and load it
-	if(imageData == NULL ||									// Does the memory storage exist?
-	   fread(imageData, 1, imageSize, file) != imageSize)	// Does the image size match the memory reserved?
+	width = header->width;
+	height = header->height;
+	format = header->format;
+
+	if (quality != BlockCompressor::OFF)
+		blocks = data + header->offset[0];
+	else
 	{
-		if(imageData != NULL)								// Was the image data loaded
-			free(imageData);								// If so, then release the image data
+		pixels = data + header->offset[0];
+		mipmaps = header->numLevels > 1 ? data + header->offset[1] : NULL;
+	}
+
+	return true;
+}
 
-		fclose(file);										// Close the file
+void GLTexture::SaveBaked(const char *name)
+{
+	int channels = (format == GL_RGBA) ? 4 : 3;
+	BlockCompressor::Quality quality = blocks ? BlockCompressor::GetQuality() : BlockCompressor::OFF;
+	BakedHeader header;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, BAKED_MAGIC, 4);
+	header.version = BAKED_VERSION;
+	header.width = width;
+	header.height = height;
+	header.format = format;
+	header.quality = (unsigned int)quality;
+	header.filter = (unsigned int)MipChain::GetFilter();
+
+	// Only what Decode made with the settings it has now
+	if (quality != BlockCompressor::GetQuality() || (blocks == NULL && pixels == NULL) ||
+		(blocks == NULL && mipmaps == NULL && (width > 1 || height > 1)) ||
+		!BakedLayout(width, height, channels, quality, header))
 		return;
+
+	// Write to a temporary file first so a half written file is never picked up
+	char *file = FileName(name);
+	std::string bakedname = std::string(file) + BAKED_EXTENSION;
+	std::string tempname = bakedname + ".tmp";
+
+	free(file);
+
+	FILE *f = fopen(tempname.c_str(), "wb");
+
+	// The texture directory may be read only, we just don't bake then
+	if (f == NULL)
+		return;
+
+	// The levels straight from the buffers Upload would have used
+	unsigned int at = 0;
+	bool written = BakedWrite(f, at, 0, &header, sizeof(header));
+
+	if (blocks)
+		written = written && BakedWrite(f, at, header.offset[0], blocks, header.fileSize - header.offset[0]);
+	else
+	{
+		written = written && BakedWrite(f, at, header.offset[0], pixels, header.size[0]);
+
+		if (header.numLevels > 1)
+			written = written && BakedWrite(f, at, header.offset[1], mipmaps, header.fileSize - header.offset[1]);
 	}
 
-	// Loop through the image data and swap the 1st and 3rd bytes (red and blue)
-	for(GLuint i = 0; i < int(imageSize); i += bytesPerPixel)
+	if (fclose(f) != 0 || !written)
 	{
-		temp = imageData[i];
-		imageData[i] = imageData[i + 2];
-		imageData[i + 2] = temp;
+		remove(tempname.c_str());
+		return;
 	}
 
-	// We are done with the file so close it
-	fclose(file);
+	remove(bakedname.c_str());
+	if (rename(tempname.c_str(), bakedname.c_str()) != 0)
+		remove(tempname.c_str());
+}
 
-	// Set the type
-	if (bpp == 24)
-		type = GL_RGB;
-	
-	// Generate the OpenGL texture id
-	glGenTextures(1, &texture[0]);
+bool GLTexture::GetBaking()
+{
+	return baking;
+}
 
-	// Bind this texture to its id
-	glBindTexture(GL_TEXTURE_2D, texture[0]);
+void GLTexture::SetBaking(bool bake)
+{
+	baking = bake;
+}
 
-	// Use mipmapping filter
-	glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER,GL_LINEAR_MIPMAP_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MAG_FILTER,GL_LINEAR);
+bool GLTexture::GetPreferCompressed()
+{
+	return preferCompressed;
+}
 
-	// Generate the mipmaps
-	gluBuild2DMipmaps(GL_TEXTURE_2D, type, width, height, type, GL_UNSIGNED_BYTE, imageData);
+void GLTexture::SetPreferCompressed(bool prefer)
+{
+	preferCompressed = prefer;
+}
 
-	// Cleanup
-	free(imageData);
+bool GLTexture::DecodeBMP(const char *name)
+{
+	LOADSTATS_FILE(name);
+	LOADSTATS_SCOPE("decode", 0);
+
+	int w, h;
+	bool alpha;
+
+	// Decode the mapped file straight into a pooled buffer
+	unsigned char *image = BMPDecoder::Load(name, w, h, alpha);
+
+	// If the texture file was not found or can't be read, return from the function
+	if (image == NULL)
+		return false;
+
+	// Just in case we want to use the width and height later
+	width = w;
+	height = h;
+
+	LOADSTATS_BYTES((size_t)width * height * (alpha ? 4 : 3));
+
+	// Keep the image data for Upload
+	FreePixels();
+	pixels = image;
+	format = alpha ? GL_RGBA : GL_RGB;
+
+	return true;
+}
+
+bool GLTexture::DecodeTGA(const char *name)
+{
+	LOADSTATS_FILE(name);
+	LOADSTATS_SCOPE("decode", 0);
+
+	int w, h;
+	bool alpha;
+
+	// Decode the mapped file straight into a pooled buffer
+	unsigned char *image = TGADecoder::Load(name, w, h, alpha);
+
+	// If the texture file was not found or can't be read, return from the function
+	if (image == NULL)
+		return false;
+
+	// Just in case we want to use the width and height later
+	width = w;
+	height = h;
+
+	LOADSTATS_BYTES((size_t)width * height * (alpha ? 4 : 3));
+
+	// Keep the image data for Upload
+	FreePixels();
+	pixels = image;
+	format = alpha ? GL_RGBA : GL_RGB;
+
+	return true;
+}
+
+bool GLTexture::DecodeJPEG(const char *name)
+{
+	LOADSTATS_FILE(name);
+	LOADSTATS_SCOPE("decode", 0);
+
+	int w, h;
+
+	// Decode the mapped file straight into a pooled buffer
+	unsigned char *image = JPEGDecoder::Load(name, w, h);
+
+	// If the texture file was not found or can't be read, return from the function
+	if (image == NULL)
+		return false;
+
+	// Just in case we want to use the width and height later
+	width = w;
+	height = h;
+
+	LOADSTATS_BYTES((size_t)width * height * 3);
+
+	// Keep the image data for Upload
+	FreePixels();
+	pixels = image;
+	format = GL_RGB;
+
+	return true;
+}
+
+bool GLTexture::DecodePNG(const char *name)
+{
+	LOADSTATS_FILE(name);
+	LOADSTATS_SCOPE("decode", 0);
+
+	int w, h;
+	bool alpha;
+
+	// Decode the mapped file straight into a pooled buffer
+	unsigned char *image = PNGDecoder::Load(name, w, h, alpha);
+
+	// If the texture file was not found or can't be read, return from the function
+	if (image == NULL)
+		return false;
+
+	// Just in case we want to use the width and height later
+	width = w;
+	height = h;
+
+	LOADSTATS_BYTES((size_t)width * height * (alpha ? 4 : 3));
+
+	// Keep the image data for Upload
+	FreePixels();
+	pixels = image;
+	format = alpha ? GL_RGBA : GL_RGB;
+
+	return true;
 }
 
 
+#ifdef _WIN32
 void GLTexture::LoadBMPResource(char *name)
 {
 	// Find the bitmap in the bitmap resources
@@ -272,7 +809,7 @@ void GLTexture::LoadBMPResource(char *name)
 	glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MAG_FILTER,GL_LINEAR);
 
 	// Generate the mipmaps
-	gluBuild2DMipmaps(GL_TEXTURE_2D, 3, width, height, GL_RGB, GL_UNSIGNED_BYTE, (unsigned char *)buffer+sizeof(BITMAPINFO)+2);
+	MipChain::BuildAndUpload((unsigned char *)buffer+sizeof(BITMAPINFO)+2, width, height, GL_RGB);
 	//gluBuild2DMipmaps(GL_TEXTURE_2D, 3, width, height, GL_RGB, GL_UNSIGNED_BYTE, bmp->bmBits);
 
 	// Cleanup
@@ -282,20 +819,6 @@ void GLTexture::LoadBMPResource(char *name)
 
 void GLTexture::LoadTGAResource(char *name)
 {
-	// struct to cast the resource into
-	struct TGAstruct {
-		GLubyte	TGAcompare[12];								// Used to compare TGA header
-		GLubyte	header[6];									// First 6 useful bytes of the header
-	};
-
-	GLubyte		TGAheader[12]	= {0,0,2,0,0,0,0,0,0,0,0,0};// Uncompressed TGA header
-	GLuint		bytesPerPixel;								// Holds the number of bytes per pixel used
-	GLuint		imageSize;									// Used to store the image size
-	GLuint		temp;										// Temporary variable
-	GLuint		type			= GL_RGBA;					// Set the default type to RBGA (32 BPP)
-	GLubyte		*imageData;									// Image data (up to 32 Bits)
-	GLuint		bpp;										// Image color depth in bits per pixel.
-
 	// Find the targa in the "TGA" resources
 	HRSRC hrsrc = FindResource(0, name, "TGA");
 
@@ -310,51 +833,27 @@ void GLTexture::LoadTGAResource(char *name)
 	if (resource==0)
 		return;
 
-	// Load it into the buffer
-	void *buffer = LockResource(resource);
+	// The resource is the whole file, it stays loaded with the program
+	const unsigned char *buffer = (const unsigned char *)LockResource(resource);
+	size_t size = SizeofResource(0, hrsrc);
 
-	// Cast it into the targa struct
-	TGAstruct *top = (TGAstruct*)buffer;
+	TGADecoder::Info info;
 
-	// Make sure it checks out against our comparison header
-	if (memcmp(TGAheader,top,sizeof(TGAheader)) != 0)
+	// Make sure it is a targa we can read
+	if (!TGADecoder::ReadInfo(buffer, size, info))
 		return;
 
-	// Determine the TGA width and height (highbyte*256+lowbyte)
-	width  = top->header[1] * 256 + top->header[0];
-	height = top->header[3] * 256 + top->header[2];
-    
-	// Check to make sure the targa is valid and is 24 bit or 32 bit
-	if(width	<=0	||										// Is the width less than or equal to zero
-	   height	<=0	||										// Is the height less than or equal to zero
-	   (top->header[4] != 24 && top->header[4] != 32))		// Is it 24 or 32 bit?
+	unsigned char *imageData = PixelPool::Alloc(TGADecoder::ImageSize(info));
+
+	if (!TGADecoder::Decode(buffer, size, info, imageData))
 	{
-		// If anything didn't check out then close the file and return
+		PixelPool::Free(imageData);
 		return;
 	}
 
-	bpp				= top->header[4];							// Grab the bits per pixel
-	bytesPerPixel	= bpp / 8;								// Divide by 8 to get the bytes per pixel
-	imageSize		= width * height * bytesPerPixel;		// Calculate the memory required for the data
-
-	// Allocate the memory for the image data
-	imageData		= new GLubyte[imageSize];
-
-	// Load the data in
-	memcpy(imageData, (GLubyte*)buffer+18, imageSize);
+	width = info.width;
+	height = info.height;
 
-	// Loop through the image data and swap the 1st and 3rd bytes (red and blue)
-	for(GLuint i = 0; i < int(imageSize); i += bytesPerPixel)
-	{
-		temp = imageData[i];
-		imageData[i] = imageData[i + 2];
-		imageData[i + 2] = temp;
-	}
-
-	// Set the type
-	if (bpp == 24)
-		type = GL_RGB;
-	
 	// Generate the OpenGL texture id
 	glGenTextures(1, &texture[0]);
 
@@ -366,18 +865,20 @@ void GLTexture::LoadTGAResource(char *name)
 	glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MAG_FILTER,GL_LINEAR);
 
 	// Generate the mipmaps
-	gluBuild2DMipmaps(GL_TEXTURE_2D, type, width, height, type, GL_UNSIGNED_BYTE, imageData);
+	MipChain::BuildAndUpload(imageData, width, height, info.alpha ? GL_RGBA : GL_RGB);
 
 	// Cleanup
-	free(imageData);
-	free(buffer);
-	free(top);
+	PixelPool::Free(imageData);
 }
 
+#endif
+
 void GLTexture::BuildColorTexture(unsigned char r, unsigned char g, unsigned char b)
 {
 	unsigned char data[12];	// a 2x2 texture at 24 bits
 
+	LOADSTATS_SCOPE("color texture", sizeof(data));
+
 	// Store the data
 	for(int i = 0; i < 12; i += 3)
 	{
@@ -399,5 +900,5 @@ void GLTexture::BuildColorTexture(unsigned char r, unsigned char g, unsigned cha
 	glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MAG_FILTER,GL_LINEAR);
 
 	// Generate the texture
-	gluBuild2DMipmaps(GL_TEXTURE_2D, 3, 2, 2, GL_RGB, GL_UNSIGNED_BYTE, data);
+	MipChain::BuildAndUpload(data, 2, 2, GL_RGB);
 }
@@ -5,8 +5,8 @@
 //
 // GLTexture.h: interface for the GLTexture class.
 // This class loads a texture file and prepares it
-// to be used in OpenGL. It can open a bitmap or a
-// targa file. The min filter is set to mipmap b/c
+// to be used in OpenGL. It can open a bitmap, a
+// targa, a JPEG or a PNG file. The min filter is set to mipmap b/c
 // they look better and the performance cost on
 // modern video cards in negligible. I leave all of
 // the texture management to the application. I have
@@ -32,17 +32,50 @@
 // tex3.BuildColorTexture(255, 0, 0);	// Builds a solid red texture
 // tex3.Use();				 // Binds the targa for use
 //
+// // Load can be split in two so the file reading can happen on
+// // another thread. Decode doesn't touch OpenGL, Upload does
+// // and has to run on the thread that owns the GL context.
+// if (tex.Decode("texture.bmp"))	// Reads the file into tex.pixels and builds its mipmaps
+//     tex.Upload();				// Creates the GL texture and frees tex.pixels
+//
+// // With a quality set Decode also block compresses the image
+// // (see BlockCompressor.h), Upload sends the blocks as they are.
+// BlockCompressor::SetQuality(BlockCompressor::NORMAL);
+//
+// // Decode writes what it made, the mipmaps and any blocks, to
+// // "texture.bmp.tex" next to the image. Later Decodes map that
+// // file instead while it is newer than the image and was made
+// // with the same quality and mip filter, and Upload hands the
+// // levels to GL straight from the mapping. Without the image the
+// // baked file is used alone. Set this before loading to neither
+// // read nor write them.
+// GLTexture::SetBaking(false);
+//
+// // A .bmp or .tga with a .png, .jpg or .jpeg of the same name and
+// // size next to it is read from that file instead, it is a fraction
+// // of the size. Without the .bmp or .tga any of them is read, so the
+// // bitmaps can be deleted. Set this before loading to read the names
+// // as given.
+// GLTexture::SetPreferCompressed(false);
+//
 //////////////////////////////////////////////////////////////////////
 
 #ifndef GLTEXTURE_H
 #define GLTEXTURE_H
 
+#ifdef _WIN32
 #include <windows.h>		// Header File For Windows
 #include <gl\gl.h>			// Header File For The OpenGL32 Library
 #include <gl\glu.h>			// Header File For The GLu32 Library
-#include "GLAUX.H"		// Header File For The Glaux Library
+#else
+#include <GL/gl.h>			// The loaders also build on Linux for the benchmark
+#include <GL/glu.h>
+#endif
+
+#include "BlockCompressor.h"
+#include "MappedFile.h"
 
-#pragma comment(lib, "glaux")
+#include <string>
 
 class GLTexture  
 {
@@ -51,6 +84,10 @@ public:
 	unsigned int texture[1];						// OpenGL's number for the texture
 	int width;										// Texture's width
 	int height;										// Texture's height
+	unsigned char *pixels;							// The decoded image waiting for Upload
+	unsigned char *mipmaps;							// Its smaller levels (see MipChain.h)
+	unsigned char *blocks;							// Or the image and its levels block compressed
+	GLenum format;									// GL_RGB or GL_RGBA for the decoded image
 	void Use();										// Binds the texture for use
 	void BuildColorTexture(unsigned char r, unsigned char g, unsigned char b);	// Sometimes we want a texture of uniform color
 	void LoadTGAResource(char *name);				// Load a targa from the resources
@@ -59,9 +96,30 @@ public:
 	void LoadTGA(char *name);						// Loads a targa file
 	void LoadBMP(char *name);						// Loads a bitmap file
 	void Load(char *name);							// Load the texture
+	bool Decode(const char *name);					// Reads the texture file into pixels without touching GL
+	bool DecodeImage(const char *name);				// Decode without the mipmaps and blocks, for callers that copy the image
+	void Upload();									// Creates the GL texture from pixels
+	void BuildMipmaps();							// Makes mipmaps from pixels, Decode already does
+	bool Compress(BlockCompressor::Quality quality);// Replaces pixels and mipmaps with blocks
+	void FreePixels();								// Drops the decoded image, its mipmaps and blocks
+	static bool GetBaking();						// True if Decode reads and writes baked files
+	static void SetBaking(bool bake);				// Changes it, set it before any loading starts
+	static bool GetPreferCompressed();				// True if a .png or .jpg next to a .bmp or .tga is read instead
+	static void SetPreferCompressed(bool prefer);	// Changes it, set it before any loading starts
+	static void SourceFile(const char *name, std::string &file);	// The file Decode reads for name
 	GLTexture();									// Constructor
 	virtual ~GLTexture();							// Destructor
 
+private:
+	MappedFile baked;								// The baked file pixels, mipmaps or blocks point into
+	char *FileName(const char *name);				// The file name without "'s, sets texturename
+	void Release(unsigned char *p);					// Frees a buffer unless it is in the baked file
+	bool LoadBaked(const char *name);				// Maps the baked file if it is good to use
+	void SaveBaked(const char *name);				// Writes what Decode made out as the baked file
+	bool DecodeBMP(const char *name);				// Reads a bitmap file into pixels
+	bool DecodeTGA(const char *name);				// Reads a targa file into pixels
+	bool DecodeJPEG(const char *name);				// Reads a JPEG file into pixels
+	bool DecodePNG(const char *name);				// Reads a PNG file into pixels
 };
 
 #endif GLTEXTURE_H
\ No newline at end of file
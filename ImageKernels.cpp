@@ -0,0 +1,508 @@
+//////////////////////////////////////////////////////////////////////
+//
+// Image Kernels
+//
+// ImageKernels.cpp: implementation of the ImageKernels class.
+//
+//////////////////////////////////////////////////////////////////////
+
+#include "ImageKernels.h"
+
+#include <stddef.h>
+#include <string.h>
+
+// SSSE3 is checked for at run time
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define IMAGE_KERNELS_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// GCC and clang only allow SSSE3 intrinsics in functions marked for it,
+// MSVC allows them anywhere
+#if defined(__GNUC__) || defined(__clang__)
+#define IMAGE_KERNELS_SSSE3 __attribute__((target("ssse3")))
+#else
+#define IMAGE_KERNELS_SSSE3
+#endif
+
+//////////////////////////////////////////////////////////////////////
+// CPU detection
+//////////////////////////////////////////////////////////////////////
+
+static ImageKernels::Level DetectLevel()
+{
+#ifdef IMAGE_KERNELS_X86
+#if defined(_MSC_VER)
+	int info[4];
+
+	__cpuid(info, 1);
+
+	if (info[2] & (1 << 9))
+		return ImageKernels::SSSE3;
+
+	return ImageKernels::SCALAR;
+#else
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("ssse3"))
+		return ImageKernels::SSSE3;
+
+	return ImageKernels::SCALAR;
+#endif
+#else
+	return ImageKernels::SCALAR;
+#endif
+}
+
+static ImageKernels::Level &CurrentLevel()
+{
+	static ImageKernels::Level level = DetectLevel();
+	return level;
+}
+
+ImageKernels::Level ImageKernels::Supported()
+{
+	static Level supported = DetectLevel();
+	return supported;
+}
+
+ImageKernels::Level ImageKernels::GetLevel()
+{
+	return CurrentLevel();
+}
+
+void ImageKernels::SetLevel(Level level)
+{
+	CurrentLevel() = (level < Supported()) ? level : Supported();
+}
+
+//////////////////////////////////////////////////////////////////////
+// SSSE3 versions
+//////////////////////////////////////////////////////////////////////
+
+#ifdef IMAGE_KERNELS_X86
+
+// Four pixels per 16 byte load. The last 4 bytes of each load are the
+// next pixel's, the shuffle leaves them where they are and the next
+// store writes them again, so no store goes past the last pixel as long
+// as two more pixels follow the four.
+IMAGE_KERNELS_SSSE3
+static int SwapRedBlue24SSSE3(const unsigned char *src, unsigned char *dst, int count)
+{
+	const __m128i swap = _mm_setr_epi8(2,1,0, 5,4,3, 8,7,6, 11,10,9, 12,13,14,15);
+	int i = 0;
+
+	for (; i + 6 <= count; i += 4)
+	{
+		__m128i p = _mm_loadu_si128((const __m128i *)(src + i * 3));
+		_mm_storeu_si128((__m128i *)(dst + i * 3), _mm_shuffle_epi8(p, swap));
+	}
+
+	return i;
+}
+
+IMAGE_KERNELS_SSSE3
+static int SwapRedBlue32SSSE3(const unsigned char *src, unsigned char *dst, int count)
+{
+	const __m128i swap = _mm_setr_epi8(2,1,0,3, 6,5,4,7, 10,9,8,11, 14,13,12,15);
+	int i = 0;
+
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128i p = _mm_loadu_si128((const __m128i *)(src + i * 4));
+		_mm_storeu_si128((__m128i *)(dst + i * 4), _mm_shuffle_epi8(p, swap));
+	}
+
+	return i;
+}
+
+// Four pixels in, 12 bytes out. The store is 16 bytes wide so it stops
+// while two more pixels of output follow
+IMAGE_KERNELS_SSSE3
+static int DropAlpha32SSSE3(const unsigned char *src, unsigned char *dst, int count)
+{
+	const __m128i pack = _mm_setr_epi8(2,1,0, 6,5,4, 10,9,8, 14,13,12, -1,-1,-1,-1);
+	int i = 0;
+
+	for (; i + 6 <= count; i += 4)
+	{
+		__m128i p = _mm_loadu_si128((const __m128i *)(src + i * 4));
+		_mm_storeu_si128((__m128i *)(dst + i * 3), _mm_shuffle_epi8(p, pack));
+	}
+
+	return i;
+}
+
+// 16 pixels in, 48 bytes out in three stores
+IMAGE_KERNELS_SSSE3
+static int ExpandGraySSSE3(const unsigned char *src, unsigned char *dst, int count)
+{
+	const __m128i first = _mm_setr_epi8(0,0,0, 1,1,1, 2,2,2, 3,3,3, 4,4,4, 5);
+	const __m128i second = _mm_setr_epi8(5,5, 6,6,6, 7,7,7, 8,8,8, 9,9,9, 10,10);
+	const __m128i third = _mm_setr_epi8(10, 11,11,11, 12,12,12, 13,13,13, 14,14,14, 15,15,15);
+	int i = 0;
+
+	for (; i + 16 <= count; i += 16)
+	{
+		__m128i p = _mm_loadu_si128((const __m128i *)(src + i));
+
+		_mm_storeu_si128((__m128i *)(dst + i * 3), _mm_shuffle_epi8(p, first));
+		_mm_storeu_si128((__m128i *)(dst + i * 3 + 16), _mm_shuffle_epi8(p, second));
+		_mm_storeu_si128((__m128i *)(dst + i * 3 + 32), _mm_shuffle_epi8(p, third));
+	}
+
+	return i;
+}
+
+// 8 pixels in, 32 bytes out in two stores
+IMAGE_KERNELS_SSSE3
+static int ExpandGrayAlphaSSSE3(const unsigned char *src, unsigned char *dst, int count)
+{
+	const __m128i lo = _mm_setr_epi8(0,0,0,1, 2,2,2,3, 4,4,4,5, 6,6,6,7);
+	const __m128i hi = _mm_setr_epi8(8,8,8,9, 10,10,10,11, 12,12,12,13, 14,14,14,15);
+	int i = 0;
+
+	for (; i + 8 <= count; i += 8)
+	{
+		__m128i p = _mm_loadu_si128((const __m128i *)(src + i * 2));
+
+		_mm_storeu_si128((__m128i *)(dst + i * 4), _mm_shuffle_epi8(p, lo));
+		_mm_storeu_si128((__m128i *)(dst + i * 4 + 16), _mm_shuffle_epi8(p, hi));
+	}
+
+	return i;
+}
+
+// The JFIF color conversion in 14 bit fixed point, small enough for
+// 16 bit multipliers
+#define YCC_SHIFT		14
+#define YCC_ROUND		(1 << (YCC_SHIFT - 1))
+#define YCC_CR_R		22970	// 1.402
+#define YCC_CB_G		-5638	// -0.344136
+#define YCC_CR_G		-11700	// -0.714136
+#define YCC_CB_B		29032	// 1.772
+
+// 8 pixels a time. Each product and sum is 32 bits from madd, the
+// channels are packed to bytes with saturation, then spread to RGB
+IMAGE_KERNELS_SSSE3
+static int YCbCrToRGBSSSE3(const unsigned char *y, const unsigned char *cb, const unsigned char *cr, unsigned char *dst, int count)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i center = _mm_set1_epi16(128);
+	const __m128i round = _mm_set1_epi32(YCC_ROUND);
+	const __m128i red = _mm_setr_epi16(YCC_CR_R, 0, YCC_CR_R, 0, YCC_CR_R, 0, YCC_CR_R, 0);
+	const __m128i green = _mm_setr_epi16(YCC_CB_G, YCC_CR_G, YCC_CB_G, YCC_CR_G, YCC_CB_G, YCC_CR_G, YCC_CB_G, YCC_CR_G);
+	const __m128i blue = _mm_setr_epi16(YCC_CB_B, 0, YCC_CB_B, 0, YCC_CB_B, 0, YCC_CB_B, 0);
+
+	// Bytes 0-7 red, 8-15 green in one register, blue in the other
+	const __m128i rg0 = _mm_setr_epi8(0,8,-1, 1,9,-1, 2,10,-1, 3,11,-1, 4,12,-1, 5);
+	const __m128i b0 = _mm_setr_epi8(-1,-1,0, -1,-1,1, -1,-1,2, -1,-1,3, -1,-1,4, -1);
+	const __m128i rg1 = _mm_setr_epi8(13,-1, 6,14,-1, 7,15,-1, -1,-1,-1,-1,-1,-1,-1,-1);
+	const __m128i b1 = _mm_setr_epi8(-1,5, -1,-1,6, -1,-1,7, -1,-1,-1,-1,-1,-1,-1,-1);
+	int i = 0;
+
+	for (; i + 8 <= count; i += 8)
+	{
+		__m128i luma = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(y + i)), zero);
+		__m128i u = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(cb + i)), zero), center);
+		__m128i v = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(cr + i)), zero), center);
+
+		// Cb, Cr pairs for the madds, 4 pixels in each half
+		__m128i lo = _mm_unpacklo_epi16(u, v);
+		__m128i hi = _mm_unpackhi_epi16(u, v);
+		__m128i vlo = _mm_unpacklo_epi16(v, zero);
+		__m128i vhi = _mm_unpackhi_epi16(v, zero);
+		__m128i ulo = _mm_unpacklo_epi16(u, zero);
+		__m128i uhi = _mm_unpackhi_epi16(u, zero);
+
+		__m128i r = _mm_packs_epi32(
+			_mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(vlo, red), round), YCC_SHIFT),
+			_mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(vhi, red), round), YCC_SHIFT));
+		__m128i g = _mm_packs_epi32(
+			_mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(lo, green), round), YCC_SHIFT),
+			_mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(hi, green), round), YCC_SHIFT));
+		__m128i b = _mm_packs_epi32(
+			_mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(ulo, blue), round), YCC_SHIFT),
+			_mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(uhi, blue), round), YCC_SHIFT));
+
+		__m128i rg = _mm_packus_epi16(_mm_add_epi16(luma, r), _mm_add_epi16(luma, g));
+		__m128i bb = _mm_packus_epi16(_mm_add_epi16(luma, b), zero);
+
+		// 24 bytes out, stored as 16 and 8
+		_mm_storeu_si128((__m128i *)(dst + i * 3), _mm_or_si128(_mm_shuffle_epi8(rg, rg0), _mm_shuffle_epi8(bb, b0)));
+		_mm_storel_epi64((__m128i *)(dst + i * 3 + 16), _mm_or_si128(_mm_shuffle_epi8(rg, rg1), _mm_shuffle_epi8(bb, b1)));
+	}
+
+	return i;
+}
+
+// 8 pixels of each row in, 4 out. The sums are 16 bit so the
+// rounding is the same as the plain version's
+IMAGE_KERNELS_SSSE3
+static int HalveRows32SSSE3(const unsigned char *row0, const unsigned char *row1, unsigned char *dst, int count)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i two = _mm_set1_epi16(2);
+	int i = 0;
+
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128i half[2];
+
+		for (int k = 0; k < 2; k++)
+		{
+			__m128i a = _mm_loadu_si128((const __m128i *)(row0 + i * 8 + k * 16));
+			__m128i b = _mm_loadu_si128((const __m128i *)(row1 + i * 8 + k * 16));
+
+			// Columns first, two pixels in each half
+			__m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+			__m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+
+			// Then each pixel with its right neighbour
+			lo = _mm_add_epi16(lo, _mm_srli_si128(lo, 8));
+			hi = _mm_add_epi16(hi, _mm_srli_si128(hi, 8));
+
+			half[k] = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(lo, hi), two), 2);
+		}
+
+		_mm_storeu_si128((__m128i *)(dst + i * 4), _mm_packus_epi16(half[0], half[1]));
+	}
+
+	return i;
+}
+
+// 8 pixels of each row in, 4 out. The shuffles split each 12 bytes
+// into the even and the odd pixels, widened to 16 bits. The second
+// load starts 8 bytes in so neither reads past the 24 bytes.
+IMAGE_KERNELS_SSSE3
+static int HalveRows24SSSE3(const unsigned char *row0, const unsigned char *row1, unsigned char *dst, int count)
+{
+	const __m128i even0 = _mm_setr_epi8(0,-1,1,-1,2,-1, 6,-1,7,-1,8,-1, -1,-1,-1,-1);
+	const __m128i odd0 = _mm_setr_epi8(3,-1,4,-1,5,-1, 9,-1,10,-1,11,-1, -1,-1,-1,-1);
+	const __m128i even1 = _mm_setr_epi8(4,-1,5,-1,6,-1, 10,-1,11,-1,12,-1, -1,-1,-1,-1);
+	const __m128i odd1 = _mm_setr_epi8(7,-1,8,-1,9,-1, 13,-1,14,-1,15,-1, -1,-1,-1,-1);
+	const __m128i pack = _mm_setr_epi8(0,1,2,3,4,5, 8,9,10,11,12,13, -1,-1,-1,-1);
+	const __m128i two = _mm_set1_epi16(2);
+	int i = 0;
+
+	for (; i + 4 <= count; i += 4)
+	{
+		const unsigned char *a = row0 + i * 6;
+		const unsigned char *b = row1 + i * 6;
+
+		__m128i a0 = _mm_loadu_si128((const __m128i *)a);
+		__m128i b0 = _mm_loadu_si128((const __m128i *)b);
+		__m128i a1 = _mm_loadu_si128((const __m128i *)(a + 8));
+		__m128i b1 = _mm_loadu_si128((const __m128i *)(b + 8));
+
+		__m128i s0 = _mm_add_epi16(_mm_add_epi16(_mm_shuffle_epi8(a0, even0), _mm_shuffle_epi8(a0, odd0)),
+			_mm_add_epi16(_mm_shuffle_epi8(b0, even0), _mm_shuffle_epi8(b0, odd0)));
+		__m128i s1 = _mm_add_epi16(_mm_add_epi16(_mm_shuffle_epi8(a1, even1), _mm_shuffle_epi8(a1, odd1)),
+			_mm_add_epi16(_mm_shuffle_epi8(b1, even1), _mm_shuffle_epi8(b1, odd1)));
+
+		s0 = _mm_srli_epi16(_mm_add_epi16(s0, two), 2);
+		s1 = _mm_srli_epi16(_mm_add_epi16(s1, two), 2);
+
+		// 12 bytes out, stored as 8 and 4 so nothing past them is touched
+		__m128i out = _mm_shuffle_epi8(_mm_packus_epi16(s0, s1), pack);
+		int last = _mm_cvtsi128_si32(_mm_srli_si128(out, 8));
+
+		_mm_storel_epi64((__m128i *)(dst + i * 3), out);
+		memcpy(dst + i * 3 + 8, &last, 4);
+	}
+
+	return i;
+}
+
+// 16 bytes at a time, widened to floats in four steps of 4
+IMAGE_KERNELS_SSSE3
+static int AddWeightedRowSSSE3(const unsigned char *row, float weight, float *sum, int count)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128 w = _mm_set1_ps(weight);
+	int i = 0;
+
+	for (; i + 16 <= count; i += 16)
+	{
+		__m128i p = _mm_loadu_si128((const __m128i *)(row + i));
+		__m128i lo = _mm_unpacklo_epi8(p, zero);
+		__m128i hi = _mm_unpackhi_epi8(p, zero);
+		__m128i q[4] = {
+			_mm_unpacklo_epi16(lo, zero), _mm_unpackhi_epi16(lo, zero),
+			_mm_unpacklo_epi16(hi, zero), _mm_unpackhi_epi16(hi, zero)
+		};
+
+		for (int k = 0; k < 4; k++)
+		{
+			__m128 s = _mm_loadu_ps(sum + i + k * 4);
+			_mm_storeu_ps(sum + i + k * 4, _mm_add_ps(s, _mm_mul_ps(w, _mm_cvtepi32_ps(q[k]))));
+		}
+	}
+
+	return i;
+}
+
+#endif
+
+//////////////////////////////////////////////////////////////////////
+// Swizzles
+//////////////////////////////////////////////////////////////////////
+
+void ImageKernels::SwapRedBlue24(const unsigned char *src, unsigned char *dst, int count)
+{
+	int i = 0;
+
+#ifdef IMAGE_KERNELS_X86
+	if (GetLevel() >= SSSE3)
+		i = SwapRedBlue24SSSE3(src, dst, count);
+#endif
+
+	// The rest one at a time, a temp so it works in place
+	for (; i < count; i++)
+	{
+		unsigned char b = src[i*3];
+
+		dst[i*3] = src[i*3+2];
+		dst[i*3+1] = src[i*3+1];
+		dst[i*3+2] = b;
+	}
+}
+
+void ImageKernels::SwapRedBlue32(const unsigned char *src, unsigned char *dst, int count)
+{
+	int i = 0;
+
+#ifdef IMAGE_KERNELS_X86
+	if (GetLevel() >= SSSE3)
+		i = SwapRedBlue32SSSE3(src, dst, count);
+#endif
+
+	for (; i < count; i++)
+	{
+		unsigned char b = src[i*4];
+
+		dst[i*4] = src[i*4+2];
+		dst[i*4+1] = src[i*4+1];
+		dst[i*4+2] = b;
+		dst[i*4+3] = src[i*4+3];
+	}
+}
+
+void ImageKernels::DropAlpha32(const unsigned char *src, unsigned char *dst, int count)
+{
+	int i = 0;
+
+#ifdef IMAGE_KERNELS_X86
+	if (GetLevel() >= SSSE3)
+		i = DropAlpha32SSSE3(src, dst, count);
+#endif
+
+	// The output never gets ahead of the input, in place is fine
+	for (; i < count; i++)
+	{
+		unsigned char b = src[i*4];
+		unsigned char g = src[i*4+1];
+		unsigned char r = src[i*4+2];
+
+		dst[i*3] = r;
+		dst[i*3+1] = g;
+		dst[i*3+2] = b;
+	}
+}
+
+void ImageKernels::ExpandGray(const unsigned char *src, unsigned char *dst, int count)
+{
+	int i = 0;
+
+#ifdef IMAGE_KERNELS_X86
+	if (GetLevel() >= SSSE3)
+		i = ExpandGraySSSE3(src, dst, count);
+#endif
+
+	for (; i < count; i++)
+		dst[i*3] = dst[i*3+1] = dst[i*3+2] = src[i];
+}
+
+void ImageKernels::ExpandGrayAlpha(const unsigned char *src, unsigned char *dst, int count)
+{
+	int i = 0;
+
+#ifdef IMAGE_KERNELS_X86
+	if (GetLevel() >= SSSE3)
+		i = ExpandGrayAlphaSSSE3(src, dst, count);
+#endif
+
+	for (; i < count; i++)
+	{
+		dst[i*4] = dst[i*4+1] = dst[i*4+2] = src[i*2];
+		dst[i*4+3] = src[i*2+1];
+	}
+}
+
+static unsigned char Clamp255(int v)
+{
+	return (unsigned char)(v < 0 ? 0 : (v > 255 ? 255 : v));
+}
+
+void ImageKernels::YCbCrToRGB(const unsigned char *y, const unsigned char *cb, const unsigned char *cr, unsigned char *dst, int count)
+{
+	int i = 0;
+
+#ifdef IMAGE_KERNELS_X86
+	if (GetLevel() >= SSSE3)
+		i = YCbCrToRGBSSSE3(y, cb, cr, dst, count);
+#endif
+
+	// The same fixed point as the SSSE3 version
+	for (; i < count; i++)
+	{
+		int u = cb[i] - 128;
+		int v = cr[i] - 128;
+
+		dst[i*3] = Clamp255(y[i] + ((v * YCC_CR_R + YCC_ROUND) >> YCC_SHIFT));
+		dst[i*3+1] = Clamp255(y[i] + ((u * YCC_CB_G + v * YCC_CR_G + YCC_ROUND) >> YCC_SHIFT));
+		dst[i*3+2] = Clamp255(y[i] + ((u * YCC_CB_B + YCC_ROUND) >> YCC_SHIFT));
+	}
+}
+
+//////////////////////////////////////////////////////////////////////
+// Filters
+//////////////////////////////////////////////////////////////////////
+
+void ImageKernels::HalveRows(const unsigned char *row0, const unsigned char *row1, unsigned char *dst, int count, int channels)
+{
+	int i = 0;
+
+#ifdef IMAGE_KERNELS_X86
+	if (GetLevel() >= SSSE3 && channels == 4)
+		i = HalveRows32SSSE3(row0, row1, dst, count);
+	else if (GetLevel() >= SSSE3 && channels == 3)
+		i = HalveRows24SSSE3(row0, row1, dst, count);
+#endif
+
+	for (; i < count; i++)
+	{
+		const unsigned char *a = row0 + i * 2 * channels;
+		const unsigned char *b = row1 + i * 2 * channels;
+
+		for (int c = 0; c < channels; c++)
+			dst[i * channels + c] = (unsigned char)((a[c] + a[c + channels] + b[c] + b[c + channels] + 2) >> 2);
+	}
+}
+
+void ImageKernels::AddWeightedRow(const unsigned char *row, float weight, float *sum, int count)
+{
+	int i = 0;
+
+#ifdef IMAGE_KERNELS_X86
+	if (GetLevel() >= SSSE3)
+		i = AddWeightedRowSSSE3(row, weight, sum, count);
+#endif
+
+	// The same multiply then add as the SSSE3 version, so the same sums
+	for (; i < count; i++)
+		sum[i] += weight * row[i];
+}
@@ -0,0 +1,75 @@
+//////////////////////////////////////////////////////////////////////
+//
+// Image Kernels
+//
+// ImageKernels.h: interface for the ImageKernels class.
+// This class holds the loops the texture decoders run over
+// every pixel of an image. Each one has a plain C++ version
+// and an SSSE3 version that works on 16 bytes at a time,
+// the SSSE3 one is used when the CPU has it. Both give the
+// same bytes.
+//
+// The file formats store their pixels blue first, OpenGL wants
+// them red first. Every swizzle can work in place (src == dst),
+// the gray expansions write more than they read so they can't.
+// HalveRows averages 2x2 blocks for the next mipmap level,
+// AddWeightedRow is one tap of a filter down the columns.
+//
+// Usage:
+// // One row of a 24 bit bitmap, BGR to RGB
+// ImageKernels::SwapRedBlue24(row, out, width);
+//
+// // 32 bit pixels, BGRA to RGBA or BGRA to RGB
+// ImageKernels::SwapRedBlue32(row, out, width);
+// ImageKernels::DropAlpha32(row, out, width);
+//
+// // 8 bit gray to RGB, gray and alpha to RGBA
+// ImageKernels::ExpandGray(row, out, width);
+// ImageKernels::ExpandGrayAlpha(row, out, width);
+//
+// // A JPEG's Y, Cb and Cr rows to one RGB row
+// ImageKernels::YCbCrToRGB(y, cb, cr, out, width);
+//
+// // Two rows of 2 * width pixels into one row of width pixels
+// ImageKernels::HalveRows(row0, row1, out, width, 3);
+//
+// // Force the plain version, e.g. to compare results
+// ImageKernels::SetLevel(ImageKernels::SCALAR);
+//
+//////////////////////////////////////////////////////////////////////
+
+#ifndef IMAGEKERNELS_H
+#define IMAGEKERNELS_H
+
+class ImageKernels
+{
+public:
+	enum Level {
+		SCALAR,		// Plain C++
+		SSSE3		// 16 bytes at a time with pshufb
+	};
+
+	// BGR to RGB for count pixels of 3 bytes
+	static void SwapRedBlue24(const unsigned char *src, unsigned char *dst, int count);
+	// BGRA to RGBA for count pixels of 4 bytes
+	static void SwapRedBlue32(const unsigned char *src, unsigned char *dst, int count);
+	// BGRA to RGB for count pixels, the alpha byte is left out
+	static void DropAlpha32(const unsigned char *src, unsigned char *dst, int count);
+	// Gray to RGB for count pixels of 1 byte, not in place
+	static void ExpandGray(const unsigned char *src, unsigned char *dst, int count);
+	// Gray and alpha to RGBA for count pixels of 2 bytes, not in place
+	static void ExpandGrayAlpha(const unsigned char *src, unsigned char *dst, int count);
+	// YCbCr (JFIF, full range) to RGB for count pixels, one byte a channel in each row
+	static void YCbCrToRGB(const unsigned char *y, const unsigned char *cb, const unsigned char *cr, unsigned char *dst, int count);
+	// Averages each 2x2 block of two rows into count pixels, rounded to nearest.
+	// The rows hold 2 * count pixels of channels bytes.
+	static void HalveRows(const unsigned char *row0, const unsigned char *row1, unsigned char *dst, int count, int channels);
+	// sum[i] += weight * row[i] for count bytes
+	static void AddWeightedRow(const unsigned char *row, float weight, float *sum, int count);
+
+	static Level GetLevel();				// The instruction set the kernels use
+	static void SetLevel(Level level);		// Lowers (or restores) it, capped at what the CPU has
+	static Level Supported();				// The best instruction set the CPU has
+};
+
+#endif IMAGEKERNELS_H
@@ -0,0 +1,1035 @@
+//////////////////////////////////////////////////////////////////////
+//
+// JPEG Decoder Class
+//
+// JPEGDecoder.cpp: implementation of the JPEGDecoder class.
+//
+//////////////////////////////////////////////////////////////////////
+
+#include "JPEGDecoder.h"
+#include "ImageKernels.h"
+#include "MappedFile.h"
+#include "PixelPool.h"
+
+#include <string.h>
+#include <vector>
+
+#define JPEG_SOF0		0xC0	// Baseline
+#define JPEG_SOF1		0xC1	// Extended, Huffman coded
+#define JPEG_SOF2		0xC2	// Progressive, Huffman coded
+#define JPEG_DHT		0xC4	// Huffman tables
+#define JPEG_RST0		0xD0	// Restart markers, D0 to D7
+#define JPEG_SOI		0xD8	// Start of image
+#define JPEG_EOI		0xD9	// End of image
+#define JPEG_SOS		0xDA	// Start of scan
+#define JPEG_DQT		0xDB	// Quantization tables
+#define JPEG_DRI		0xDD	// Restart interval
+#define JPEG_APP14		0xEE	// Adobe's, says whether the colors are YCbCr
+
+#define HUFFMAN_FAST	9		// The bits the lookup table of a code covers
+
+// Where each coefficient of the zig-zag order goes in the 8x8 block
+static const unsigned char zigzag[64] = {
+	0, 1, 8, 16, 9, 2, 3, 10, 17, 24, 32, 25, 18, 11, 4, 5,
+	12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6, 7, 14, 21, 28,
+	35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+	58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63 };
+
+// The markers are big endian, and may not be aligned
+static unsigned int ReadU16(const unsigned char *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+//////////////////////////////////////////////////////////////////////
+// Entropy coding
+//////////////////////////////////////////////////////////////////////
+
+// The bits of a scan, most significant first. A 0xFF in the data is
+// followed by a stuffed 0, any other byte after it is a marker, where
+// the scan stops and only zeros are read
+struct JPEGBitReader {
+	const unsigned char *p;
+	const unsigned char *end;
+	unsigned long long bits;		// The bits read ahead, at the top
+	int count;						// How many of them there are
+	bool marker;					// True: p is at the marker that ends the data
+
+	void Fill()
+	{
+		while (count <= 56)
+		{
+			unsigned int b = 0;
+
+			if (!marker && p < end)
+			{
+				b = *p;
+
+				if (b != 0xFF)
+					p++;
+				else if (p + 1 < end && p[1] == 0)
+					p += 2;
+				else
+				{
+					marker = true;
+					b = 0;
+				}
+			}
+
+			bits |= (unsigned long long)b << (56 - count);
+			count += 8;
+		}
+	}
+
+	unsigned int Peek(int n)
+	{
+		if (count < n)
+			Fill();
+
+		return (unsigned int)(bits >> (64 - n));
+	}
+
+	void Skip(int n)
+	{
+		bits <<= n;
+		count -= n;
+	}
+
+	unsigned int Get(int n)
+	{
+		if (n == 0)
+			return 0;
+
+		unsigned int v = Peek(n);
+		Skip(n);
+		return v;
+	}
+
+	// n bits as a signed coefficient
+	int Receive(int n)
+	{
+		if (n == 0)
+			return 0;
+
+		int v = (int)Get(n);
+
+		return v < (1 << (n - 1)) ? v - (1 << n) + 1 : v;
+	}
+
+	// Drops what is read ahead and steps over the restart marker
+	void Restart()
+	{
+		bits = 0;
+		count = 0;
+		marker = false;
+
+		while (p + 1 < end && p[0] == 0xFF && p[1] == 0xFF)
+			p++;
+
+		if (p + 1 < end && p[0] == 0xFF && p[1] >= JPEG_RST0 && p[1] <= JPEG_RST0 + 7)
+			p += 2;
+	}
+};
+
+// A Huffman table. Codes up to HUFFMAN_FAST bits are found with one
+// lookup, longer ones by comparing with the last code of each length
+struct JPEGHuffman {
+	unsigned short fast[1 << HUFFMAN_FAST];	// Length << 8 | value, 0 if longer
+	int maxCode[17];						// The last code of each length, -1 if none
+	int offset[17];							// Value index minus first code of each length
+	unsigned char values[256];				// The values in code order
+	bool defined;							// True once a DHT filled it
+
+	// False if the counts make more codes than the lengths have room for
+	bool Build(const unsigned char *counts, const unsigned char *symbols)
+	{
+		int code = 0;
+		int k = 0;
+
+		memset(fast, 0, sizeof(fast));
+
+		for (int len = 1; len <= 16; len++)
+		{
+			offset[len] = k - code;
+
+			// Checked before the fill, too many codes would run off the table
+			if (code + counts[len - 1] > (1 << len))
+				return false;
+
+			for (int i = 0; i < counts[len - 1]; i++, k++, code++)
+			{
+				values[k] = symbols[k];
+
+				if (len <= HUFFMAN_FAST)
+				{
+					int first = code << (HUFFMAN_FAST - len);
+
+					for (int fill = 0; fill < (1 << (HUFFMAN_FAST - len)); fill++)
+						fast[first + fill] = (unsigned short)((len << 8) | symbols[k]);
+				}
+			}
+
+			maxCode[len] = counts[len - 1] ? code - 1 : -1;
+			code <<= 1;
+		}
+
+		defined = true;
+		return true;
+	}
+
+	// The next value, -1 if the bits are no code
+	int Decode(JPEGBitReader &in) const
+	{
+		unsigned int peek = in.Peek(16);
+		unsigned int entry = fast[peek >> (16 - HUFFMAN_FAST)];
+
+		if (entry != 0)
+		{
+			in.Skip(entry >> 8);
+			return entry & 255;
+		}
+
+		for (int len = HUFFMAN_FAST + 1; len <= 16; len++)
+		{
+			int code = (int)(peek >> (16 - len));
+
+			if (code <= maxCode[len])
+			{
+				in.Skip(len);
+				return values[offset[len] + code];
+			}
+		}
+
+		return -1;
+	}
+};
+
+struct JPEGComponent {
+	int id;							// The id the scans use
+	int h, v;						// The sampling factors
+	int table;						// Its quantization table
+	int dcTable, acTable;			// Its Huffman tables in the current scan
+	int dcPred;						// The last DC value, the next is coded from it
+	int blocksPerLine;				// The blocks of a row, padded to whole MCUs
+	int blocksPerColumn;			// The rows of blocks, padded to whole MCUs
+	short *coefs;					// 64 coefficients of every block, natural order
+	unsigned char *plane;			// The samples once transformed
+};
+
+// Everything read so far
+struct JPEGFrame {
+	int width, height;
+	bool progressive;
+	int numComponents;
+	JPEGComponent comps[3];
+	int hmax, vmax;					// The biggest sampling factors
+	int mcusX, mcusY;				// The MCUs across and down
+	unsigned short quant[4][64];	// Natural order
+	JPEGHuffman dc[4], ac[4];
+	int restartInterval;			// MCUs between restart markers, 0 for none
+	int transform;					// Adobe's color transform, -1 without the marker
+	int eobrun;						// Blocks left in a progressive end of band run
+};
+
+static bool DecodeBlockBaseline(JPEGFrame &f, JPEGBitReader &in, JPEGComponent &c, short *block)
+{
+	const JPEGHuffman &dc = f.dc[c.dcTable];
+	const JPEGHuffman &ac = f.ac[c.acTable];
+	int t = dc.Decode(in);
+
+	if (t < 0 || t > 16)
+		return false;
+
+	c.dcPred += in.Receive(t);
+	block[0] = (short)c.dcPred;
+
+	for (int k = 1; k < 64; )
+	{
+		int rs = ac.Decode(in);
+
+		if (rs < 0)
+			return false;
+
+		int r = rs >> 4;
+		int s = rs & 15;
+
+		if (s == 0)
+		{
+			// End of block, or 16 zeros
+			if (r != 15)
+				break;
+
+			k += 16;
+			continue;
+		}
+
+		k += r;
+
+		if (k > 63)
+			return false;
+
+		block[zigzag[k++]] = (short)in.Receive(s);
+	}
+
+	return true;
+}
+
+static bool DecodeBlockDC(JPEGFrame &f, JPEGBitReader &in, JPEGComponent &c, short *block, int ah, int al)
+{
+	// The first scan has the top bits, each refinement one more
+	if (ah == 0)
+	{
+		int t = f.dc[c.dcTable].Decode(in);
+
+		if (t < 0 || t > 16)
+			return false;
+
+		c.dcPred += in.Receive(t);
+		block[0] = (short)(c.dcPred * (1 << al));
+	}
+	else if (in.Get(1))
+		block[0] |= (short)(1 << al);
+
+	return true;
+}
+
+static bool DecodeBlockAC(JPEGFrame &f, JPEGBitReader &in, JPEGComponent &c, short *block, int ss, int se, int al)
+{
+	if (f.eobrun > 0)
+	{
+		f.eobrun--;
+		return true;
+	}
+
+	const JPEGHuffman &ac = f.ac[c.acTable];
+
+	for (int k = ss; k <= se; )
+	{
+		int rs = ac.Decode(in);
+
+		if (rs < 0)
+			return false;
+
+		int r = rs >> 4;
+		int s = rs & 15;
+
+		if (s == 0)
+		{
+			// A run of blocks with nothing more in the band, this one first
+			if (r < 15)
+			{
+				f.eobrun = (1 << r) - 1 + (int)in.Get(r);
+				break;
+			}
+
+			k += 16;
+			continue;
+		}
+
+		k += r;
+
+		if (k > 63)
+			return false;
+
+		block[zigzag[k++]] = (short)(in.Receive(s) * (1 << al));
+	}
+
+	return true;
+}
+
+// The next bit of every coefficient already there, and the new ones
+// that come up at this bit. The same walk as libjpeg's decode_mcu_AC_refine
+static bool DecodeBlockACRefine(JPEGFrame &f, JPEGBitReader &in, JPEGComponent &c, short *block, int ss, int se, int al)
+{
+	const JPEGHuffman &ac = f.ac[c.acTable];
+	int p1 = 1 << al;
+	int m1 = -(1 << al);
+	int k = ss;
+
+	if (f.eobrun == 0)
+	{
+		for (; k <= se; k++)
+		{
+			int rs = ac.Decode(in);
+
+			if (rs < 0)
+				return false;
+
+			int r = rs >> 4;
+			int s = rs & 15;
+
+			if (s != 0)
+				s = in.Get(1) ? p1 : m1;
+			else if (r != 15)
+			{
+				f.eobrun = (1 << r) + (int)in.Get(r);
+				break;
+			}
+
+			// Skip r zeros, refining the others on the way
+			for (; k <= se; k++)
+			{
+				short &coef = block[zigzag[k]];
+
+				if (coef != 0)
+				{
+					if (in.Get(1) && (coef & p1) == 0)
+						coef = (short)(coef + (coef >= 0 ? p1 : m1));
+				}
+				else if (--r < 0)
+					break;
+			}
+
+			if (s != 0 && k <= se)
+				block[zigzag[k]] = (short)s;
+		}
+	}
+
+	// The rest of the band only has refinement bits
+	if (f.eobrun > 0)
+	{
+		for (; k <= se; k++)
+		{
+			short &coef = block[zigzag[k]];
+
+			if (coef != 0 && in.Get(1) && (coef & p1) == 0)
+				coef = (short)(coef + (coef >= 0 ? p1 : m1));
+		}
+
+		f.eobrun--;
+	}
+
+	return true;
+}
+
+// Decodes the entropy coded data of one scan, p is left after it
+static bool DecodeScan(JPEGFrame &f, const unsigned char *&p, const unsigned char *end, JPEGComponent **scan, int numScan,
+	int ss, int se, int ah, int al)
+{
+	JPEGBitReader in = { p, end, 0, 0, false };
+
+	for (int i = 0; i < f.numComponents; i++)
+		f.comps[i].dcPred = 0;
+
+	f.eobrun = 0;
+
+	// One component alone goes through its blocks in rows, without the
+	// padding of the MCUs. Several go MCU by MCU
+	int unitsX = f.mcusX;
+	int unitsY = f.mcusY;
+
+	if (numScan == 1)
+	{
+		const JPEGComponent &c = *scan[0];
+
+		unitsX = ((f.width * c.h + f.hmax - 1) / f.hmax + 7) / 8;
+		unitsY = ((f.height * c.v + f.vmax - 1) / f.vmax + 7) / 8;
+	}
+
+	int units = 0;
+	bool ok = true;
+
+	for (int uy = 0; uy < unitsY && ok; uy++)
+	{
+		for (int ux = 0; ux < unitsX && ok; ux++)
+		{
+			if (f.restartInterval > 0 && units > 0 && units % f.restartInterval == 0)
+			{
+				in.Restart();
+
+				for (int i = 0; i < f.numComponents; i++)
+					f.comps[i].dcPred = 0;
+
+				f.eobrun = 0;
+			}
+
+			units++;
+
+			for (int i = 0; i < numScan && ok; i++)
+			{
+				JPEGComponent &c = *scan[i];
+				int bw = numScan == 1 ? 1 : c.h;
+				int bh = numScan == 1 ? 1 : c.v;
+
+				for (int by = 0; by < bh && ok; by++)
+				{
+					for (int bx = 0; bx < bw && ok; bx++)
+					{
+						int row = uy * bh + by;
+						int col = ux * bw + bx;
+						short *block = c.coefs + ((size_t)row * c.blocksPerLine + col) * 64;
+
+						if (!f.progressive)
+							ok = DecodeBlockBaseline(f, in, c, block);
+						else if (ss == 0)
+							ok = DecodeBlockDC(f, in, c, block, ah, al);
+						else if (ah == 0)
+							ok = DecodeBlockAC(f, in, c, block, ss, se, al);
+						else
+							ok = DecodeBlockACRefine(f, in, c, block, ss, se, al);
+					}
+				}
+			}
+		}
+	}
+
+	p = in.p;
+
+	return ok;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Pixels
+//////////////////////////////////////////////////////////////////////
+
+// The AAN scale of each row and column, folded into the quantization
+static const float aanScale[8] = {
+	1.0f, 1.387039845f, 1.306562965f, 1.175875602f,
+	1.0f, 0.785694958f, 0.541196100f, 0.275899379f };
+
+// One dimension of the float AAN inverse DCT, the same as libjpeg's
+// jidctflt, over 8 values step apart
+static void IDCT8(const float *in, float *out, int step)
+{
+	float tmp0 = in[0];
+	float tmp1 = in[step * 2];
+	float tmp2 = in[step * 4];
+	float tmp3 = in[step * 6];
+
+	// Even part
+	float tmp10 = tmp0 + tmp2;
+	float tmp11 = tmp0 - tmp2;
+	float tmp13 = tmp1 + tmp3;
+	float tmp12 = (tmp1 - tmp3) * 1.414213562f - tmp13;
+
+	tmp0 = tmp10 + tmp13;
+	tmp3 = tmp10 - tmp13;
+	tmp1 = tmp11 + tmp12;
+	tmp2 = tmp11 - tmp12;
+
+	// Odd part
+	float tmp4 = in[step];
+	float tmp5 = in[step * 3];
+	float tmp6 = in[step * 5];
+	float tmp7 = in[step * 7];
+
+	float z13 = tmp6 + tmp5;
+	float z10 = tmp6 - tmp5;
+	float z11 = tmp4 + tmp7;
+	float z12 = tmp4 - tmp7;
+
+	tmp7 = z11 + z13;
+	tmp11 = (z11 - z13) * 1.414213562f;
+
+	float z5 = (z10 + z12) * 1.847759065f;
+	tmp10 = z5 - z12 * 1.082392200f;
+	tmp12 = z5 - z10 * 2.613125930f;
+
+	tmp6 = tmp12 - tmp7;
+	tmp5 = tmp11 - tmp6;
+	tmp4 = tmp10 - tmp5;
+
+	out[0] = tmp0 + tmp7;
+	out[step * 7] = tmp0 - tmp7;
+	out[step] = tmp1 + tmp6;
+	out[step * 6] = tmp1 - tmp6;
+	out[step * 2] = tmp2 + tmp5;
+	out[step * 5] = tmp2 - tmp5;
+	out[step * 3] = tmp3 + tmp4;
+	out[step * 4] = tmp3 - tmp4;
+}
+
+static unsigned char Descale(float v)
+{
+	// Scaled down by 8 and centered on 128, the cast rounds anything
+	// that isn't clamped to 0 anyway
+	int i = (int)(v * 0.125f + 128.5f);
+
+	return (unsigned char)(i < 0 ? 0 : (i > 255 ? 255 : i));
+}
+
+// Dequantizes and transforms a block into 8 rows of the plane
+static void IDCTBlock(const short *block, const float *quant, unsigned char *dst, size_t stride)
+{
+	float in[64], work[64], row[8];
+	int last = 63;
+
+	while (last > 0 && block[last] == 0)
+		last--;
+
+	// Flat blocks are common in smooth textures, one value fills them
+	if (last == 0)
+	{
+		unsigned char v = Descale(block[0] * quant[0]);
+
+		for (int y = 0; y < 8; y++, dst += stride)
+			memset(dst, v, 8);
+
+		return;
+	}
+
+	for (int i = 0; i < 64; i++)
+		in[i] = block[i] * quant[i];
+
+	// Columns, then rows
+	for (int x = 0; x < 8; x++)
+		IDCT8(in + x, work + x, 8);
+
+	for (int y = 0; y < 8; y++, dst += stride)
+	{
+		IDCT8(work + y * 8, row, 1);
+
+		for (int x = 0; x < 8; x++)
+			dst[x] = Descale(row[x]);
+	}
+}
+
+static void TransformComponent(const JPEGFrame &f, JPEGComponent &c)
+{
+	float quant[64];
+	size_t stride = (size_t)c.blocksPerLine * 8;
+
+	for (int i = 0; i < 64; i++)
+		quant[i] = f.quant[c.table][i] * aanScale[i / 8] * aanScale[i % 8];
+
+	for (int row = 0; row < c.blocksPerColumn; row++)
+	{
+		for (int col = 0; col < c.blocksPerLine; col++)
+		{
+			const short *block = c.coefs + ((size_t)row * c.blocksPerLine + col) * 64;
+			IDCTBlock(block, quant, c.plane + row * 8 * stride + col * 8, stride);
+		}
+	}
+}
+
+// The planes to RGB rows, bottom row first
+static void ConvertPlanes(const JPEGFrame &f, unsigned char *out)
+{
+	size_t outStride = (size_t)f.width * 3;
+	std::vector<unsigned char> stretched[3];
+	const unsigned char *rows[3];
+
+	for (int i = 0; i < f.numComponents; i++)
+		stretched[i].resize(f.width);
+
+	for (int y = 0; y < f.height; y++)
+	{
+		unsigned char *dst = out + outStride * (f.height - 1 - y);
+
+		// Each component's row at full size, repeating subsampled ones
+		for (int i = 0; i < f.numComponents; i++)
+		{
+			const JPEGComponent &c = f.comps[i];
+			const unsigned char *src = c.plane + (size_t)(y * c.v / f.vmax) * c.blocksPerLine * 8;
+
+			if (c.h == f.hmax)
+				rows[i] = src;
+			else if (f.hmax % c.h == 0)
+			{
+				// The usual 2 to 1, each sample repeated
+				int factor = f.hmax / c.h;
+				unsigned char *dst = &stretched[i][0];
+
+				for (int x = 0; x < f.width; x += factor)
+					memset(dst + x, src[x / factor], (f.width - x < factor) ? f.width - x : factor);
+
+				rows[i] = dst;
+			}
+			else
+			{
+				for (int x = 0; x < f.width; x++)
+					stretched[i][x] = src[x * c.h / f.hmax];
+
+				rows[i] = &stretched[i][0];
+			}
+		}
+
+		if (f.numComponents == 1)
+			ImageKernels::ExpandGray(rows[0], dst, f.width);
+		else if (f.transform == 0)
+		{
+			for (int x = 0; x < f.width; x++)
+			{
+				dst[x * 3] = rows[0][x];
+				dst[x * 3 + 1] = rows[1][x];
+				dst[x * 3 + 2] = rows[2][x];
+			}
+		}
+		else
+			ImageKernels::YCbCrToRGB(rows[0], rows[1], rows[2], dst, f.width);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////
+// Markers
+//////////////////////////////////////////////////////////////////////
+
+// The next marker at or after p, 0 if there is none. p is left after it
+static int NextMarker(const unsigned char *&p, const unsigned char *end)
+{
+	while (p + 1 < end)
+	{
+		if (p[0] == 0xFF && p[1] != 0 && p[1] != 0xFF)
+		{
+			int marker = p[1];
+			p += 2;
+			return marker;
+		}
+
+		p++;
+	}
+
+	return 0;
+}
+
+// The frame header, the components' coefficients are left for later
+static bool ReadFrame(const unsigned char *s, size_t length, int marker, JPEGFrame &f)
+{
+	if (length < 8 || s[0] != 8)
+		return false;
+
+	f.progressive = marker == JPEG_SOF2;
+	f.height = (int)ReadU16(s + 1);
+	f.width = (int)ReadU16(s + 3);
+	f.numComponents = s[5];
+
+	if (f.width <= 0 || f.height <= 0 || (f.numComponents != 1 && f.numComponents != 3) ||
+		length < 6 + (size_t)f.numComponents * 3)
+		return false;
+
+	f.hmax = 1;
+	f.vmax = 1;
+
+	for (int i = 0; i < f.numComponents; i++)
+	{
+		JPEGComponent &c = f.comps[i];
+
+		c.id = s[6 + i * 3];
+		c.h = s[7 + i * 3] >> 4;
+		c.v = s[7 + i * 3] & 15;
+		c.table = s[8 + i * 3];
+
+		if (c.h < 1 || c.h > 4 || c.v < 1 || c.v > 4 || c.table > 3)
+			return false;
+
+		f.hmax = c.h > f.hmax ? c.h : f.hmax;
+		f.vmax = c.v > f.vmax ? c.v : f.vmax;
+	}
+
+	return true;
+}
+
+bool JPEGDecoder::ReadInfo(const unsigned char *data, size_t size, Info &info)
+{
+	memset(&info, 0, sizeof(info));
+
+	if (data == NULL || size < 4 || data[0] != 0xFF || data[1] != JPEG_SOI)
+		return false;
+
+	const unsigned char *p = data + 2;
+	const unsigned char *end = data + size;
+
+	// Everything before the frame header has a length
+	for (;;)
+	{
+		int marker = NextMarker(p, end);
+
+		if (marker == 0 || marker == JPEG_EOI || marker == JPEG_SOS || p + 2 > end)
+			return false;
+
+		size_t length = ReadU16(p);
+
+		if (length < 2 || p + length > end)
+			return false;
+
+		if (marker == JPEG_SOF0 || marker == JPEG_SOF1 || marker == JPEG_SOF2)
+		{
+			JPEGFrame f;
+
+			if (!ReadFrame(p + 2, length - 2, marker, f))
+				return false;
+
+			info.width = f.width;
+			info.height = f.height;
+			info.components = f.numComponents;
+			info.progressive = f.progressive;
+			return true;
+		}
+
+		// The other frame types are the lossless, hierarchical and arithmetic ones
+		if (marker >= 0xC3 && marker <= 0xCF && marker != JPEG_DHT && marker != 0xC8 && marker != 0xCC)
+			return false;
+
+		p += length;
+	}
+}
+
+size_t JPEGDecoder::ImageSize(const Info &info)
+{
+	return (size_t)info.width * info.height * 3;
+}
+
+static bool ReadQuantization(const unsigned char *s, size_t length, JPEGFrame &f)
+{
+	while (length > 0)
+	{
+		int precision = s[0] >> 4;
+		int id = s[0] & 15;
+		size_t bytes = precision ? 128 : 64;
+
+		if (id > 3 || precision > 1 || length < 1 + bytes)
+			return false;
+
+		for (int k = 0; k < 64; k++)
+			f.quant[id][zigzag[k]] = (unsigned short)(precision ? ReadU16(s + 1 + k * 2) : s[1 + k]);
+
+		s += 1 + bytes;
+		length -= 1 + bytes;
+	}
+
+	return true;
+}
+
+static bool ReadHuffman(const unsigned char *s, size_t length, JPEGFrame &f)
+{
+	while (length > 0)
+	{
+		int type = s[0] >> 4;
+		int id = s[0] & 15;
+
+		if (type > 1 || id > 3 || length < 17)
+			return false;
+
+		size_t total = 0;
+
+		for (int i = 0; i < 16; i++)
+			total += s[1 + i];
+
+		if (total > 256 || length < 17 + total)
+			return false;
+
+		JPEGHuffman &h = type ? f.ac[id] : f.dc[id];
+
+		if (!h.Build(s + 1, s + 17))
+			return false;
+
+		s += 17 + total;
+		length -= 17 + total;
+	}
+
+	return true;
+}
+
+// Makes room for the coefficients and samples once the frame is known
+static bool AllocComponents(JPEGFrame &f)
+{
+	f.mcusX = (f.width + 8 * f.hmax - 1) / (8 * f.hmax);
+	f.mcusY = (f.height + 8 * f.vmax - 1) / (8 * f.vmax);
+
+	for (int i = 0; i < f.numComponents; i++)
+	{
+		JPEGComponent &c = f.comps[i];
+		size_t blocks;
+
+		c.blocksPerLine = f.mcusX * c.h;
+		c.blocksPerColumn = f.mcusY * c.v;
+		blocks = (size_t)c.blocksPerLine * c.blocksPerColumn;
+
+		c.coefs = (short *)PixelPool::Alloc(blocks * 64 * sizeof(short));
+		c.plane = PixelPool::Alloc(blocks * 64);
+
+		if (c.coefs == NULL || c.plane == NULL)
+			return false;
+
+		memset(c.coefs, 0, blocks * 64 * sizeof(short));
+	}
+
+	return true;
+}
+
+static void FreeComponents(JPEGFrame &f)
+{
+	for (int i = 0; i < f.numComponents; i++)
+	{
+		PixelPool::Free((unsigned char *)f.comps[i].coefs);
+		PixelPool::Free(f.comps[i].plane);
+	}
+}
+
+// Every marker of the file, with the scans decoded as they come
+static bool ReadMarkers(const unsigned char *data, size_t size, JPEGFrame &f)
+{
+	const unsigned char *p = data + 2;
+	const unsigned char *end = data + size;
+	bool frame = false;
+	bool scanned = false;
+
+	for (;;)
+	{
+		int marker = NextMarker(p, end);
+
+		// A file cut short keeps what its scans had
+		if (marker == 0 || marker == JPEG_EOI)
+			return scanned;
+
+		// Restart markers out of place have no length
+		if (marker >= JPEG_RST0 && marker <= JPEG_RST0 + 7)
+			continue;
+
+		if (p + 2 > end)
+			return scanned;
+
+		size_t length = ReadU16(p);
+		const unsigned char *s = p + 2;
+
+		if (length < 2 || p + length > end)
+			return scanned;
+
+		p += length;
+		length -= 2;
+
+		switch (marker)
+		{
+			case JPEG_SOF0	:
+			case JPEG_SOF1	:
+			case JPEG_SOF2	:
+				if (frame || !ReadFrame(s, length, marker, f) || !AllocComponents(f))
+					return false;
+
+				frame = true;
+				break;
+			case JPEG_DQT	:
+				if (!ReadQuantization(s, length, f))
+					return false;
+				break;
+			case JPEG_DHT	:
+				if (!ReadHuffman(s, length, f))
+					return false;
+				break;
+			case JPEG_DRI	:
+				if (length < 2)
+					return false;
+
+				f.restartInterval = (int)ReadU16(s);
+				break;
+			case JPEG_APP14	:
+				if (length >= 12 && memcmp(s, "Adobe", 5) == 0)
+					f.transform = s[11];
+				break;
+			case JPEG_SOS	:
+			{
+				if (!frame || length < 1)
+					return false;
+
+				int numScan = s[0];
+				JPEGComponent *scan[3];
+
+				if (numScan < 1 || numScan > f.numComponents || length < 4 + (size_t)numScan * 2)
+					return false;
+
+				for (int i = 0; i < numScan; i++)
+				{
+					int id = s[1 + i * 2];
+					int tables = s[2 + i * 2];
+
+					scan[i] = NULL;
+
+					for (int j = 0; j < f.numComponents; j++)
+					{
+						if (f.comps[j].id == id)
+							scan[i] = &f.comps[j];
+					}
+
+					if (scan[i] == NULL || (tables >> 4) > 3 || (tables & 15) > 3)
+						return false;
+
+					scan[i]->dcTable = tables >> 4;
+					scan[i]->acTable = tables & 15;
+				}
+
+				const unsigned char *t = s + 1 + numScan * 2;
+				int ss = t[0];
+				int se = t[1];
+				int ah = t[2] >> 4;
+				int al = t[2] & 15;
+
+				if (!f.progressive)
+				{
+					ss = 0;
+					se = 63;
+				}
+				else if (ss > se || se > 63 || (ss == 0 && se != 0) || (ss > 0 && numScan != 1) || al > 13)
+					return false;
+
+				// Every table the scan is going to use
+				for (int i = 0; i < numScan; i++)
+				{
+					if ((ss == 0 && ah == 0 && !f.dc[scan[i]->dcTable].defined) ||
+						(se > 0 && !f.ac[scan[i]->acTable].defined))
+						return false;
+				}
+
+				// A scan that goes bad ends the image, the blocks it didn't
+				// reach keep what the earlier scans gave them
+				scanned = true;
+
+				if (!DecodeScan(f, p, end, scan, numScan, ss, se, ah, al))
+					return true;
+				break;
+			}
+			default			:
+				break;
+		}
+	}
+}
+
+bool JPEGDecoder::Decode(const unsigned char *data, size_t size, const Info &info, unsigned char *out)
+{
+	if (out == NULL)
+		return false;
+
+	JPEGFrame *f = new JPEGFrame;
+
+	memset(f, 0, sizeof(JPEGFrame));
+	f->transform = -1;
+
+	bool ok = ReadMarkers(data, size, *f) && f->width == info.width && f->height == info.height;
+
+	if (ok)
+	{
+		for (int i = 0; i < f->numComponents; i++)
+			TransformComponent(*f, f->comps[i]);
+
+		ConvertPlanes(*f, out);
+	}
+
+	FreeComponents(*f);
+	delete f;
+
+	return ok;
+}
+
+unsigned char *JPEGDecoder::Load(const char *name, int &width, int &height)
+{
+	MappedFile file;
+	Info info;
+
+	if (!file.Open(name))
+		return NULL;
+
+	if (!ReadInfo(file.data, file.size, info))
+		return NULL;
+
+	unsigned char *pixels = PixelPool::Alloc(ImageSize(info));
+
+	if (!Decode(file.data, file.size, info, pixels))
+	{
+		PixelPool::Free(pixels);
+		return NULL;
+	}
+
+	width = info.width;
+	height = info.height;
+
+	return pixels;
+}
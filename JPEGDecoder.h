@@ -0,0 +1,62 @@
+//////////////////////////////////////////////////////////////////////
+//
+// JPEG Decoder Class
+//
+// JPEGDecoder.h: interface for the JPEGDecoder class.
+// This class reads JPEG files without libjpeg. It takes the
+// Huffman coded kinds, baseline and progressive, gray or three
+// components (YCbCr, or RGB if an Adobe marker says so) with
+// any sampling, and restart markers. Arithmetic coding, 12 bit
+// samples and CMYK aren't taken. The rows come out as RGB,
+// tightly packed and bottom row first the way OpenGL wants them.
+//
+// Every coefficient is kept until the last scan, then each block
+// is turned back into pixels with a float AAN IDCT. Subsampled
+// chroma is stretched by repeating it, without smoothing.
+//
+// Load maps the file and decodes it straight into a PixelPool
+// buffer. Decode fills a buffer the caller already has.
+//
+// Usage:
+// int width, height;
+// unsigned char *pixels = JPEGDecoder::Load("Bannana_v01.jpg", width, height);
+// ...
+// PixelPool::Free(pixels);
+//
+// // Or into your own buffer
+// JPEGDecoder::Info info;
+// if (JPEGDecoder::ReadInfo(data, size, info))
+// {
+//     std::vector<unsigned char> image(JPEGDecoder::ImageSize(info));
+//     JPEGDecoder::Decode(data, size, info, &image[0]);
+// }
+//
+//////////////////////////////////////////////////////////////////////
+
+#ifndef JPEGDECODER_H
+#define JPEGDECODER_H
+
+#include <stddef.h>
+
+class JPEGDecoder
+{
+public:
+	struct Info {
+		int width;					// The image's width in pixels
+		int height;					// The image's height in pixels
+		int components;				// 1 gray, 3 color
+		bool progressive;			// True: the coefficients come in several scans
+	};
+
+	// Reads the markers up to the frame header and fills info, false if
+	// the file is no JPEG this can read
+	static bool ReadInfo(const unsigned char *data, size_t size, Info &info);
+	// The bytes Decode writes
+	static size_t ImageSize(const Info &info);
+	// Decodes the pixels into out, which has room for ImageSize bytes
+	static bool Decode(const unsigned char *data, size_t size, const Info &info, unsigned char *out);
+	// Maps and decodes a file into a PixelPool buffer, NULL if it can't
+	static unsigned char *Load(const char *name, int &width, int &height);
+};
+
+#endif JPEGDECODER_H
@@ -0,0 +1,319 @@
+//////////////////////////////////////////////////////////////////////
+//
+// Load Statistics Class
+//
+// LoadStats.cpp: implementation of the LoadStats class.
+// The allocations are counted by replacing the global operator
+// new, so everything the loaders allocate through the standard
+// library is seen too. malloc can't be replaced the same way,
+// the few places that use it call CountAlloc themselves.
+//
+//////////////////////////////////////////////////////////////////////
+
+#include "LoadStats.h"
+
+#ifdef LOAD_STATS
+
+#include <stdlib.h>
+#include <string>
+#include <map>
+#include <vector>
+#include <mutex>
+#include <new>
+#include <algorithm>
+
+// The table's containers use the operators below in this same file,
+// newer gcc inlines both ends and sees new paired with free
+#if defined(__GNUC__) && __GNUC__ >= 11
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+// One row of the table
+struct LoadStatsEntry {
+	std::string file;	// The file the section belongs to
+	std::string section;// The section's name
+	int calls;			// How many times the section ran
+	double ms;			// The time spent in it, without the sections inside
+	size_t bytes;		// The bytes it read
+	size_t allocs;		// The heap allocations it made
+};
+
+typedef std::map<std::pair<std::string, std::string>, LoadStatsEntry> LoadStatsTable;
+
+// The table is shared by all threads, the counters are per thread
+static std::mutex statsLock;
+static LoadStatsTable *statsTable = NULL;
+
+static thread_local size_t threadAllocs = 0;
+static thread_local bool threadPaused = false;
+static thread_local const char *threadFile = NULL;
+static thread_local LoadStats::Scope *threadScope = NULL;
+
+//////////////////////////////////////////////////////////////////////
+// Allocation counting
+//////////////////////////////////////////////////////////////////////
+
+void LoadStats::CountAlloc()
+{
+	if (threadPaused)
+		return;
+
+	threadAllocs++;
+}
+
+void *operator new(size_t bytes)
+{
+	LoadStats::CountAlloc();
+
+	void *p = malloc(bytes ? bytes : 1);
+
+	if (p == NULL)
+		throw std::bad_alloc();
+
+	return p;
+}
+
+void *operator new[](size_t bytes)
+{
+	return operator new(bytes);
+}
+
+void *operator new(size_t bytes, const std::nothrow_t &) noexcept
+{
+	LoadStats::CountAlloc();
+
+	return malloc(bytes ? bytes : 1);
+}
+
+void *operator new[](size_t bytes, const std::nothrow_t &tag) noexcept
+{
+	return operator new(bytes, tag);
+}
+
+void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+	free(p);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Sections
+//////////////////////////////////////////////////////////////////////
+
+LoadStats::File::File(const char *name)
+{
+	previous = threadFile;
+	threadFile = name;
+}
+
+LoadStats::File::~File()
+{
+	threadFile = previous;
+}
+
+LoadStats::Scope::Scope(const char *section, size_t bytes)
+{
+	this->section = section;
+	this->bytes = bytes;
+	childMs = 0.0;
+	childBytes = 0;
+	childAllocs = 0;
+	allocs = threadAllocs;
+	parent = threadScope;
+	threadScope = this;
+
+	// Last, so the bookkeeping isn't timed
+	start = std::chrono::steady_clock::now();
+}
+
+LoadStats::Scope::~Scope()
+{
+	double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	size_t made = threadAllocs - allocs;
+
+	threadScope = parent;
+
+	// The section that holds this one only keeps the rest
+	if (parent)
+	{
+		parent->childMs += ms;
+		parent->childBytes += bytes;
+		parent->childAllocs += made;
+	}
+
+	// Filling in the table allocates, that isn't the loader's
+	threadPaused = true;
+
+	{
+		std::lock_guard<std::mutex> guard(statsLock);
+
+		if (statsTable == NULL)
+			statsTable = new LoadStatsTable;
+
+		std::string file = threadFile ? threadFile : "";
+		LoadStatsEntry &e = (*statsTable)[std::make_pair(file, std::string(section))];
+
+		if (e.calls == 0)
+		{
+			e.file = file;
+			e.section = section;
+		}
+
+		e.calls++;
+		e.ms += ms - childMs;
+		e.bytes += bytes > childBytes ? bytes - childBytes : 0;
+		e.allocs += made - childAllocs;
+	}
+
+	threadPaused = false;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Reporting
+//////////////////////////////////////////////////////////////////////
+
+static bool SlowerFirst(const LoadStatsEntry &a, const LoadStatsEntry &b)
+{
+	return a.ms > b.ms;
+}
+
+// A copy of the table, sorted by time
+static void SortedEntries(std::vector<LoadStatsEntry> &entries)
+{
+	std::lock_guard<std::mutex> guard(statsLock);
+
+	entries.clear();
+
+	if (statsTable)
+	{
+		for (LoadStatsTable::const_iterator i = statsTable->begin(); i != statsTable->end(); ++i)
+			entries.push_back(i->second);
+	}
+
+	std::sort(entries.begin(), entries.end(), SlowerFirst);
+}
+
+// Writes s as a JSON string
+static void JsonString(FILE *out, const std::string &s)
+{
+	fputc('"', out);
+
+	for (size_t i = 0; i < s.size(); i++)
+	{
+		unsigned char c = (unsigned char)s[i];
+
+		if (c == '"' || c == '\\')
+			fprintf(out, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(out, "\\u%04x", c);
+		else
+			fputc(c, out);
+	}
+
+	fputc('"', out);
+}
+
+void LoadStats::Report(FILE *out)
+{
+	std::vector<LoadStatsEntry> entries;
+	SortedEntries(entries);
+
+	// The totals per section first, they say what kind of work is slow
+	std::map<std::string, LoadStatsEntry> sections;
+	double total = 0.0;
+
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		LoadStatsEntry &s = sections[entries[i].section];
+
+		s.section = entries[i].section;
+		s.calls += entries[i].calls;
+		s.ms += entries[i].ms;
+		s.bytes += entries[i].bytes;
+		s.allocs += entries[i].allocs;
+		total += entries[i].ms;
+	}
+
+	std::vector<LoadStatsEntry> totals;
+
+	for (std::map<std::string, LoadStatsEntry>::const_iterator i = sections.begin(); i != sections.end(); ++i)
+		totals.push_back(i->second);
+
+	std::sort(totals.begin(), totals.end(), SlowerFirst);
+
+	fprintf(out, "%-16s %8s %10s %6s %12s %8s\n", "section", "calls", "ms", "%", "bytes", "allocs");
+
+	for (size_t i = 0; i < totals.size(); i++)
+	{
+		const LoadStatsEntry &e = totals[i];
+
+		fprintf(out, "%-16s %8d %10.3f %6.1f %12zu %8zu\n", e.section.c_str(), e.calls, e.ms,
+			total > 0.0 ? 100.0 * e.ms / total : 0.0, e.bytes, e.allocs);
+	}
+
+	fprintf(out, "%-16s %8s %10.3f\n\n", "total", "", total);
+
+	// Then every file's sections
+	fprintf(out, "%-40s %-16s %8s %10s %12s %8s\n", "file", "section", "calls", "ms", "bytes", "allocs");
+
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		const LoadStatsEntry &e = entries[i];
+
+		fprintf(out, "%-40s %-16s %8d %10.3f %12zu %8zu\n", e.file.c_str(), e.section.c_str(),
+			e.calls, e.ms, e.bytes, e.allocs);
+	}
+}
+
+bool LoadStats::WriteJson(const char *name)
+{
+	std::vector<LoadStatsEntry> entries;
+	SortedEntries(entries);
+
+	FILE *out = fopen(name, "w");
+
+	if (out == NULL)
+		return false;
+
+	fprintf(out, "[\n");
+
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		const LoadStatsEntry &e = entries[i];
+
+		fprintf(out, "  {\"file\": ");
+		JsonString(out, e.file);
+		fprintf(out, ", \"section\": ");
+		JsonString(out, e.section);
+		fprintf(out, ", \"calls\": %d, \"ms\": %.3f, \"bytes\": %zu, \"allocs\": %zu}%s\n",
+			e.calls, e.ms, e.bytes, e.allocs, i + 1 < entries.size() ? "," : "");
+	}
+
+	fprintf(out, "]\n");
+
+	return fclose(out) == 0;
+}
+
+void LoadStats::Clear()
+{
+	std::lock_guard<std::mutex> guard(statsLock);
+
+	if (statsTable)
+		statsTable->clear();
+}
+
+#endif
@@ -0,0 +1,109 @@
+//////////////////////////////////////////////////////////////////////
+//
+// Load Statistics Class
+//
+// LoadStats.h: interface for the LoadStats class.
+// This class records where the loaders spend their time. Every
+// section of a load, a chunk type of a 3ds file or a step like
+// the normals or a texture's upload, adds its time, the bytes
+// it read and the number of heap allocations it made to a
+// table kept per file and per section. A section that contains
+// others only counts its own share, so the table adds up to
+// the whole load and a 3ds file's bytes add up to its size.
+//
+// It only exists when LOAD_STATS is defined. Without it the
+// macros are empty and the functions are empty inlines, so the
+// loaders and the game can call them and nothing is left of
+// them in the build. One section per block, the macros name
+// their variables.
+//
+// Usage:
+// // In a loader, for the rest of the enclosing block
+// LOADSTATS_FILE(name);						// What file the sections belong to
+// LOADSTATS_SCOPE("VERT_LIST", chunk.Remaining());	// Times a section that reads so many bytes
+// LOADSTATS_BYTES(size);						// Or adds them once they are known
+//
+// // Once everything is loaded
+// LoadStats::Report(stdout);					// A table sorted by time, slowest first
+// LoadStats::WriteJson("load_stats.json");	// The same as JSON
+// LoadStats::Clear();							// Starts over
+//
+//////////////////////////////////////////////////////////////////////
+
+#ifndef LOADSTATS_H
+#define LOADSTATS_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#ifdef LOAD_STATS
+
+#include <chrono>
+
+#define LOADSTATS_FILE(name) LoadStats::File loadStatsFile(name)
+#define LOADSTATS_SCOPE(section, bytes) LoadStats::Scope loadStatsScope(section, bytes)
+#define LOADSTATS_BYTES(bytes) loadStatsScope.AddBytes(bytes)
+
+class LoadStats
+{
+public:
+	static void Report(FILE *out);					// Prints the table, slowest first
+	static bool WriteJson(const char *name);		// Writes the table to a JSON file
+	static void Clear();							// Forgets everything recorded
+	static void CountAlloc();						// Counts an allocation made with malloc
+
+	// Names the file the sections on this thread belong to until it goes out of scope
+	class File
+	{
+	public:
+		File(const char *name);
+		~File();
+
+	private:
+		const char *previous;						// The file before this one
+
+		File(const File &);
+		File &operator=(const File &);
+	};
+
+	// Times the section until it goes out of scope
+	class Scope
+	{
+	public:
+		Scope(const char *section, size_t bytes);
+		void AddBytes(size_t n) { bytes += n; }	// For sections that only know the size once they read it
+		~Scope();
+
+	private:
+		const char *section;						// The section's name, a string literal
+		size_t bytes;								// The bytes the section reads
+		size_t childBytes;							// Bytes the sections inside this one read
+		std::chrono::steady_clock::time_point start;// When the section started
+		double childMs;								// Time the sections inside this one took
+		size_t childAllocs;							// Allocations the sections inside this one made
+		size_t allocs;								// The thread's allocation count at the start
+		Scope *parent;								// The section this one is inside of
+
+		Scope(const Scope &);
+		Scope &operator=(const Scope &);
+	};
+};
+
+#else
+
+#define LOADSTATS_FILE(name)
+#define LOADSTATS_SCOPE(section, bytes)
+#define LOADSTATS_BYTES(bytes)
+
+class LoadStats
+{
+public:
+	static void Report(FILE *) {}
+	static bool WriteJson(const char *) { return false; }
+	static void Clear() {}
+	static void CountAlloc() {}
+};
+
+#endif
+
+#endif LOADSTATS_H
@@ -0,0 +1,162 @@
+//////////////////////////////////////////////////////////////////////
+//
+// Memory Mapped File Class
+//
+// MappedFile.cpp: implementation of the MappedFile class.
+//
+//////////////////////////////////////////////////////////////////////
+
+#include "MappedFile.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+//////////////////////////////////////////////////////////////////////
+// Construction/Destruction
+//////////////////////////////////////////////////////////////////////
+
+MappedFile::MappedFile()
+{
+	data = NULL;
+	size = 0;
+	file = NULL;
+	mapping = NULL;
+}
+
+MappedFile::MappedFile(MappedFile &&other)
+{
+	data = other.data;
+	size = other.size;
+	file = other.file;
+	mapping = other.mapping;
+
+	other.data = NULL;
+	other.size = 0;
+	other.file = NULL;
+	other.mapping = NULL;
+}
+
+MappedFile &MappedFile::operator=(MappedFile &&other)
+{
+	if (this != &other)
+	{
+		Close();
+
+		data = other.data;
+		size = other.size;
+		file = other.file;
+		mapping = other.mapping;
+
+		other.data = NULL;
+		other.size = 0;
+		other.file = NULL;
+		other.mapping = NULL;
+	}
+
+	return *this;
+}
+
+MappedFile::~MappedFile()
+{
+	Close();
+}
+
+bool MappedFile::Open(const char *name, bool copyOnWrite)
+{
+	// Drop any file we already have mapped
+	Close();
+
+#ifdef _WIN32
+	HANDLE f = CreateFileA(name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+
+	if (f == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER length;
+
+	// Empty files can't be mapped
+	if (!GetFileSizeEx(f, &length) || length.QuadPart == 0)
+	{
+		CloseHandle(f);
+		return false;
+	}
+
+	HANDLE m = CreateFileMappingA(f, NULL, copyOnWrite ? PAGE_WRITECOPY : PAGE_READONLY, 0, 0, NULL);
+
+	if (m == NULL)
+	{
+		CloseHandle(f);
+		return false;
+	}
+
+	void *view = MapViewOfFile(m, copyOnWrite ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0);
+
+	if (view == NULL)
+	{
+		CloseHandle(m);
+		CloseHandle(f);
+		return false;
+	}
+
+	file = f;
+	mapping = m;
+	size = (size_t)length.QuadPart;
+	data = (const unsigned char *)view;
+#else
+	int fd = open(name, O_RDONLY);
+
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+
+	// Empty files can't be mapped
+	if (fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		close(fd);
+		return false;
+	}
+
+	int prot = copyOnWrite ? (PROT_READ | PROT_WRITE) : PROT_READ;
+	void *view = mmap(NULL, (size_t)st.st_size, prot, MAP_PRIVATE, fd, 0);
+
+	// The descriptor isn't needed once the mapping exists
+	close(fd);
+
+	if (view == MAP_FAILED)
+		return false;
+
+	// We read the file front to back
+	madvise(view, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+	size = (size_t)st.st_size;
+	data = (const unsigned char *)view;
+#endif
+
+	return true;
+}
+
+void MappedFile::Close()
+{
+	if (data == NULL)
+		return;
+
+#ifdef _WIN32
+	UnmapViewOfFile(data);
+	CloseHandle((HANDLE)mapping);
+	CloseHandle((HANDLE)file);
+#else
+	munmap((void *)data, size);
+#endif
+
+	data = NULL;
+	size = 0;
+	file = NULL;
+	mapping = NULL;
+}
@@ -0,0 +1,56 @@
+//////////////////////////////////////////////////////////////////////
+//
+// Memory Mapped File Class
+//
+// MappedFile.h: interface for the MappedFile class.
+// This class maps a whole file into memory read-only so
+// that the loaders can decode it straight from the mapped
+// bytes instead of going through many small fread calls.
+// It uses CreateFileMapping on Windows and mmap everywhere
+// else. The mapping is released when the object is closed
+// or destroyed. A file can also be mapped copy-on-write, so
+// the caller may patch the bytes in memory without touching
+// the file on disk.
+//
+// Usage:
+// MappedFile f;
+//
+// if (f.Open("model.3ds"))	// Map the file
+// {
+//     // f.data points to f.size bytes of the file
+//     f.Close();				// Unmap the file
+// }
+//
+// // A mapping can be handed to another MappedFile, but not shared
+// MappedFile g(std::move(f));
+//
+//////////////////////////////////////////////////////////////////////
+
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <stddef.h>
+
+class MappedFile
+{
+public:
+	const unsigned char *data;	// The mapped bytes of the file
+	size_t size;				// The size of the file in bytes
+	bool Open(const char *name, bool copyOnWrite = false);	// Maps the file, returns false if it can't
+	void Close();				// Unmaps the file
+	bool IsOpen() const { return data != NULL; }
+	MappedFile();				// Constructor
+	MappedFile(MappedFile &&other);				// Takes over other's mapping
+	MappedFile &operator=(MappedFile &&other);	// Takes over other's mapping
+	virtual ~MappedFile();		// Destructor
+
+private:
+	void *file;					// The OS file handle
+	void *mapping;				// The OS mapping handle
+
+	// A mapping can't be shared between two owners
+	MappedFile(const MappedFile &);
+	MappedFile &operator=(const MappedFile &);
+};
+
+#endif MAPPEDFILE_H
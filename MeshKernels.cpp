@@ -0,0 +1,351 @@
+//////////////////////////////////////////////////////////////////////
+//
+// Mesh Kernels
+//
+// MeshKernels.cpp: implementation of the MeshKernels class.
+//
+//////////////////////////////////////////////////////////////////////
+
+#include "MeshKernels.h"
+
+#include <stddef.h>
+#include <math.h>
+
+// SSE2 is always there on x64, AVX2 is checked for at run time
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define MESH_KERNELS_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// GCC and clang only allow AVX2 intrinsics in functions marked for it,
+// MSVC allows them anywhere
+#if defined(__GNUC__) || defined(__clang__)
+#define MESH_KERNELS_AVX2 __attribute__((target("avx2")))
+#else
+#define MESH_KERNELS_AVX2
+#endif
+
+//////////////////////////////////////////////////////////////////////
+// CPU detection
+//////////////////////////////////////////////////////////////////////
+
+static MeshKernels::Level DetectLevel()
+{
+#ifdef MESH_KERNELS_X86
+#if defined(_MSC_VER)
+	int info[4];
+
+	__cpuid(info, 0);
+	int maxLeaf = info[0];
+
+	__cpuid(info, 1);
+	bool sse2 = (info[3] & (1 << 26)) != 0;
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+
+	if (!sse2)
+		return MeshKernels::SCALAR;
+
+	// The OS has to save the YMM registers for AVX to be usable
+	if (maxLeaf >= 7 && osxsave && (_xgetbv(0) & 6) == 6)
+	{
+		__cpuidex(info, 7, 0);
+
+		if (info[1] & (1 << 5))
+			return MeshKernels::AVX2;
+	}
+
+	return MeshKernels::SSE2;
+#else
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2"))
+		return MeshKernels::AVX2;
+	if (__builtin_cpu_supports("sse2"))
+		return MeshKernels::SSE2;
+
+	return MeshKernels::SCALAR;
+#endif
+#else
+	return MeshKernels::SCALAR;
+#endif
+}
+
+static MeshKernels::Level &CurrentLevel()
+{
+	static MeshKernels::Level level = DetectLevel();
+	return level;
+}
+
+MeshKernels::Level MeshKernels::Supported()
+{
+	static Level supported = DetectLevel();
+	return supported;
+}
+
+MeshKernels::Level MeshKernels::GetLevel()
+{
+	return CurrentLevel();
+}
+
+void MeshKernels::SetLevel(Level level)
+{
+	CurrentLevel() = (level < Supported()) ? level : Supported();
+}
+
+//////////////////////////////////////////////////////////////////////
+// Face normals
+//////////////////////////////////////////////////////////////////////
+
+// Adds one triangle's normal to its three vertices
+static inline void AddFaceNormal(float *normals, int a, int b, int c, float nx, float ny, float nz)
+{
+	normals[a*3]   += nx;
+	normals[a*3+1] += ny;
+	normals[a*3+2] += nz;
+	normals[b*3]   += nx;
+	normals[b*3+1] += ny;
+	normals[b*3+2] += nz;
+	normals[c*3]   += nx;
+	normals[c*3+1] += ny;
+	normals[c*3+2] += nz;
+}
+
+static void FaceNormalsScalar(const float *verts, int numVerts, const unsigned short *faces, int numIndices, float *normals)
+{
+	for (int i = 0; i + 2 < numIndices; i+=3)
+	{
+		int vertA = faces[i];
+		int vertB = faces[i+1];
+		int vertC = faces[i+2];
+
+		// Faces that point past the vertex list would read garbage
+		if (vertA >= numVerts || vertB >= numVerts || vertC >= numVerts)
+			continue;
+
+		const float *v1 = &verts[vertA*3];
+		const float *v2 = &verts[vertB*3];
+		const float *v3 = &verts[vertC*3];
+
+		// V2 - V3;
+		float u0 = v2[0] - v3[0];
+		float u1 = v2[1] - v3[1];
+		float u2 = v2[2] - v3[2];
+
+		// V2 - V1;
+		float w0 = v2[0] - v1[0];
+		float w1 = v2[1] - v1[1];
+		float w2 = v2[2] - v1[2];
+
+		AddFaceNormal(normals, vertA, vertB, vertC,
+			u1*w2 - u2*w1,
+			u2*w0 - u0*w2,
+			u0*w1 - u1*w0);
+	}
+}
+
+#ifdef MESH_KERNELS_X86
+
+// Loads a vertex as x y z 0 without reading past it
+static inline __m128 LoadVec3(const float *p)
+{
+	return _mm_movelh_ps(_mm_loadl_pi(_mm_setzero_ps(), (const __m64 *)p), _mm_load_ss(p + 2));
+}
+
+// Adds x y z of v to the three floats at p
+static inline void AddVec3(float *p, __m128 v)
+{
+	__m128 sum = _mm_add_ps(LoadVec3(p), v);
+
+	_mm_storel_pi((__m64 *)p, sum);
+	_mm_store_ss(p + 2, _mm_movehl_ps(sum, sum));
+}
+
+// One triangle at a time with each vertex in a register, the cross
+// product is done with shuffles. Wider versions that gather several
+// triangles at once lose to this one, the time goes into the scattered
+// adds to the normals and not into the math.
+static void FaceNormalsSSE2(const float *verts, int numVerts, const unsigned short *faces, int numIndices, float *normals)
+{
+	for (int i = 0; i + 2 < numIndices; i += 3)
+	{
+		int vertA = faces[i];
+		int vertB = faces[i+1];
+		int vertC = faces[i+2];
+
+		// Faces that point past the vertex list would read garbage
+		if (vertA >= numVerts || vertB >= numVerts || vertC >= numVerts)
+			continue;
+
+		__m128 a = LoadVec3(&verts[vertA*3]);
+		__m128 b = LoadVec3(&verts[vertB*3]);
+		__m128 c = LoadVec3(&verts[vertC*3]);
+
+		// V2 - V3 and V2 - V1
+		__m128 u = _mm_sub_ps(b, c);
+		__m128 w = _mm_sub_ps(b, a);
+
+		// u.yzx * w.zxy - u.zxy * w.yzx
+		__m128 n = _mm_sub_ps(
+			_mm_mul_ps(_mm_shuffle_ps(u, u, _MM_SHUFFLE(3,0,2,1)), _mm_shuffle_ps(w, w, _MM_SHUFFLE(3,1,0,2))),
+			_mm_mul_ps(_mm_shuffle_ps(u, u, _MM_SHUFFLE(3,1,0,2)), _mm_shuffle_ps(w, w, _MM_SHUFFLE(3,0,2,1))));
+
+		// Add this normal to its verts' normals
+		AddVec3(&normals[vertA*3], n);
+		AddVec3(&normals[vertB*3], n);
+		AddVec3(&normals[vertC*3], n);
+	}
+}
+
+#endif
+
+void MeshKernels::AccumulateFaceNormals(const float *verts, int numVerts, const unsigned short *faces, int numIndices, float *normals)
+{
+	// Nothing to do without both vertices and faces
+	if (verts == NULL || faces == NULL || normals == NULL)
+		return;
+
+#ifdef MESH_KERNELS_X86
+	// AVX2 has nothing to add here, see FaceNormalsSSE2
+	if (GetLevel() >= SSE2)
+	{
+		FaceNormalsSSE2(verts, numVerts, faces, numIndices, normals);
+		return;
+	}
+#endif
+
+	FaceNormalsScalar(verts, numVerts, faces, numIndices, normals);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Normalization
+//////////////////////////////////////////////////////////////////////
+
+static void NormalizeScalar(float *normals, int first, int numVerts)
+{
+	for (int g = first; g < numVerts; g++)
+	{
+		float *n = &normals[g*3];
+		float length = (float)sqrt((n[0]*n[0]) + (n[1]*n[1]) + (n[2]*n[2]));
+
+		if (length == 0.0f)
+			length = 1.0f;
+
+		n[0] /= length;
+		n[1] /= length;
+		n[2] /= length;
+	}
+}
+
+#ifdef MESH_KERNELS_X86
+
+// Four normals at a time, xyzx yzxy zxyz is shuffled into xxxx yyyy zzzz and back
+static int NormalizeSSE2(float *normals, int numVerts)
+{
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	int g = 0;
+
+	for (; g + 4 <= numVerts; g += 4)
+	{
+		float *p = &normals[g*3];
+
+		__m128 a = _mm_loadu_ps(p);
+		__m128 b = _mm_loadu_ps(p + 4);
+		__m128 c = _mm_loadu_ps(p + 8);
+
+		__m128 x = _mm_shuffle_ps(a, _mm_shuffle_ps(b, c, _MM_SHUFFLE(1,1,2,2)), _MM_SHUFFLE(2,0,3,0));
+		__m128 y = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(0,0,1,1)), _mm_shuffle_ps(b, c, _MM_SHUFFLE(2,2,3,3)), _MM_SHUFFLE(2,0,2,0));
+		__m128 z = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(1,1,2,2)), _mm_shuffle_ps(c, c, _MM_SHUFFLE(3,3,0,0)), _MM_SHUFFLE(2,0,2,0));
+
+		__m128 length = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z)));
+
+		// Zero length normals get divided by one
+		__m128 isZero = _mm_cmpeq_ps(length, zero);
+		length = _mm_or_ps(_mm_andnot_ps(isZero, length), _mm_and_ps(isZero, one));
+
+		x = _mm_div_ps(x, length);
+		y = _mm_div_ps(y, length);
+		z = _mm_div_ps(z, length);
+
+		a = _mm_shuffle_ps(_mm_shuffle_ps(x, y, _MM_SHUFFLE(0,0,0,0)), _mm_shuffle_ps(z, x, _MM_SHUFFLE(1,1,0,0)), _MM_SHUFFLE(2,0,2,0));
+		b = _mm_shuffle_ps(_mm_shuffle_ps(y, z, _MM_SHUFFLE(1,1,1,1)), _mm_shuffle_ps(x, y, _MM_SHUFFLE(2,2,2,2)), _MM_SHUFFLE(2,0,2,0));
+		c = _mm_shuffle_ps(_mm_shuffle_ps(z, x, _MM_SHUFFLE(3,3,2,2)), _mm_shuffle_ps(y, z, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(2,0,2,0));
+
+		_mm_storeu_ps(p, a);
+		_mm_storeu_ps(p + 4, b);
+		_mm_storeu_ps(p + 8, c);
+	}
+
+	return g;
+}
+
+// Eight normals at a time, the same shuffles done in both 128 bit lanes
+MESH_KERNELS_AVX2
+static int NormalizeAVX2(float *normals, int numVerts)
+{
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 one = _mm256_set1_ps(1.0f);
+	int g = 0;
+
+	for (; g + 8 <= numVerts; g += 8)
+	{
+		float *p = &normals[g*3];
+
+		// Normals 0-3 go in the low lanes, 4-7 in the high lanes
+		__m256 a = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p)), _mm_loadu_ps(p + 12), 1);
+		__m256 b = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p + 4)), _mm_loadu_ps(p + 16), 1);
+		__m256 c = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p + 8)), _mm_loadu_ps(p + 20), 1);
+
+		__m256 x = _mm256_shuffle_ps(a, _mm256_shuffle_ps(b, c, _MM_SHUFFLE(1,1,2,2)), _MM_SHUFFLE(2,0,3,0));
+		__m256 y = _mm256_shuffle_ps(_mm256_shuffle_ps(a, b, _MM_SHUFFLE(0,0,1,1)), _mm256_shuffle_ps(b, c, _MM_SHUFFLE(2,2,3,3)), _MM_SHUFFLE(2,0,2,0));
+		__m256 z = _mm256_shuffle_ps(_mm256_shuffle_ps(a, b, _MM_SHUFFLE(1,1,2,2)), _mm256_shuffle_ps(c, c, _MM_SHUFFLE(3,3,0,0)), _MM_SHUFFLE(2,0,2,0));
+
+		__m256 length = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y)), _mm256_mul_ps(z, z)));
+
+		// Zero length normals get divided by one
+		__m256 isZero = _mm256_cmp_ps(length, zero, _CMP_EQ_OQ);
+		length = _mm256_blendv_ps(length, one, isZero);
+
+		x = _mm256_div_ps(x, length);
+		y = _mm256_div_ps(y, length);
+		z = _mm256_div_ps(z, length);
+
+		a = _mm256_shuffle_ps(_mm256_shuffle_ps(x, y, _MM_SHUFFLE(0,0,0,0)), _mm256_shuffle_ps(z, x, _MM_SHUFFLE(1,1,0,0)), _MM_SHUFFLE(2,0,2,0));
+		b = _mm256_shuffle_ps(_mm256_shuffle_ps(y, z, _MM_SHUFFLE(1,1,1,1)), _mm256_shuffle_ps(x, y, _MM_SHUFFLE(2,2,2,2)), _MM_SHUFFLE(2,0,2,0));
+		c = _mm256_shuffle_ps(_mm256_shuffle_ps(z, x, _MM_SHUFFLE(3,3,2,2)), _mm256_shuffle_ps(y, z, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(2,0,2,0));
+
+		_mm_storeu_ps(p, _mm256_castps256_ps128(a));
+		_mm_storeu_ps(p + 4, _mm256_castps256_ps128(b));
+		_mm_storeu_ps(p + 8, _mm256_castps256_ps128(c));
+		_mm_storeu_ps(p + 12, _mm256_extractf128_ps(a, 1));
+		_mm_storeu_ps(p + 16, _mm256_extractf128_ps(b, 1));
+		_mm_storeu_ps(p + 20, _mm256_extractf128_ps(c, 1));
+	}
+
+	return g;
+}
+
+#endif
+
+void MeshKernels::NormalizeNormals(float *normals, int numVerts)
+{
+	if (normals == NULL)
+		return;
+
+	int done = 0;
+
+#ifdef MESH_KERNELS_X86
+	Level level = GetLevel();
+
+	if (level == AVX2)
+		done = NormalizeAVX2(normals, numVerts);
+	else if (level == SSE2)
+		done = NormalizeSSE2(normals, numVerts);
+#endif
+
+	// The leftover normals
+	NormalizeScalar(normals, done, numVerts);
+}
@@ -0,0 +1,50 @@
+//////////////////////////////////////////////////////////////////////
+//
+// Mesh Kernels
+//
+// MeshKernels.h: interface for the MeshKernels class.
+// This class holds the number crunching loops the model
+// loader runs over whole vertex arrays. Each one has a
+// plain C++ version and SIMD versions (SSE2 for the face
+// normals, SSE2 and AVX2 for the normalization), the
+// fastest one the CPU supports is picked the first time
+// one is called. The SIMD versions do the same float
+// operations in the same order, so they give the same
+// results.
+//
+// Usage:
+// // Adds every face's normal to the normals of its three vertices
+// MeshKernels::AccumulateFaceNormals(verts, numVerts, faces, numIndices, normals);
+//
+// // Scales every normal to unit length
+// MeshKernels::NormalizeNormals(normals, numVerts);
+//
+// // Force the plain version, e.g. to compare results
+// MeshKernels::SetLevel(MeshKernels::SCALAR);
+//
+//////////////////////////////////////////////////////////////////////
+
+#ifndef MESHKERNELS_H
+#define MESHKERNELS_H
+
+class MeshKernels
+{
+public:
+	enum Level {
+		SCALAR,		// Plain C++
+		SSE2,		// 4 at a time
+		AVX2		// 8 at a time
+	};
+
+	// Adds the (unnormalized) normal of each triangle in faces to its vertices.
+	// Triangles that index past numVerts are skipped.
+	static void AccumulateFaceNormals(const float *verts, int numVerts, const unsigned short *faces, int numIndices, float *normals);
+	// Reduces each normal to unit length, zero length normals are left alone
+	static void NormalizeNormals(float *normals, int numVerts);
+
+	static Level GetLevel();				// The instruction set the kernels use
+	static void SetLevel(Level level);		// Lowers (or restores) it, capped at what the CPU has
+	static Level Supported();				// The best instruction set the CPU has
+};
+
+#endif MESHKERNELS_H
@@ -0,0 +1,363 @@
+//////////////////////////////////////////////////////////////////////
+//
+// Mesh Optimizer
+//
+// MeshOptimizer.cpp: implementation of the MeshOptimizer class.
+//
+//////////////////////////////////////////////////////////////////////
+
+#include "MeshOptimizer.h"
+
+#include <math.h>
+#include <string.h>
+#include <vector>
+
+//////////////////////////////////////////////////////////////////////
+// Welding
+//////////////////////////////////////////////////////////////////////
+
+// The floats of one vertex that have to match for it to be welded
+struct WeldKey {
+	float v[8];		// The position, normal and texture coordinate
+};
+
+static void MakeKey(WeldKey &key, const float *verts, const float *normals, const float *texcoords, int i)
+{
+	memcpy(&key.v[0], &verts[i * 3], 3 * sizeof(float));
+	memcpy(&key.v[3], &normals[i * 3], 3 * sizeof(float));
+
+	if (texcoords)
+		memcpy(&key.v[6], &texcoords[i * 2], 2 * sizeof(float));
+	else
+		key.v[6] = key.v[7] = 0.0f;
+}
+
+// Hashes the bits of the floats, so only exact copies end up together
+static unsigned int HashKey(const WeldKey &key)
+{
+	unsigned int bits[8];
+	unsigned int h = 2166136261u;
+
+	memcpy(bits, key.v, sizeof(bits));
+
+	for (int i = 0; i < 8; i++)
+	{
+		h ^= bits[i];
+		h *= 16777619u;
+		h ^= h >> 15;
+	}
+
+	return h;
+}
+
+int MeshOptimizer::WeldVertices(float *verts, float *normals, float *texcoords, int numVerts, unsigned short *remap)
+{
+	if (numVerts <= 0)
+		return 0;
+
+	// An open addressed table at most half full, it holds new indices
+	size_t tableSize = 1;
+
+	while (tableSize < (size_t)numVerts * 2)
+		tableSize *= 2;
+
+	std::vector<int> table(tableSize, -1);
+	int unique = 0;
+	WeldKey key, other;
+
+	for (int i = 0; i < numVerts; i++)
+	{
+		MakeKey(key, verts, normals, texcoords, i);
+
+		size_t slot = HashKey(key) & (tableSize - 1);
+
+		// Look for a vertex we kept that is the same
+		while (table[slot] >= 0)
+		{
+			MakeKey(other, verts, normals, texcoords, table[slot]);
+
+			if (memcmp(key.v, other.v, sizeof(key.v)) == 0)
+				break;
+
+			slot = (slot + 1) & (tableSize - 1);
+		}
+
+		if (table[slot] >= 0)
+		{
+			remap[i] = (unsigned short)table[slot];
+			continue;
+		}
+
+		// A new one, it moves down to the next free index. That is never
+		// past i so the arrays can be packed in place
+		memmove(&verts[unique * 3], &verts[i * 3], 3 * sizeof(float));
+		memmove(&normals[unique * 3], &normals[i * 3], 3 * sizeof(float));
+
+		if (texcoords)
+			memmove(&texcoords[unique * 2], &texcoords[i * 2], 2 * sizeof(float));
+
+		table[slot] = unique;
+		remap[i] = (unsigned short)unique;
+		unique++;
+	}
+
+	return unique;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Vertex cache order
+//////////////////////////////////////////////////////////////////////
+
+// The cache the scores model, bigger than the one ACMR is measured
+// with so that the order works well on most hardware
+#define FORSYTH_CACHE	32
+
+// How much a vertex at each cache position is worth. The last
+// triangle's vertices get a fixed score so the next triangle doesn't
+// just reuse the same edge.
+static float CacheScore(int position)
+{
+	if (position < 0)
+		return 0.0f;
+
+	if (position < 3)
+		return 0.75f;
+
+	return powf(1.0f - (float)(position - 3) / (FORSYTH_CACHE - 3), 1.5f);
+}
+
+// Vertices with few triangles left get a boost so that they are
+// finished off instead of left behind as lone triangles
+static float ValenceScore(int live)
+{
+	return 2.0f / sqrtf((float)live);
+}
+
+void MeshOptimizer::OptimizeVertexCache(unsigned short *indices, int numIndices, int numVerts)
+{
+	int numTris = numIndices / 3;
+
+	if (numTris < 2 || numVerts <= 0)
+		return;
+
+	// The triangles that use each vertex, packed one vertex after another
+	std::vector<int> live(numVerts, 0);
+
+	for (int i = 0; i < numTris * 3; i++)
+		live[indices[i]]++;
+
+	std::vector<int> first(numVerts + 1, 0);
+
+	for (int v = 0; v < numVerts; v++)
+		first[v + 1] = first[v] + live[v];
+
+	std::vector<int> adjacency(numTris * 3);
+	std::vector<int> fill(first.begin(), first.end() - 1);
+
+	for (int t = 0; t < numTris; t++)
+	{
+		for (int k = 0; k < 3; k++)
+			adjacency[fill[indices[t * 3 + k]]++] = t;
+	}
+
+	// Precompute the scores, valence is clamped where it stops mattering
+	float cacheTable[FORSYTH_CACHE + 3];
+	float valenceTable[32];
+
+	for (int p = 0; p < FORSYTH_CACHE + 3; p++)
+		cacheTable[p] = p < FORSYTH_CACHE ? CacheScore(p) : 0.0f;
+
+	for (int n = 1; n < 32; n++)
+		valenceTable[n] = ValenceScore(n);
+
+	std::vector<float> vertScore(numVerts);
+	std::vector<float> triScore(numTris, 0.0f);
+	std::vector<bool> emitted(numTris, false);
+
+	for (int v = 0; v < numVerts; v++)
+		vertScore[v] = live[v] ? valenceTable[live[v] < 32 ? live[v] : 31] : -1.0f;
+
+	for (int t = 0; t < numTris; t++)
+	{
+		for (int k = 0; k < 3; k++)
+			triScore[t] += vertScore[indices[t * 3 + k]];
+	}
+
+	// The best triangle overall to start from
+	int best = 0;
+
+	for (int t = 1; t < numTris; t++)
+	{
+		if (triScore[t] > triScore[best])
+			best = t;
+	}
+
+	std::vector<unsigned short> out(numTris * 3);
+	int cache[FORSYTH_CACHE + 3];
+	int newCache[FORSYTH_CACHE + 3];
+	int cacheCount = 0;
+	int scan = 0;
+
+	for (int emittedCount = 0; emittedCount < numTris; emittedCount++)
+	{
+		// Nothing in the cache has triangles left, take the next one in
+		// the original order so the search stays linear
+		if (best < 0)
+		{
+			while (emitted[scan])
+				scan++;
+
+			best = scan;
+		}
+
+		const unsigned short *tri = &indices[best * 3];
+
+		memcpy(&out[emittedCount * 3], tri, 3 * sizeof(unsigned short));
+		emitted[best] = true;
+
+		// The triangle is no longer live on its vertices
+		for (int k = 0; k < 3; k++)
+		{
+			int v = tri[k];
+			int *adj = &adjacency[first[v]];
+
+			for (int a = 0; a < live[v]; a++)
+			{
+				if (adj[a] == best)
+				{
+					adj[a] = adj[live[v] - 1];
+					break;
+				}
+			}
+
+			live[v]--;
+		}
+
+		// Its vertices go to the front of the cache, the rest shift back
+		int newCount = 0;
+
+		for (int k = 0; k < 3; k++)
+			newCache[newCount++] = tri[k];
+
+		for (int c = 0; c < cacheCount; c++)
+		{
+			int v = cache[c];
+
+			if (v != tri[0] && v != tri[1] && v != tri[2])
+				newCache[newCount++] = v;
+		}
+
+		// Rescore every vertex that was touched, the ones pushed past the
+		// end are out of the cache now
+		for (int c = 0; c < newCount; c++)
+		{
+			int v = newCache[c];
+
+			vertScore[v] = live[v] ? cacheTable[c] + valenceTable[live[v] < 32 ? live[v] : 31] : -1.0f;
+		}
+
+		// The next triangle is the best one around the cache
+		best = -1;
+		float bestScore = -1.0f;
+
+		for (int c = 0; c < newCount; c++)
+		{
+			int v = newCache[c];
+			const int *adj = &adjacency[first[v]];
+
+			for (int a = 0; a < live[v]; a++)
+			{
+				int t = adj[a];
+				const unsigned short *u = &indices[t * 3];
+
+				triScore[t] = vertScore[u[0]] + vertScore[u[1]] + vertScore[u[2]];
+
+				if (triScore[t] > bestScore)
+				{
+					bestScore = triScore[t];
+					best = t;
+				}
+			}
+		}
+
+		cacheCount = newCount < FORSYTH_CACHE ? newCount : FORSYTH_CACHE;
+		memcpy(cache, newCache, cacheCount * sizeof(int));
+	}
+
+	memcpy(indices, &out[0], numTris * 3 * sizeof(unsigned short));
+}
+
+//////////////////////////////////////////////////////////////////////
+// Vertex fetch order
+//////////////////////////////////////////////////////////////////////
+
+void MeshOptimizer::BuildFetchRemap(const unsigned short *indices, int numIndices, unsigned short *remap, int &next)
+{
+	for (int i = 0; i < numIndices; i++)
+	{
+		if (remap[indices[i]] == UNUSED)
+			remap[indices[i]] = (unsigned short)next++;
+	}
+}
+
+void MeshOptimizer::RemapVertices(float *verts, float *normals, float *texcoords, int numVerts, unsigned short *remap, int numUsed)
+{
+	// The vertices nobody draws keep their order after the rest
+	for (int v = 0; v < numVerts; v++)
+	{
+		if (remap[v] == UNUSED)
+			remap[v] = (unsigned short)numUsed++;
+	}
+
+	std::vector<float> copy(numVerts * 3);
+
+	memcpy(&copy[0], verts, numVerts * 3 * sizeof(float));
+	for (int v = 0; v < numVerts; v++)
+		memcpy(&verts[remap[v] * 3], &copy[v * 3], 3 * sizeof(float));
+
+	memcpy(&copy[0], normals, numVerts * 3 * sizeof(float));
+	for (int v = 0; v < numVerts; v++)
+		memcpy(&normals[remap[v] * 3], &copy[v * 3], 3 * sizeof(float));
+
+	if (texcoords)
+	{
+		memcpy(&copy[0], texcoords, numVerts * 2 * sizeof(float));
+		for (int v = 0; v < numVerts; v++)
+			memcpy(&texcoords[remap[v] * 2], &copy[v * 2], 2 * sizeof(float));
+	}
+}
+
+void MeshOptimizer::RemapIndices(unsigned short *indices, int numIndices, const unsigned short *remap)
+{
+	for (int i = 0; i < numIndices; i++)
+		indices[i] = remap[indices[i]];
+}
+
+//////////////////////////////////////////////////////////////////////
+// Measuring
+//////////////////////////////////////////////////////////////////////
+
+float MeshOptimizer::ACMR(const unsigned short *indices, int numIndices, int numVerts)
+{
+	int numTris = numIndices / 3;
+
+	if (numTris == 0 || numVerts <= 0)
+		return 0.0f;
+
+	// A vertex is in the FIFO if it went in less than CACHE_SIZE misses ago
+	std::vector<int> stamp(numVerts, -CACHE_SIZE - 1);
+	int misses = 0;
+
+	for (int i = 0; i < numTris * 3; i++)
+	{
+		int v = indices[i];
+
+		if (misses - stamp[v] > CACHE_SIZE)
+		{
+			stamp[v] = misses;
+			misses++;
+		}
+	}
+
+	return (float)misses / numTris;
+}
@@ -0,0 +1,80 @@
+//////////////////////////////////////////////////////////////////////
+//
+// Mesh Optimizer
+//
+// MeshOptimizer.h: interface for the MeshOptimizer class.
+// This class holds the load time passes that make a mesh
+// cheaper for the GPU to draw without changing how it looks.
+// Welding merges vertices whose position, normal and texture
+// coordinate are exactly the same. The vertex cache pass
+// reorders the triangles of an index list so that vertices
+// the GPU just transformed get reused (Tom Forsyth's "Linear-
+// Speed Vertex Cache Optimisation"). The fetch pass numbers
+// the vertices in the order the index lists first use them,
+// so the vertex arrays are read front to back.
+//
+// The quality of an index list is measured as its ACMR, the
+// average number of vertices transformed per triangle with a
+// FIFO cache of CACHE_SIZE vertices. 3.0 is the worst, about
+// 0.5 is the best a regular grid can get.
+//
+// Every index passed in has to be below numVerts.
+//
+// Usage:
+// // Merge the duplicates, remap tells where each old vertex went
+// std::vector<unsigned short> remap(numVerts);
+// numVerts = MeshOptimizer::WeldVertices(verts, normals, texcoords, numVerts, &remap[0]);
+// MeshOptimizer::RemapIndices(indices, numIndices, &remap[0]);
+//
+// // Reorder the triangles of each list that gets drawn
+// float before = MeshOptimizer::ACMR(indices, numIndices, numVerts);
+// MeshOptimizer::OptimizeVertexCache(indices, numIndices, numVerts);
+//
+// // Number the vertices by first use over all of the lists
+// int next = 0;
+// std::fill(remap.begin(), remap.end(), MeshOptimizer::UNUSED);
+// MeshOptimizer::BuildFetchRemap(indices, numIndices, &remap[0], next);
+// MeshOptimizer::RemapVertices(verts, normals, texcoords, numVerts, &remap[0], next);
+// MeshOptimizer::RemapIndices(indices, numIndices, &remap[0]);
+//
+//////////////////////////////////////////////////////////////////////
+
+#ifndef MESHOPTIMIZER_H
+#define MESHOPTIMIZER_H
+
+class MeshOptimizer
+{
+public:
+	enum {
+		CACHE_SIZE = 16,		// The FIFO cache ACMR is measured with
+		UNUSED = 0xFFFF			// A remap entry for a vertex no list uses
+	};
+
+	// What the optimizer did to a whole model
+	struct Stats {
+		int vertsBefore;		// The vertices before welding
+		int vertsAfter;			// The vertices after welding
+		int triangles;			// The triangles in the drawn index lists
+		float acmrBefore;		// Vertices transformed per triangle before
+		float acmrAfter;		// Vertices transformed per triangle after
+	};
+
+	// Merges identical vertices, keeping the first of each. remap gets the
+	// new index of every old vertex. Returns the new number of vertices.
+	// texcoords may be NULL.
+	static int WeldVertices(float *verts, float *normals, float *texcoords, int numVerts, unsigned short *remap);
+	// Reorders the triangles of the list for the post-transform vertex cache
+	static void OptimizeVertexCache(unsigned short *indices, int numIndices, int numVerts);
+	// Gives every vertex the list uses that doesn't have a new index yet
+	// the next one. Call it for each list in draw order.
+	static void BuildFetchRemap(const unsigned short *indices, int numIndices, unsigned short *remap, int &next);
+	// Moves every vertex to its new index. Vertices still UNUSED go after
+	// the used ones, remap is filled in for them.
+	static void RemapVertices(float *verts, float *normals, float *texcoords, int numVerts, unsigned short *remap, int numUsed);
+	// Replaces every index with its remap entry
+	static void RemapIndices(unsigned short *indices, int numIndices, const unsigned short *remap);
+	// The average cache miss ratio of the list
+	static float ACMR(const unsigned short *indices, int numIndices, int numVerts);
+};
+
+#endif MESHOPTIMIZER_H
@@ -0,0 +1,421 @@
+//////////////////////////////////////////////////////////////////////
+//
+// Mesh Simplifier
+//
+// MeshSimplifier.cpp: implementation of the MeshSimplifier class.
+//
+//////////////////////////////////////////////////////////////////////
+
+#include "MeshSimplifier.h"
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+// How much more an open edge's plane counts than a triangle's
+#define BORDER_WEIGHT	10.0
+
+// What a vertex is allowed to do
+enum VertexKind {
+	KIND_MANIFOLD,		// Inside the surface, collapses into any neighbour
+	KIND_BORDER,		// On an open edge, only collapses along it
+	KIND_LOCKED			// Never moves
+};
+
+//////////////////////////////////////////////////////////////////////
+// Quadrics
+//////////////////////////////////////////////////////////////////////
+
+// The symmetric 4x4 matrix of the summed planes, and their total weight
+struct Quadric {
+	double a00, a01, a02, a03;
+	double a11, a12, a13;
+	double a22, a23;
+	double a33;
+	double w;
+};
+
+static void AddPlane(Quadric &q, double nx, double ny, double nz, double d, double w)
+{
+	q.a00 += w * nx * nx;
+	q.a01 += w * nx * ny;
+	q.a02 += w * nx * nz;
+	q.a03 += w * nx * d;
+	q.a11 += w * ny * ny;
+	q.a12 += w * ny * nz;
+	q.a13 += w * ny * d;
+	q.a22 += w * nz * nz;
+	q.a23 += w * nz * d;
+	q.a33 += w * d * d;
+	q.w += w;
+}
+
+static void AddQuadric(Quadric &q, const Quadric &r)
+{
+	q.a00 += r.a00; q.a01 += r.a01; q.a02 += r.a02; q.a03 += r.a03;
+	q.a11 += r.a11; q.a12 += r.a12; q.a13 += r.a13;
+	q.a22 += r.a22; q.a23 += r.a23;
+	q.a33 += r.a33;
+	q.w += r.w;
+}
+
+// The weighted sum of the squared distances from p to the planes
+static double Evaluate(const Quadric &q, const float *p)
+{
+	double x = p[0], y = p[1], z = p[2];
+
+	double e = q.a00 * x * x + 2.0 * q.a01 * x * y + 2.0 * q.a02 * x * z + 2.0 * q.a03 * x +
+		q.a11 * y * y + 2.0 * q.a12 * y * z + 2.0 * q.a13 * y +
+		q.a22 * z * z + 2.0 * q.a23 * z +
+		q.a33;
+
+	return e > 0.0 ? e : 0.0;
+}
+
+static void Cross(const float *a, const float *b, const float *c, double *n)
+{
+	double e1[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+	double e2[3] = { c[0] - a[0], c[1] - a[1], c[2] - a[2] };
+
+	n[0] = e1[1] * e2[2] - e1[2] * e2[1];
+	n[1] = e1[2] * e2[0] - e1[0] * e2[2];
+	n[2] = e1[0] * e2[1] - e1[1] * e2[0];
+}
+
+//////////////////////////////////////////////////////////////////////
+// Topology
+//////////////////////////////////////////////////////////////////////
+
+// The triangles around each vertex, packed one vertex after another
+struct Adjacency {
+	std::vector<int> first;		// Where each vertex's triangles start
+	std::vector<int> tris;		// The triangles
+};
+
+static void BuildAdjacency(Adjacency &adj, const unsigned short *indices, int numIndices, int numVerts)
+{
+	adj.first.assign(numVerts + 1, 0);
+
+	for (int i = 0; i < numIndices; i++)
+		adj.first[indices[i] + 1]++;
+
+	for (int v = 0; v < numVerts; v++)
+		adj.first[v + 1] += adj.first[v];
+
+	std::vector<int> fill(adj.first.begin(), adj.first.end() - 1);
+	adj.tris.resize(numIndices);
+
+	for (int i = 0; i < numIndices; i++)
+		adj.tris[fill[indices[i]]++] = i / 3;
+}
+
+// The number of triangles that have both a and b
+static int EdgeCount(const Adjacency &adj, const unsigned short *indices, int a, int b)
+{
+	int count = 0;
+
+	for (int k = adj.first[a]; k < adj.first[a + 1]; k++)
+	{
+		const unsigned short *t = &indices[adj.tris[k] * 3];
+
+		if (t[0] == b || t[1] == b || t[2] == b)
+			count++;
+	}
+
+	return count;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Simplification
+//////////////////////////////////////////////////////////////////////
+
+// A vertex and the neighbour it would collapse into
+struct Collapse {
+	double cost;
+	int v;
+	int target;
+
+	bool operator<(const Collapse &other) const { return cost < other.cost; }
+};
+
+int MeshSimplifier::Simplify(const float *verts, int numVerts,
+	const unsigned short *indices, const int *groups, int numIndices,
+	int targetIndices, unsigned short *out, int *outGroups, float &error)
+{
+	int count = numIndices - numIndices % 3;
+
+	error = 0.0f;
+
+	std::vector<unsigned short> idx(indices, indices + count);
+	std::vector<int> grp(groups, groups + count / 3);
+
+	// Vertices between two material groups stay where they are
+	std::vector<int> group(numVerts, -1);
+	std::vector<char> locked(numVerts, 0);
+
+	for (int i = 0; i < count; i++)
+	{
+		int v = idx[i];
+
+		if (group[v] >= 0 && group[v] != grp[i / 3])
+			locked[v] = 1;
+
+		group[v] = grp[i / 3];
+	}
+
+	// So do texture seams, the copies of a position must move together
+	std::vector<int> byPosition;
+
+	for (int v = 0; v < numVerts; v++)
+	{
+		if (group[v] >= 0)
+			byPosition.push_back(v);
+	}
+
+	std::sort(byPosition.begin(), byPosition.end(), [verts](int a, int b)
+		{
+			return memcmp(&verts[a * 3], &verts[b * 3], 3 * sizeof(float)) < 0;
+		});
+
+	for (size_t i = 1; i < byPosition.size(); i++)
+	{
+		int a = byPosition[i - 1], b = byPosition[i];
+
+		if (memcmp(&verts[a * 3], &verts[b * 3], 3 * sizeof(float)) == 0)
+			locked[a] = locked[b] = 1;
+	}
+
+	// Every vertex starts with the planes of its triangles
+	std::vector<Quadric> quadrics(numVerts);
+	Adjacency adj;
+
+	memset(&quadrics[0], 0, numVerts * sizeof(Quadric));
+	BuildAdjacency(adj, &idx[0], count, numVerts);
+
+	for (int t = 0; t < count / 3; t++)
+	{
+		const unsigned short *tri = &idx[t * 3];
+		double n[3];
+
+		Cross(&verts[tri[0] * 3], &verts[tri[1] * 3], &verts[tri[2] * 3], n);
+
+		double area = sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+
+		if (area == 0.0)
+			continue;
+
+		n[0] /= area; n[1] /= area; n[2] /= area;
+
+		const float *p = &verts[tri[0] * 3];
+		double d = -(n[0] * p[0] + n[1] * p[1] + n[2] * p[2]);
+
+		for (int k = 0; k < 3; k++)
+			AddPlane(quadrics[tri[k]], n[0], n[1], n[2], d, area * 0.5);
+
+		// Open edges also get a plane standing up from the triangle along them
+		for (int k = 0; k < 3; k++)
+		{
+			int a = tri[k], b = tri[(k + 1) % 3];
+
+			if (EdgeCount(adj, &idx[0], a, b) != 1)
+				continue;
+
+			const float *pa = &verts[a * 3];
+			const float *pb = &verts[b * 3];
+			double e[3] = { pb[0] - pa[0], pb[1] - pa[1], pb[2] - pa[2] };
+			double bn[3] = { e[1] * n[2] - e[2] * n[1], e[2] * n[0] - e[0] * n[2], e[0] * n[1] - e[1] * n[0] };
+			double len = sqrt(bn[0] * bn[0] + bn[1] * bn[1] + bn[2] * bn[2]);
+
+			if (len == 0.0)
+				continue;
+
+			bn[0] /= len; bn[1] /= len; bn[2] /= len;
+
+			double bd = -(bn[0] * pa[0] + bn[1] * pa[1] + bn[2] * pa[2]);
+			double w = (e[0] * e[0] + e[1] * e[1] + e[2] * e[2]) * BORDER_WEIGHT;
+
+			AddPlane(quadrics[a], bn[0], bn[1], bn[2], bd, w);
+			AddPlane(quadrics[b], bn[0], bn[1], bn[2], bd, w);
+		}
+	}
+
+	std::vector<char> kind(numVerts);
+	std::vector<char> touched(numVerts);
+	std::vector<int> collapseTo(numVerts);
+	std::vector<Collapse> collapses;
+
+	// Each pass does the cheapest collapses that don't get in each other's way
+	while (count > targetIndices)
+	{
+		BuildAdjacency(adj, &idx[0], count, numVerts);
+
+		// Sort out what each vertex may do now
+		for (int v = 0; v < numVerts; v++)
+		{
+			kind[v] = locked[v] ? KIND_LOCKED : KIND_MANIFOLD;
+
+			for (int k = adj.first[v]; k < adj.first[v + 1] && kind[v] != KIND_LOCKED; k++)
+			{
+				const unsigned short *tri = &idx[adj.tris[k] * 3];
+
+				for (int c = 0; c < 3; c++)
+				{
+					if (tri[c] == v)
+						continue;
+
+					int n = EdgeCount(adj, &idx[0], v, tri[c]);
+
+					// More than two triangles on an edge, don't touch it
+					if (n > 2)
+						kind[v] = KIND_LOCKED;
+					else if (n == 1 && kind[v] == KIND_MANIFOLD)
+						kind[v] = KIND_BORDER;
+				}
+			}
+		}
+
+		// Price every collapse that is allowed
+		collapses.clear();
+
+		for (int t = 0; t < count / 3; t++)
+		{
+			const unsigned short *tri = &idx[t * 3];
+
+			for (int k = 0; k < 3; k++)
+			{
+				for (int dir = 0; dir < 2; dir++)
+				{
+					int v = dir ? tri[(k + 1) % 3] : tri[k];
+					int target = dir ? tri[k] : tri[(k + 1) % 3];
+
+					if (v == target || kind[v] == KIND_LOCKED)
+						continue;
+
+					// Open edges only collapse along themselves
+					if (kind[v] == KIND_BORDER &&
+						(kind[target] == KIND_MANIFOLD || EdgeCount(adj, &idx[0], v, target) != 1))
+						continue;
+
+					Quadric q = quadrics[v];
+					AddQuadric(q, quadrics[target]);
+
+					Collapse c;
+					c.cost = Evaluate(q, &verts[target * 3]);
+					c.v = v;
+					c.target = target;
+					collapses.push_back(c);
+				}
+			}
+		}
+
+		std::sort(collapses.begin(), collapses.end());
+
+		// Take just enough of them
+		int wanted = (count - targetIndices + 2) / 3;
+		int removed = 0;
+		int done = 0;
+
+		std::fill(touched.begin(), touched.end(), 0);
+
+		for (size_t i = 0; i < collapses.size() && removed < wanted; i++)
+		{
+			const Collapse &c = collapses[i];
+
+			if (touched[c.v] || touched[c.target])
+				continue;
+
+			// Skip it if a triangle that stays would turn over
+			bool flips = false;
+			int dies = 0;
+
+			for (int k = adj.first[c.v]; k < adj.first[c.v + 1] && !flips; k++)
+			{
+				const unsigned short *tri = &idx[adj.tris[k] * 3];
+
+				if (tri[0] == c.target || tri[1] == c.target || tri[2] == c.target)
+				{
+					dies++;
+					continue;
+				}
+
+				const float *p[3], *q[3];
+
+				for (int j = 0; j < 3; j++)
+				{
+					p[j] = &verts[tri[j] * 3];
+					q[j] = tri[j] == c.v ? &verts[c.target * 3] : p[j];
+				}
+
+				double n0[3], n1[3];
+
+				Cross(p[0], p[1], p[2], n0);
+				Cross(q[0], q[1], q[2], n1);
+
+				if (n0[0] * n1[0] + n0[1] * n1[1] + n0[2] * n1[2] <= 0.0)
+					flips = true;
+			}
+
+			if (flips)
+				continue;
+
+			// Collapse it, the vertices around it wait for the next pass
+			for (int k = adj.first[c.v]; k < adj.first[c.v + 1]; k++)
+			{
+				const unsigned short *tri = &idx[adj.tris[k] * 3];
+
+				touched[tri[0]] = touched[tri[1]] = touched[tri[2]] = 1;
+			}
+
+			collapseTo[c.v] = c.target + 1;
+			AddQuadric(quadrics[c.target], quadrics[c.v]);
+
+			if (quadrics[c.target].w > 0.0)
+			{
+				float e = (float)sqrt(c.cost / quadrics[c.target].w);
+
+				if (e > error)
+					error = e;
+			}
+
+			removed += dies;
+			done++;
+		}
+
+		if (done == 0)
+			break;
+
+		// Move the collapsed vertices and drop the triangles that went flat
+		int kept = 0;
+
+		for (int t = 0; t < count / 3; t++)
+		{
+			unsigned short tri[3];
+
+			for (int k = 0; k < 3; k++)
+			{
+				int v = idx[t * 3 + k];
+
+				tri[k] = (unsigned short)(collapseTo[v] ? collapseTo[v] - 1 : v);
+			}
+
+			if (tri[0] == tri[1] || tri[1] == tri[2] || tri[0] == tri[2])
+				continue;
+
+			memcpy(&idx[kept * 3], tri, sizeof(tri));
+			grp[kept] = grp[t];
+			kept++;
+		}
+
+		count = kept * 3;
+		std::fill(collapseTo.begin(), collapseTo.end(), 0);
+	}
+
+	if (count > 0)
+	{
+		memcpy(out, &idx[0], count * sizeof(unsigned short));
+		memcpy(outGroups, &grp[0], count / 3 * sizeof(int));
+	}
+
+	return count;
+}
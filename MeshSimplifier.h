@@ -0,0 +1,47 @@
+//////////////////////////////////////////////////////////////////////
+//
+// Mesh Simplifier
+//
+// MeshSimplifier.h: interface for the MeshSimplifier class.
+// This class makes coarser versions of a mesh for drawing it
+// far away. It collapses vertices into one of their neighbours,
+// cheapest first, where the cost is the quadric error of
+// Garland and Heckbert: the squared distance from the planes of
+// the triangles that have been merged into the vertex. Vertices
+// only move onto other vertices, so the result is a new index
+// list over the same vertex arrays.
+//
+// Open edges only collapse along themselves, so holes and the
+// outlines of thin parts keep their shape. Vertices that sit
+// between two material groups or on a texture seam (two vertices
+// at the same position) never move, so the groups still meet and
+// the textures don't tear. Collapses that would flip a triangle
+// over are skipped.
+//
+// Usage:
+// // groups gives the material group of each triangle, the kept
+// // triangles keep their group in outGroups
+// float error;
+// int n = MeshSimplifier::Simplify(verts, numVerts, indices, groups, numIndices,
+//     numIndices / 2, out, outGroups, error);
+//
+// // error is the furthest the surface moved, in model units
+//
+//////////////////////////////////////////////////////////////////////
+
+#ifndef MESHSIMPLIFIER_H
+#define MESHSIMPLIFIER_H
+
+class MeshSimplifier
+{
+public:
+	// Collapses vertices until at most targetIndices indices are left or
+	// nothing can be collapsed anymore. out and outGroups need room for
+	// numIndices and numIndices / 3 entries. Returns the number of indices
+	// written to out. Every index has to be below numVerts.
+	static int Simplify(const float *verts, int numVerts,
+		const unsigned short *indices, const int *groups, int numIndices,
+		int targetIndices, unsigned short *out, int *outGroups, float &error);
+};
+
+#endif MESHSIMPLIFIER_H
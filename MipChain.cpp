@@ -0,0 +1,425 @@
+//////////////////////////////////////////////////////////////////////
+//
+// Mip Chain Class
+//
+// MipChain.cpp: implementation of the MipChain class.
+//
+//////////////////////////////////////////////////////////////////////
+
+#include "MipChain.h"
+#include "ImageKernels.h"
+#include "PixelPool.h"
+#include "WorkerPool.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#define BAND_PIXELS		32768		// The output pixels of a level one job filters
+#define KAISER_WIDTH	2.0			// The Kaiser filter reaches this far, in pixels of the smaller level
+#define KAISER_ALPHA	4.0			// The shape of its window, higher is smoother
+
+#ifndef GL_MAX_TEXTURE_SIZE
+#define GL_MAX_TEXTURE_SIZE 0x0D33
+#endif
+
+static MipChain::Filter filter = MipChain::BOX;
+
+// What the driver takes, read once on the GL thread
+static int driverNonPowerOfTwo = -1;
+static GLint driverMaxSize = 0;
+
+static bool PowerOfTwo(int n)
+{
+	return (n & (n - 1)) == 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Sizes
+//////////////////////////////////////////////////////////////////////
+
+int MipChain::Levels(int width, int height)
+{
+	int levels = 1;
+
+	for (; width > 1 || height > 1; levels++)
+	{
+		width = width > 1 ? width / 2 : 1;
+		height = height > 1 ? height / 2 : 1;
+	}
+
+	return levels;
+}
+
+size_t MipChain::ChainSize(int width, int height, int channels)
+{
+	size_t bytes = 0;
+
+	while (width > 1 || height > 1)
+	{
+		width = width > 1 ? width / 2 : 1;
+		height = height > 1 ? height / 2 : 1;
+		bytes += (size_t)width * height * channels;
+	}
+
+	return bytes;
+}
+
+MipChain::Filter MipChain::GetFilter()
+{
+	return filter;
+}
+
+void MipChain::SetFilter(Filter f)
+{
+	filter = f;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Filters
+//////////////////////////////////////////////////////////////////////
+
+// Calls body(first, last) for bands of rows, across the workers
+// when the level is big enough to be worth it
+template <class Body>
+static void ForBands(int rows, int rowPixels, const Body &body)
+{
+	int bandRows = BAND_PIXELS / (rowPixels > 0 ? rowPixels : 1);
+
+	if (bandRows < 1)
+		bandRows = 1;
+
+	int bands = (rows + bandRows - 1) / bandRows;
+
+	if (bands <= 1)
+	{
+		body(0, rows);
+		return;
+	}
+
+	WorkerPool::Shared().ParallelFor(bands, [&](int band)
+	{
+		int first = band * bandRows;
+		int last = first + bandRows < rows ? first + bandRows : rows;
+
+		body(first, last);
+	});
+}
+
+// The source pixels and weights of each pixel of a smaller level,
+// along one axis
+struct Taps {
+	int size;						// Taps per pixel
+	std::vector<int> index;			// The source pixel of each tap
+	std::vector<float> weight;		// And what it counts for
+};
+
+// Pairs for an even size, three taps that cover the pixels evenly for an odd one
+static void BoxTaps(int n, int m, Taps &taps)
+{
+	taps.size = (n == 1) ? 1 : (n % 2 == 0) ? 2 : 3;
+	taps.index.resize(m * taps.size);
+	taps.weight.resize(m * taps.size);
+
+	for (int i = 0; i < m; i++)
+	{
+		int *index = &taps.index[i * taps.size];
+		float *weight = &taps.weight[i * taps.size];
+
+		for (int k = 0; k < taps.size; k++)
+			index[k] = i * 2 + k;
+
+		if (taps.size == 1)
+			weight[0] = 1.0f;
+		else if (taps.size == 2)
+			weight[0] = weight[1] = 0.5f;
+		else
+		{
+			weight[0] = (float)(m - i) / n;
+			weight[1] = (float)m / n;
+			weight[2] = (float)(i + 1) / n;
+		}
+	}
+}
+
+static double BesselI0(double x)
+{
+	double sum = 1.0;
+	double term = 1.0;
+
+	for (int k = 1; term > sum * 1e-12; k++)
+	{
+		double t = x / (2.0 * k);
+		term *= t * t;
+		sum += term;
+	}
+
+	return sum;
+}
+
+static double Sinc(double x)
+{
+	if (x == 0.0)
+		return 1.0;
+
+	x *= 3.14159265358979323846;
+	return sin(x) / x;
+}
+
+// A sinc cut off at the smaller level's pixel rate, under a Kaiser
+// window. The edges are clamped
+static void KaiserTaps(int n, int m, Taps &taps)
+{
+	double scale = (double)n / m;
+	double radius = KAISER_WIDTH * scale;
+	double norm = BesselI0(KAISER_ALPHA);
+
+	taps.size = (int)ceil(radius * 2.0) + 1;
+	taps.index.resize(m * taps.size);
+	taps.weight.resize(m * taps.size);
+
+	std::vector<double> w(taps.size);
+
+	for (int i = 0; i < m; i++)
+	{
+		int *index = &taps.index[i * taps.size];
+		float *weight = &taps.weight[i * taps.size];
+		double center = (i + 0.5) * scale;
+		int first = (int)floor(center - radius);
+		double total = 0.0;
+
+		for (int k = 0; k < taps.size; k++)
+		{
+			int j = first + k;
+			double d = (j + 0.5 - center) / scale;
+			double r = d / KAISER_WIDTH;
+
+			w[k] = fabs(r) < 1.0 ? Sinc(d) * BesselI0(KAISER_ALPHA * sqrt(1.0 - r * r)) / norm : 0.0;
+			total += w[k];
+
+			index[k] = j < 0 ? 0 : j >= n ? n - 1 : j;
+		}
+
+		for (int k = 0; k < taps.size; k++)
+			weight[k] = (float)(w[k] / total);
+	}
+}
+
+static void MakeTaps(int n, int m, Taps &taps)
+{
+	if (filter == MipChain::KAISER && n > 1)
+		KaiserTaps(n, m, taps);
+	else
+		BoxTaps(n, m, taps);
+}
+
+// Both sizes even: 2x2 blocks, 4 pixels at a time
+static void HalveBox(const unsigned char *src, int width, unsigned char *dst, int dw, int dh, int channels)
+{
+	size_t srcStride = (size_t)width * channels;
+	size_t dstStride = (size_t)dw * channels;
+
+	ForBands(dh, dw, [&](int first, int last)
+	{
+		for (int y = first; y < last; y++)
+		{
+			const unsigned char *row = src + srcStride * y * 2;
+			ImageKernels::HalveRows(row, row + srcStride, dst + dstStride * y, dw, channels);
+		}
+	});
+}
+
+// One row across, rounded to bytes. The channel count and, for
+// the box filter, the taps are fixed so the compiler can unroll it
+template <int CHANNELS, int TAPS>
+static void ResampleRow(const float *r, unsigned char *d, int dw, const Taps &across)
+{
+	int size = TAPS ? TAPS : across.size;
+
+	for (int x = 0; x < dw; x++)
+	{
+		const int *index = &across.index[x * size];
+		const float *weight = &across.weight[x * size];
+		float sum[CHANNELS] = {};
+
+		for (int k = 0; k < size; k++)
+		{
+			const float *p = r + index[k] * CHANNELS;
+
+			for (int c = 0; c < CHANNELS; c++)
+				sum[c] += weight[k] * p[c];
+		}
+
+		// The Kaiser filter's lobes can overshoot
+		for (int c = 0; c < CHANNELS; c++)
+		{
+			int v = (int)(sum[c] + 0.5f);
+			d[x * CHANNELS + c] = (unsigned char)(v < 0 ? 0 : v > 255 ? 255 : v);
+		}
+	}
+}
+
+// Any size and filter. Each row of the smaller level is filtered down
+// the columns first, which runs straight through memory, then across
+static void Resample(const unsigned char *src, int width, int height, unsigned char *dst, int dw, int dh, int channels)
+{
+	Taps across, down;
+
+	MakeTaps(width, dw, across);
+	MakeTaps(height, dh, down);
+
+	size_t srcStride = (size_t)width * channels;
+	size_t dstStride = (size_t)dw * channels;
+
+	ForBands(dh, dw, [&](int first, int last)
+	{
+		std::vector<float> column(srcStride);
+
+		for (int y = first; y < last; y++)
+		{
+			const int *index = &down.index[y * down.size];
+			const float *weight = &down.weight[y * down.size];
+			float *sum = &column[0];
+
+			memset(sum, 0, srcStride * sizeof(float));
+
+			for (int k = 0; k < down.size; k++)
+				ImageKernels::AddWeightedRow(src + srcStride * index[k], weight[k], sum, (int)srcStride);
+
+			unsigned char *d = dst + dstStride * y;
+
+			if (across.size == 3)
+				channels == 4 ? ResampleRow<4, 3>(sum, d, dw, across) : ResampleRow<3, 3>(sum, d, dw, across);
+			else
+				channels == 4 ? ResampleRow<4, 0>(sum, d, dw, across) : ResampleRow<3, 0>(sum, d, dw, across);
+		}
+	});
+}
+
+//////////////////////////////////////////////////////////////////////
+// Building
+//////////////////////////////////////////////////////////////////////
+
+unsigned char *MipChain::Build(const unsigned char *pixels, int width, int height, int channels)
+{
+	size_t bytes = ChainSize(width, height, channels);
+
+	if (pixels == NULL || bytes == 0)
+		return NULL;
+
+	unsigned char *mipmaps = PixelPool::Alloc(bytes);
+
+	if (mipmaps == NULL)
+		return NULL;
+
+	// Each level is made from the one above it
+	const unsigned char *src = pixels;
+	unsigned char *dst = mipmaps;
+
+	while (width > 1 || height > 1)
+	{
+		int dw = width > 1 ? width / 2 : 1;
+		int dh = height > 1 ? height / 2 : 1;
+
+		if (filter == BOX && width % 2 == 0 && height % 2 == 0)
+			HalveBox(src, width, dst, dw, dh, channels);
+		else
+			Resample(src, width, height, dst, dw, dh, channels);
+
+		src = dst;
+		dst += (size_t)dw * dh * channels;
+		width = dw;
+		height = dh;
+	}
+
+	return mipmaps;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Uploading
+//////////////////////////////////////////////////////////////////////
+
+static void CheckDriver()
+{
+	if (driverNonPowerOfTwo >= 0)
+		return;
+
+	// Every GL from 2.0 takes any size, older ones with the extension
+	const char *version = (const char *)glGetString(GL_VERSION);
+	const char *extensions = (const char *)glGetString(GL_EXTENSIONS);
+
+	driverNonPowerOfTwo = (version && atoi(version) >= 2) ||
+		(extensions && strstr(extensions, "GL_ARB_texture_non_power_of_two"));
+
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &driverMaxSize);
+
+	if (driverMaxSize <= 0)
+		driverMaxSize = 1024;
+}
+
+bool MipChain::NonPowerOfTwo()
+{
+	CheckDriver();
+	return driverNonPowerOfTwo != 0;
+}
+
+int MipChain::MaxSize()
+{
+	CheckDriver();
+	return driverMaxSize;
+}
+
+bool MipChain::Upload(const unsigned char *pixels, const unsigned char *mipmaps, int width, int height, GLenum format)
+{
+	int levels = Levels(width, height);
+	int channels = (format == GL_RGBA) ? 4 : 3;
+
+	if (pixels == NULL || (levels > 1 && mipmaps == NULL))
+		return false;
+
+	if (!NonPowerOfTwo() && (!PowerOfTwo(width) || !PowerOfTwo(height)))
+		return false;
+
+	// The small levels' rows are tightly packed
+	GLint alignment;
+	glGetIntegerv(GL_UNPACK_ALIGNMENT, &alignment);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+	const unsigned char *level = pixels;
+	int target = 0;
+
+	for (int i = 0; i < levels; i++)
+	{
+		// A level too big for the card is left out, the next one is the top
+		if (width <= driverMaxSize && height <= driverMaxSize)
+			glTexImage2D(GL_TEXTURE_2D, target++, channels, width, height, 0, format, GL_UNSIGNED_BYTE, level);
+
+		level = (i == 0) ? mipmaps : level + (size_t)width * height * channels;
+		width = width > 1 ? width / 2 : 1;
+		height = height > 1 ? height / 2 : 1;
+	}
+
+	glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
+
+	return true;
+}
+
+void MipChain::BuildAndUpload(const unsigned char *pixels, int width, int height, GLenum format)
+{
+	int channels = (format == GL_RGBA) ? 4 : 3;
+
+	// Don't build levels the driver won't take
+	if (NonPowerOfTwo() || (PowerOfTwo(width) && PowerOfTwo(height)))
+	{
+		unsigned char *mipmaps = Build(pixels, width, height, channels);
+		bool ok = Upload(pixels, mipmaps, width, height, format);
+
+		PixelPool::Free(mipmaps);
+
+		if (ok)
+			return;
+	}
+
+	gluBuild2DMipmaps(GL_TEXTURE_2D, channels, width, height, format, GL_UNSIGNED_BYTE, pixels);
+}
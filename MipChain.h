@@ -0,0 +1,78 @@
+//////////////////////////////////////////////////////////////////////
+//
+// Mip Chain Class
+//
+// MipChain.h: interface for the MipChain class.
+// This class builds the mipmaps of a decoded image and uploads
+// them, in place of gluBuild2DMipmaps. GLU scales every image
+// to a power of two with a slow generic filter and then halves
+// it one level at a time on the GL thread. Here the levels are
+// built where the image was decoded, with a 2x2 box filter that
+// runs 4 pixels at a time (ImageKernels::HalveRows), and the
+// rows of the big levels are split across the WorkerPool.
+//
+// Sizes that aren't a power of two keep their size when the
+// driver takes them (GL 2.0 or ARB_texture_non_power_of_two).
+// Each level is half the one above, rounded down, and an odd
+// size is filtered with 3 taps so no pixel is dropped. On a
+// driver without them Upload returns false and the caller
+// hands the image to GLU, which scales it.
+//
+// The Kaiser filter is sharper than the box, distant levels
+// keep more detail, but it is several times slower.
+//
+// Usage:
+// // Any thread, levels 1 and down in one PixelPool buffer
+// unsigned char *mipmaps = MipChain::Build(pixels, width, height, 3);
+//
+// // The GL thread, with the texture bound
+// if (!MipChain::Upload(pixels, mipmaps, width, height, GL_RGB))
+//     gluBuild2DMipmaps(GL_TEXTURE_2D, 3, width, height, GL_RGB, GL_UNSIGNED_BYTE, pixels);
+// PixelPool::Free(mipmaps);
+//
+// // Or both at once on the GL thread
+// MipChain::BuildAndUpload(pixels, width, height, GL_RGB);
+//
+// MipChain::SetFilter(MipChain::KAISER);	// For every chain built after
+//
+//////////////////////////////////////////////////////////////////////
+
+#ifndef MIPCHAIN_H
+#define MIPCHAIN_H
+
+#ifdef _WIN32
+#include <windows.h>		// Header File For Windows
+#include <gl\gl.h>			// Header File For The OpenGL32 Library
+#include <gl\glu.h>			// Header File For The GLu32 Library
+#else
+#include <GL/gl.h>
+#include <GL/glu.h>
+#endif
+
+#include <stddef.h>
+
+class MipChain
+{
+public:
+	enum Filter {
+		BOX,		// The average of each 2x2 block, 3 taps across an odd size
+		KAISER		// Kaiser windowed sinc, sharper and slower
+	};
+
+	static int Levels(int width, int height);		// The levels down to 1x1, the image included
+	static size_t ChainSize(int width, int height, int channels);	// The bytes of the levels below the image
+	// Builds the levels below the image into a PixelPool buffer, one after the
+	// other with no row padding. NULL for a 1x1 image or without memory.
+	static unsigned char *Build(const unsigned char *pixels, int width, int height, int channels);
+	// Uploads the image and its levels to the bound texture, false (and
+	// nothing uploaded) if the driver can't take the size or mipmaps is missing
+	static bool Upload(const unsigned char *pixels, const unsigned char *mipmaps, int width, int height, GLenum format);
+	// Build and Upload, GLU when Upload can't
+	static void BuildAndUpload(const unsigned char *pixels, int width, int height, GLenum format);
+	static bool NonPowerOfTwo();					// True if the driver takes any size, GL thread only
+	static int MaxSize();							// The biggest level the driver takes, GL thread only
+	static Filter GetFilter();						// The filter Build uses
+	static void SetFilter(Filter filter);			// Changes it, set it before any loading starts
+};
+
+#endif MIPCHAIN_H
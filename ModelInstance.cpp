@@ -0,0 +1,86 @@
+//////////////////////////////////////////////////////////////////////
+//
+// Model Instance Class
+//
+// ModelInstance.cpp: implementation of the ModelInstance class.
+//
+//////////////////////////////////////////////////////////////////////
+
+#include "ModelInstance.h"
+
+//////////////////////////////////////////////////////////////////////
+// Construction/Destruction
+//////////////////////////////////////////////////////////////////////
+
+ModelInstance::ModelInstance(MeshAsset *asset)
+{
+	this->asset = asset;
+	visible = true;
+	lit = true;
+
+	pos.x = pos.y = pos.z = 0.0f;
+	rot.x = rot.y = rot.z = 0.0f;
+	scale = 1.0f;
+	dirty = true;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Placement
+//////////////////////////////////////////////////////////////////////
+
+void ModelInstance::SetPosition(float x, float y, float z)
+{
+	pos.x = x;
+	pos.y = y;
+	pos.z = z;
+	dirty = true;
+}
+
+void ModelInstance::SetRotation(float x, float y, float z)
+{
+	rot.x = x;
+	rot.y = y;
+	rot.z = z;
+	dirty = true;
+}
+
+void ModelInstance::SetScale(float s)
+{
+	scale = s;
+	dirty = true;
+}
+
+const float *ModelInstance::GetWorldMatrix()
+{
+	if (dirty)
+	{
+		Model_3DS::MakeMatrix(pos, rot, scale, world);
+		dirty = false;
+	}
+
+	return world;
+}
+
+void ModelInstance::GetWorldBounds(Model_3DS::Bounds &out)
+{
+	asset->GetWorldBounds(GetWorldMatrix(), out);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Drawing
+//////////////////////////////////////////////////////////////////////
+
+void ModelInstance::Draw(float distance)
+{
+	if (!visible || asset == NULL)
+		return;
+
+	glPushMatrix();
+
+		glMultMatrixf(GetWorldMatrix());
+
+		// The instance's scale counts toward how big the errors look
+		asset->DrawInstance(asset->SelectLod(distance, scale), lit);
+
+	glPopMatrix();
+}
@@ -0,0 +1,75 @@
+//////////////////////////////////////////////////////////////////////
+//
+// Model Instance Class
+//
+// ModelInstance.h: interface for the ModelInstance class.
+// A Model_3DS holds a mesh asset: the geometry, the materials
+// and the textures, loaded once. A ModelInstance is one copy of
+// it placed in the world, with its own position, rotation,
+// scale and flags. Any number of instances can share one asset,
+// so a level full of the same prop loads it once and keeps just
+// a few floats for each copy.
+//
+// Each instance keeps its world matrix and only rebuilds it when
+// the instance was moved, so Draw is a glMultMatrixf instead of
+// a translate, rotates and a scale every frame. The asset's own
+// pos, rot and scale still apply inside the instance's.
+//
+// Usage:
+// MeshAsset tree;
+// tree.Load("tree.3ds");
+//
+// ModelInstance a(&tree), b(&tree);
+// a.SetPosition(10.0f, 0.0f, 5.0f);
+// b.SetPosition(-4.0f, 0.0f, 8.0f);
+// b.SetRotation(0.0f, 90.0f, 0.0f);	// Degrees about x, y then z
+// b.SetScale(0.7f);
+//
+// // Draw picks the asset's level of detail for the distance
+// a.Draw(distance);
+//
+// // Where the instance is in the world, for culling and collisions
+// Model_3DS::Bounds bounds;
+// b.GetWorldBounds(bounds);
+//
+// // The flags are per instance too
+// b.visible = false;
+// b.lit = false;
+//
+//////////////////////////////////////////////////////////////////////
+
+#ifndef MODELINSTANCE_H
+#define MODELINSTANCE_H
+
+#include "Model_3DS.h"
+
+// The shared, loaded part of a model
+typedef Model_3DS MeshAsset;
+
+class ModelInstance
+{
+public:
+	MeshAsset *asset;		// The mesh this is a copy of, not owned
+	bool visible;			// True: Draw renders the instance
+	bool lit;				// True: the instance is lit
+
+	void SetPosition(float x, float y, float z);	// Moves the instance
+	void SetRotation(float x, float y, float z);	// Turns the instance, in degrees
+	void SetScale(float s);							// Sizes the instance
+	const Model_3DS::Vector &GetPosition() const { return pos; }
+	const Model_3DS::Vector &GetRotation() const { return rot; }
+	float GetScale() const { return scale; }
+	const float *GetWorldMatrix();					// The instance's matrix, column major
+	void GetWorldBounds(Model_3DS::Bounds &out);	// The box and sphere around the instance in the world
+	void Draw(float distance = 0.0f);				// Draws the asset here, distance picks the level of detail
+	ModelInstance(MeshAsset *asset = NULL);			// Constructor
+
+private:
+	Model_3DS::Vector pos;	// Where the instance is
+	Model_3DS::Vector rot;	// The angles the instance is turned by
+	float scale;			// The size of the instance
+	float world[16];		// The matrix made from pos, rot and scale
+	bool dirty;				// True: world has to be made again
+};
+
+#endif MODELINSTANCE_H
@@ -17,12 +17,13 @@
 // 2) If you want the face to be textured assign the
 //    texture to the Diffuse Color map
 // 3) The texture must be supported by the GLTexture class
-//    which only supports bitmap and targa right now
+//    which supports bitmap, targa, JPEG and PNG files
 // 4) The texture must be located in the same directory as
 //    the model
 //
 // Support for non-textured faces is done by reading the color
-// from the material's diffuse color.
+// from the material's diffuse color. They are drawn untextured
+// in that color, times the color the caller set.
 //
 // Some models have problems loading even if you follow all of
 // the restrictions I have stated and I don't know why. If you
@@ -38,6 +39,18 @@
 // m.Load("model.3ds"); // Load the model
 // m.Draw();			// Renders the model to the screen
 //
+// // Load is Decode followed by Finalize. Decode does all of the
+// // file reading and never touches OpenGL, so many models can be
+// // decoded on worker threads at once. Finalize creates the GL
+// // textures and has to run on the thread that owns the context.
+// m.Decode("model.3ds");	// On any thread
+// m.Finalize();			// On the GL thread
+//
+// // Until Finalize is done Draw doesn't render the model. Once
+// // the geometry is decoded and the model is marked decoded it
+// // draws a wire box around the model as a placeholder.
+// m.decoded = true;		// Set by the asset loader on the GL thread
+//
 // // If you want to show the model's normals
 // m.shownormals = true;
 //
@@ -66,6 +79,13 @@
 // m.Objects[0].pos.y = 0.0f;
 // m.Objects[0].pos.z = 0.0f;
 //
+// // The first Load of a model bakes its final geometry into
+// // "model.3ds.cache" next to it. Later loads map that file
+// // instead of parsing the 3ds file again. The cache is rebuilt
+// // whenever the 3ds file's size or time stamp changes. Set this
+// // before Load to always parse the 3ds file.
+// m.useCache = false;
+//
 //////////////////////////////////////////////////////////////////////
 
 // This is used to generate a warning from the compiler
@@ -75,13 +95,27 @@
 #define warn( x )  message( __FILE__LINE__ #x "\n" ) 
 
 // You need to uncomment this if you are using MFC
+#ifdef _MSC_VER
 #pragma warn( You need to uncomment this if you are using MFC )
+#endif
 //#include "stdafx.h"
 #include <string>
+#include <algorithm>
 #include "Model_3DS.h"
+#include "MeshKernels.h"
+#include "MeshSimplifier.h"
+#include "WorkerPool.h"
+#include "LoadStats.h"
 
 #include <math.h>			// Header file for the math library
+#include <float.h>			// Header file for the float limits
+#include <string.h>			// Header file for the string functions
+#include <sys/stat.h>		// Header file for the file time stamps
+#ifdef _WIN32
 #include <gl\gl.h>			// Header file for the OpenGL32 library
+#else
+#include <GL/gl.h>
+#endif
 
 // The chunk's id numbers
 #define MAIN3DS				0x4D4D
@@ -129,6 +163,67 @@
 #define PERC_INT			0x0030
 #define PERC_FLOAT			0x0031
 
+// The baked mesh cache
+#define CACHE_MAGIC			"M3DC"
+#define CACHE_VERSION		4
+#define CACHE_ALIGN			16
+
+// The cache file starts with this header. All offsets are from
+// the start of the file and every array starts CACHE_ALIGN aligned
+struct CacheHeader {
+	char magic[4];				// Always CACHE_MAGIC
+	unsigned int version;		// Always CACHE_VERSION
+	long long sourceSize;		// The size of the 3ds file the cache was baked from
+	long long sourceTime;		// The modification time of that 3ds file
+	unsigned int numMaterials;	// The number of CacheMaterial records after the header
+	unsigned int numObjects;	// The number of CacheObject records after the materials
+	unsigned int numMatFaces;	// The number of CacheMatFaces records after the objects
+	unsigned int fileSize;		// The size of the whole cache file
+	unsigned int optimized;		// True: the geometry went through OptimizeMeshes
+	int vertsBefore;			// The optimizer's stats
+	int vertsAfter;
+	int triangles;
+	float acmrBefore;
+	float acmrAfter;
+	unsigned int lods;			// True: the objects have their simplified levels
+};
+
+struct CacheMaterial {
+	char name[80];				// The material's name
+	char mapname[80];			// The material's texture file
+	unsigned char color[4];		// The material's diffuse color
+	unsigned int textured;		// Whether or not it is textured
+};
+
+struct CacheObject {
+	char name[80];				// The object's name
+	int numVerts;				// The number of vertices
+	int numTexCoords;			// The number of texture coordinates
+	int numFaces;				// The number of face indices
+	int numMatFaces;			// The number of material groups
+	unsigned int textured;		// True: the object has its own texture coordinates
+	float pos[3];				// The object's position
+	float rot[3];				// The object's rotation
+	unsigned int vertexes;		// Offset of the vertex array
+	unsigned int normals;		// Offset of the normal array
+	unsigned int texcoords;		// Offset of the texture coordinate array
+	unsigned int faces;			// Offset of the face index array
+	unsigned int firstMatFaces;	// The object's first CacheMatFaces record, each level's groups follow
+	int numLods;				// The number of simplified levels
+	float lodError[Model_3DS::MAX_LODS];	// How far each level moved the surface
+	Model_3DS::Bounds bounds;	// The box and sphere around the vertices
+};
+
+// The levels of detail
+#define LOD_ANGLE			0.001f	// The angle in radians a level's error may cover, about a pixel
+#define LOD_MIN_TRIS		64		// Meshes smaller than this aren't simplified any further
+
+struct CacheMatFaces {
+	int MatIndex;				// An index to the materials
+	int numSubFaces;			// The number of indices in the group
+	unsigned int subFaces;		// Offset of the group's index array
+};
+
 //////////////////////////////////////////////////////////////////////
 // Construction/Destruction
 //////////////////////////////////////////////////////////////////////
@@ -136,7 +231,33 @@
 Model_3DS::Model_3DS()
 {
 	// Initialization
+	Reset();
+}
+
+Model_3DS::Model_3DS(Model_3DS &&other)
+{
+	Reset();
+	Take(other);
+}
+
+Model_3DS &Model_3DS::operator=(Model_3DS &&other)
+{
+	if (this != &other)
+	{
+		Free();
+		Take(other);
+	}
+
+	return *this;
+}
+
+Model_3DS::~Model_3DS()
+{
+	Free();
+}
 
+void Model_3DS::Reset()
+{
 	// Don't show the normals by default
 	shownormals = false;
 
@@ -155,80 +276,309 @@ Model_3DS::Model_3DS()
 	rot.y = 0.0f;
 	rot.z = 0.0f;
 
-	// Set up the path
-	path = new char[80];
-	sprintf_s(path, sizeof(path), "");
+	// The name and path are set by Decode
+	modelname = NULL;
+	path = NULL;
 
 	// Zero out our counters for MFC
 	numObjects = 0;
 	numMaterials = 0;
+	totalVerts = 0;
+	totalFaces = 0;
+	Materials = NULL;
+	Objects = NULL;
+
+	// The arena is allocated once the file has been measured
+	arena = NULL;
+	arenaSize = 0;
+	arenaUsed = 0;
+
+	// We are only parsing while inside Load
+	pendingMatFaces = NULL;
 
 	// Set the scale to one
 	scale = 1.0f;
+
+	// Bake and reuse the mesh cache by default
+	useCache = true;
+
+	// Keep the meshes as the artist made them by default
+	optimize = false;
+	memset(&optimizeStats, 0, sizeof(optimizeStats));
+
+	// Only the full meshes by default
+	generateLods = false;
+	lodBias = 1.0f;
+	numLods = 0;
+	memset(lodError, 0, sizeof(lodError));
+	lodArena = NULL;
+
+	// Draw from the float arrays by default
+	packVertices = false;
+	packedArena = NULL;
+
+	// Draw the objects one by one by default
+	staticBatch = false;
+
+	// Make the textures while loading by default
+	lazyTextures = false;
+
+	// Every texture on its own by default
+	atlas = NULL;
+
+	// Load every object by default
+	objectFilter = ObjectFilter();
+	Batch = NULL;
+	batchArena = NULL;
+
+	// Nothing is loaded yet
+	decoded = false;
+	ready = false;
+	finalizedMaterials = 0;
+	memset(&bounds, 0, sizeof(bounds));
 }
 
-Model_3DS::~Model_3DS()
+void Model_3DS::Take(Model_3DS &other)
+{
+	// The settings
+	shownormals = other.shownormals;
+	lit = other.lit;
+	visible = other.visible;
+	pos = other.pos;
+	rot = other.rot;
+	scale = other.scale;
+	useCache = other.useCache;
+	optimize = other.optimize;
+	optimizeStats = other.optimizeStats;
+	generateLods = other.generateLods;
+	lodBias = other.lodBias;
+	numLods = other.numLods;
+	memcpy(lodError, other.lodError, sizeof(lodError));
+	lodArena = other.lodArena;
+	packVertices = other.packVertices;
+	packedArena = other.packedArena;
+	staticBatch = other.staticBatch;
+	lazyTextures = other.lazyTextures;
+	atlas = other.atlas;
+	objectFilter = std::move(other.objectFilter);
+	Batch = other.Batch;
+	batchArena = other.batchArena;
+
+	// The model itself
+	modelname = other.modelname;
+	path = other.path;
+	numObjects = other.numObjects;
+	numMaterials = other.numMaterials;
+	totalVerts = other.totalVerts;
+	totalFaces = other.totalFaces;
+	Materials = other.Materials;
+	Objects = other.Objects;
+	arena = other.arena;
+	arenaSize = other.arenaSize;
+	arenaUsed = other.arenaUsed;
+	bin3ds = std::move(other.bin3ds);
+	cache = std::move(other.cache);
+
+	// How far it is loaded
+	decoded = other.decoded;
+	ready = other.ready;
+	finalizedMaterials = other.finalizedMaterials;
+	bounds = other.bounds;
+
+	// other doesn't own any of it anymore
+	other.Reset();
+}
+
+void Model_3DS::Free()
+{
+	// The textures belong to the cache and the atlas
+	FreeArrays();
+
+	// Delete the texture files no other model uses
+	TextureCache::Shared().Purge();
+
+	bin3ds.Close();
+
+	delete [] modelname;
+	delete [] path;
+	modelname = NULL;
+	path = NULL;
+}
+
+void Model_3DS::FreeArrays()
+{
+	// The shared textures wait for a Purge on the GL thread
+	for (int i = 0; i < numMaterials; i++)
+		TextureCache::Shared().Release(Materials[i].shared);
+
+	delete [] Materials;
+	Materials = NULL;
+	numMaterials = 0;
+
+	// Everything else lives in the arena or the cache
+	delete [] arena;
+	arena = NULL;
+	arenaSize = 0;
+	arenaUsed = 0;
+	Objects = NULL;
+	numObjects = 0;
+	totalVerts = 0;
+	totalFaces = 0;
+
+	cache.Close();
+	memset(&optimizeStats, 0, sizeof(optimizeStats));
+
+	// The levels of detail are made after the arena is full
+	delete [] lodArena;
+	lodArena = NULL;
+	numLods = 0;
+	memset(lodError, 0, sizeof(lodError));
+
+	delete [] packedArena;
+	packedArena = NULL;
+
+	delete [] batchArena;
+	batchArena = NULL;
+	Batch = NULL;
+
+	decoded = false;
+	ready = false;
+	finalizedMaterials = 0;
+}
+
+// Every arena allocation starts 16 byte aligned
+static size_t ArenaAlign(size_t bytes)
+{
+	return (bytes + 15) & ~(size_t)15;
+}
+
+void *Model_3DS::ArenaAlloc(size_t bytes)
 {
+	bytes = ArenaAlign(bytes);
 
+	// The measure pass should have made room for everything
+	if (arena == NULL || bytes > arenaSize - arenaUsed)
+		return NULL;
+
+	void *p = arena + arenaUsed;
+	arenaUsed += bytes;
+	return p;
 }
 
 void Model_3DS::Load(char *name)
 {
+	if (Decode(name))
+		Finalize();
+}
+
+bool Model_3DS::Decode(const char *name)
+{
+	LOADSTATS_FILE(name);
+	LOADSTATS_SCOPE("decode", 0);
+
 	// holds the main chunk header
 	ChunkHeader main;
 
-	// strip "'s
-	if (strstr(name, "\""))
-		name = strtok(name, "\"");
+	// Drop whatever was loaded before. The GL textures are only freed
+	// by Free, Decode may be running on a thread without a GL context
+	FreeArrays();
+	delete [] modelname;
+	delete [] path;
+	modelname = NULL;
+	path = NULL;
+
+	// Keep our own copy of the name with the "'s stripped
+	char *copy = new char[strlen(name) + 1];
+	char *dst = copy;
+
+	for (const char *src = name; *src; src++)
+	{
+		if (*src != '"')
+			*dst++ = *src;
+	}
+
+	*dst = 0;
+	name = copy;
 
 	// Find the path
-	if (strstr(name, "/") || strstr(name, "\\"))
+	const char *slash = strrchr(name, '/');
+	const char *backslash = strrchr(name, '\\');
+
+	if (backslash > slash)
+		slash = backslash;
+
+	// Allocate space for the path and its trailing separator
+	size_t pathlen = slash ? slash - name + 1 : 0;
+	path = new char[pathlen + 1];
+
+	// Copy the path into path
+	memcpy (path, name, pathlen);
+	path[pathlen] = 0;
+
+	// For future reference
+	modelname = copy;
+
+	// Use the baked geometry if it is still good. It holds every
+	// object, so a filtered load always parses the file
+	bool cached = useCache && !objectFilter;
+
+	if (!cached || !LoadCache(name))
 	{
-		// Holds the name of the model minus the path
-		char *temp;
+		// Map the whole file, if we can't there is nothing to load
+		if (!bin3ds.Open(name))
+			return false;
 
-		// Find the name without the path
-		if (strstr(name, "/"))
-			temp = strrchr(name, '/');
-		else
-			temp = strrchr(name, '\\');
+		LOADSTATS_BYTES(bin3ds.size);
 
-		// Allocate space for the path
-		path = new char[strlen(name)-strlen(temp)+1];
+		// The cursor that walks the whole file
+		Chunk file(bin3ds.data, bin3ds.data + bin3ds.size);
+		Chunk data(NULL, NULL);
 
-		// Get a pointer to the end of the path and name
-		char *src = name + strlen(name) - 1;
+		// Load the Main Chunk's header and start Processing
+		if (file.NextChunk(main, data))
+			MainChunkProcessor(data);
 
-		// Back up until a \ or the start
-		while (src != path && !((*(src-1)) == '\\' || (*(src-1)) == '/'))
-			src--;
+		// Don't need the file anymore so unmap it
+		bin3ds.Close();
 
-		// Copy the path into path
-		memcpy (path, name, src-name);
-		path[src-name] = 0;
-	}
+		// Calculate the vertex normals
+		CalculateNormals();
 
-	// Load the file
-	bin3ds = fopen(name,"rb");
+		// If the object doesn't have any texcoords generate some
+		for (int k = 0; k < numObjects; k++)
+		{
+			if (Objects[k].numTexCoords == 0)
+			{
+				// Take an array to hold the texture coordinates, the measure pass made room
+				Objects[k].TexCoords = (GLfloat *)ArenaAlloc(Objects[k].numVerts * 2 * sizeof(GLfloat));
 
-	// Make sure we are at the beginning
-	fseek(bin3ds, 0, SEEK_SET);
+				if (Objects[k].TexCoords == NULL)
+					continue;
 
-	// Load the Main Chunk's header
-	fread(&main.id,sizeof(main.id),1,bin3ds);
-    fread(&main.len,sizeof(main.len),1,bin3ds);
+				// Set the number of texture coords
+				Objects[k].numTexCoords = Objects[k].numVerts;
 
-	// Start Processing
-	MainChunkProcessor(main.len, ftell(bin3ds));
+				// Make some texture coords
+				for (int m = 0; m < Objects[k].numTexCoords; m++)
+				{
+					Objects[k].TexCoords[2*m] = Objects[k].Vertexes[3*m];
+					Objects[k].TexCoords[2*m+1] = Objects[k].Vertexes[3*m+1];
+				}
+			}
+		}
 
-	// Don't need the file anymore so close it
-	fclose(bin3ds);
+		// Weld and reorder for the vertex cache
+		if (optimize)
+			OptimizeMeshes();
 
-	// Calculate the vertex normals
-	CalculateNormals();
+		// Make the simplified levels from the final meshes
+		if (generateLods)
+			BuildLods();
 
-	// For future reference
-	modelname = name;
+		// Next time we can skip all of the above
+		if (cached)
+			SaveCache(name);
+	}
 
 	// Find the total number of faces and vertices
 	totalFaces = 0;
@@ -240,875 +590,2759 @@ void Model_3DS::Load(char *name)
 		totalVerts += Objects[i].numVerts;
 	}
 
-	// If the object doesn't have any texcoords generate some
-	for (int k = 0; k < numObjects; k++)
+	// The objects' bounds came with their vertices, the model's follow
+	// from them. Draw also shows the box while the textures load
+	UpdateBounds();
+
+	// Move the small textures onto the atlas before anything copies
+	// the texture coordinates
+	if (atlas && !lazyTextures)
+		AtlasTextures();
+
+	// Merge the objects by material once their faces are final
+	if (staticBatch)
+		BuildBatch();
+
+	// The stream Draw reads, from the final arrays whichever way they came
+	if (packVertices)
+		PackVertices();
+
+	// Only the materials the faces use get a texture
+	MarkReferencedMaterials();
+
+	// Read the texture files, they get uploaded in Finalize. Lazy
+	// models read them when they are first drawn.
+	if (!lazyTextures)
+		DecodeTextures();
+
+	return true;
+}
+
+void Model_3DS::MarkReferencedMaterials()
+{
+	for (int j = 0; j < numMaterials; j++)
+	{
+		Materials[j].referenced = false;
+		Materials[j].loaded = false;
+	}
+
+	// The levels of detail only use materials the full mesh does
+	for (int i = 0; i < numObjects; i++)
 	{
-		if (Objects[k].numTexCoords == 0)
+		for (int j = 0; j < Objects[i].numMatFaces; j++)
 		{
-			// Set the number of texture coords
-			Objects[k].numTexCoords = Objects[k].numVerts;
+			const MaterialFaces &g = Objects[i].MatFaces[j];
 
-			// Allocate an array to hold the texture coordinates
-			Objects[k].TexCoords = new GLfloat[Objects[k].numTexCoords * 2];
-
-			// Make some texture coords
-			for (int m = 0; m < Objects[k].numTexCoords; m++)
-			{
-				Objects[k].TexCoords[2*m] = Objects[k].Vertexes[3*m];
-				Objects[k].TexCoords[2*m+1] = Objects[k].Vertexes[3*m+1];
-			}
+			if (g.numSubFaces > 0 && g.MatIndex >= 0 && g.MatIndex < numMaterials)
+				Materials[g.MatIndex].referenced = true;
 		}
 	}
+}
 
-	// Let's build simple colored textures for the materials w/o a texture
+void Model_3DS::DecodeTextures()
+{
 	for (int j = 0; j < numMaterials; j++)
 	{
-		if (Materials[j].textured == false)
-		{
-			unsigned char r = Materials[j].color.r;
-			unsigned char g = Materials[j].color.g;
-			unsigned char b = Materials[j].color.b;
-			Materials[j].tex.BuildColorTexture(r, g, b);
-			Materials[j].textured = true;
-		}
+		if (Materials[j].referenced)
+			DecodeMaterial(j);
 	}
 }
 
-void Model_3DS::Draw()
+void Model_3DS::DecodeMaterial(int index)
 {
-	if (visible)
+	Material &m = Materials[index];
+
+	if (m.textured && m.shared == NULL && m.atlasPage < 0)
 	{
-	glPushMatrix();
+		// Load the texture from the model's directory, or share it
+		// with whoever loaded the same file before
+		char fullname[160];
+		sprintf(fullname, "%s%s", path, m.mapname);
+		m.shared = TextureCache::Shared().Acquire(fullname);
+	}
+}
 
-		// Move the model
-		glTranslatef(pos.x, pos.y, pos.z);
+void Model_3DS::AtlasTextures()
+{
+	LOADSTATS_SCOPE("atlas", 0);
 
-		// Rotate the model
-		glRotatef(rot.x, 1.0f, 0.0f, 0.0f);
-		glRotatef(rot.y, 0.0f, 1.0f, 0.0f);
-		glRotatef(rot.z, 0.0f, 0.0f, 1.0f);
+	// The texture coordinates each material's faces reach, over every
+	// level. A vertex drawn with two materials can't move for either
+	std::vector<float> lo(numMaterials * 2, FLT_MAX);
+	std::vector<float> hi(numMaterials * 2, -FLT_MAX);
+	std::vector<bool> fits(numMaterials);
+	std::vector<std::vector<int> > owner(numObjects);
 
-		glScalef(scale, scale, scale);
+	for (int j = 0; j < numMaterials; j++)
+		fits[j] = Materials[j].textured;
 
-		// Loop through the objects
-		for (int i = 0; i < numObjects; i++)
+	for (int i = 0; i < numObjects; i++)
+	{
+		const Object &obj = Objects[i];
+
+		owner[i].assign(obj.numVerts, -1);
+
+		for (int lod = 0; lod <= obj.numLods; lod++)
 		{
-			// Enable texture coordiantes, normals, and vertices arrays
-			if (Objects[i].textured)
-				glEnableClientState(GL_TEXTURE_COORD_ARRAY);
-			if (lit)
-				glEnableClientState(GL_NORMAL_ARRAY);
-			glEnableClientState(GL_VERTEX_ARRAY);
-
-			// Point them to the objects arrays
-			if (Objects[i].textured)
-				glTexCoordPointer(2, GL_FLOAT, 0, Objects[i].TexCoords);
-			if (lit)
-				glNormalPointer(GL_FLOAT, 0, Objects[i].Normals);
-			glVertexPointer(3, GL_FLOAT, 0, Objects[i].Vertexes);
-
-			// Loop through the faces as sorted by material and draw them
-			for (int j = 0; j < Objects[i].numMatFaces; j ++)
+			const MaterialFaces *faces = obj.Lod(lod);
+
+			for (int j = 0; j < obj.numMatFaces; j++)
 			{
-				// Use the material's texture
-				Materials[Objects[i].MatFaces[j].MatIndex].tex.Use();
+				int mat = faces[j].MatIndex;
+
+				if (mat < 0 || mat >= numMaterials)
+					continue;
+
+				for (int k = 0; k < faces[j].numSubFaces; k++)
+				{
+					int v = faces[j].subFaces[k];
+					int &o = owner[i][v];
 
-				glPushMatrix();
+					if (v >= obj.numTexCoords)
+					{
+						fits[mat] = false;
+						continue;
+					}
 
-					// Move the model
-					glTranslatef(Objects[i].pos.x, Objects[i].pos.y, Objects[i].pos.z);
+					if (o >= 0 && o != mat)
+						fits[mat] = fits[o] = false;
 
-					glRotatef(Objects[i].rot.z, 0.0f, 0.0f, 1.0f);
-					glRotatef(Objects[i].rot.y, 0.0f, 1.0f, 0.0f);
-					glRotatef(Objects[i].rot.x, 1.0f, 0.0f, 0.0f);
+					o = mat;
 
-					// Draw the faces using an index to the vertex array
-					glDrawElements(GL_TRIANGLES, Objects[i].MatFaces[j].numSubFaces, GL_UNSIGNED_SHORT, Objects[i].MatFaces[j].subFaces);
+					for (int c = 0; c < 2; c++)
+					{
+						float t = obj.TexCoords[v * 2 + c];
 
-				glPopMatrix();
+						lo[mat * 2 + c] = t < lo[mat * 2 + c] ? t : lo[mat * 2 + c];
+						hi[mat * 2 + c] = t > hi[mat * 2 + c] ? t : hi[mat * 2 + c];
+					}
+				}
 			}
+		}
+	}
+
+	// Faces that stay within one copy of the texture go in, moved
+	// back to the first copy if they use another one
+	std::vector<float> shift(numMaterials * 2, 0.0f);
+	std::vector<TextureAtlas::Region> regions(numMaterials);
+
+	for (int j = 0; j < numMaterials; j++)
+	{
+		Material &m = Materials[j];
+
+		if (!fits[j] || lo[j * 2] > hi[j * 2])
+			continue;
+
+		float cutlo[2], cuthi[2];
+
+		for (int c = 0; c < 2; c++)
+		{
+			shift[j * 2 + c] = floorf(lo[j * 2 + c]);
+			cutlo[c] = lo[j * 2 + c] - shift[j * 2 + c];
+			cuthi[c] = hi[j * 2 + c] - shift[j * 2 + c];
 
-			// Show the normals?
-			if (shownormals)
+			if (cuthi[c] > 1.001f)
+				fits[j] = false;
+		}
+
+		char fullname[160];
+		sprintf(fullname, "%s%s", path, m.mapname);
+
+		if (fits[j] && atlas->Place(fullname, cutlo, cuthi, regions[j]))
+			m.atlasPage = regions[j].page;
+	}
+
+	// Move the coordinates into the page
+	for (int i = 0; i < numObjects; i++)
+	{
+		Object &obj = Objects[i];
+
+		for (int v = 0; v < obj.numVerts; v++)
+		{
+			int mat = owner[i][v];
+
+			if (mat < 0 || Materials[mat].atlasPage < 0)
+				continue;
+
+			const TextureAtlas::Region &r = regions[mat];
+
+			for (int c = 0; c < 2; c++)
 			{
-				// Loop through the vertices and normals and draw the normal
-				for (int k = 0; k < Objects[i].numVerts * 3; k += 3)
-				{
-					// Disable texturing
-					glDisable(GL_TEXTURE_2D);
-					// Disbale lighting if the model is lit
-					if (lit)
-						glDisable(GL_LIGHTING);
-					// Draw the normals blue
-					glColor3f(0.0f, 0.0f, 1.0f);
-
-					// Draw a line between the vertex and the end of the normal
-					glBegin(GL_LINES);
-						glVertex3f(Objects[i].Vertexes[k], Objects[i].Vertexes[k+1], Objects[i].Vertexes[k+2]);
-						glVertex3f(Objects[i].Vertexes[k]+Objects[i].Normals[k], Objects[i].Vertexes[k+1]+Objects[i].Normals[k+1], Objects[i].Vertexes[k+2]+Objects[i].Normals[k+2]);
-					glEnd();
-
-					// Reset the color to white
-					glColor3f(1.0f, 1.0f, 1.0f);
-					// If the model is lit then renable lighting
-					if (lit)
-						glEnable(GL_LIGHTING);
-				}
+				float &t = obj.TexCoords[v * 2 + c];
+				t = r.offset[c] + (t - shift[mat * 2 + c]) * r.scale[c];
 			}
 		}
+	}
+}
 
-	glPopMatrix();
+void Model_3DS::LoadMaterial(int index)
+{
+	Material &m = Materials[index];
+
+	if (m.loaded)
+		return;
+
+	// The color textures don't have a file of their own
+	LOADSTATS_FILE(modelname);
+
+	if (m.atlasPage >= 0)
+	{
+		// Upload the page unless it is up to date
+		atlas->Upload(m.atlasPage);
+
+		m.tex.texture[0] = atlas->Texture(m.atlasPage);
 	}
+	else if (m.textured)
+	{
+		// A lazy model hasn't read the file yet
+		if (m.shared == NULL)
+			DecodeMaterial(index);
+
+		// Hand the decoded texture to GL unless it was already
+		TextureCache::Shared().Upload(m.shared);
+
+		const GLTexture &t = m.shared->tex;
+		m.tex.texture[0] = t.texture[0];
+		m.tex.width = t.width;
+		m.tex.height = t.height;
+		m.tex.format = t.format;
+	}
+
+	// The materials w/o a texture are drawn with their color, they
+	// don't need anything from GL
+
+	// Even if the file couldn't be read, so Draw doesn't try every frame
+	m.loaded = true;
 }
 
-void Model_3DS::CalculateNormals()
+void Model_3DS::PreloadTextures()
 {
-	// Let's build some normals
-	for (int i = 0; i < numObjects; i++)
+	for (int j = 0; j < numMaterials; j++)
+	{
+		if (Materials[j].referenced)
+			LoadMaterial(j);
+	}
+}
+
+void Model_3DS::Finalize()
+{
+	size_t budget = (size_t)-1;
+
+	// All of it now, a page the atlas hasn't built yet is built here
+	FinalizeMaterials(budget, false);
+}
+
+bool Model_3DS::FinalizeSome(size_t &budget)
+{
+	return FinalizeMaterials(budget, true);
+}
+
+bool Model_3DS::FinalizeMaterials(size_t &budget, bool wait)
+{
+	// Finalize means the geometry is ours to read
+	decoded = true;
+
+	for (; finalizedMaterials < numMaterials && budget > 0; finalizedMaterials++)
+	{
+		Material &m = Materials[finalizedMaterials];
+
+		// Nothing draws it, or Draw makes it once something does
+		if (!m.referenced || lazyTextures)
+			continue;
+
+		// A worker builds the page once every model on it placed its
+		// textures, a later frame picks it up from here
+		if (wait && m.atlasPage >= 0 && !atlas->UploadReady(m.atlasPage))
+			break;
+
+		// Count what the upload costs against the budget, a texture
+		// another model already uploaded costs nothing
+		if ((m.shared && m.shared->tex.texture[0] == 0) || m.atlasPage >= 0)
+		{
+			size_t bytes = m.atlasPage >= 0 ? atlas->UploadBytes(m.atlasPage) : m.shared->imageBytes;
+
+			budget = (bytes >= budget) ? 0 : budget - bytes;
+		}
+
+		LoadMaterial(finalizedMaterials);
+	}
+
+	ready = (finalizedMaterials == numMaterials);
+	return ready;
+}
+
+// The matrix helpers work like their GL namesakes: they multiply m
+// on the right, matrices are column major
+static void MatrixMultiply(float *m, const float *r)
+{
+	float out[16];
+
+	for (int c = 0; c < 4; c++)
 	{
-		for (int g = 0; g < Objects[i].numVerts; g++)
+		for (int row = 0; row < 4; row++)
 		{
-			// Reduce each vert's normal to unit
-			float length;
-			Vector unit;
+			out[c * 4 + row] = m[row] * r[c * 4] + m[4 + row] * r[c * 4 + 1] +
+				m[8 + row] * r[c * 4 + 2] + m[12 + row] * r[c * 4 + 3];
+		}
+	}
+
+	memcpy(m, out, sizeof(out));
+}
+
+static void MatrixIdentity(float *m)
+{
+	memset(m, 0, 16 * sizeof(float));
+	m[0] = m[5] = m[10] = m[15] = 1.0f;
+}
+
+static void MatrixTranslate(float *m, float x, float y, float z)
+{
+	float t[16];
+
+	MatrixIdentity(t);
+	t[12] = x;
+	t[13] = y;
+	t[14] = z;
+	MatrixMultiply(m, t);
+}
+
+static void MatrixScale(float *m, float x, float y, float z)
+{
+	float s[16];
+
+	MatrixIdentity(s);
+	s[0] = x;
+	s[5] = y;
+	s[10] = z;
+	MatrixMultiply(m, s);
+}
+
+// Rotates about one of the axes, 0 is x, 1 is y and 2 is z
+static void MatrixRotate(float *m, float degrees, int axis)
+{
+	if (degrees == 0.0f)
+		return;
+
+	float r[16];
+	float a = degrees * 3.14159265f / 180.0f;
+	float c = cosf(a), s = sinf(a);
+	int u = (axis + 1) % 3, v = (axis + 2) % 3;
+
+	MatrixIdentity(r);
+	r[u * 4 + u] = c;
+	r[u * 4 + v] = s;
+	r[v * 4 + u] = -s;
+	r[v * 4 + v] = c;
+	MatrixMultiply(m, r);
+}
+
+// The object's own move and turn, the way DrawLevel applies them
+static void ObjectMatrix(const Model_3DS::Object &obj, float *m)
+{
+	MatrixIdentity(m);
+	MatrixTranslate(m, obj.pos.x, obj.pos.y, obj.pos.z);
+	MatrixRotate(m, obj.rot.z, 2);
+	MatrixRotate(m, obj.rot.y, 1);
+	MatrixRotate(m, obj.rot.x, 0);
+}
+
+void Model_3DS::MakeMatrix(const Vector &pos, const Vector &rot, float scale, float matrix[16])
+{
+	MatrixIdentity(matrix);
+	MatrixTranslate(matrix, pos.x, pos.y, pos.z);
+	MatrixRotate(matrix, rot.x, 0);
+	MatrixRotate(matrix, rot.y, 1);
+	MatrixRotate(matrix, rot.z, 2);
+	MatrixScale(matrix, scale, scale, scale);
+}
+
+void Model_3DS::GetModelMatrix(float matrix[16])
+{
+	MakeMatrix(pos, rot, scale, matrix);
+}
+
+void Model_3DS::TransformBounds(const Bounds &in, const float *matrix, Bounds &out)
+{
+	const float *m = matrix;
+	float c[3] = { (in.min.x + in.max.x) * 0.5f, (in.min.y + in.max.y) * 0.5f, (in.min.z + in.max.z) * 0.5f };
+	float e[3] = { (in.max.x - in.min.x) * 0.5f, (in.max.y - in.min.y) * 0.5f, (in.max.z - in.min.z) * 0.5f };
+	float s[3] = { in.center.x, in.center.y, in.center.z };
+	float nc[3], ne[3], ns[3];
+	float stretch = 0.0f;
+
+	// The box's center moves, its half size is spread over the new
+	// axes by the absolute values of the matrix (Arvo's method)
+	for (int row = 0; row < 3; row++)
+	{
+		nc[row] = m[12 + row];
+		ns[row] = m[12 + row];
+		ne[row] = 0.0f;
+
+		for (int k = 0; k < 3; k++)
+		{
+			nc[row] += m[k * 4 + row] * c[k];
+			ns[row] += m[k * 4 + row] * s[k];
+			ne[row] += fabsf(m[k * 4 + row]) * e[k];
+		}
+	}
+
+	// The sphere grows by the most the matrix stretches any direction,
+	// the root of the largest eigenvalue of M^T M. A scale after a turn
+	// can stretch more than any one axis, so the columns aren't enough.
+	double a[3][3];
+
+	for (int i = 0; i < 3; i++)
+	{
+		for (int j = 0; j < 3; j++)
+			a[i][j] = (double)m[i * 4] * m[j * 4] + (double)m[i * 4 + 1] * m[j * 4 + 1] + (double)m[i * 4 + 2] * m[j * 4 + 2];
+	}
+
+	double off = a[0][1] * a[0][1] + a[0][2] * a[0][2] + a[1][2] * a[1][2];
+	double q = (a[0][0] + a[1][1] + a[2][2]) / 3.0;
+	double p2 = (a[0][0] - q) * (a[0][0] - q) + (a[1][1] - q) * (a[1][1] - q) + (a[2][2] - q) * (a[2][2] - q) + 2.0 * off;
+
+	if (p2 <= 1e-20 * q * q)
+		stretch = (float)q;
+	else
+	{
+		// The closed form for the eigenvalues of a symmetric 3x3 matrix
+		double p = sqrt(p2 / 6.0);
+		double b[3][3];
+
+		for (int i = 0; i < 3; i++)
+		{
+			for (int j = 0; j < 3; j++)
+				b[i][j] = (a[i][j] - (i == j ? q : 0.0)) / p;
+		}
+
+		double r = (b[0][0] * (b[1][1] * b[2][2] - b[1][2] * b[2][1]) -
+			b[0][1] * (b[1][0] * b[2][2] - b[1][2] * b[2][0]) +
+			b[0][2] * (b[1][0] * b[2][1] - b[1][1] * b[2][0])) * 0.5;
+
+		r = r < -1.0 ? -1.0 : (r > 1.0 ? 1.0 : r);
+		stretch = (float)(q + 2.0 * p * cos(acos(r) / 3.0));
+	}
+
+	out.min.x = nc[0] - ne[0];
+	out.min.y = nc[1] - ne[1];
+	out.min.z = nc[2] - ne[2];
+	out.max.x = nc[0] + ne[0];
+	out.max.y = nc[1] + ne[1];
+	out.max.z = nc[2] + ne[2];
+	out.center.x = ns[0];
+	out.center.y = ns[1];
+	out.center.z = ns[2];
+	out.radius = in.radius * sqrtf(stretch);
+}
+
+void Model_3DS::GetWorldBounds(const float *instance, Bounds &out)
+{
+	float m[16];
+
+	if (instance)
+		memcpy(m, instance, sizeof(m));
+	else
+		MatrixIdentity(m);
+
+	float model[16];
+
+	GetModelMatrix(model);
+	MatrixMultiply(m, model);
+	TransformBounds(bounds, m, out);
+}
+
+void Model_3DS::GetObjectWorldBounds(int objindex, const float *instance, Bounds &out)
+{
+	float m[16];
+
+	if (instance)
+		memcpy(m, instance, sizeof(m));
+	else
+		MatrixIdentity(m);
+
+	float model[16], object[16];
+
+	GetModelMatrix(model);
+	ObjectMatrix(Objects[objindex], object);
+	MatrixMultiply(m, model);
+	MatrixMultiply(m, object);
+	TransformBounds(Objects[objindex].bounds, m, out);
+}
+
+void Model_3DS::UpdateBounds()
+{
+	LOADSTATS_SCOPE("bounds", 0);
+
+	bool first = true;
+
+	memset(&bounds, 0, sizeof(bounds));
+
+	// The box around the objects' boxes, moved the way they are drawn
+	std::vector<Bounds> moved(numObjects);
+
+	for (int i = 0; i < numObjects; i++)
+	{
+		float m[16];
+
+		if (Objects[i].numVerts == 0)
+			continue;
+
+		ObjectMatrix(Objects[i], m);
+		TransformBounds(Objects[i].bounds, m, moved[i]);
+
+		const Bounds &b = moved[i];
+
+		if (first)
+		{
+			bounds.min = b.min;
+			bounds.max = b.max;
+			first = false;
+			continue;
+		}
+
+		if (b.min.x < bounds.min.x) bounds.min.x = b.min.x;
+		if (b.min.y < bounds.min.y) bounds.min.y = b.min.y;
+		if (b.min.z < bounds.min.z) bounds.min.z = b.min.z;
+		if (b.max.x > bounds.max.x) bounds.max.x = b.max.x;
+		if (b.max.y > bounds.max.y) bounds.max.y = b.max.y;
+		if (b.max.z > bounds.max.z) bounds.max.z = b.max.z;
+	}
+
+	// A sphere from the middle of the box that holds every object's sphere
+	bounds.center.x = (bounds.min.x + bounds.max.x) * 0.5f;
+	bounds.center.y = (bounds.min.y + bounds.max.y) * 0.5f;
+	bounds.center.z = (bounds.min.z + bounds.max.z) * 0.5f;
+
+	for (int i = 0; i < numObjects; i++)
+	{
+		if (Objects[i].numVerts == 0)
+			continue;
+
+		const Bounds &b = moved[i];
+		float dx = b.center.x - bounds.center.x;
+		float dy = b.center.y - bounds.center.y;
+		float dz = b.center.z - bounds.center.z;
+		float r = sqrtf(dx * dx + dy * dy + dz * dz) + b.radius;
+
+		if (r > bounds.radius)
+			bounds.radius = r;
+	}
+}
+
+void Model_3DS::DrawPlaceholder()
+{
+	// The twelve edges of the box
+	static const int edges[12][2] = {
+		{0,1}, {1,3}, {3,2}, {2,0},
+		{4,5}, {5,7}, {7,6}, {6,4},
+		{0,4}, {1,5}, {2,6}, {3,7}
+	};
+
+	glPushAttrib(GL_ENABLE_BIT | GL_CURRENT_BIT);
+
+	glDisable(GL_TEXTURE_2D);
+	glDisable(GL_LIGHTING);
+	glColor3f(0.5f, 0.5f, 0.5f);
+
+	glBegin(GL_LINES);
+		for (int e = 0; e < 12; e++)
+		{
+			for (int k = 0; k < 2; k++)
+			{
+				int c = edges[e][k];
+				glVertex3f((c & 1) ? bounds.max.x : bounds.min.x,
+						   (c & 2) ? bounds.max.y : bounds.min.y,
+						   (c & 4) ? bounds.max.z : bounds.min.z);
+			}
+		}
+	glEnd();
+
+	glPopAttrib();
+}
+
+void Model_3DS::Draw()
+{
+	DrawLevel(0, lit);
+}
+
+void Model_3DS::Draw(float distance, float size)
+{
+	DrawLevel(SelectLod(distance, size), lit);
+}
+
+void Model_3DS::DrawInstance(int lod, bool lighting)
+{
+	DrawLevel(lod, lighting);
+}
+
+int Model_3DS::SelectLod(float distance, float size)
+{
+	// Up close, or nothing to pick from
+	if (numLods == 0 || distance <= 0.0f)
+		return 0;
+
+	// The coarsest level whose error still looks smaller than a pixel
+	float allowed = distance * LOD_ANGLE;
+	float worldScale = scale * size * lodBias;
+
+	for (int lod = numLods; lod > 0; lod--)
+	{
+		if (lodError[lod - 1] * worldScale <= allowed)
+			return lod;
+	}
+
+	return 0;
+}
+
+void Model_3DS::DrawLevel(int lod, bool lighting)
+{
+	// Nothing to draw until the loader hands us the geometry
+	if (!decoded)
+		return;
+
+	if (visible)
+	{
+	glPushMatrix();
+
+		// Move the model
+		glTranslatef(pos.x, pos.y, pos.z);
+
+		// Rotate the model
+		glRotatef(rot.x, 1.0f, 0.0f, 0.0f);
+		glRotatef(rot.y, 0.0f, 1.0f, 0.0f);
+		glRotatef(rot.z, 0.0f, 0.0f, 1.0f);
+
+		glScalef(scale, scale, scale);
+
+		// Just show where the model will be while its textures load
+		if (!ready)
+		{
+			DrawPlaceholder();
+			glPopMatrix();
+			return;
+		}
+
+		// The batch has every object's faces, or draw the objects one by one
+		if (Batch)
+			DrawObject(*Batch, lod, lighting);
+		else
+		{
+			for (int i = 0; i < numObjects; i++)
+				DrawObject(Objects[i], lod, lighting);
+		}
+
+	glPopMatrix();
+	}
+}
+
+void Model_3DS::DrawObject(const Object &obj, int lod, bool lighting)
+{
+	PackedVertex *packed = obj.Packed;
+
+	// Enable texture coordiantes, normals, and vertices arrays
+	if (obj.textured)
+		glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+	if (lighting)
+		glEnableClientState(GL_NORMAL_ARRAY);
+	glEnableClientState(GL_VERTEX_ARRAY);
+
+	// Point them to the objects arrays
+	if (packed)
+	{
+		// All three come from the one stream
+		if (obj.textured)
+			glTexCoordPointer(2, GL_SHORT, sizeof(PackedVertex), packed->uv);
+		if (lighting)
+			glNormalPointer(GL_SHORT, sizeof(PackedVertex), packed->normal);
+		glVertexPointer(3, GL_SHORT, sizeof(PackedVertex), packed->pos);
+
+		// The texture matrix scales the texture coordinates back
+		if (obj.textured)
+		{
+			glMatrixMode(GL_TEXTURE);
+			glPushMatrix();
+			glTranslatef(obj.uvOffset[0], obj.uvOffset[1], 0.0f);
+			glScalef(obj.uvScale[0], obj.uvScale[1], 1.0f);
+			glMatrixMode(GL_MODELVIEW);
+		}
+	}
+	else
+	{
+		if (obj.textured)
+			glTexCoordPointer(2, GL_FLOAT, 0, obj.TexCoords);
+		if (lighting)
+			glNormalPointer(GL_FLOAT, 0, obj.Normals);
+		glVertexPointer(3, GL_FLOAT, 0, obj.Vertexes);
+	}
+
+	// The faces of the level we are drawing
+	MaterialFaces *faces = obj.Lod(lod);
+
+	// The object's transform is the same for all of its faces
+	glPushMatrix();
+
+		// Move the model
+		glTranslatef(obj.pos.x, obj.pos.y, obj.pos.z);
+
+		glRotatef(obj.rot.z, 0.0f, 0.0f, 1.0f);
+		glRotatef(obj.rot.y, 0.0f, 1.0f, 0.0f);
+		glRotatef(obj.rot.x, 1.0f, 0.0f, 0.0f);
+
+		// Scale the packed positions back
+		if (packed)
+		{
+			glTranslatef(obj.packOffset.x, obj.packOffset.y, obj.packOffset.z);
+			glScalef(obj.packScale.x, obj.packScale.y, obj.packScale.z);
+		}
+
+		// Loop through the faces as sorted by material and draw them
+		unsigned int bound = ~0u;		// The texture the last group bound, ~0 for none yet
+		GLfloat tint[4];				// The caller's color
+		bool plain = false;				// True: a plain material turned texturing off
+		bool colored = false;			// True: a plain material's color replaced the caller's
+
+		for (int j = 0; j < obj.numMatFaces; j ++)
+		{
+			// Faces whose material never turned up aren't drawn
+			if (faces[j].numSubFaces == 0 || faces[j].MatIndex < 0)
+				continue;
+
+			Material &m = Materials[faces[j].MatIndex];
+
+			// Use the material's texture, made now if this is its first draw
+			if (!m.loaded)
+				LoadMaterial(faces[j].MatIndex);
+
+			if (m.textured)
+			{
+				// Back to the caller's color for the texture to modulate
+				if (colored)
+				{
+					glColor4fv(tint);
+					colored = false;
+				}
+
+				// Materials on one atlas page don't need a bind each
+				if (plain || m.tex.texture[0] != bound)
+				{
+					m.tex.Use();
+					bound = m.tex.texture[0];
+					plain = false;
+				}
+			}
+			else
+			{
+				// The color the caller set tints the plain materials the
+				// way it does the textures
+				if (!colored)
+					glGetFloatv(GL_CURRENT_COLOR, tint);
+
+				if (!plain)
+				{
+					glDisable(GL_TEXTURE_2D);
+					plain = true;
+				}
+
+				glColor4f(tint[0] * m.color.r / 255.0f, tint[1] * m.color.g / 255.0f,
+					tint[2] * m.color.b / 255.0f, tint[3] * m.color.a / 255.0f);
+				colored = true;
+			}
+
+			// Draw the faces using an index to the vertex array
+			if (faces[j].subFaces32)
+				glDrawElements(GL_TRIANGLES, faces[j].numSubFaces, GL_UNSIGNED_INT, faces[j].subFaces32);
+			else
+				glDrawElements(GL_TRIANGLES, faces[j].numSubFaces, GL_UNSIGNED_SHORT, faces[j].subFaces);
+		}
+
+		// Leave the color and texturing the way the caller had them
+		if (colored)
+			glColor4fv(tint);
+		if (plain)
+			glEnable(GL_TEXTURE_2D);
+
+	glPopMatrix();
+
+	// Put the texture matrix back
+	if (packed && obj.textured)
+	{
+		glMatrixMode(GL_TEXTURE);
+		glPopMatrix();
+		glMatrixMode(GL_MODELVIEW);
+	}
+
+	// Show the normals?
+	if (shownormals)
+	{
+		// Loop through the vertices and normals and draw the normal
+		for (int k = 0; k < obj.numVerts * 3; k += 3)
+		{
+			// Disable texturing
+			glDisable(GL_TEXTURE_2D);
+			// Disbale lighting if the model is lit
+			if (lighting)
+				glDisable(GL_LIGHTING);
+			// Draw the normals blue
+			glColor3f(0.0f, 0.0f, 1.0f);
+
+			// Draw a line between the vertex and the end of the normal
+			glBegin(GL_LINES);
+				glVertex3f(obj.Vertexes[k], obj.Vertexes[k+1], obj.Vertexes[k+2]);
+				glVertex3f(obj.Vertexes[k]+obj.Normals[k], obj.Vertexes[k+1]+obj.Normals[k+1], obj.Vertexes[k+2]+obj.Normals[k+2]);
+			glEnd();
+
+			// Reset the color to white
+			glColor3f(1.0f, 1.0f, 1.0f);
+			// If the model is lit then renable lighting
+			if (lighting)
+				glEnable(GL_LIGHTING);
+		}
+	}
+}
+
+void Model_3DS::CalculateNormals()
+{
+	LOADSTATS_SCOPE("normals", 0);
+
+	// The objects don't share anything so they can be done side by side
+	WorkerPool::Shared().ParallelFor(numObjects, [this](int i)
+		{
+			Object &obj = Objects[i];
+
+			// Add up the normals of the faces around each vertex
+			MeshKernels::AccumulateFaceNormals(obj.Vertexes, obj.numVerts, obj.Faces, obj.numFaces, obj.Normals);
+
+			// Reduce each vert's normal to unit
+			MeshKernels::NormalizeNormals(obj.Normals, obj.numVerts);
+		});
+}
+
+void Model_3DS::OptimizeMeshes()
+{
+	LOADSTATS_SCOPE("optimize", 0);
+
+	std::vector<MeshOptimizer::Stats> stats(numObjects);
+
+	// Like the normals, each object is done on its own
+	WorkerPool::Shared().ParallelFor(numObjects, [this, &stats](int i)
+		{
+			Object &obj = Objects[i];
+			MeshOptimizer::Stats &s = stats[i];
+
+			memset(&s, 0, sizeof(s));
+			s.vertsBefore = s.vertsAfter = obj.numVerts;
+
+			for (int j = 0; j < obj.numMatFaces; j++)
+			{
+				s.triangles += obj.MatFaces[j].numSubFaces / 3;
+				s.acmrBefore += MeshOptimizer::ACMR(obj.MatFaces[j].subFaces, obj.MatFaces[j].numSubFaces, obj.numVerts) * (obj.MatFaces[j].numSubFaces / 3);
+			}
+
+			s.acmrAfter = s.acmrBefore;
+
+			// The passes need every array to have one entry per vertex and
+			// every index to be a real vertex, leave anything else alone
+			bool valid = obj.numVerts > 0 && obj.numTexCoords == obj.numVerts;
+
+			for (int k = 0; valid && k < obj.numFaces; k++)
+				valid = obj.Faces[k] < obj.numVerts;
+
+			for (int j = 0; valid && j < obj.numMatFaces; j++)
+			{
+				for (int k = 0; valid && k < obj.MatFaces[j].numSubFaces; k++)
+					valid = obj.MatFaces[j].subFaces[k] < obj.numVerts;
+			}
+
+			if (!valid)
+				return;
+
+			std::vector<unsigned short> remap(obj.numVerts);
+
+			// Merge the duplicates
+			obj.numVerts = MeshOptimizer::WeldVertices(obj.Vertexes, obj.Normals, obj.TexCoords, obj.numVerts, &remap[0]);
+			obj.numTexCoords = obj.numVerts;
+
+			MeshOptimizer::RemapIndices(obj.Faces, obj.numFaces, &remap[0]);
+
+			for (int j = 0; j < obj.numMatFaces; j++)
+				MeshOptimizer::RemapIndices(obj.MatFaces[j].subFaces, obj.MatFaces[j].numSubFaces, &remap[0]);
+
+			// Reorder the triangles of each group, they are drawn one by one
+			for (int j = 0; j < obj.numMatFaces; j++)
+				MeshOptimizer::OptimizeVertexCache(obj.MatFaces[j].subFaces, obj.MatFaces[j].numSubFaces, obj.numVerts);
+
+			// Then number the vertices in the order they are drawn
+			int next = 0;
+
+			std::fill(remap.begin(), remap.end(), (unsigned short)MeshOptimizer::UNUSED);
+
+			for (int j = 0; j < obj.numMatFaces; j++)
+				MeshOptimizer::BuildFetchRemap(obj.MatFaces[j].subFaces, obj.MatFaces[j].numSubFaces, &remap[0], next);
+
+			MeshOptimizer::RemapVertices(obj.Vertexes, obj.Normals, obj.TexCoords, obj.numVerts, &remap[0], next);
+			MeshOptimizer::RemapIndices(obj.Faces, obj.numFaces, &remap[0]);
+
+			for (int j = 0; j < obj.numMatFaces; j++)
+				MeshOptimizer::RemapIndices(obj.MatFaces[j].subFaces, obj.MatFaces[j].numSubFaces, &remap[0]);
+
+			s.vertsAfter = obj.numVerts;
+			s.acmrAfter = 0.0f;
+
+			for (int j = 0; j < obj.numMatFaces; j++)
+				s.acmrAfter += MeshOptimizer::ACMR(obj.MatFaces[j].subFaces, obj.MatFaces[j].numSubFaces, obj.numVerts) * (obj.MatFaces[j].numSubFaces / 3);
+		});
+
+	// Add the objects up, ACMR weighted by their triangles
+	memset(&optimizeStats, 0, sizeof(optimizeStats));
+
+	for (int i = 0; i < numObjects; i++)
+	{
+		optimizeStats.vertsBefore += stats[i].vertsBefore;
+		optimizeStats.vertsAfter += stats[i].vertsAfter;
+		optimizeStats.triangles += stats[i].triangles;
+		optimizeStats.acmrBefore += stats[i].acmrBefore;
+		optimizeStats.acmrAfter += stats[i].acmrAfter;
+	}
+
+	if (optimizeStats.triangles > 0)
+	{
+		optimizeStats.acmrBefore /= optimizeStats.triangles;
+		optimizeStats.acmrAfter /= optimizeStats.triangles;
+	}
+}
+
+void Model_3DS::BuildLods()
+{
+	LOADSTATS_SCOPE("lods", 0);
+
+	// Each object's levels, kept until they can all go in one block
+	struct Levels {
+		std::vector<unsigned short> indices[MAX_LODS];	// The level's faces sorted by group
+		std::vector<int> counts[MAX_LODS];				// The number of indices in each group
+	};
+
+	std::vector<Levels> levels(numObjects);
+
+	WorkerPool::Shared().ParallelFor(numObjects, [this, &levels](int i)
+		{
+			Object &obj = Objects[i];
+			Levels &lv = levels[i];
+
+			obj.numLods = 0;
+
+			// All of the drawn faces in one list, with the group of each
+			std::vector<unsigned short> indices;
+			std::vector<int> groups;
+
+			for (int j = 0; j < obj.numMatFaces; j++)
+			{
+				const MaterialFaces &g = obj.MatFaces[j];
+
+				for (int k = 0; k + 2 < g.numSubFaces; k += 3)
+				{
+					indices.insert(indices.end(), g.subFaces + k, g.subFaces + k + 3);
+					groups.push_back(j);
+				}
+			}
+
+			// The simplifier needs every index to be a real vertex
+			for (size_t k = 0; k < indices.size(); k++)
+			{
+				if (indices[k] >= obj.numVerts)
+					return;
+			}
+
+			std::vector<unsigned short> out(indices.size());
+			std::vector<int> outGroups(groups.size());
+			float error = 0.0f;
+
+			// Each level starts from the one before
+			while (obj.numLods < MAX_LODS && (int)groups.size() >= LOD_MIN_TRIS)
+			{
+				int count = (int)indices.size();
+				float levelError;
+
+				int kept = MeshSimplifier::Simplify(obj.Vertexes, obj.numVerts, &indices[0], &groups[0], count,
+					count / 6 * 3, &out[0], &outGroups[0], levelError);
+
+				// Stop once the simplifier can't get much further
+				if (kept > count * 3 / 4)
+					break;
+
+				if (levelError > error)
+					error = levelError;
+
+				// Sort the faces back into their groups
+				int lod = obj.numLods;
+				std::vector<int> &counts = lv.counts[lod];
+				std::vector<int> start(obj.numMatFaces, 0);
+
+				counts.assign(obj.numMatFaces, 0);
+
+				for (int t = 0; t < kept / 3; t++)
+					counts[outGroups[t]] += 3;
+
+				for (int j = 1; j < obj.numMatFaces; j++)
+					start[j] = start[j - 1] + counts[j - 1];
+
+				lv.indices[lod].resize(kept);
+
+				for (int t = 0; t < kept / 3; t++)
+				{
+					memcpy(&lv.indices[lod][start[outGroups[t]]], &out[t * 3], 3 * sizeof(unsigned short));
+					start[outGroups[t]] += 3;
+				}
+
+				// The levels get the same vertex cache treatment as the full mesh
+				if (optimize)
+				{
+					for (int j = 0, first = 0; j < obj.numMatFaces; first += counts[j], j++)
+						MeshOptimizer::OptimizeVertexCache(&lv.indices[lod][first], counts[j], obj.numVerts);
+				}
+
+				obj.lodError[lod] = error;
+				obj.numLods++;
+
+				indices.assign(out.begin(), out.begin() + kept);
+				groups.assign(outGroups.begin(), outGroups.begin() + kept / 3);
+			}
+		});
+
+	// One block for all of the levels
+	size_t bytes = 0;
+
+	for (int i = 0; i < numObjects; i++)
+	{
+		for (int lod = 0; lod < Objects[i].numLods; lod++)
+		{
+			bytes += ArenaAlign(Objects[i].numMatFaces * sizeof(MaterialFaces));
+
+			for (int j = 0; j < Objects[i].numMatFaces; j++)
+				bytes += ArenaAlign(levels[i].counts[lod][j] * sizeof(GLushort));
+		}
+	}
+
+	delete [] lodArena;
+	lodArena = new unsigned char[bytes ? bytes : 1];
+
+	unsigned char *next = lodArena;
+
+	for (int i = 0; i < numObjects; i++)
+	{
+		Object &obj = Objects[i];
+
+		for (int lod = 0; lod < obj.numLods; lod++)
+		{
+			MaterialFaces *faces = (MaterialFaces *)next;
+			const unsigned short *src = levels[i].indices[lod].empty() ? NULL : &levels[i].indices[lod][0];
+
+			next += ArenaAlign(obj.numMatFaces * sizeof(MaterialFaces));
+
+			for (int j = 0; j < obj.numMatFaces; j++)
+			{
+				int count = levels[i].counts[lod][j];
+
+				faces[j].MatIndex = obj.MatFaces[j].MatIndex;
+				faces[j].numSubFaces = count;
+				faces[j].subFaces = (GLushort *)next;
+				faces[j].subFaces32 = NULL;
+
+				if (count > 0)
+					memcpy(faces[j].subFaces, src, count * sizeof(GLushort));
+
+				src += count;
+				next += ArenaAlign(count * sizeof(GLushort));
+			}
+
+			obj.LodFaces[lod] = faces;
+		}
+	}
+
+	CollectLodErrors();
+}
+
+void Model_3DS::BuildBatch()
+{
+	LOADSTATS_SCOPE("batch", 0);
+
+	// The objects' own moves and turns would be lost
+	for (int i = 0; i < numObjects; i++)
+	{
+		const Object &obj = Objects[i];
+
+		if (obj.pos.x != 0.0f || obj.pos.y != 0.0f || obj.pos.z != 0.0f ||
+			obj.rot.x != 0.0f || obj.rot.y != 0.0f || obj.rot.z != 0.0f)
+			return;
+	}
+
+	// Materials that draw the same, the same texture file, atlas page
+	// or color, share the first one's slot
+	std::vector<int> same(numMaterials);
+
+	for (int m = 0; m < numMaterials; m++)
+	{
+		const Material &mat = Materials[m];
+
+		same[m] = m;
+
+		for (int k = 0; k < m; k++)
+		{
+			const Material &other = Materials[k];
+
+			if (mat.atlasPage >= 0 && mat.atlasPage == other.atlasPage)
+			{
+				same[m] = k;
+				break;
+			}
+
+			if (mat.atlasPage < 0 && other.atlasPage < 0 && mat.textured == other.textured &&
+				(mat.textured ? strcmp(mat.mapname, other.mapname) == 0 :
+					memcmp(&mat.color, &other.color, sizeof(Color4i)) == 0))
+			{
+				same[m] = k;
+				break;
+			}
+		}
+	}
+
+	// The looks the full meshes use, in the order they first show up
+	std::vector<int> slot(numMaterials, -1);
+	std::vector<int> used;
+	int groups = 0;
+	int total = 0;
+	bool textured = false;
+
+	for (int i = 0; i < numObjects; i++)
+	{
+		const Object &obj = Objects[i];
+
+		for (int j = 0; j < obj.numMatFaces; j++)
+		{
+			int mat = obj.MatFaces[j].MatIndex;
+
+			if (obj.MatFaces[j].numSubFaces == 0 || mat < 0 || mat >= numMaterials)
+				continue;
+
+			if (slot[same[mat]] < 0)
+			{
+				slot[same[mat]] = (int)used.size();
+				used.push_back(same[mat]);
+			}
+
+			slot[mat] = slot[same[mat]];
+
+			groups++;
+		}
+
+		total += obj.numVerts;
+		textured = textured || obj.textured;
+	}
+
+	// Only worth it when it saves draws
+	if (used.empty() || (int)used.size() == groups)
+		return;
+
+	// The merged groups of each level, in the slot order
+	int numGroups = (int)used.size();
+	bool wide = total > 0xFFFF;
+	size_t indexSize = wide ? sizeof(GLuint) : sizeof(GLushort);
+	std::vector<int> counts((numLods + 1) * numGroups, 0);
+
+	for (int lod = 0; lod <= numLods; lod++)
+	{
+		for (int i = 0; i < numObjects; i++)
+		{
+			const MaterialFaces *faces = Objects[i].Lod(lod);
+
+			for (int j = 0; j < Objects[i].numMatFaces; j++)
+			{
+				int mat = faces[j].MatIndex;
+
+				if (mat >= 0 && mat < numMaterials && slot[mat] >= 0)
+					counts[lod * numGroups + slot[mat]] += faces[j].numSubFaces;
+			}
+		}
+	}
+
+	// One block for the batch, its vertices and its faces. A single
+	// object's vertices can be drawn as they are.
+	bool share = numObjects == 1;
+	size_t bytes = ArenaAlign(sizeof(Object)) + ArenaAlign(numGroups * sizeof(MaterialFaces)) * (numLods + 1);
+
+	if (!share)
+		bytes += ArenaAlign(total * 3 * sizeof(GLfloat)) * 2 + ArenaAlign(total * 2 * sizeof(GLfloat));
+
+	for (size_t k = 0; k < counts.size(); k++)
+		bytes += ArenaAlign(counts[k] * indexSize);
+
+	delete [] batchArena;
+	batchArena = new unsigned char[bytes];
+
+	unsigned char *next = batchArena;
+	Object &batch = *(Object *)next;
+
+	next += ArenaAlign(sizeof(Object));
+	memset(&batch, 0, sizeof(Object));
+	strcpy(batch.name, "batch");
+	batch.numVerts = total;
+	batch.numTexCoords = textured ? total : 0;
+	batch.textured = textured;
+	batch.numMatFaces = numGroups;
+	batch.numLods = numLods;
+	batch.bounds = bounds;
+	memcpy(batch.lodError, lodError, sizeof(batch.lodError));
+
+	std::vector<int> base(numObjects, 0);
+
+	if (share)
+	{
+		batch.Vertexes = Objects[0].Vertexes;
+		batch.Normals = Objects[0].Normals;
+		batch.TexCoords = Objects[0].TexCoords;
+		batch.numTexCoords = Objects[0].numTexCoords;
+	}
+	else
+	{
+		batch.Vertexes = (GLfloat *)next;
+		next += ArenaAlign(total * 3 * sizeof(GLfloat));
+		batch.Normals = (GLfloat *)next;
+		next += ArenaAlign(total * 3 * sizeof(GLfloat));
+		batch.TexCoords = (GLfloat *)next;
+		next += ArenaAlign(total * 2 * sizeof(GLfloat));
+	}
+
+	// The vertices one object after the other, objects without texture
+	// coordinates get zeros
+	for (int i = 0, first = 0; !share && i < numObjects; first += Objects[i].numVerts, i++)
+	{
+		const Object &obj = Objects[i];
+		int tex = obj.numTexCoords < obj.numVerts ? obj.numTexCoords : obj.numVerts;
+
+		base[i] = first;
+		memcpy(&batch.Vertexes[first * 3], obj.Vertexes, obj.numVerts * 3 * sizeof(GLfloat));
+		memcpy(&batch.Normals[first * 3], obj.Normals, obj.numVerts * 3 * sizeof(GLfloat));
+
+		if (textured)
+		{
+			memcpy(&batch.TexCoords[first * 2], obj.TexCoords, tex * 2 * sizeof(GLfloat));
+			memset(&batch.TexCoords[(first + tex) * 2], 0, (obj.numVerts - tex) * 2 * sizeof(GLfloat));
+		}
+	}
+
+	// Each level's groups, every object's faces of a material one after
+	// the other so each object keeps its vertex cache order
+	for (int lod = 0; lod <= numLods; lod++)
+	{
+		MaterialFaces *merged = (MaterialFaces *)next;
+		std::vector<int> fill(numGroups, 0);
+
+		next += ArenaAlign(numGroups * sizeof(MaterialFaces));
+
+		for (int g = 0; g < numGroups; g++)
+		{
+			int count = counts[lod * numGroups + g];
+
+			merged[g].MatIndex = used[g];
+			merged[g].numSubFaces = count;
+			merged[g].subFaces = wide ? NULL : (GLushort *)next;
+			merged[g].subFaces32 = wide ? (GLuint *)next : NULL;
+			next += ArenaAlign(count * indexSize);
+		}
+
+		for (int i = 0; i < numObjects; i++)
+		{
+			const MaterialFaces *faces = Objects[i].Lod(lod);
+
+			for (int j = 0; j < Objects[i].numMatFaces; j++)
+			{
+				int mat = faces[j].MatIndex;
+
+				if (mat < 0 || mat >= numMaterials || slot[mat] < 0)
+					continue;
+
+				MaterialFaces &dst = merged[slot[mat]];
+				int &at = fill[slot[mat]];
+
+				for (int k = 0; k < faces[j].numSubFaces; k++)
+				{
+					unsigned int index = faces[j].subFaces[k] + base[i];
+
+					if (wide)
+						dst.subFaces32[at++] = index;
+					else
+						dst.subFaces[at++] = (GLushort)index;
+				}
+			}
+		}
+
+		if (lod == 0)
+			batch.MatFaces = merged;
+		else
+			batch.LodFaces[lod - 1] = merged;
+	}
+
+	Batch = &batch;
+}
+
+// Scales v from [-1, 1] to a 16 bit value
+static short PackUnit(float v)
+{
+	float s = v * 32767.0f;
+
+	if (s > 32767.0f)
+		s = 32767.0f;
+	if (s < -32767.0f)
+		s = -32767.0f;
+
+	return (short)(s < 0.0f ? s - 0.5f : s + 0.5f);
+}
+
+void Model_3DS::PackVertices()
+{
+	LOADSTATS_SCOPE("pack", 0);
+
+	// A batched model only draws the Batch
+	if (Batch)
+	{
+		delete [] packedArena;
+		packedArena = new PackedVertex[Batch->numVerts ? Batch->numVerts : 1];
+		PackObject(*Batch, packedArena);
+		return;
+	}
+
+	size_t total = 0;
+
+	for (int i = 0; i < numObjects; i++)
+		total += Objects[i].numVerts;
+
+	delete [] packedArena;
+	packedArena = new PackedVertex[total ? total : 1];
+
+	PackedVertex *next = packedArena;
+
+	for (int i = 0; i < numObjects; i++)
+	{
+		PackObject(Objects[i], next);
+		next += Objects[i].numVerts;
+	}
+}
+
+void Model_3DS::PackObject(Object &obj, PackedVertex *out)
+{
+	float lo[3], hi[3], uvlo[2], uvhi[2];
+
+	obj.Packed = out;
+
+	// The object's box and the range of the texture coordinates
+	lo[0] = obj.bounds.min.x;
+	lo[1] = obj.bounds.min.y;
+	lo[2] = obj.bounds.min.z;
+	hi[0] = obj.bounds.max.x;
+	hi[1] = obj.bounds.max.y;
+	hi[2] = obj.bounds.max.z;
+	uvlo[0] = uvlo[1] = uvhi[0] = uvhi[1] = 0.0f;
+
+	for (int v = 0; v < obj.numTexCoords && v < obj.numVerts; v++)
+	{
+		for (int k = 0; k < 2; k++)
+		{
+			float t = obj.TexCoords[v * 2 + k];
+
+			if (v == 0 || t < uvlo[k]) uvlo[k] = t;
+			if (v == 0 || t > uvhi[k]) uvhi[k] = t;
+		}
+	}
+
+	// Half the size of the box maps to 32767, a flat box still needs a scale
+	float half[3], uvhalf[2];
+
+	for (int k = 0; k < 3; k++)
+	{
+		half[k] = (hi[k] - lo[k]) * 0.5f;
+
+		if (half[k] <= 0.0f)
+			half[k] = 1.0f;
+	}
+
+	for (int k = 0; k < 2; k++)
+	{
+		uvhalf[k] = (uvhi[k] - uvlo[k]) * 0.5f;
+
+		if (uvhalf[k] <= 0.0f)
+			uvhalf[k] = 1.0f;
+	}
+
+	obj.packOffset.x = (lo[0] + hi[0]) * 0.5f;
+	obj.packOffset.y = (lo[1] + hi[1]) * 0.5f;
+	obj.packOffset.z = (lo[2] + hi[2]) * 0.5f;
+	obj.packScale.x = half[0] / 32767.0f;
+	obj.packScale.y = half[1] / 32767.0f;
+	obj.packScale.z = half[2] / 32767.0f;
+	obj.uvOffset[0] = (uvlo[0] + uvhi[0]) * 0.5f;
+	obj.uvOffset[1] = (uvlo[1] + uvhi[1]) * 0.5f;
+	obj.uvScale[0] = uvhalf[0] / 32767.0f;
+	obj.uvScale[1] = uvhalf[1] / 32767.0f;
+
+	const float center[3] = { obj.packOffset.x, obj.packOffset.y, obj.packOffset.z };
+
+	for (int v = 0; v < obj.numVerts; v++)
+	{
+		PackedVertex &pv = obj.Packed[v];
+		const float *n = &obj.Normals[v * 3];
+
+		for (int k = 0; k < 3; k++)
+			pv.pos[k] = PackUnit((obj.Vertexes[v * 3 + k] - center[k]) / half[k]);
+
+		// The normal matrix of the scaled box divides by half, so multiply
+		// by it here and bring the result back to unit length
+		float sn[3] = { n[0] * half[0], n[1] * half[1], n[2] * half[2] };
+		float len = sqrtf(sn[0] * sn[0] + sn[1] * sn[1] + sn[2] * sn[2]);
+
+		for (int k = 0; k < 3; k++)
+			pv.normal[k] = PackUnit(len > 0.0f ? sn[k] / len : 0.0f);
+
+		if (v < obj.numTexCoords)
+		{
+			pv.uv[0] = PackUnit((obj.TexCoords[v * 2] - obj.uvOffset[0]) / uvhalf[0]);
+			pv.uv[1] = PackUnit((obj.TexCoords[v * 2 + 1] - obj.uvOffset[1]) / uvhalf[1]);
+		}
+		else
+			pv.uv[0] = pv.uv[1] = 0;
+	}
+}
+
+void Model_3DS::GetMemoryStats(MemoryStats &stats)
+{
+	memset(&stats, 0, sizeof(stats));
+
+	for (int i = 0; i < numObjects; i++)
+	{
+		const Object &obj = Objects[i];
+
+		stats.vertexBytes += obj.numVerts * 6 * sizeof(GLfloat) + obj.numTexCoords * 2 * sizeof(GLfloat);
+		stats.indexBytes += obj.numFaces * sizeof(GLushort) + obj.numMatFaces * sizeof(MaterialFaces);
+
+		if (obj.Packed)
+			stats.packedBytes += obj.numVerts * sizeof(PackedVertex);
+
+		for (int lod = 0; lod <= obj.numLods; lod++)
+		{
+			MaterialFaces *faces = obj.Lod(lod);
+			size_t bytes = lod ? obj.numMatFaces * sizeof(MaterialFaces) : 0;
+
+			for (int j = 0; j < obj.numMatFaces; j++)
+				bytes += faces[j].numSubFaces * sizeof(GLushort);
+
+			if (lod)
+				stats.lodBytes += bytes;
+			else
+				stats.indexBytes += bytes;
+		}
+	}
+
+	// The batch copies the faces of every level, and the vertices when
+	// there is more than one object
+	if (Batch)
+	{
+		const Object &obj = *Batch;
+		size_t indexSize = obj.MatFaces[0].subFaces32 ? sizeof(GLuint) : sizeof(GLushort);
+
+		if (obj.Vertexes != Objects[0].Vertexes)
+			stats.batchBytes = obj.numVerts * 6 * sizeof(GLfloat) + obj.numTexCoords * 2 * sizeof(GLfloat);
+
+		for (int lod = 0; lod <= obj.numLods; lod++)
+		{
+			const MaterialFaces *faces = obj.Lod(lod);
+
+			stats.batchBytes += obj.numMatFaces * sizeof(MaterialFaces);
+
+			for (int j = 0; j < obj.numMatFaces; j++)
+				stats.batchBytes += faces[j].numSubFaces * indexSize;
+		}
+
+		if (obj.Packed)
+			stats.packedBytes += obj.numVerts * sizeof(PackedVertex);
+	}
+}
+
+void Model_3DS::CollectLodErrors()
+{
+	numLods = 0;
+
+	for (int i = 0; i < numObjects; i++)
+	{
+		if (Objects[i].numLods > numLods)
+			numLods = Objects[i].numLods;
+	}
+
+	// An object that runs out of levels keeps drawing its coarsest one
+	for (int lod = 0; lod < numLods; lod++)
+	{
+		lodError[lod] = 0.0f;
+
+		for (int i = 0; i < numObjects; i++)
+		{
+			const Object &obj = Objects[i];
+
+			if (obj.numLods == 0)
+				continue;
+
+			float error = obj.lodError[lod < obj.numLods ? lod : obj.numLods - 1];
+
+			if (error > lodError[lod])
+				lodError[lod] = error;
+		}
+	}
+}
+
+//////////////////////////////////////////////////////////////////////
+// Mesh cache
+//////////////////////////////////////////////////////////////////////
+
+// Rounds a cache offset up to the next aligned one
+static unsigned int CacheAlign(unsigned int offset)
+{
+	return (offset + CACHE_ALIGN - 1) & ~(unsigned int)(CACHE_ALIGN - 1);
+}
+
+// Finds the size and time stamp the cache has to match
+static bool CacheSourceStamp(const char *name, long long &size, long long &time)
+{
+	struct stat st;
+
+	if (stat(name, &st) != 0)
+		return false;
+
+	size = (long long)st.st_size;
+	time = (long long)st.st_mtime;
+	return true;
+}
+
+// Returns a pointer into the cache if the whole array is inside it
+static void *CacheArray(const MappedFile &f, unsigned int offset, size_t bytes)
+{
+	if (offset > f.size || bytes > f.size - offset)
+		return NULL;
+
+	return (void *)(f.data + offset);
+}
+
+// True if every index of the array is one of the object's vertices
+static bool CacheIndices(const MappedFile &f, unsigned int offset, int count, int numVerts)
+{
+	const GLushort *indices = (const GLushort *)CacheArray(f, offset, count * sizeof(GLushort));
+
+	if (indices == NULL)
+		return false;
+
+	for (int k = 0; k < count; k++)
+	{
+		if (indices[k] >= numVerts)
+			return false;
+	}
+
+	return true;
+}
+
+bool Model_3DS::LoadCache(const char *name)
+{
+	LOADSTATS_SCOPE("cache load", 0);
+
+	long long sourceSize, sourceTime;
+
+	// Without the 3ds file we can't tell if the cache is stale
+	if (!CacheSourceStamp(name, sourceSize, sourceTime))
+		return false;
+
+	std::string cachename = std::string(name) + ".cache";
+
+	// Map the cache copy-on-write so the arrays can still be edited in memory
+	if (!cache.Open(cachename.c_str(), true))
+		return false;
+
+	const unsigned char *base = cache.data;
+	const CacheHeader *header = (const CacheHeader *)base;
+
+	// Make sure it is a cache we wrote for this exact 3ds file
+	if (cache.size < sizeof(CacheHeader) ||
+		memcmp(header->magic, CACHE_MAGIC, 4) != 0 ||
+		header->version != CACHE_VERSION ||
+		header->fileSize != cache.size ||
+		header->sourceSize != sourceSize ||
+		header->sourceTime != sourceTime ||
+		header->optimized != (optimize ? 1u : 0u) ||
+		header->lods != (generateLods ? 1u : 0u))
+	{
+		cache.Close();
+		return false;
+	}
+
+	LOADSTATS_BYTES(cache.size);
+
+	size_t tables = sizeof(CacheHeader) +
+		header->numMaterials * sizeof(CacheMaterial) +
+		header->numObjects * sizeof(CacheObject) +
+		header->numMatFaces * sizeof(CacheMatFaces);
+
+	if (tables > cache.size)
+	{
+		cache.Close();
+		return false;
+	}
+
+	const CacheMaterial *cmats = (const CacheMaterial *)(header + 1);
+	const CacheObject *cobjs = (const CacheObject *)(cmats + header->numMaterials);
+	const CacheMatFaces *cgroups = (const CacheMatFaces *)(cobjs + header->numObjects);
+
+	// Check every array before anything gets pointed at it, and every
+	// index in them, they go straight to the draw calls
+	for (unsigned int i = 0; i < header->numObjects; i++)
+	{
+		const CacheObject &co = cobjs[i];
+
+		if (co.numVerts < 0 || co.numTexCoords < 0 || co.numFaces < 0 || co.numMatFaces < 0 ||
+			co.numLods < 0 || co.numLods > MAX_LODS ||
+			co.firstMatFaces + (unsigned long long)co.numMatFaces * (co.numLods + 1) > header->numMatFaces ||
+			CacheArray(cache, co.vertexes, co.numVerts * 3 * sizeof(GLfloat)) == NULL ||
+			CacheArray(cache, co.normals, co.numVerts * 3 * sizeof(GLfloat)) == NULL ||
+			CacheArray(cache, co.texcoords, co.numTexCoords * 2 * sizeof(GLfloat)) == NULL ||
+			!CacheIndices(cache, co.faces, co.numFaces, co.numVerts))
+		{
+			cache.Close();
+			return false;
+		}
+
+		for (int j = 0; j < co.numMatFaces * (co.numLods + 1); j++)
+		{
+			const CacheMatFaces &cg = cgroups[co.firstMatFaces + j];
+
+			// -1 is a group whose material never turned up
+			if (cg.numSubFaces < 0 || cg.MatIndex < -1 || cg.MatIndex >= (long long)header->numMaterials ||
+				!CacheIndices(cache, cg.subFaces, cg.numSubFaces, co.numVerts))
+			{
+				cache.Close();
+				return false;
+			}
+		}
+	}
+
+	// The optimizer's stats from when the cache was baked
+	optimizeStats.vertsBefore = header->vertsBefore;
+	optimizeStats.vertsAfter = header->vertsAfter;
+	optimizeStats.triangles = header->triangles;
+	optimizeStats.acmrBefore = header->acmrBefore;
+	optimizeStats.acmrAfter = header->acmrAfter;
+
+	// The material table
+	numMaterials = (int)header->numMaterials;
+
+	if (numMaterials > 0)
+	{
+		Materials = new Material[numMaterials];
+
+		for (int i = 0; i < numMaterials; i++)
+		{
+			memcpy(Materials[i].name, cmats[i].name, sizeof(Materials[i].name));
+			memcpy(Materials[i].mapname, cmats[i].mapname, sizeof(Materials[i].mapname));
+			Materials[i].name[sizeof(Materials[i].name) - 1] = 0;
+			Materials[i].mapname[sizeof(Materials[i].mapname) - 1] = 0;
+			Materials[i].color.r = cmats[i].color[0];
+			Materials[i].color.g = cmats[i].color[1];
+			Materials[i].color.b = cmats[i].color[2];
+			Materials[i].color.a = cmats[i].color[3];
+			Materials[i].textured = cmats[i].textured != 0;
+			Materials[i].shared = NULL;
+			Materials[i].atlasPage = -1;
+		}
+	}
+
+	// The objects and their group tables go in the arena,
+	// their arrays point straight into the mapped cache
+	numObjects = (int)header->numObjects;
+
+	size_t bytes = ArenaAlign(numObjects * sizeof(Object));
+
+	for (int i = 0; i < numObjects; i++)
+		bytes += ArenaAlign(cobjs[i].numMatFaces * sizeof(MaterialFaces)) * (cobjs[i].numLods + 1);
+
+	arena = new unsigned char[bytes ? bytes : 1];
+	arenaSize = bytes;
+	arenaUsed = 0;
+
+	if (numObjects > 0)
+	{
+		Objects = (Object *)ArenaAlloc(numObjects * sizeof(Object));
+
+		for (int i = 0; i < numObjects; i++)
+		{
+			const CacheObject &co = cobjs[i];
+			Object &obj = Objects[i];
+
+			memcpy(obj.name, co.name, sizeof(obj.name));
+			obj.name[sizeof(obj.name) - 1] = 0;
+			obj.numVerts = co.numVerts;
+			obj.numTexCoords = co.numTexCoords;
+			obj.numFaces = co.numFaces;
+			obj.numMatFaces = co.numMatFaces;
+			obj.textured = co.textured != 0;
+			obj.pos.x = co.pos[0];
+			obj.pos.y = co.pos[1];
+			obj.pos.z = co.pos[2];
+			obj.rot.x = co.rot[0];
+			obj.rot.y = co.rot[1];
+			obj.rot.z = co.rot[2];
+			obj.Vertexes = (GLfloat *)CacheArray(cache, co.vertexes, 0);
+			obj.Normals = (GLfloat *)CacheArray(cache, co.normals, 0);
+			obj.TexCoords = (GLfloat *)CacheArray(cache, co.texcoords, 0);
+			obj.Faces = (GLushort *)CacheArray(cache, co.faces, 0);
+			obj.MatFaces = NULL;
+			obj.numLods = 0;
+			obj.Packed = NULL;
+			obj.bounds = co.bounds;
+
+			if (obj.numMatFaces > 0)
+			{
+				obj.numLods = co.numLods;
+				memcpy(obj.lodError, co.lodError, sizeof(obj.lodError));
+
+				// The full mesh's groups, then each level's
+				for (int lod = 0; lod <= obj.numLods; lod++)
+				{
+					MaterialFaces *faces = (MaterialFaces *)ArenaAlloc(obj.numMatFaces * sizeof(MaterialFaces));
+					const CacheMatFaces *cg = &cgroups[co.firstMatFaces + lod * obj.numMatFaces];
+
+					for (int j = 0; j < obj.numMatFaces; j++)
+					{
+						faces[j].MatIndex = cg[j].MatIndex;
+						faces[j].numSubFaces = cg[j].numSubFaces;
+						faces[j].subFaces = (GLushort *)CacheArray(cache, cg[j].subFaces, 0);
+						faces[j].subFaces32 = NULL;
+					}
+
+					if (lod == 0)
+						obj.MatFaces = faces;
+					else
+						obj.LodFaces[lod - 1] = faces;
+				}
+			}
+		}
+	}
+
+	CollectLodErrors();
+
+	return true;
+}
+
+void Model_3DS::SaveCache(const char *name)
+{
+	LOADSTATS_SCOPE("cache save", 0);
+
+	long long sourceSize, sourceTime;
+
+	if (!CacheSourceStamp(name, sourceSize, sourceTime))
+		return;
+
+	CacheHeader header;
+	std::vector<CacheMaterial> cmats(numMaterials);
+	std::vector<CacheObject> cobjs(numObjects);
+	std::vector<CacheMatFaces> cgroups;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CACHE_MAGIC, 4);
+	header.version = CACHE_VERSION;
+	header.sourceSize = sourceSize;
+	header.sourceTime = sourceTime;
+	header.numMaterials = numMaterials;
+	header.numObjects = numObjects;
+	header.optimized = optimize ? 1 : 0;
+	header.vertsBefore = optimizeStats.vertsBefore;
+	header.vertsAfter = optimizeStats.vertsAfter;
+	header.triangles = optimizeStats.triangles;
+	header.acmrBefore = optimizeStats.acmrBefore;
+	header.acmrAfter = optimizeStats.acmrAfter;
+	header.lods = generateLods ? 1 : 0;
+
+	for (int i = 0; i < numMaterials; i++)
+	{
+		memset(&cmats[i], 0, sizeof(CacheMaterial));
+		memcpy(cmats[i].name, Materials[i].name, sizeof(cmats[i].name));
+		memcpy(cmats[i].mapname, Materials[i].mapname, sizeof(cmats[i].mapname));
+		cmats[i].color[0] = Materials[i].color.r;
+		cmats[i].color[1] = Materials[i].color.g;
+		cmats[i].color[2] = Materials[i].color.b;
+		cmats[i].color[3] = Materials[i].color.a;
+		cmats[i].textured = Materials[i].textured ? 1 : 0;
+	}
+
+	for (int i = 0; i < numObjects; i++)
+		header.numMatFaces += Objects[i].numMatFaces * (Objects[i].numLods + 1);
+
+	cgroups.resize(header.numMatFaces);
+
+	// Lay the arrays out after the tables
+	unsigned int offset = (unsigned int)(sizeof(CacheHeader) +
+		cmats.size() * sizeof(CacheMaterial) +
+		cobjs.size() * sizeof(CacheObject) +
+		cgroups.size() * sizeof(CacheMatFaces));
+	unsigned int group = 0;
+
+	for (int i = 0; i < numObjects; i++)
+	{
+		Object &obj = Objects[i];
+		CacheObject &co = cobjs[i];
+
+		memset(&co, 0, sizeof(CacheObject));
+		memcpy(co.name, obj.name, sizeof(co.name));
+		co.numVerts = obj.numVerts;
+		co.numTexCoords = obj.numTexCoords;
+		co.numFaces = obj.numFaces;
+		co.numMatFaces = obj.numMatFaces;
+		co.textured = obj.textured ? 1 : 0;
+		co.pos[0] = obj.pos.x;
+		co.pos[1] = obj.pos.y;
+		co.pos[2] = obj.pos.z;
+		co.rot[0] = obj.rot.x;
+		co.rot[1] = obj.rot.y;
+		co.rot[2] = obj.rot.z;
+		co.firstMatFaces = group;
+		co.numLods = obj.numLods;
+		memcpy(co.lodError, obj.lodError, sizeof(co.lodError));
+		co.bounds = obj.bounds;
+
+		co.vertexes = offset = CacheAlign(offset);
+		offset += obj.numVerts * 3 * sizeof(GLfloat);
+		co.normals = offset = CacheAlign(offset);
+		offset += obj.numVerts * 3 * sizeof(GLfloat);
+		co.texcoords = offset = CacheAlign(offset);
+		offset += obj.numTexCoords * 2 * sizeof(GLfloat);
+		co.faces = offset = CacheAlign(offset);
+		offset += obj.numFaces * sizeof(GLushort);
+
+		for (int lod = 0; lod <= obj.numLods; lod++)
+		{
+			MaterialFaces *faces = obj.Lod(lod);
+
+			for (int j = 0; j < obj.numMatFaces; j++, group++)
+			{
+				cgroups[group].MatIndex = faces[j].MatIndex;
+				cgroups[group].numSubFaces = faces[j].numSubFaces;
+				cgroups[group].subFaces = offset = CacheAlign(offset);
+				offset += faces[j].numSubFaces * sizeof(GLushort);
+			}
+		}
+	}
+
+	header.fileSize = CacheAlign(offset);
+
+	// Build the whole file in memory so it can be written at once
+	std::vector<unsigned char> out(header.fileSize, 0);
+	unsigned char *dst = &out[0];
+
+	memcpy(dst, &header, sizeof(header));
+	dst += sizeof(header);
+	if (!cmats.empty())
+		memcpy(dst, &cmats[0], cmats.size() * sizeof(CacheMaterial));
+	dst += cmats.size() * sizeof(CacheMaterial);
+	if (!cobjs.empty())
+		memcpy(dst, &cobjs[0], cobjs.size() * sizeof(CacheObject));
+	dst += cobjs.size() * sizeof(CacheObject);
+	if (!cgroups.empty())
+		memcpy(dst, &cgroups[0], cgroups.size() * sizeof(CacheMatFaces));
+
+	for (int i = 0; i < numObjects; i++)
+	{
+		Object &obj = Objects[i];
+		CacheObject &co = cobjs[i];
+
+		if (obj.numVerts > 0)
+		{
+			memcpy(&out[co.vertexes], obj.Vertexes, obj.numVerts * 3 * sizeof(GLfloat));
+			memcpy(&out[co.normals], obj.Normals, obj.numVerts * 3 * sizeof(GLfloat));
+		}
+		if (obj.numTexCoords > 0)
+			memcpy(&out[co.texcoords], obj.TexCoords, obj.numTexCoords * 2 * sizeof(GLfloat));
+		if (obj.numFaces > 0)
+			memcpy(&out[co.faces], obj.Faces, obj.numFaces * sizeof(GLushort));
+
+		for (int lod = 0; lod <= obj.numLods; lod++)
+		{
+			MaterialFaces *faces = obj.Lod(lod);
+			const CacheMatFaces *cg = &cgroups[co.firstMatFaces + lod * obj.numMatFaces];
+
+			for (int j = 0; j < obj.numMatFaces; j++)
+			{
+				if (faces[j].numSubFaces > 0)
+					memcpy(&out[cg[j].subFaces], faces[j].subFaces, faces[j].numSubFaces * sizeof(GLushort));
+			}
+		}
+	}
+
+	// Write to a temporary file first so a half written cache is never picked up
+	std::string cachename = std::string(name) + ".cache";
+	std::string tempname = cachename + ".tmp";
+
+	FILE *f = fopen(tempname.c_str(), "wb");
+
+	// The model directory may be read only, we just don't cache then
+	if (f == NULL)
+		return;
+
+	bool written = fwrite(&out[0], 1, out.size(), f) == out.size();
+
+	if (fclose(f) != 0 || !written)
+	{
+		remove(tempname.c_str());
+		return;
+	}
+
+	remove(cachename.c_str());
+	if (rename(tempname.c_str(), cachename.c_str()) != 0)
+		remove(tempname.c_str());
+}
+
+//////////////////////////////////////////////////////////////////////
+// Chunk cursor
+//////////////////////////////////////////////////////////////////////
+
+bool Model_3DS::Chunk::Read(void *dst, size_t n)
+{
+	// Never read past the end of the chunk
+	if (!ok || Remaining() < n)
+	{
+		memset(dst, 0, n);
+		pos = end;
+		ok = false;
+		return false;
+	}
+
+	memcpy(dst, pos, n);
+	pos += n;
+	return true;
+}
+
+unsigned char Model_3DS::Chunk::ReadByte()
+{
+	unsigned char v;
+	Read(&v, sizeof(v));
+	return v;
+}
+
+unsigned short Model_3DS::Chunk::ReadShort()
+{
+	// The 3ds file is little endian just like the machines we run on
+	unsigned short v;
+	Read(&v, sizeof(v));
+	return v;
+}
+
+unsigned long Model_3DS::Chunk::ReadLong()
+{
+	// Lengths are always 4 bytes in the file no matter how big a long is
+	unsigned int v;
+	Read(&v, sizeof(v));
+	return v;
+}
+
+float Model_3DS::Chunk::ReadFloat()
+{
+	float v;
+	Read(&v, sizeof(v));
+	return v;
+}
+
+void Model_3DS::Chunk::ReadString(char *dst, int max)
+{
+	int i = 0;
+
+	// Copy up to the terminating zero, truncating names that are too long
+	while (pos < end && *pos != 0)
+	{
+		if (i < max - 1)
+			dst[i++] = (char)*pos;
+		pos++;
+	}
+
+	dst[i] = 0;
+
+	// Step over the terminating zero
+	if (pos < end)
+		pos++;
+	else
+		ok = false;
+}
+
+bool Model_3DS::Chunk::Skip(size_t n)
+{
+	if (Remaining() < n)
+	{
+		pos = end;
+		ok = false;
+		return false;
+	}
 
-			unit.x = Objects[i].Normals[g*3];
-			unit.y = Objects[i].Normals[g*3+1];
-			unit.z = Objects[i].Normals[g*3+2];
+	pos += n;
+	return true;
+}
 
-			length = (float)sqrt((unit.x*unit.x) + (unit.y*unit.y) + (unit.z*unit.z));
+bool Model_3DS::Chunk::NextChunk(ChunkHeader &h, Chunk &child)
+{
+	// Every chunk needs at least its 6 byte header
+	if (Remaining() < 6)
+		return false;
 
-			if (length == 0.0f)
-				length = 1.0f;
+	h.id = ReadShort();
+	h.len = ReadLong();
 
-			unit.x /= length;
-			unit.y /= length;
-			unit.z /= length;
+	// The length counts the header too
+	size_t length = (h.len < 6) ? 0 : (size_t)(h.len - 6);
 
-			Objects[i].Normals[g*3]   = unit.x;
-			Objects[i].Normals[g*3+1] = unit.y;
-			Objects[i].Normals[g*3+2] = unit.z;
-		}
+	// Clamp broken chunks to what is left of their parent
+	if (length > Remaining())
+	{
+		length = Remaining();
+		ok = false;
 	}
+
+	child = Chunk(pos, pos + length);
+	pos += length;
+	return true;
 }
 
-void Model_3DS::MainChunkProcessor(long length, long findex)
+//////////////////////////////////////////////////////////////////////
+// Chunk processors
+//////////////////////////////////////////////////////////////////////
+
+void Model_3DS::MainChunkProcessor(Chunk &chunk)
 {
 	ChunkHeader h;
+	Chunk sub(NULL, NULL);
 
-	// move the file pointer to the beginning of the main
-	// chunk's data findex + the size of the header
-	fseek(bin3ds, findex, SEEK_SET);
-
-	while (ftell(bin3ds) < (findex + length - 6))
+	while (chunk.NextChunk(h, sub))
 	{
-		fread(&h.id,sizeof(h.id),1,bin3ds);
-		fread(&h.len,sizeof(h.len),1,bin3ds);
-
 		switch (h.id)
 		{
 			// This is the mesh information like vertices, faces, and materials
 			case EDIT3DS	:
-				EditChunkProcessor(h.len, ftell(bin3ds));
+				EditChunkProcessor(sub);
 				break;
 			// I left this in case anyone gets very ambitious
 			case KEYF3DS	:
-				//KeyFrameChunkProcessor(h.len, ftell(bin3ds));
+				//KeyFrameChunkProcessor(sub);
 				break;
 			default			:
 				break;
 		}
+	}
+}
+
+size_t Model_3DS::MeasureEditChunk(Chunk chunk, int &materials, int &objects)
+{
+	// It only reads the headers, the parse gets the bytes
+	LOADSTATS_SCOPE("measure", 0);
 
-		fseek(bin3ds, (h.len - 6), SEEK_CUR);
+	ChunkHeader h;
+	Chunk sub(NULL, NULL);
+	Chunk mesh(NULL, NULL);
+	size_t bytes = 0;
+	char name[80];
+
+	materials = 0;
+	objects = 0;
+
+	while (chunk.NextChunk(h, sub))
+	{
+		switch (h.id)
+		{
+			case MATERIAL	:
+				materials++;
+				break;
+			case OBJECT	:
+				// Objects the filter leaves out take no room
+				if (!AcceptObject(sub))
+					break;
+
+				objects++;
+
+				// Skip the object's name, the meshes follow it
+				sub.ReadString(name, 80);
+
+				while (sub.NextChunk(h, mesh))
+				{
+					if (h.id == TRIG_MESH)
+					{
+						int groups;
+						bytes += MeasureMeshChunk(mesh, groups);
+					}
+				}
+				break;
+			default			:
+				break;
+		}
 	}
 
-	// move the file pointer back to where we got it so
-	// that the ProcessChunk() which we interrupted will read
-	// from the right place
-	fseek(bin3ds, findex, SEEK_SET);
+	return bytes + ArenaAlign(objects * sizeof(Object));
 }
 
-void Model_3DS::EditChunkProcessor(long length, long findex)
+size_t Model_3DS::MeasureMeshChunk(Chunk chunk, int &groups)
 {
 	ChunkHeader h;
+	Chunk sub(NULL, NULL);
+	Chunk list(NULL, NULL);
+	size_t bytes = 0;
+	int numVerts = 0;
+	int numCoords = 0;
+	char name[80];
 
-	// move the file pointer to the beginning of the main
-	// chunk's data findex + the size of the header
-	fseek(bin3ds, findex, SEEK_SET);
+	groups = 0;
 
-	// First count the number of Objects and Materials
-	while (ftell(bin3ds) < (findex + length - 6))
+	// The counts are clamped the same way the processors below clamp them
+	while (chunk.NextChunk(h, sub))
 	{
-		fread(&h.id,sizeof(h.id),1,bin3ds);
-		fread(&h.len,sizeof(h.len),1,bin3ds);
-
 		switch (h.id)
 		{
-			case OBJECT	:
-				numObjects++;
+			case VERT_LIST	:
+			{
+				unsigned short n = sub.ReadShort();
+
+				if (sub.Remaining() < (size_t)n * 12)
+					n = (unsigned short)(sub.Remaining() / 12);
+
+				// The vertices and their normals
+				numVerts = n;
+				bytes += ArenaAlign(n * 3 * sizeof(GLfloat)) * 2;
 				break;
-			case MATERIAL	:
-				numMaterials++;
+			}
+			case TEX_VERTS	:
+			{
+				unsigned short n = sub.ReadShort();
+
+				if (sub.Remaining() < (size_t)n * 8)
+					n = (unsigned short)(sub.Remaining() / 8);
+
+				numCoords = n;
+				bytes += ArenaAlign(n * 2 * sizeof(GLfloat));
+				break;
+			}
+			case FACE_DESC	:
+			{
+				unsigned short numFaces = sub.ReadShort();
+
+				if (sub.Remaining() < (size_t)numFaces * 8)
+					numFaces = (unsigned short)(sub.Remaining() / 8);
+
+				bytes += ArenaAlign(numFaces * 3 * sizeof(GLushort));
+				sub.Skip(numFaces * 8);
+
+				while (sub.NextChunk(h, list))
+				{
+					if (h.id != FACE_MAT)
+						continue;
+
+					list.ReadString(name, 80);
+
+					unsigned short numEntries = list.ReadShort();
+
+					if (list.Remaining() < (size_t)numEntries * 2)
+						numEntries = (unsigned short)(list.Remaining() / 2);
+
+					if (numFaces == 0)
+						numEntries = 0;
+
+					bytes += ArenaAlign(numEntries * 3 * sizeof(GLushort));
+					groups++;
+				}
 				break;
+			}
 			default			:
 				break;
 		}
-
-		fseek(bin3ds, (h.len - 6), SEEK_CUR);
 	}
 
-	// Now load the materials
-	if (numMaterials > 0)
-	{
-		Materials = new Material[numMaterials];
+	// Decode makes up texture coords for a mesh that has none
+	if (numCoords == 0)
+		bytes += ArenaAlign(numVerts * 2 * sizeof(GLfloat));
 
-		// Material is set to untextured until we find otherwise
-		for (int d = 0; d < numMaterials; d++)
-			Materials[d].textured = false;
+	return bytes + ArenaAlign(groups * sizeof(MaterialFaces));
+}
+
+void Model_3DS::IndexObjectChunk(Chunk chunk, ObjectInfo &info)
+{
+	ChunkHeader h;
+	Chunk mesh(NULL, NULL);
+	Chunk sub(NULL, NULL);
 
-		fseek(bin3ds, findex, SEEK_SET);
+	info.numVerts = 0;
+	info.numFaces = 0;
+	chunk.ReadString(info.name, 80);
 
-		int i = 0;
+	// Only the counts at the start of the lists are read, the same
+	// clamp as the processors keeps them honest
+	while (chunk.NextChunk(h, mesh))
+	{
+		if (h.id != TRIG_MESH)
+			continue;
 
-		while (ftell(bin3ds) < (findex + length - 6))
+		while (mesh.NextChunk(h, sub))
 		{
-			fread(&h.id,sizeof(h.id),1,bin3ds);
-			fread(&h.len,sizeof(h.len),1,bin3ds);
+			unsigned short n;
 
 			switch (h.id)
 			{
-				case MATERIAL	:
-					MaterialChunkProcessor(h.len, ftell(bin3ds), i);
-					i++;
+				case VERT_LIST	:
+					n = sub.ReadShort();
+					info.numVerts += (sub.Remaining() < (size_t)n * 12) ? (int)(sub.Remaining() / 12) : n;
+					break;
+				case FACE_DESC	:
+					n = sub.ReadShort();
+					info.numFaces += (sub.Remaining() < (size_t)n * 8) ? (int)(sub.Remaining() / 8) : n;
 					break;
 				default			:
 					break;
 			}
-
-			fseek(bin3ds, (h.len - 6), SEEK_CUR);
 		}
 	}
+}
 
-	// Load the Objects (individual meshes in the whole model)
-	if (numObjects > 0)
-	{
-		Objects = new Object[numObjects];
+bool Model_3DS::AcceptObject(const Chunk &chunk)
+{
+	if (!objectFilter)
+		return true;
 
-		// Set the textured variable to false until we find a texture
-		for (int k = 0; k < numObjects; k++)
-			Objects[k].textured = false;
+	ObjectInfo info;
 
-		// Zero the objects position and rotation
-		for (int m = 0; m < numObjects; m++)
+	IndexObjectChunk(chunk, info);
+	info.offset = (size_t)(chunk.pos - bin3ds.data) - 6;
+	return objectFilter(info);
+}
+
+bool Model_3DS::ReadIndex(const char *name, std::vector<ObjectInfo> &index)
+{
+	MappedFile file;
+	ChunkHeader h;
+	Chunk data(NULL, NULL);
+	Chunk edit(NULL, NULL);
+	Chunk sub(NULL, NULL);
+
+	index.clear();
+
+	if (!file.Open(name))
+		return false;
+
+	// Walk the chunk headers down to the objects, everything else is skipped
+	Chunk whole(file.data, file.data + file.size);
+
+	if (whole.NextChunk(h, data))
+	{
+		while (data.NextChunk(h, edit))
 		{
-			Objects[m].pos.x = 0.0f;
-			Objects[m].pos.y = 0.0f;
-			Objects[m].pos.z = 0.0f;
+			if (h.id != EDIT3DS)
+				continue;
+
+			while (edit.NextChunk(h, sub))
+			{
+				if (h.id != OBJECT)
+					continue;
+
+				ObjectInfo info;
 
-			Objects[m].rot.x = 0.0f;
-			Objects[m].rot.y = 0.0f;
-			Objects[m].rot.z = 0.0f;
+				IndexObjectChunk(sub, info);
+				info.offset = (size_t)(sub.pos - file.data) - 6;
+				index.push_back(info);
+			}
 		}
+	}
+
+	return true;
+}
 
-		// Zero out the number of texture coords
-		for (int n = 0; n < numObjects; n++)
-			Objects[n].numTexCoords = 0;
+Model_3DS::ObjectFilter Model_3DS::NamedObjects(const std::vector<std::string> &names)
+{
+	return [names](const ObjectInfo &info)
+	{
+		return std::find(names.begin(), names.end(), info.name) != names.end();
+	};
+}
+
+void Model_3DS::EditChunkProcessor(Chunk &chunk)
+{
+	LOADSTATS_SCOPE("EDIT3DS", chunk.Remaining());
 
-		fseek(bin3ds, findex, SEEK_SET);
+	ChunkHeader h;
+	Chunk sub(NULL, NULL);
+	int materials, objects;
 
-		int j = 0;
+	// Count everything first so the whole model fits in one allocation
+	size_t bytes = MeasureEditChunk(chunk, materials, objects);
 
-		while (ftell(bin3ds) < (findex + length - 6))
-		{
-			fread(&h.id,sizeof(h.id),1,bin3ds);
-			fread(&h.len,sizeof(h.len),1,bin3ds);
+	// A file with more than one edit chunk only keeps the last
+	FreeArrays();
 
-			switch (h.id)
+	arena = new unsigned char[bytes ? bytes : 1];
+	arenaSize = bytes;
+	arenaUsed = 0;
+
+	if (materials > 0)
+		Materials = new Material[materials];
+
+	if (objects > 0)
+		Objects = (Object *)ArenaAlloc(objects * sizeof(Object));
+
+	// Face groups that name a material further down the file
+	std::vector<PendingMatFaces> pending;
+	pendingMatFaces = &pending;
+
+	while (chunk.NextChunk(h, sub))
+	{
+		switch (h.id)
+		{
+			case MATERIAL	:
 			{
-				case OBJECT	:
-					ObjectChunkProcessor(h.len, ftell(bin3ds), j);
-					j++;
+				if (numMaterials >= materials)
 					break;
-				default			:
+
+				Material &m = Materials[numMaterials];
+
+				// Material is set to untextured until we find otherwise
+				m.name[0] = 0;
+				m.mapname[0] = 0;
+				m.textured = false;
+				m.shared = NULL;
+				m.atlasPage = -1;
+				m.color.r = m.color.g = m.color.b = m.color.a = 255;
+
+				MaterialChunkProcessor(sub, numMaterials++);
+				break;
+			}
+			case OBJECT	:
+			{
+				if (numObjects >= objects || !AcceptObject(sub))
 					break;
+
+				Object &o = Objects[numObjects];
+
+				// Start with an empty object that isn't moved or rotated
+				o.name[0] = 0;
+				o.Vertexes = NULL;
+				o.Normals = NULL;
+				o.TexCoords = NULL;
+				o.Faces = NULL;
+				o.numFaces = 0;
+				o.numMatFaces = 0;
+				o.numVerts = 0;
+				o.numTexCoords = 0;
+				o.textured = false;
+				o.MatFaces = NULL;
+				o.pos.x = o.pos.y = o.pos.z = 0.0f;
+				o.rot.x = o.rot.y = o.rot.z = 0.0f;
+				o.numLods = 0;
+				o.Packed = NULL;
+				memset(&o.bounds, 0, sizeof(o.bounds));
+
+				ObjectChunkProcessor(sub, numObjects++);
+				break;
 			}
+			default			:
+				break;
+		}
+	}
+
+	// Hook up the face groups that came before their material
+	for (size_t p = 0; p < pending.size(); p++)
+	{
+		Object &obj = Objects[pending[p].objindex];
+		int material;
 
-			fseek(bin3ds, (h.len - 6), SEEK_CUR);
+		for (material = 0; material < numMaterials; material++)
+		{
+			if (strcmp(pending[p].name, Materials[material].name) == 0)
+				break;
 		}
+
+		// A later mesh of the same object may have replaced the groups.
+		// A name that matched no material at all leaves the group at -1
+		if (pending[p].subfacesindex < obj.numMatFaces && material < numMaterials)
+			obj.MatFaces[pending[p].subfacesindex].MatIndex = material;
 	}
 
-	// move the file pointer back to where we got it so
-	// that the ProcessChunk() which we interrupted will read
-	// from the right place
-	fseek(bin3ds, findex, SEEK_SET);
+	pendingMatFaces = NULL;
 }
 
-void Model_3DS::MaterialChunkProcessor(long length, long findex, int matindex)
+void Model_3DS::MaterialChunkProcessor(Chunk &chunk, int matindex)
 {
-	ChunkHeader h;
+	LOADSTATS_SCOPE("MATERIAL", chunk.Remaining());
 
-	// move the file pointer to the beginning of the main
-	// chunk's data findex + the size of the header
-	fseek(bin3ds, findex, SEEK_SET);
+	ChunkHeader h;
+	Chunk sub(NULL, NULL);
 
-	while (ftell(bin3ds) < (findex + length - 6))
+	while (chunk.NextChunk(h, sub))
 	{
-		fread(&h.id,sizeof(h.id),1,bin3ds);
-		fread(&h.len,sizeof(h.len),1,bin3ds);
-
 		switch (h.id)
 		{
 			case MAT_NAME	:
 				// Loads the material's names
-				MaterialNameChunkProcessor(h.len, ftell(bin3ds), matindex);
+				MaterialNameChunkProcessor(sub, matindex);
 				break;
 			case MAT_AMBIENT	:
-				//ColorChunkProcessor(h.len, ftell(bin3ds));
+				//ColorChunkProcessor(sub);
 				break;
 			case MAT_DIFFUSE	:
-				DiffuseColorChunkProcessor(h.len, ftell(bin3ds), matindex);
+				DiffuseColorChunkProcessor(sub, matindex);
 				break;
 			case MAT_SPECULAR	:
-				//ColorChunkProcessor(h.len, ftell(bin3ds));
+				//ColorChunkProcessor(sub);
 			case MAT_TEXMAP	:
 				// Finds the names of the textures of the material and loads them
-				TextureMapChunkProcessor(h.len, ftell(bin3ds), matindex);
+				TextureMapChunkProcessor(sub, matindex);
 				break;
 			default			:
 				break;
 		}
-
-		fseek(bin3ds, (h.len - 6), SEEK_CUR);
 	}
-
-	// move the file pointer back to where we got it so
-	// that the ProcessChunk() which we interrupted will read
-	// from the right place
-	fseek(bin3ds, findex, SEEK_SET);
 }
 
-void Model_3DS::MaterialNameChunkProcessor(long length, long findex, int matindex)
+void Model_3DS::MaterialNameChunkProcessor(Chunk &chunk, int matindex)
 {
-	// move the file pointer to the beginning of the main
-	// chunk's data findex + the size of the header
-	fseek(bin3ds, findex, SEEK_SET);
-
 	// Read the material's name
-	for (int i = 0; i < 80; i++)
-	{
-		Materials[matindex].name[i] = fgetc(bin3ds);
-		if (Materials[matindex].name[i] == 0)
-		{
-			Materials[matindex].name[i] = NULL;
-			break;
-		}
-	}
-
-	// move the file pointer back to where we got it so
-	// that the ProcessChunk() which we interrupted will read
-	// from the right place
-	fseek(bin3ds, findex, SEEK_SET);
+	chunk.ReadString(Materials[matindex].name, 80);
 }
 
-void Model_3DS::DiffuseColorChunkProcessor(long length, long findex, int matindex)
+void Model_3DS::DiffuseColorChunkProcessor(Chunk &chunk, int matindex)
 {
 	ChunkHeader h;
+	Chunk sub(NULL, NULL);
 
-	// move the file pointer to the beginning of the main
-	// chunk's data findex + the size of the header
-	fseek(bin3ds, findex, SEEK_SET);
-
-	while (ftell(bin3ds) < (findex + length - 6))
+	while (chunk.NextChunk(h, sub))
 	{
-		fread(&h.id,sizeof(h.id),1,bin3ds);
-		fread(&h.len,sizeof(h.len),1,bin3ds);
-
 		// Determine the format of the color and load it
 		switch (h.id)
 		{
 			case COLOR_RGB	:
 				// A rgb float color chunk
-				FloatColorChunkProcessor(h.len, ftell(bin3ds), matindex);
+				FloatColorChunkProcessor(sub, matindex);
 				break;
 			case COLOR_TRU	:
 				// A rgb int color chunk
-				IntColorChunkProcessor(h.len, ftell(bin3ds), matindex);
+				IntColorChunkProcessor(sub, matindex);
 				break;
 			case COLOR_RGBG	:
 				// A rgb gamma corrected float color chunk
-				FloatColorChunkProcessor(h.len, ftell(bin3ds), matindex);
+				FloatColorChunkProcessor(sub, matindex);
 				break;
 			case COLOR_TRUG	:
 				// A rgb gamma corrected int color chunk
-				IntColorChunkProcessor(h.len, ftell(bin3ds), matindex);
+				IntColorChunkProcessor(sub, matindex);
 				break;
 			default			:
 				break;
 		}
-
-		fseek(bin3ds, (h.len - 6), SEEK_CUR);
 	}
-
-	// move the file pointer back to where we got it so
-	// that the ProcessChunk() which we interrupted will read
-	// from the right place
-	fseek(bin3ds, findex, SEEK_SET);
 }
 
-void Model_3DS::FloatColorChunkProcessor(long length, long findex, int matindex)
+void Model_3DS::FloatColorChunkProcessor(Chunk &chunk, int matindex)
 {
-	float r;
-	float g;
-	float b;
-
-	// move the file pointer to the beginning of the main
-	// chunk's data findex + the size of the header
-	fseek(bin3ds, findex, SEEK_SET);
+	float r = chunk.ReadFloat();
+	float g = chunk.ReadFloat();
+	float b = chunk.ReadFloat();
 
-	fread(&r,sizeof(r),1,bin3ds);
-	fread(&g,sizeof(g),1,bin3ds);
-	fread(&b,sizeof(b),1,bin3ds);
+	Material &m = Materials[matindex];
 
-	Materials[matindex].color.r = (unsigned char)(r*255.0f);
-	Materials[matindex].color.g = (unsigned char)(r*255.0f);
-	Materials[matindex].color.b = (unsigned char)(r*255.0f);
-	Materials[matindex].color.a = 255;
-
-	// move the file pointer back to where we got it so
-	// that the ProcessChunk() which we interrupted will read
-	// from the right place
-	fseek(bin3ds, findex, SEEK_SET);
+	m.color.r = (unsigned char)(r*255.0f);
+	m.color.g = (unsigned char)(g*255.0f);
+	m.color.b = (unsigned char)(b*255.0f);
+	m.color.a = 255;
 }
 
-void Model_3DS::IntColorChunkProcessor(long length, long findex, int matindex)
+void Model_3DS::IntColorChunkProcessor(Chunk &chunk, int matindex)
 {
-	unsigned char r;
-	unsigned char g;
-	unsigned char b;
-
-	// move the file pointer to the beginning of the main
-	// chunk's data findex + the size of the header
-	fseek(bin3ds, findex, SEEK_SET);
+	unsigned char r = chunk.ReadByte();
+	unsigned char g = chunk.ReadByte();
+	unsigned char b = chunk.ReadByte();
 
-	fread(&r,sizeof(r),1,bin3ds);
-	fread(&g,sizeof(g),1,bin3ds);
-	fread(&b,sizeof(b),1,bin3ds);
+	Material &m = Materials[matindex];
 
-	Materials[matindex].color.r = r;
-	Materials[matindex].color.g = g;
-	Materials[matindex].color.b = b;
-	Materials[matindex].color.a = 255;
-
-	// move the file pointer back to where we got it so
-	// that the ProcessChunk() which we interrupted will read
-	// from the right place
-	fseek(bin3ds, findex, SEEK_SET);
+	m.color.r = r;
+	m.color.g = g;
+	m.color.b = b;
+	m.color.a = 255;
 }
 
-void Model_3DS::TextureMapChunkProcessor(long length, long findex, int matindex)
+void Model_3DS::TextureMapChunkProcessor(Chunk &chunk, int matindex)
 {
-	ChunkHeader h;
+	LOADSTATS_SCOPE("MAT_TEXMAP", chunk.Remaining());
 
-	// move the file pointer to the beginning of the main
-	// chunk's data findex + the size of the header
-	fseek(bin3ds, findex, SEEK_SET);
+	ChunkHeader h;
+	Chunk sub(NULL, NULL);
 
-	while (ftell(bin3ds) < (findex + length - 6))
+	while (chunk.NextChunk(h, sub))
 	{
-		fread(&h.id,sizeof(h.id),1,bin3ds);
-		fread(&h.len,sizeof(h.len),1,bin3ds);
-
 		switch (h.id)
 		{
 			case MAT_MAPNAME:
 				// Read the name of texture in the Diffuse Color map
-				MapNameChunkProcessor(h.len, ftell(bin3ds), matindex);
+				MapNameChunkProcessor(sub, matindex);
 				break;
 			default			:
 				break;
 		}
-
-		fseek(bin3ds, (h.len - 6), SEEK_CUR);
 	}
-
-	// move the file pointer back to where we got it so
-	// that the ProcessChunk() which we interrupted will read
-	// from the right place
-	fseek(bin3ds, findex, SEEK_SET);
 }
 
-void Model_3DS::MapNameChunkProcessor(long length, long findex, int matindex)
+void Model_3DS::MapNameChunkProcessor(Chunk &chunk, int matindex)
 {
 	char name[80];
 
-	// move the file pointer to the beginning of the main
-	// chunk's data findex + the size of the header
-	fseek(bin3ds, findex, SEEK_SET);
-
 	// Read the name of the texture
-	for (int i = 0; i < 80; i++)
-	{
-		name[i] = fgetc(bin3ds);
-		if (name[i] == 0)
-		{
-			name[i] = NULL;
-			break;
-		}
-	}
+	chunk.ReadString(name, 80);
 
 	std::string n = name;
-	n.erase(n.end() - 3, n.end());
+	if (n.size() >= 3)
+		n.erase(n.end() - 3, n.end());
 	n += "bmp";
-	// Load the name and indicate that the material has a texture
-	char fullname[80];
-	sprintf(fullname, "%s%s", path, n.c_str());
-	Materials[matindex].tex.Load(fullname);
-	Materials[matindex].textured = true;
-
-	// move the file pointer back to where we got it so
-	// that the ProcessChunk() which we interrupted will read
-	// from the right place
-	fseek(bin3ds, findex, SEEK_SET);
+	// Store the name and indicate that the material has a texture,
+	// the texture itself is loaded once the whole model is read
+	Material &m = Materials[matindex];
+	strncpy(m.mapname, n.c_str(), sizeof(m.mapname) - 1);
+	m.mapname[sizeof(m.mapname) - 1] = 0;
+	m.textured = true;
 }
 
-void Model_3DS::ObjectChunkProcessor(long length, long findex, int objindex)
+void Model_3DS::ObjectChunkProcessor(Chunk &chunk, int objindex)
 {
-	ChunkHeader h;
+	LOADSTATS_SCOPE("OBJECT", chunk.Remaining());
 
-	// move the file pointer to the beginning of the main
-	// chunk's data findex + the size of the header
-	fseek(bin3ds, findex, SEEK_SET);
+	ChunkHeader h;
+	Chunk sub(NULL, NULL);
 
 	// Load the object's name
-	for (int i = 0; i < 80; i++)
-	{
-		Objects[objindex].name[i] = fgetc(bin3ds);
-		if (Objects[objindex].name[i] == 0)
-		{
-			Objects[objindex].name[i] = NULL;
-			break;
-		}
-	}
+	chunk.ReadString(Objects[objindex].name, 80);
 
-	while (ftell(bin3ds) < (findex + length - 6))
+	while (chunk.NextChunk(h, sub))
 	{
-		fread(&h.id,sizeof(h.id),1,bin3ds);
-		fread(&h.len,sizeof(h.len),1,bin3ds);
-
 		switch (h.id)
 		{
 			case TRIG_MESH	:
 				// Process the triangles of the object
-				TriangularMeshChunkProcessor(h.len, ftell(bin3ds), objindex);
+				TriangularMeshChunkProcessor(sub, objindex);
 				break;
 			default			:
 				break;
 		}
-
-		fseek(bin3ds, (h.len - 6), SEEK_CUR);
 	}
-
-	// move the file pointer back to where we got it so
-	// that the ProcessChunk() which we interrupted will read
-	// from the right place
-	fseek(bin3ds, findex, SEEK_SET);
 }
 
-void Model_3DS::TriangularMeshChunkProcessor(long length, long findex, int objindex)
+void Model_3DS::TriangularMeshChunkProcessor(Chunk &chunk, int objindex)
 {
+	LOADSTATS_SCOPE("TRIG_MESH", chunk.Remaining());
+
 	ChunkHeader h;
+	Chunk sub(NULL, NULL);
+	Object &obj = Objects[objindex];
+	int groups;
 
-	// move the file pointer to the beginning of the main
-	// chunk's data findex + the size of the header
-	fseek(bin3ds, findex, SEEK_SET);
+	// Make room for the face groups up front, they are filled in as they are found
+	MeasureMeshChunk(chunk, groups);
 
-	while (ftell(bin3ds) < (findex + length - 6))
+	if (groups > 0)
 	{
-		fread(&h.id,sizeof(h.id),1,bin3ds);
-		fread(&h.len,sizeof(h.len),1,bin3ds);
+		obj.MatFaces = (MaterialFaces *)ArenaAlloc(groups * sizeof(MaterialFaces));
+		obj.numMatFaces = 0;
+
+		if (obj.MatFaces == NULL)
+			groups = 0;
+	}
 
+	while (chunk.NextChunk(h, sub))
+	{
 		switch (h.id)
 		{
 			case VERT_LIST	:
 				// Load the vertices of the onject
-				VertexListChunkProcessor(h.len, ftell(bin3ds), objindex);
+				VertexListChunkProcessor(sub, objindex);
 				break;
 			case LOCAL_COORDS	:
-				//LocalCoordinatesChunkProcessor(h.len, ftell(bin3ds));
+				//LocalCoordinatesChunkProcessor(sub);
 				break;
 			case TEX_VERTS	:
 				// Load the texture coordinates for the vertices
-				TexCoordsChunkProcessor(h.len, ftell(bin3ds), objindex);
-				Objects[objindex].textured = true;
-				break;
-			default			:
+				TexCoordsChunkProcessor(sub, objindex);
+				obj.textured = true;
 				break;
-		}
-
-		fseek(bin3ds, (h.len - 6), SEEK_CUR);
-	}
-
-	// After we have loaded the vertices we can load the faces
-	fseek(bin3ds, findex, SEEK_SET);
-
-	while (ftell(bin3ds) < (findex + length - 6))
-	{
-		fread(&h.id,sizeof(h.id),1,bin3ds);
-		fread(&h.len,sizeof(h.len),1,bin3ds);
-
-		switch (h.id)
-		{
 			case FACE_DESC	:
 				// Load the faces of the object
-				FacesDescriptionChunkProcessor(h.len, ftell(bin3ds), objindex);
+				FacesDescriptionChunkProcessor(sub, objindex, groups);
 				break;
 			default			:
 				break;
 		}
-
-		fseek(bin3ds, (h.len - 6), SEEK_CUR);
 	}
-
-	// move the file pointer back to where we got it so
-	// that the ProcessChunk() which we interrupted will read
-	// from the right place
-	fseek(bin3ds, findex, SEEK_SET);
 }
 
-void Model_3DS::VertexListChunkProcessor(long length, long findex, int objindex)
+void Model_3DS::VertexListChunkProcessor(Chunk &chunk, int objindex)
 {
-	unsigned short numVerts;
+	LOADSTATS_SCOPE("VERT_LIST", chunk.Remaining());
 
-	// move the file pointer to the beginning of the main
-	// chunk's data findex + the size of the header
-	fseek(bin3ds, findex, SEEK_SET);
+	Object &obj = Objects[objindex];
 
 	// Read the number of vertices of the object
-	fread(&numVerts,sizeof(numVerts),1,bin3ds);
+	unsigned short numVerts = chunk.ReadShort();
+
+	// Don't trust a count the chunk doesn't have room for
+	if (chunk.Remaining() < (size_t)numVerts * 12)
+		numVerts = (unsigned short)(chunk.Remaining() / 12);
+
+	// Take arrays for the vertices and normals
+	obj.Vertexes = (GLfloat *)ArenaAlloc(numVerts * 3 * sizeof(GLfloat));
+	obj.Normals = (GLfloat *)ArenaAlloc(numVerts * 3 * sizeof(GLfloat));
 
-	// Allocate arrays for the vertices and normals
-	Objects[objindex].Vertexes = new GLfloat[numVerts * 3];
-	Objects[objindex].Normals = new GLfloat[numVerts * 3];
+	if (obj.Vertexes == NULL || obj.Normals == NULL)
+		numVerts = 0;
 
 	// Assign the number of vertices for future use
-	Objects[objindex].numVerts = numVerts;
+	obj.numVerts = numVerts;
 
 	// Zero out the normals array
-	for (int j = 0; j < numVerts * 3; j++)
-		Objects[objindex].Normals[j] = 0.0f;
+	memset(obj.Normals, 0, numVerts * 3 * sizeof(GLfloat));
+
+	// Copy the whole list out of the file at once
+	chunk.Read(obj.Vertexes, numVerts * 3 * sizeof(GLfloat));
+
+	// Switch the y and z coordinates and change the sign of the z coordinate,
+	// growing the object's box while the vertices are at hand
+	float lo[3] = { 0.0f, 0.0f, 0.0f };
+	float hi[3] = { 0.0f, 0.0f, 0.0f };
 
-	// Read the vertices, switching the y and z coordinates and changing the sign of the z coordinate
 	for (int i = 0; i < numVerts * 3; i+=3)
 	{
-		fread(&Objects[objindex].Vertexes[i],sizeof(GLfloat),1,bin3ds);
-		fread(&Objects[objindex].Vertexes[i+2],sizeof(GLfloat),1,bin3ds);
-		fread(&Objects[objindex].Vertexes[i+1],sizeof(GLfloat),1,bin3ds);
+		GLfloat *p = &obj.Vertexes[i];
+		GLfloat y = p[1];
+
+		p[1] = p[2];
+		p[2] = -y;
+
+		for (int k = 0; k < 3; k++)
+		{
+			if (i == 0 || p[k] < lo[k]) lo[k] = p[k];
+			if (i == 0 || p[k] > hi[k]) hi[k] = p[k];
+		}
+	}
+
+	Bounds &b = obj.bounds;
 
-		// Change the sign of the z coordinate
-		Objects[objindex].Vertexes[i+2] = -Objects[objindex].Vertexes[i+2];
+	b.min.x = lo[0];
+	b.min.y = lo[1];
+	b.min.z = lo[2];
+	b.max.x = hi[0];
+	b.max.y = hi[1];
+	b.max.z = hi[2];
+	b.center.x = (lo[0] + hi[0]) * 0.5f;
+	b.center.y = (lo[1] + hi[1]) * 0.5f;
+	b.center.z = (lo[2] + hi[2]) * 0.5f;
+
+	// The sphere around the box's center, the vertices are still in the cache
+	float r2 = 0.0f;
+
+	for (int i = 0; i < numVerts * 3; i+=3)
+	{
+		const GLfloat *p = &obj.Vertexes[i];
+		float dx = p[0] - b.center.x;
+		float dy = p[1] - b.center.y;
+		float dz = p[2] - b.center.z;
+		float d2 = dx * dx + dy * dy + dz * dz;
+
+		if (d2 > r2)
+			r2 = d2;
 	}
 
-	// move the file pointer back to where we got it so
-	// that the ProcessChunk() which we interrupted will read
-	// from the right place
-	fseek(bin3ds, findex, SEEK_SET);
+	b.radius = sqrtf(r2);
 }
 
-void Model_3DS::TexCoordsChunkProcessor(long length, long findex, int objindex)
+void Model_3DS::TexCoordsChunkProcessor(Chunk &chunk, int objindex)
 {
-	// The number of texture coordinates
-	unsigned short numCoords;
+	LOADSTATS_SCOPE("TEX_VERTS", chunk.Remaining());
 
-	// move the file pointer to the beginning of the main
-	// chunk's data findex + the size of the header
-	fseek(bin3ds, findex, SEEK_SET);
+	Object &obj = Objects[objindex];
 
 	// Read the number of coordinates
-	fread(&numCoords,sizeof(numCoords),1,bin3ds);
+	unsigned short numCoords = chunk.ReadShort();
 
-	// Allocate an array to hold the texture coordinates
-	Objects[objindex].TexCoords = new GLfloat[numCoords * 2];
+	// Don't trust a count the chunk doesn't have room for
+	if (chunk.Remaining() < (size_t)numCoords * 8)
+		numCoords = (unsigned short)(chunk.Remaining() / 8);
+
+	// Take an array to hold the texture coordinates
+	obj.TexCoords = (GLfloat *)ArenaAlloc(numCoords * 2 * sizeof(GLfloat));
+
+	if (obj.TexCoords == NULL)
+		numCoords = 0;
 
 	// Set the number of texture coords
-	Objects[objindex].numTexCoords = numCoords;
+	obj.numTexCoords = numCoords;
 
 	// Read teh texture coordiantes into the array
-	for (int i = 0; i < numCoords * 2; i+=2)
-	{
-		fread(&Objects[objindex].TexCoords[i],sizeof(GLfloat),1,bin3ds);
-		fread(&Objects[objindex].TexCoords[i+1],sizeof(GLfloat),1,bin3ds);
-	}
-
-	// move the file pointer back to where we got it so
-	// that the ProcessChunk() which we interrupted will read
-	// from the right place
-	fseek(bin3ds, findex, SEEK_SET);
+	chunk.Read(obj.TexCoords, numCoords * 2 * sizeof(GLfloat));
 }
 
-void Model_3DS::FacesDescriptionChunkProcessor(long length, long findex, int objindex)
+void Model_3DS::FacesDescriptionChunkProcessor(Chunk &chunk, int objindex, int maxGroups)
 {
+	LOADSTATS_SCOPE("FACE_DESC", chunk.Remaining());
+
 	ChunkHeader h;
-	unsigned short numFaces;	// The number of faces in the object
-	unsigned short vertA;		// The first vertex of the face
-	unsigned short vertB;		// The second vertex of the face
-	unsigned short vertC;		// The third vertex of the face
-	unsigned short flags;		// The winding order flags
-	long subs;					// Holds our place in the file
-	int numMatFaces = 0;		// The number of different materials
-
-	// move the file pointer to the beginning of the main
-	// chunk's data findex + the size of the header
-	fseek(bin3ds, findex, SEEK_SET);
+	Chunk sub(NULL, NULL);
+	Object &obj = Objects[objindex];
 
 	// Read the number of faces
-	fread(&numFaces,sizeof(numFaces),1,bin3ds);
+	unsigned short numFaces = chunk.ReadShort();
 
-	// Allocate an array to hold the faces
-	Objects[objindex].Faces = new GLushort[numFaces * 3];
+	// Don't trust a count the chunk doesn't have room for
+	if (chunk.Remaining() < (size_t)numFaces * 8)
+		numFaces = (unsigned short)(chunk.Remaining() / 8);
+
+	// Take an array to hold the faces
+	obj.Faces = (GLushort *)ArenaAlloc(numFaces * 3 * sizeof(GLushort));
 	// Store the number of faces
-	Objects[objindex].numFaces = numFaces * 3;
+	obj.numFaces = obj.Faces ? numFaces * 3 : 0;
 
-	// Read the faces into the array
-	for (int i = 0; i < numFaces * 3; i+=3)
-	{
-		// Read the vertices of the face
-		fread(&vertA,sizeof(vertA),1,bin3ds);
-		fread(&vertB,sizeof(vertB),1,bin3ds);
-		fread(&vertC,sizeof(vertC),1,bin3ds);
-		fread(&flags,sizeof(flags),1,bin3ds);
-
-		// Place them in the array
-		Objects[objindex].Faces[i]   = vertA;
-		Objects[objindex].Faces[i+1] = vertB;
-		Objects[objindex].Faces[i+2] = vertC;
-
-		// Calculate the face's normal
-		Vector n;
-		Vertex v1;
-		Vertex v2;
-		Vertex v3;
-
-		v1.x = Objects[objindex].Vertexes[vertA*3];
-		v1.y = Objects[objindex].Vertexes[vertA*3+1];
-		v1.z = Objects[objindex].Vertexes[vertA*3+2];
-		v2.x = Objects[objindex].Vertexes[vertB*3];
-		v2.y = Objects[objindex].Vertexes[vertB*3+1];
-		v2.z = Objects[objindex].Vertexes[vertB*3+2];
-		v3.x = Objects[objindex].Vertexes[vertC*3];
-		v3.y = Objects[objindex].Vertexes[vertC*3+1];
-		v3.z = Objects[objindex].Vertexes[vertC*3+2];
-
-		// calculate the normal
-		float u[3], v[3];
-
-		// V2 - V3;
-		u[0] = v2.x - v3.x;
-		u[1] = v2.y - v3.y;
-		u[2] = v2.z - v3.z;
-
-		// V2 - V1;
-		v[0] = v2.x - v1.x;
-		v[1] = v2.y - v1.y;
-		v[2] = v2.z - v1.z;
-
-		n.x = (u[1]*v[2] - u[2]*v[1]);
-		n.y = (u[2]*v[0] - u[0]*v[2]);
-		n.z = (u[0]*v[1] - u[1]*v[0]);
-
-		// Add this normal to its verts' normals
-		Objects[objindex].Normals[vertA*3]   += n.x;
-		Objects[objindex].Normals[vertA*3+1] += n.y;
-		Objects[objindex].Normals[vertA*3+2] += n.z;
-		Objects[objindex].Normals[vertB*3]   += n.x;
-		Objects[objindex].Normals[vertB*3+1] += n.y;
-		Objects[objindex].Normals[vertB*3+2] += n.z;
-		Objects[objindex].Normals[vertC*3]   += n.x;
-		Objects[objindex].Normals[vertC*3+1] += n.y;
-		Objects[objindex].Normals[vertC*3+2] += n.z;
-	}
-
-	// Store our current file position
-	subs = ftell(bin3ds);
-
-	// Check to see how many materials the faces are split into
-	while (ftell(bin3ds) < (findex + length - 6))
-	{
-		fread(&h.id,sizeof(h.id),1,bin3ds);
-		fread(&h.len,sizeof(h.len),1,bin3ds);
+	// Read the faces into the array, each face is three vertices and the winding order flags
+	const unsigned char *src = chunk.pos;
+
+	for (int i = 0; i < obj.numFaces; i+=3, src += 8)
+	{
+		memcpy(&obj.Faces[i], src, 3 * sizeof(GLushort));
+	}
+
+	chunk.Skip(numFaces * 8);
 
+	// Split the faces up according to their materials
+	while (chunk.NextChunk(h, sub))
+	{
 		switch (h.id)
 		{
 			case FACE_MAT	:
-				//FacesMaterialsListChunkProcessor(h.len, ftell(bin3ds), objindex);
-				numMatFaces++;
+				// Process the faces and split them up
+				FacesMaterialsListChunkProcessor(sub, objindex, maxGroups);
 				break;
 			default			:
 				break;
 		}
-
-		fseek(bin3ds, (h.len - 6), SEEK_CUR);
-	}
-
-	// Split the faces up according to their materials
-	if (numMatFaces > 0)
-	{
-		// Allocate an array to hold the lists of faces divided by material
-		Objects[objindex].MatFaces = new MaterialFaces[numMatFaces];
-		// Store the number of material faces
-		Objects[objindex].numMatFaces = numMatFaces;
-
-		fseek(bin3ds, subs, SEEK_SET);
-
-		int j = 0;
-
-		// Split the faces up
-		while (ftell(bin3ds) < (findex + length - 6))
-		{
-			fread(&h.id,sizeof(h.id),1,bin3ds);
-			fread(&h.len,sizeof(h.len),1,bin3ds);
-
-			switch (h.id)
-			{
-				case FACE_MAT	:
-					// Process the faces and split them up
-					FacesMaterialsListChunkProcessor(h.len, ftell(bin3ds), objindex, j);
-					j++;
-					break;
-				default			:
-					break;
-			}
-
-			fseek(bin3ds, (h.len - 6), SEEK_CUR);
-		}
 	}
-
-	// move the file pointer back to where we got it so
-	// that the ProcessChunk() which we interrupted will read
-	// from the right place
-	fseek(bin3ds, findex, SEEK_SET);
 }
 
-void Model_3DS::FacesMaterialsListChunkProcessor(long length, long findex, int objindex, int subfacesindex)
+void Model_3DS::FacesMaterialsListChunkProcessor(Chunk &chunk, int objindex, int maxGroups)
 {
+	LOADSTATS_SCOPE("FACE_MAT", chunk.Remaining());
+
 	char name[80];				// The material's name
-	unsigned short numEntries;	// The number of faces associated with this material
-	unsigned short Face;		// Holds the faces as they are read
 	int material;				// An index to the Materials array for this material
+	Object &obj = Objects[objindex];
 
-	// move the file pointer to the beginning of the main
-	// chunk's data findex + the size of the header
-	fseek(bin3ds, findex, SEEK_SET);
+	// The mesh was measured, there is always room unless the file lied
+	if (obj.numMatFaces >= maxGroups)
+		return;
+
+	MaterialFaces &group = obj.MatFaces[obj.numMatFaces];
 
 	// Read the material's name
-	for (int i = 0; i < 80; i++)
-	{
-		name[i] = fgetc(bin3ds);
-		if (name[i] == 0)
-		{
-			name[i] = NULL;
-			break;
-		}
-	}
+	chunk.ReadString(name, 80);
 
 	// Faind the material's index in the Materials array
 	for (material = 0; material < numMaterials; material++)
@@ -1117,30 +3351,59 @@ void Model_3DS::FacesMaterialsListChunkProcessor(long length, long findex, int o
 			break;
 	}
 
-	// Store this value for later so that we can find the material
-	Objects[objindex].MatFaces[subfacesindex].MatIndex = material;
+	// The material may still be ahead of us in the file
+	if (material == numMaterials)
+	{
+		PendingMatFaces p;
+		p.objindex = objindex;
+		p.subfacesindex = obj.numMatFaces;
+		strcpy(p.name, name);
+		pendingMatFaces->push_back(p);
+	}
+
+	// Store this value for later so that we can find the material,
+	// -1 until the pending one turns up
+	group.MatIndex = (material < numMaterials) ? material : -1;
 
 	// Read the number of faces associated with this material
-	fread(&numEntries,sizeof(numEntries),1,bin3ds);
+	unsigned short numEntries = chunk.ReadShort();
+
+	// Don't trust a count the chunk doesn't have room for
+	if (chunk.Remaining() < (size_t)numEntries * 2)
+		numEntries = (unsigned short)(chunk.Remaining() / 2);
 
-	// Allocate an array to hold the list of faces associated with this material
-	Objects[objindex].MatFaces[subfacesindex].subFaces = new GLushort[numEntries * 3];
-	// Store this number for later use
-	Objects[objindex].MatFaces[subfacesindex].numSubFaces = numEntries * 3;
+	// There is nothing to split up if the object has no faces
+	if (obj.numFaces == 0)
+		numEntries = 0;
+
+	// Take an array to hold the list of faces associated with this material
+	group.subFaces = (GLushort *)ArenaAlloc(numEntries * 3 * sizeof(GLushort));
+	group.subFaces32 = NULL;
+
+	if (group.subFaces == NULL)
+		numEntries = 0;
 
 	// Read the faces into the array
-	for (int i = 0; i < numEntries * 3; i+=3)
+	int written = 0;
+
+	for (int i = 0; i < numEntries; i++)
 	{
 		// read the face
-		fread(&Face,sizeof(Face),1,bin3ds);
+		unsigned short Face = chunk.ReadShort();
+
+		// Skip faces that don't exist
+		if (Face * 3 >= obj.numFaces)
+			continue;
+
 		// Add the face's vertices to the list
-		Objects[objindex].MatFaces[subfacesindex].subFaces[i] = Objects[objindex].Faces[Face * 3];
-		Objects[objindex].MatFaces[subfacesindex].subFaces[i+1] = Objects[objindex].Faces[Face * 3 + 1];
-		Objects[objindex].MatFaces[subfacesindex].subFaces[i+2] = Objects[objindex].Faces[Face * 3 + 2];
-	}
-	
-	// move the file pointer back to where we got it so
-	// that the ProcessChunk() which we interrupted will read
-	// from the right place
-	fseek(bin3ds, findex, SEEK_SET);
+		group.subFaces[written] = obj.Faces[Face * 3];
+		group.subFaces[written+1] = obj.Faces[Face * 3 + 1];
+		group.subFaces[written+2] = obj.Faces[Face * 3 + 2];
+		written += 3;
+	}
+
+	// Store this number for later use, the faces that were there
+	group.numSubFaces = written;
+
+	obj.numMatFaces++;
 }
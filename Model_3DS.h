@@ -17,12 +17,13 @@
 // 2) If you want the face to be textured assign the
 //    texture to the Diffuse Color map
 // 3) The texture must be supported by the GLTexture class
-//    which only supports bitmap and targa right now
+//    which supports bitmap, targa, JPEG and PNG files
 // 4) The texture must be located in the same directory as
 //    the model
 //
 // Support for non-textured faces is done by reading the color
-// from the material's diffuse color.
+// from the material's diffuse color. They are drawn untextured
+// in that color, times the color the caller set.
 //
 // Some models have problems loading even if you follow all of
 // the restrictions I have stated and I don't know why. If you
@@ -38,6 +39,18 @@
 // m.Load("model.3ds"); // Load the model
 // m.Draw();			// Renders the model to the screen
 //
+// // Load is Decode followed by Finalize. Decode does all of the
+// // file reading and never touches OpenGL, so many models can be
+// // decoded on worker threads at once. Finalize creates the GL
+// // textures and has to run on the thread that owns the context.
+// m.Decode("model.3ds");	// On any thread
+// m.Finalize();			// On the GL thread
+//
+// // Until Finalize is done Draw doesn't render the model. Once
+// // the geometry is decoded and the model is marked decoded it
+// // draws a wire box around the model as a placeholder.
+// m.decoded = true;		// Set by the asset loader on the GL thread
+//
 // // If you want to show the model's normals
 // m.shownormals = true;
 //
@@ -57,6 +70,9 @@
 // m.pos.y = 0.0f;
 // m.pos.z = 0.0f;
 //
+// // To draw one loaded model in many places give each place a
+// // ModelInstance, they share the model's geometry and textures
+//
 // // If you want to move or rotate individual objects
 // m.Objects[0].rot.x = 90.0f;
 // m.Objects[0].rot.y = 30.0f;
@@ -66,6 +82,102 @@
 // m.Objects[0].pos.y = 0.0f;
 // m.Objects[0].pos.z = 0.0f;
 //
+// // The first Load of a model bakes its final geometry into
+// // "model.3ds.cache" next to it. Later loads map that file
+// // instead of parsing the 3ds file again. The cache is rebuilt
+// // whenever the 3ds file's size or time stamp changes. Set this
+// // before Load to always parse the 3ds file.
+// m.useCache = false;
+//
+// // Set this before Load to weld duplicate vertices and reorder
+// // the triangles and vertices for the GPU's vertex cache. The
+// // result is baked into the cache, optimizeStats tells how much
+// // it helped.
+// m.optimize = true;
+// printf("ACMR %.2f -> %.2f\n", m.optimizeStats.acmrBefore, m.optimizeStats.acmrAfter);
+//
+// // Set this before Load to also make up to MAX_LODS simplified
+// // levels of detail, each with about half the triangles of the
+// // one before. They are baked into the cache too.
+// m.generateLods = true;
+//
+// // Draw picks the level from how far away the model is and the
+// // scale the caller draws it at, so the level's error stays
+// // below about a pixel. A bias above 1 switches to the coarser
+// // levels sooner, below 1 later.
+// m.lodBias = 2.0f;
+// m.Draw(distance, 0.7f);
+//
+// // Set this before Load to draw from one interleaved stream of
+// // 16 byte vertices instead of three float arrays (32 bytes a
+// // vertex). Positions and texture coordinates are 16 bit and
+// // scaled back in the modelview and texture matrices, normals are
+// // 16 bit too. Like any scaled model it needs GL_NORMALIZE for lighting.
+// m.packVertices = true;
+//
+// // Set this before Load to merge the objects into one vertex
+// // array with one list of faces per material, so Draw makes one
+// // draw call per material instead of one per object and material.
+// // It is only done when no object has a pos or rot of its own, and
+// // only when it saves draws. Past 65535 vertices the merged lists
+// // use 32 bit indices. Moving objects afterwards has no effect.
+// m.staticBatch = true;
+//
+// // How much memory the geometry takes, and what packing saves
+// Model_3DS::MemoryStats mem;
+// m.GetMemoryStats(mem);
+//
+// // Load finds a box and a sphere around every object and around
+// // the whole model, in model units. The world versions add the
+// // model's pos, rot and scale, and an optional instance matrix
+// // (column major like OpenGL's) that is applied before them.
+// Model_3DS::Bounds b;
+// m.GetWorldBounds(instanceMatrix, b);
+// m.GetObjectWorldBounds(0, NULL, b);
+//
+// // After moving objects around, bring the model's bounds up to date
+// m.UpdateBounds();
+//
+// // All of a model's geometry lives in one block of memory that
+// // is sized before the file is parsed. Free releases it along
+// // with the GL textures, loading again frees the old model first.
+// m.Free();
+//
+// // Only the materials some face uses get a texture. Set this
+// // before Load to also put off reading and making each texture
+// // until the first Draw that needs it, so the model is ready to
+// // draw as soon as its geometry is. PreloadTextures makes all of
+// // them at once instead, e.g. behind a loading screen.
+// m.lazyTextures = true;
+// m.PreloadTextures();	// On the GL thread
+//
+// // Models can put their small textures on the pages of a shared
+// // atlas (see TextureAtlas.h), set it before Load. A material
+// // goes in when its faces don't tile the texture or share
+// // vertices with another material's faces. Its texture
+// // coordinates are moved into the page after the mesh cache is
+// // written, so the cache doesn't depend on the atlas, and the
+// // static batch merges the materials on one page into one draw.
+// // Lazy models keep their textures apart. Loaded through the
+// // AssetLoader, FinalizeSome waits for a worker to build the page.
+// TextureAtlas propAtlas;
+// m.atlas = &propAtlas;
+//
+// // Big files can be used as a library of props. ReadIndex lists
+// // the objects of a file from their chunk headers alone, and a
+// // filter set before Load makes it skip every object it doesn't
+// // take without reading it. Filtered loads don't use the mesh
+// // cache, it holds whole models.
+// std::vector<Model_3DS::ObjectInfo> index;
+// Model_3DS::ReadIndex("forest.3ds", index);
+//
+// m.objectFilter = Model_3DS::NamedObjects({ "Tree01", "Rock02" });
+// m.objectFilter = [](const Model_3DS::ObjectInfo &o) { return o.numFaces < 1000; };
+//
+// // Models can be moved, e.g. to keep them in a std::vector
+// std::vector<Model_3DS> models;
+// models.push_back(std::move(m));
+//
 //////////////////////////////////////////////////////////////////////
 
 #ifndef MODEL_3DS_H
@@ -75,12 +187,23 @@
 // Would have greatly bloated the model class's code
 // Just replace this with your favorite texture class
 #include "GLTexture.h"
+#include "TextureCache.h"
+#include "TextureAtlas.h"
+#include "MappedFile.h"
+#include "MeshOptimizer.h"
 
 #include <stdio.h>
+#include <functional>
+#include <string>
+#include <vector>
 
 class Model_3DS  
 {
 public:
+	enum {
+		MAX_LODS = 3		// The most simplified levels a model gets
+	};
+
 	// A VERY simple vector struct
 	// I could have included a complex class but I wanted the model class to stand alone
 	struct Vector {
@@ -104,26 +227,88 @@ public:
 		unsigned char a;
 	};
 
+	// One vertex of the packed stream. pos is scaled to the object's box,
+	// normal is scaled to that box too so GL's normal matrix undoes it
+	struct PackedVertex {
+		short pos[3];				// The position
+		short normal[3];			// The normal
+		short uv[2];				// The texture coordinate
+	};
+
+	// A box and a sphere around some geometry
+	struct Bounds {
+		Vector min;					// The smallest corner of the box
+		Vector max;					// The largest corner of the box
+		Vector center;				// The center of the sphere
+		float radius;				// The radius of the sphere
+	};
+
+	// What the geometry of a model costs
+	struct MemoryStats {
+		size_t vertexBytes;			// The float vertex, normal and texture coordinate arrays
+		size_t packedBytes;			// The packed vertices, zero unless packVertices
+		size_t indexBytes;			// The faces and the material groups of the full meshes
+		size_t lodBytes;			// The material groups of the simplified levels
+		size_t batchBytes;			// The merged vertices and faces of the static batch
+	};
+
 	// Holds the material info
-	// TODO: add color support for non textured polys
 	struct Material {
 		char name[80];	// The material's name
+		char mapname[80];	// The material's texture file, relative to the model
 		GLTexture tex;	// The texture (this is the only outside reference in this class)
+		TextureCache::Entry *shared;	// The texture file as the cache shares it, NULL for a color
 		bool textured;	// whether or not it is textured
 		Color4i color;
+		bool referenced;	// True: some face is drawn with the material
+		bool loaded;	// True: the GL texture has been made
+		int atlasPage;	// The atlas page the texture was packed on, -1 if it has its own
 	};
 
+	// One object of a 3ds file as ReadIndex finds it, without loading it
+	struct ObjectInfo {
+		char name[80];				// The object's name
+		size_t offset;				// Where the object's chunk starts in the file
+		int numVerts;				// The number of vertices of its meshes
+		int numFaces;				// The number of triangles of its meshes
+	};
+
+	// Says whether Decode should load an object
+	typedef std::function<bool(const ObjectInfo &)> ObjectFilter;
+
 	// Every chunk in the 3ds file starts with this struct
 	struct ChunkHeader {
 		unsigned short id;	// The chunk's id
 		unsigned long  len;	// The lenght of the chunk
 	};
 
+	// A bounds-checked read cursor over the data of one chunk in the
+	// mapped file. Reads past the end of the chunk return zeros and
+	// clear ok instead of running off the end of the file.
+	struct Chunk {
+		const unsigned char *pos;	// The next byte to read
+		const unsigned char *end;	// One past the last byte of the chunk
+		bool ok;					// False once a read went out of bounds
+
+		Chunk(const unsigned char *start, const unsigned char *stop) : pos(start), end(stop), ok(true) {}
+		size_t Remaining() const { return (size_t)(end - pos); }
+		bool Read(void *dst, size_t n);
+		unsigned char ReadByte();
+		unsigned short ReadShort();
+		unsigned long ReadLong();
+		float ReadFloat();
+		void ReadString(char *dst, int max);
+		bool Skip(size_t n);
+		// Reads the next sub chunk header and returns a cursor over its data
+		bool NextChunk(ChunkHeader &h, Chunk &child);
+	};
+
 	// I sort the mesh by material so that I won't have to switch textures a great deal
 	struct MaterialFaces {
 		unsigned short *subFaces;	// Index to our vertex array of all the faces that use this material
+		unsigned int *subFaces32;	// The same with 32 bit indices, only a batch past 65535 vertices sets it instead
 		int numSubFaces;			// The number of faces
-		int MatIndex;				// An index to our materials
+		int MatIndex;				// An index to our materials, -1 if the name matched none
 	};
 
 	// The 3ds file can be made up of several objects
@@ -141,6 +326,19 @@ public:
 		MaterialFaces *MatFaces;	// The faces are divided by materials
 		Vector pos;					// The position to move the object to
 		Vector rot;					// The angles to rotate the object
+		int numLods;				// The number of simplified levels
+		MaterialFaces *LodFaces[MAX_LODS];	// Each level's faces, numMatFaces groups like MatFaces
+		float lodError[MAX_LODS];	// How far each level moved the surface
+		PackedVertex *Packed;		// The packed vertices, NULL unless packVertices
+		Vector packOffset;			// The center of the box the positions are scaled to
+		Vector packScale;			// Turns the packed positions back into model units
+		float uvOffset[2];			// The center of the texture coordinates
+		float uvScale[2];			// Turns the packed texture coordinates back
+		Bounds bounds;				// The box and sphere around the vertices
+
+		// The faces of a level, 0 is the full mesh. Past the last level
+		// the coarsest one is used.
+		MaterialFaces *Lod(int lod) const { if (lod > numLods) lod = numLods; return lod > 0 ? LodFaces[lod - 1] : MatFaces; }
 	};
 
 	char *modelname;		// The name of the model
@@ -157,47 +355,157 @@ public:
 	float scale;			// The size you want the model scaled to
 	bool lit;				// True: the model is lit
 	bool visible;			// True: the model gets rendered
+	bool useCache;			// True: read and write the baked mesh cache
+	bool optimize;			// True: weld and reorder the meshes for the vertex cache
+	MeshOptimizer::Stats optimizeStats;	// What optimize did, zero if it was off
+	bool generateLods;		// True: make the simplified levels of detail
+	float lodBias;			// Scales the error Draw allows for a level
+	int numLods;			// The most levels any object has
+	float lodError[MAX_LODS];	// The largest error of each level over all the objects
+	bool packVertices;		// True: draw from the packed, interleaved vertices
+	bool staticBatch;		// True: merge the objects into one draw per material
+	bool lazyTextures;		// True: make each texture at the first Draw that uses it
+	TextureAtlas *atlas;	// Packs the small textures with other models' ones, NULL keeps them apart
+	ObjectFilter objectFilter;	// Decode only loads the objects it accepts, empty loads them all
+	Object *Batch;			// The merged objects Draw uses, NULL when not batched
+	bool decoded;			// True: the GL thread may read the geometry, Draw shows a placeholder
+	bool ready;				// True: Finalize is done and Draw renders the model
+	Bounds bounds;			// The box and sphere around the objects, in model units
 	void Load(char *name);	// Loads a model
+	bool Decode(const char *name);	// Reads the model and its textures, safe to call off the GL thread
+	void Finalize();		// Creates the model's GL textures, call on the GL thread after Decode
+	bool FinalizeSome(size_t &budget);	// Finalizes textures until about budget bytes were uploaded, true when done
+	void PreloadTextures();	// Makes every texture the faces use right away, call on the GL thread
 	void Draw();			// Draws the model
-	FILE *bin3ds;			// The binary 3ds file
+	void Draw(float distance, float size = 1.0f);	// Draws the level of detail for the distance
+	int SelectLod(float distance, float size = 1.0f);	// The level Draw picks, 0 is the full mesh
+	void DrawInstance(int lod, bool lighting);	// Draws a level with the caller's lighting, see ModelInstance
+	void GetMemoryStats(MemoryStats &stats);	// Adds up what the geometry takes
+	void GetModelMatrix(float matrix[16]);		// The pos, rot and scale Draw applies, column major
+	void GetWorldBounds(const float *instance, Bounds &out);	// The model's bounds under instance (may be NULL) and the model matrix
+	void GetObjectWorldBounds(int objindex, const float *instance, Bounds &out);	// The same for one object
+	void UpdateBounds();	// Finds the model's bounds again from its objects
+	static void TransformBounds(const Bounds &in, const float *matrix, Bounds &out);	// A box and sphere around in moved by matrix
+	static void MakeMatrix(const Vector &pos, const Vector &rot, float scale, float matrix[16]);	// Moves, rotates and scales the way Draw does
+	static bool ReadIndex(const char *name, std::vector<ObjectInfo> &index);	// Lists the objects of a file without loading them
+	static ObjectFilter NamedObjects(const std::vector<std::string> &names);	// A filter that takes the objects with these names
+	void Free();			// Releases the model and its GL textures, call on the GL thread
+	MappedFile bin3ds;		// The binary 3ds file mapped into memory
 	Model_3DS();			// Constructor
+	Model_3DS(Model_3DS &&other);				// Takes over other's model
+	Model_3DS &operator=(Model_3DS &&other);	// Takes over other's model
 	virtual ~Model_3DS();	// Destructor
 
 private:
-	void IntColorChunkProcessor(long length, long findex, int matindex);
-	void FloatColorChunkProcessor(long length, long findex, int matindex);
+	MappedFile cache;		// The baked mesh cache the arrays point into
+	unsigned char *arena;	// The one block Objects and their arrays are carved from
+	size_t arenaSize;		// The size of the arena in bytes
+	size_t arenaUsed;		// The bytes of the arena handed out so far
+
+	// Sets every member to an empty model
+	void Reset();
+	// Takes over everything other owns and leaves it empty
+	void Take(Model_3DS &other);
+	// Releases the memory of the model without touching GL
+	void FreeArrays();
+	// Hands out the next bytes of the arena, NULL if it is used up
+	void *ArenaAlloc(size_t bytes);
+	// Counts the materials and objects and the arena bytes they need
+	size_t MeasureEditChunk(Chunk chunk, int &materials, int &objects);
+	// Counts the arena bytes one mesh needs and its material groups
+	size_t MeasureMeshChunk(Chunk chunk, int &groups);
+	// Reads an object chunk's name and counts, skipping its data
+	static void IndexObjectChunk(Chunk chunk, ObjectInfo &info);
+	// True if objectFilter takes the object chunk
+	bool AcceptObject(const Chunk &chunk);
+
+	// Maps the baked cache of the model if it is up to date with the 3ds file
+	bool LoadCache(const char *name);
+	// Writes the parsed geometry out as the baked cache
+	void SaveCache(const char *name);
+	// Welds and reorders the objects' vertices and face groups
+	void OptimizeMeshes();
+	// Reads the texture files of the materials the faces use
+	void DecodeTextures();
+	// Reads the texture file of one material
+	void DecodeMaterial(int index);
+	// Makes one material's GL texture, reading the file first if it has to
+	void LoadMaterial(int index);
+	// FinalizeSome, waiting for atlas pages a worker still builds if wait is set
+	bool FinalizeMaterials(size_t &budget, bool wait);
+	// Marks the materials some face group is drawn with
+	void MarkReferencedMaterials();
+	// Packs the textures that can go on the atlas and moves their texture coordinates
+	void AtlasTextures();
+	// Draws the box around the model while it is still loading
+	void DrawPlaceholder();
+	// Draws the model with the faces of a level of detail
+	void DrawLevel(int lod, bool lighting);
+	// Draws one object's faces of a level of detail
+	void DrawObject(const Object &obj, int lod, bool lighting);
+	// Merges the objects' faces by material into the Batch
+	void BuildBatch();
+	// Makes the simplified levels of every object
+	void BuildLods();
+	// Finds the model's error for each level from its objects
+	void CollectLodErrors();
+	// Builds the packed vertices of every object, or just the Batch
+	void PackVertices();
+	// Packs one object's vertices into out
+	void PackObject(Object &obj, PackedVertex *out);
+
+	unsigned char *lodArena;	// The one block the simplified levels are carved from
+	PackedVertex *packedArena;	// The one block the packed vertices are carved from
+	unsigned char *batchArena;	// The one block the Batch and its arrays are carved from
+
+	int finalizedMaterials;	// The number of materials Finalize has done so far
+
+	// Face material groups whose material hadn't been read yet when the group was
+	struct PendingMatFaces {
+		int objindex;		// The object holding the group
+		int subfacesindex;	// The group inside that object
+		char name[80];		// The name of the material the group uses
+	};
+	std::vector<PendingMatFaces> *pendingMatFaces;
+
+	void IntColorChunkProcessor(Chunk &chunk, int matindex);
+	void FloatColorChunkProcessor(Chunk &chunk, int matindex);
 	// Processes the Main Chunk that all the other chunks exist is
-	void MainChunkProcessor(long length, long findex);
+	void MainChunkProcessor(Chunk &chunk);
 		// Processes the model's info
-		void EditChunkProcessor(long length, long findex);
+		void EditChunkProcessor(Chunk &chunk);
 			
 			// Processes the model's materials
-			void MaterialChunkProcessor(long length, long findex, int matindex);
+			void MaterialChunkProcessor(Chunk &chunk, int matindex);
 				// Processes the names of the materials
-				void MaterialNameChunkProcessor(long length, long findex, int matindex);
+				void MaterialNameChunkProcessor(Chunk &chunk, int matindex);
 				// Processes the material's diffuse color
-				void DiffuseColorChunkProcessor(long length, long findex, int matindex);
+				void DiffuseColorChunkProcessor(Chunk &chunk, int matindex);
 				// Processes the material's texture maps
-				void TextureMapChunkProcessor(long length, long findex, int matindex);
+				void TextureMapChunkProcessor(Chunk &chunk, int matindex);
 					// Processes the names of the textures and load the textures
-					void MapNameChunkProcessor(long length, long findex, int matindex);
+					void MapNameChunkProcessor(Chunk &chunk, int matindex);
 			
 			// Processes the model's geometry
-			void ObjectChunkProcessor(long length, long findex, int objindex);
+			void ObjectChunkProcessor(Chunk &chunk, int objindex);
 				// Processes the triangles of the model
-				void TriangularMeshChunkProcessor(long length, long findex, int objindex);
+				void TriangularMeshChunkProcessor(Chunk &chunk, int objindex);
 					// Processes the vertices of the model and loads them
-					void VertexListChunkProcessor(long length, long findex, int objindex);
+					void VertexListChunkProcessor(Chunk &chunk, int objindex);
 					// Processes the texture cordiantes of the vertices and loads them
-					void TexCoordsChunkProcessor(long length, long findex, int objindex);
+					void TexCoordsChunkProcessor(Chunk &chunk, int objindex);
 					// Processes the faces of the model and loads the faces
-					void FacesDescriptionChunkProcessor(long length, long findex, int objindex);
+					void FacesDescriptionChunkProcessor(Chunk &chunk, int objindex, int maxGroups);
 						// Processes the materials of the faces and splits them up by material
-						void FacesMaterialsListChunkProcessor(long length, long findex, int objindex, int subfacesindex);
+						void FacesMaterialsListChunkProcessor(Chunk &chunk, int objindex, int maxGroups);
 
 	// Calculates the normals of the vertices by averaging
 	// the normals of the faces that use that vertex
 	void CalculateNormals();
+
+	// A model owns its arrays, it can be moved but not copied
+	Model_3DS(const Model_3DS &);
+	Model_3DS &operator=(const Model_3DS &);
 };
 
 #endif MODEL_3DS_H
\ No newline at end of file
@@ -1,6 +1,9 @@
 #include "TextureBuilder.h"
 #include "Model_3DS.h"
+#include "ModelInstance.h"
 #include "GLTexture.h"
+#include "AssetLoader.h"
+#include "LoadStats.h"
 #include <vector>
 #include <ctime>
 #include <glut.h>
@@ -21,8 +24,8 @@ GLdouble zNear = 0.1;
 GLdouble zFar = 500;
 
 // Background Textures
-GLuint daytex;
-GLuint nighttex;
+GLTexture tex_daySky;
+GLTexture tex_nightSky;
 
 // Model Variables
 Model_3DS model_minion;
@@ -40,6 +43,14 @@ Model_3DS model_lamp;
 // Textures
 GLTexture tex_ground;
 
+// The props' textures share a few big pages, cut down to what their faces use
+TextureAtlas propAtlas(2048, 1024, 3);
+
+// Streams the assets in while the game is already drawing
+AssetLoader assetLoader;
+const size_t uploadBudget = 4 * 1024 * 1024;	// Bytes of texture data uploaded per frame
+bool loadReported = false;						// True once the load statistics were written
+
 // Sounds
 Mix_Music* background1Sound;
 Mix_Music* background2Sound;
@@ -57,23 +68,54 @@ bool playLose = false;
 // Assets Loading Function
 void LoadAssets()
 {
-	// Loading Model files
-	model_minion.Load("Models/minion/minion.3ds");
-	model_finishLine.Load("Models/gate/gate.3ds");
-	model_bridge.Load("Models/bridge/bridge.3ds");
-	model_banana.Load("Models/banana/banana.3ds");
-	model_sandbags.Load("Models/sandbags/sandbags.3ds");
-	model_barrier.Load("Models/barriers/barrier.3ds");
-	model_tree.Load("Models/tree/Tree1.3ds");
-	model_portal.Load("Models/portal/portalTrial1.3ds");
-	model_coin.Load("Models/coin/coin.3ds");
-	model_logs.Load("Models/logs/logs.3ds");
-	model_lamp.Load("Models/lamp/lamp.3ds");
+	Model_3DS *models[] = { &model_minion, &model_finishLine, &model_bridge, &model_banana,
+		&model_sandbags, &model_barrier, &model_tree, &model_portal, &model_coin, &model_logs, &model_lamp };
+
+	// Optimize the meshes for the vertex cache, it is baked into the
+	// mesh cache so only the first run pays for it. Draw from the
+	// packed vertices, half the bytes go to the card every frame,
+	// and with one draw per material instead of one per object
+	for (int i = 0; i < sizeof(models) / sizeof(models[0]); i++)
+	{
+		models[i]->optimize = true;
+		models[i]->packVertices = true;
+		models[i]->staticBatch = true;
+	}
+
+	// The models there are many of get simplified levels for far away
+	model_tree.generateLods = true;
+	model_coin.generateLods = true;
+	model_banana.generateLods = true;
+	model_barrier.generateLods = true;
+	model_sandbags.generateLods = true;
+
+	// The forest is what costs the most, let it go coarse a bit sooner
+	model_tree.lodBias = 2.0f;
+
+	// The props the track is full of draw from the atlas
+	model_coin.atlas = &propAtlas;
+	model_lamp.atlas = &propAtlas;
+	model_banana.atlas = &propAtlas;
+	model_sandbags.atlas = &propAtlas;
+	model_finishLine.atlas = &propAtlas;
+
+	// Queue the models, they show up as they finish loading
+	assetLoader.LoadModel(&model_minion, "Models/minion/minion.3ds");
+	assetLoader.LoadModel(&model_finishLine, "Models/gate/gate.3ds");
+	assetLoader.LoadModel(&model_bridge, "Models/bridge/bridge.3ds");
+	assetLoader.LoadModel(&model_banana, "Models/banana/banana.3ds");
+	assetLoader.LoadModel(&model_sandbags, "Models/sandbags/sandbags.3ds");
+	assetLoader.LoadModel(&model_barrier, "Models/barriers/barrier.3ds");
+	assetLoader.LoadModel(&model_tree, "Models/tree/Tree1.3ds");
+	assetLoader.LoadModel(&model_portal, "Models/portal/portalTrial1.3ds");
+	assetLoader.LoadModel(&model_coin, "Models/coin/coin.3ds");
+	assetLoader.LoadModel(&model_logs, "Models/logs/logs.3ds");
+	assetLoader.LoadModel(&model_lamp, "Models/lamp/lamp.3ds");
 
 	// Loading texture files
-	tex_ground.Load("Textures/ground.bmp");
-	loadBMP(&daytex, "Textures/blu-sky-3.bmp", true);
-	loadBMP(&nighttex, "Textures/night-sky.bmp", true);
+	assetLoader.LoadTexture(&tex_ground, "Textures/ground.bmp");
+	assetLoader.LoadTexture(&tex_daySky, "Textures/blu-sky-3.bmp");
+	assetLoader.LoadTexture(&tex_nightSky, "Textures/night-sky.bmp");
 }
 
 // Lighting Configuration Function
@@ -124,6 +166,23 @@ void InitMaterial()
 	glMaterialfv(GL_FRONT, GL_SHININESS, shininess);
 }
 
+// Queues a sound effect on the asset loader
+void LoadSound(Mix_Chunk** chunk, const char* file)
+{
+	assetLoader.LoadJob(
+		[chunk, file]() {
+			*chunk = Mix_LoadWAV(file);
+
+			// A missing effect just stays silent, Mix_PlayChannel ignores NULL
+			if (*chunk == nullptr) {
+				printf_s("Failed to load sound effect! SDL_mixer Error: %s", Mix_GetError());
+				return false;
+			}
+			return true;
+		},
+		NULL);
+}
+
 void InitSound() {
 	if (SDL_Init(SDL_INIT_AUDIO) < 0) {
 		printf_s("SDL could not initialize! SDL_Error: %s", Mix_GetError());
@@ -135,24 +194,24 @@ void InitSound() {
 		exit(-1);
 	}
 
-	// Load all sounds
-	coinSound = Mix_LoadWAV("sounds/coin.wav");
+	// The music starts right away, load it now
 	background1Sound = Mix_LoadMUS("sounds/background1.mp3");
 	background2Sound = Mix_LoadMUS("sounds/background2.mp3");
-	bananaSound = Mix_LoadWAV("sounds/minion_yay.mp3");
-	logSound = Mix_LoadWAV("sounds/log.wav");
-	barrierSound = Mix_LoadWAV("sounds/barrier.mp3");
-	sandbagSound = Mix_LoadWAV("sounds/sad minion.mp3");
-	winSound = Mix_LoadWAV("sounds/win.mp3");
-	loseSound = Mix_LoadWAV("sounds/loss.mp3");
-
-	if (coinSound == nullptr || background1Sound == nullptr || bananaSound == nullptr
-		|| logSound == nullptr || sandbagSound == nullptr || winSound == nullptr
-		|| loseSound == nullptr || barrierSound == nullptr || background2Sound == nullptr) {
-		printf_s("Failed to load sound effect! SDL_mixer Error: %s", Mix_GetError());
+
+	if (background1Sound == nullptr || background2Sound == nullptr) {
+		printf_s("Failed to load music! SDL_mixer Error: %s", Mix_GetError());
 		exit(-1);
 	}
 
+	// The sound effects are decoded in the background
+	LoadSound(&coinSound, "sounds/coin.wav");
+	LoadSound(&bananaSound, "sounds/minion_yay.mp3");
+	LoadSound(&logSound, "sounds/log.wav");
+	LoadSound(&barrierSound, "sounds/barrier.mp3");
+	LoadSound(&sandbagSound, "sounds/sad minion.mp3");
+	LoadSound(&winSound, "sounds/win.mp3");
+	LoadSound(&loseSound, "sounds/loss.mp3");
+
 }
 
 void CleanUp() {
@@ -259,12 +318,14 @@ float yOffsetBanana;
 struct Coin
 {
 	float x, y, z;
+	ModelInstance instance;
 };
 std::vector<Coin> coins;
 
 struct Obstacle
 {
 	float x, y, z;
+	ModelInstance instance;
 };
 struct Log
 {
@@ -277,9 +338,31 @@ std::vector<Obstacle> sandbags;
 struct Tree
 {
 	float x, y, z;
+	ModelInstance instance;
 };
 std::vector<Tree> trees;
 
+// One copy of a shared model placed in the world, turned about y
+ModelInstance PlaceModel(Model_3DS *asset, float x, float y, float z, float rotY, float scale)
+{
+	ModelInstance instance(asset);
+
+	instance.SetPosition(x, y, z);
+	instance.SetRotation(0.0f, rotY, 0.0f);
+	instance.SetScale(scale);
+	return instance;
+}
+
+// How far a model drawn at x, y, z is from the camera, picks its level of detail
+float EyeDistance(float x, float y, float z)
+{
+	float dx = x - (float)Eye.x;
+	float dy = y - (float)Eye.y;
+	float dz = z - (float)Eye.z;
+
+	return sqrtf(dx * dx + dy * dy + dz * dz);
+}
+
 struct Portal
 {
 	float x, y, z;
@@ -304,7 +387,7 @@ void SpawnCoins(int count)
 	{
 		float x = xPositions[rand() % xCount];
 		float z = zStart - i * 10.0f;
-		coins.push_back({ x, y, z });
+		coins.push_back({ x, y, z, PlaceModel(&model_coin, x, 10.85f, z, 0.0f, 0.2f) });
 	}
 }
 
@@ -332,7 +415,7 @@ void SpawnObstacles(int count)
 	{
 		float x = xPositions[rand() % xCount];
 		float z = zStart - i * 20.0f;
-		obstacles.push_back({ x, y[i], z });
+		obstacles.push_back({ x, y[i], z, PlaceModel(&model_barrier, x, y[i], z, 180.0f, 0.2f) });
 	}
 }
 
@@ -349,9 +432,9 @@ void SpawnSandbags(int count)
 		float z = zStart - i * 10.0f;
 		if (x != x2)
 		{
-			sandbags.push_back({ x2, y, z });
+			sandbags.push_back({ x2, y, z, PlaceModel(&model_sandbags, x2, y, z, 180.0f, 1.0f) });
 		}
-		sandbags.push_back({ x, y, z });
+		sandbags.push_back({ x, y, z, PlaceModel(&model_sandbags, x, y, z, 180.0f, 1.0f) });
 	}
 }
 
@@ -382,8 +465,8 @@ void InitializeForest()
 	for (int i = 0; i < numTreesPerSide; ++i)
 	{
 		float z = zStart + i * treeSpacing;
-		trees.push_back({ -roadWidth / 2 - 1, y, z }); // Left side of the road
-		trees.push_back({ roadWidth / 2 + 1, y, z });	 // Right side of the road
+		trees.push_back({ -roadWidth / 2 - 1, y, z, PlaceModel(&model_tree, -roadWidth / 2 - 1, y, z, 0.0f, 0.7f) }); // Left side of the road
+		trees.push_back({ roadWidth / 2 + 1, y, z, PlaceModel(&model_tree, roadWidth / 2 + 1, y, z, 0.0f, 0.7f) });	 // Right side of the road
 	}
 
 	// Place additional random trees around the road
@@ -402,7 +485,7 @@ void InitializeForest()
 		}
 
 		float z = static_cast<float>(rand() % 200) - 100; // Random z position within a range
-		trees.push_back({ x, y, z });
+		trees.push_back({ x, y, z, PlaceModel(&model_tree, x, y, z, 0.0f, 0.7f) });
 	}
 }
 
@@ -443,14 +526,8 @@ void RenderGround()
 
 void RenderTrees()
 {
-	for (const auto& tree : trees)
-	{
-		glPushMatrix();
-		glTranslatef(tree.x, tree.y, tree.z);
-		glScalef(0.7, 0.7, 0.7);
-		model_tree.Draw();
-		glPopMatrix();
-	}
+	for (auto& tree : trees)
+		tree.instance.Draw(EyeDistance(tree.x, tree.y, tree.z));
 }
 
 float CalculateMinionHeight()
@@ -911,7 +988,7 @@ void RenderSky()
 
 		glColor4f(1.0f, 1.0f, 1.0f, dayNightTransition);
 		// Render day sky with fading alpha
-		glBindTexture(GL_TEXTURE_2D, daytex);
+		glBindTexture(GL_TEXTURE_2D, tex_daySky.texture[0]);
 		gluQuadricTexture(qobj, true);
 		gluQuadricNormals(qobj, GL_SMOOTH);
 		gluSphere(qobj, 100, 100, 100);
@@ -924,7 +1001,7 @@ void RenderSky()
 	else
 	{
 		// Full night sky for level 2
-		glBindTexture(GL_TEXTURE_2D, nighttex);
+		glBindTexture(GL_TEXTURE_2D, tex_nightSky.texture[0]);
 		gluQuadricTexture(qobj, true);
 		gluQuadricNormals(qobj, GL_SMOOTH);
 		gluSphere(qobj, 100, 100, 100);
@@ -954,16 +1031,10 @@ void RenderCoins()
 			{ return coin.z > Eye.z; }),
 		coins.end());
 
-	for (const auto& coin : coins)
+	for (auto& coin : coins)
 	{
-
-		glPushMatrix();
-
-		glTranslatef(coin.x, 10.85, coin.z);
-		glRotatef(coinAnimationTime, 0.0f, 1.0f, 0.0f);
-		glScalef(0.2f, 0.2f, 0.2f);
-		model_coin.Draw();
-		glPopMatrix();
+		coin.instance.SetRotation(0.0f, coinAnimationTime, 0.0f);
+		coin.instance.Draw(EyeDistance(coin.x, 10.85f, coin.z));
 	}
 }
 
@@ -986,7 +1057,7 @@ void RenderBananas()
 		glTranslatef(banana.x, banana.y + yOffsetBanana, banana.z);
 		glRotatef(90, 0, 1, 0);
 		glScalef(0.6f, 0.6f, 0.6f);
-		model_banana.Draw();
+		model_banana.Draw(EyeDistance(banana.x, banana.y, banana.z), 0.6f);
 		glPopMatrix();
 	}
 }
@@ -998,15 +1069,8 @@ void RenderObstacles()
 		std::remove_if(obstacles.begin(), obstacles.end(), [](const Obstacle& obstacle)
 			{ return obstacle.z > Eye.z; }),
 		obstacles.end());
-	for (const auto& obstacle : obstacles)
-	{
-		glPushMatrix();
-		glTranslatef(obstacle.x, obstacle.y, obstacle.z);
-		glRotatef(180, 0, 1, 0);
-		glScalef(0.2f, 0.2f, 0.2f);
-		model_barrier.Draw();
-		glPopMatrix();
-	}
+	for (auto& obstacle : obstacles)
+		obstacle.instance.Draw(EyeDistance(obstacle.x, obstacle.y, obstacle.z));
 }
 
 void RenderSandbags()
@@ -1015,15 +1079,8 @@ void RenderSandbags()
 		std::remove_if(sandbags.begin(), sandbags.end(), [](const Obstacle& sandbag)
 			{ return sandbag.z > Eye.z; }),
 		sandbags.end());
-	for (const auto& sandbag : sandbags)
-	{
-		glPushMatrix();
-		glTranslatef(sandbag.x, sandbag.y, sandbag.z);
-		glRotatef(180, 0, 1, 0);
-		glScalef(1.0f, 1.0f, 1.0f);
-		model_sandbags.Draw();
-		glPopMatrix();
-	}
+	for (auto& sandbag : sandbags)
+		sandbag.instance.Draw(EyeDistance(sandbag.x, sandbag.y, sandbag.z));
 }
 
 void RenderLogs()
@@ -1548,8 +1605,8 @@ void Reshape(int w, int h)
 // OpengGL Configuration Function
 void init(void)
 {
-	LoadAssets();
 	InitSound();
+	LoadAssets();
 	glEnable(GL_DEPTH_TEST);
 	glEnable(GL_LIGHTING);
 	glEnable(GL_LIGHT0);
@@ -1602,8 +1659,24 @@ void init(void)
 
 void Render(int value)
 {
+	// Finish a bit of the loading every frame
+	assetLoader.Update(uploadBudget);
+
+	// The clock doesn't run while the level is still loading
+	if (assetLoader.Pending() > 0)
+	{
+		startTime = std::clock();
+	}
+	else if (!loadReported)
+	{
+		// Where the loading time went, only a LOAD_STATS build has anything to say
+		LoadStats::Report(stdout);
+		LoadStats::WriteJson("load_stats.json");
+		loadReported = true;
+	}
+
 	elapsedTime = (std::clock() - startTime) / (double)CLOCKS_PER_SEC;
-	if (remainingTime > 0.0f)
+	if (remainingTime > 0.0f && assetLoader.Pending() == 0)
 	{
 		remainingTime -= 0.016f;
 	}
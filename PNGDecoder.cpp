@@ -0,0 +1,827 @@
+//////////////////////////////////////////////////////////////////////
+//
+// PNG Decoder Class
+//
+// PNGDecoder.cpp: implementation of the PNGDecoder class.
+//
+//////////////////////////////////////////////////////////////////////
+
+#include "PNGDecoder.h"
+#include "ImageKernels.h"
+#include "MappedFile.h"
+#include "PixelPool.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#define PNG_GRAY		0		// One gray channel
+#define PNG_RGB			2		// Red, green and blue
+#define PNG_PALETTE		3		// Indices into the PLTE chunk
+#define PNG_GRAY_ALPHA	4		// Gray then alpha
+#define PNG_RGBA		6		// Red, green, blue then alpha
+#define PNG_MAX_SIZE	32768	// Bigger than any texture a card takes
+
+#define HUFFMAN_FAST	10		// The bits the lookup table of a code covers
+#define HUFFMAN_MAX		15		// The longest code deflate has
+
+static const unsigned char signature[8] = { 137, 'P', 'N', 'G', 13, 10, 26, 10 };
+
+// The chunks are big endian, and may not be aligned
+static unsigned int ReadU32(const unsigned char *p)
+{
+	return ((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+//////////////////////////////////////////////////////////////////////
+// Inflate
+//////////////////////////////////////////////////////////////////////
+
+// The bits of a deflate stream, least significant first. Reading past
+// the end gives zeros, Overrun says whether that happened
+struct InflateBitReader {
+	const unsigned char *p;
+	const unsigned char *end;
+	unsigned long long bits;		// The bits read ahead
+	int count;						// How many of them there are
+	int past;						// The zero bytes made up past the end
+
+	void Fill()
+	{
+		while (count <= 56)
+		{
+			if (p < end)
+				bits |= (unsigned long long)*p++ << count;
+			else
+				past++;
+
+			count += 8;
+		}
+	}
+
+	unsigned int Peek(int n)
+	{
+		if (count < n)
+			Fill();
+
+		return (unsigned int)(bits & ((1ull << n) - 1));
+	}
+
+	void Skip(int n)
+	{
+		bits >>= n;
+		count -= n;
+	}
+
+	unsigned int Get(int n)
+	{
+		unsigned int v = Peek(n);
+		Skip(n);
+		return v;
+	}
+
+	// Drops the bits up to the next byte, and gives back the whole bytes
+	// read ahead so a stored block can be copied straight from p
+	void AlignToByte()
+	{
+		Skip(count & 7);
+
+		int unread = count / 8;
+		int made = unread < past ? unread : past;
+
+		past -= made;
+		p -= unread - made;
+		bits = 0;
+		count = 0;
+	}
+
+	bool Overrun() const
+	{
+		// The bytes read ahead don't count until they are used
+		return past * 8 > count;
+	}
+};
+
+// A canonical Huffman code. Codes up to HUFFMAN_FAST bits are found
+// with one lookup, longer ones a bit at a time from the counts
+struct InflateHuffman {
+	unsigned short fast[1 << HUFFMAN_FAST];	// Length << 9 | symbol, 0 if longer
+	short count[HUFFMAN_MAX + 1];			// The codes of each length
+	short symbol[288];						// The symbols in code order
+
+	// False if the lengths over-subscribe the code. An incomplete code is
+	// fine, the symbols it doesn't have never turn up in a good stream
+	bool Build(const unsigned char *lengths, int n)
+	{
+		short offset[HUFFMAN_MAX + 1];
+		int left = 1;
+
+		memset(count, 0, sizeof(count));
+		memset(fast, 0, sizeof(fast));
+
+		for (int i = 0; i < n; i++)
+			count[lengths[i]]++;
+
+		count[0] = 0;
+
+		for (int len = 1; len <= HUFFMAN_MAX; len++)
+		{
+			left = (left << 1) - count[len];
+
+			if (left < 0)
+				return false;
+		}
+
+		offset[1] = 0;
+
+		for (int len = 1; len < HUFFMAN_MAX; len++)
+			offset[len + 1] = offset[len] + count[len];
+
+		for (int i = 0; i < n; i++)
+		{
+			if (lengths[i] != 0)
+				symbol[offset[lengths[i]]++] = (short)i;
+		}
+
+		// The short codes in the table, bit reversed since the stream
+		// holds them first bit first
+		int code = 0;
+		int k = 0;
+
+		for (int len = 1; len <= HUFFMAN_FAST; len++)
+		{
+			for (int i = 0; i < count[len]; i++, k++, code++)
+			{
+				int reversed = 0;
+
+				for (int b = 0; b < len; b++)
+					reversed |= ((code >> b) & 1) << (len - 1 - b);
+
+				for (int fill = reversed; fill < (1 << HUFFMAN_FAST); fill += 1 << len)
+					fast[fill] = (unsigned short)((len << 9) | symbol[k]);
+			}
+
+			code <<= 1;
+		}
+
+		return true;
+	}
+
+	// The next symbol, -1 if the bits are no code
+	int Decode(InflateBitReader &in) const
+	{
+		unsigned int entry = fast[in.Peek(HUFFMAN_FAST)];
+
+		if (entry != 0)
+		{
+			in.Skip(entry >> 9);
+			return entry & 511;
+		}
+
+		// First code, first index and the code so far of each length
+		int code = 0;
+		int first = 0;
+		int index = 0;
+
+		in.Peek(HUFFMAN_MAX);
+
+		for (int len = 1; len <= HUFFMAN_MAX; len++)
+		{
+			code |= (int)in.Get(1);
+
+			if (code - first < count[len])
+				return symbol[index + code - first];
+
+			index += count[len];
+			first = (first + count[len]) << 1;
+			code <<= 1;
+		}
+
+		return -1;
+	}
+};
+
+static const short lengthBase[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const short lengthExtra[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const short distanceBase[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const short distanceExtra[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+// The lengths of the two codes of a dynamic block
+static bool ReadCodes(InflateBitReader &in, InflateHuffman &lengths, InflateHuffman &distances)
+{
+	static const unsigned char order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+	int numLengths = (int)in.Get(5) + 257;
+	int numDistances = (int)in.Get(5) + 1;
+	int numCodes = (int)in.Get(4) + 4;
+
+	if (numLengths > 286 || numDistances > 30)
+		return false;
+
+	unsigned char sizes[286 + 30];
+	InflateHuffman code;
+
+	memset(sizes, 0, 19);
+
+	for (int i = 0; i < numCodes; i++)
+		sizes[order[i]] = (unsigned char)in.Get(3);
+
+	if (!code.Build(sizes, 19))
+		return false;
+
+	// Both codes' lengths in one go, a repeat may run from one into the other
+	int n = 0;
+
+	while (n < numLengths + numDistances)
+	{
+		int sym = code.Decode(in);
+		int repeat = 0;
+		unsigned char value = 0;
+
+		if (sym < 0)
+			return false;
+
+		if (sym < 16)
+		{
+			sizes[n++] = (unsigned char)sym;
+			continue;
+		}
+
+		if (sym == 16)
+		{
+			if (n == 0)
+				return false;
+
+			value = sizes[n - 1];
+			repeat = 3 + (int)in.Get(2);
+		}
+		else if (sym == 17)
+			repeat = 3 + (int)in.Get(3);
+		else
+			repeat = 11 + (int)in.Get(7);
+
+		if (n + repeat > numLengths + numDistances)
+			return false;
+
+		memset(sizes + n, value, repeat);
+		n += repeat;
+	}
+
+	// A block without an end has no use
+	if (sizes[256] == 0)
+		return false;
+
+	return lengths.Build(sizes, numLengths) && distances.Build(sizes + numLengths, numDistances);
+}
+
+// The literals and matches of one block
+static bool InflateBlock(InflateBitReader &in, const InflateHuffman &lengths, const InflateHuffman &distances,
+	unsigned char *start, unsigned char *&out, unsigned char *end)
+{
+	for (;;)
+	{
+		int sym = lengths.Decode(in);
+
+		if (sym < 0 || in.Overrun())
+			return false;
+
+		if (sym < 256)
+		{
+			if (out == end)
+				return false;
+
+			*out++ = (unsigned char)sym;
+		}
+		else if (sym == 256)
+			return true;
+		else
+		{
+			sym -= 257;
+
+			if (sym >= 29)
+				return false;
+
+			int length = lengthBase[sym] + (int)in.Get(lengthExtra[sym]);
+			int dsym = distances.Decode(in);
+
+			if (dsym < 0 || dsym >= 30)
+				return false;
+
+			size_t distance = distanceBase[dsym] + in.Get(distanceExtra[dsym]);
+
+			if (distance > (size_t)(out - start) || length > end - out)
+				return false;
+
+			// Far enough back to copy 8 bytes at a time, else byte by byte
+			// since the copy may repeat what it just wrote
+			const unsigned char *from = out - distance;
+
+			if (distance >= 8)
+			{
+				unsigned char *stop = out + length;
+
+				while (end - out >= 8 && out < stop)
+				{
+					memcpy(out, from, 8);
+					out += 8;
+					from += 8;
+				}
+
+				while (out < stop)
+					*out++ = *from++;
+
+				out = stop;
+			}
+			else
+			{
+				for (int i = 0; i < length; i++)
+					out[i] = from[i];
+
+				out += length;
+			}
+		}
+	}
+}
+
+// Inflates a zlib stream into exactly size bytes
+static bool Inflate(const unsigned char *data, size_t dataSize, unsigned char *dst, size_t size)
+{
+	// The zlib header: deflate, no preset dictionary
+	if (dataSize < 2 || (data[0] & 0x0F) != 8 || (data[1] & 0x20) != 0 || ((data[0] << 8) | data[1]) % 31 != 0)
+		return false;
+
+	InflateBitReader in = { data + 2, data + dataSize, 0, 0, 0 };
+	unsigned char *out = dst;
+	unsigned char *end = dst + size;
+	bool last = false;
+
+	while (!last)
+	{
+		last = in.Get(1) != 0;
+		int type = (int)in.Get(2);
+
+		if (type == 0)
+		{
+			// Stored, a length and its complement then the bytes
+			in.AlignToByte();
+
+			if (in.end - in.p < 4)
+				return false;
+
+			size_t length = in.p[0] | (in.p[1] << 8);
+
+			if ((length ^ (in.p[2] | (in.p[3] << 8))) != 0xFFFF)
+				return false;
+
+			in.p += 4;
+
+			if (length > (size_t)(in.end - in.p) || length > (size_t)(end - out))
+				return false;
+
+			memcpy(out, in.p, length);
+			in.p += length;
+			out += length;
+		}
+		else if (type == 1)
+		{
+			// The fixed codes
+			unsigned char sizes[288 + 30];
+			InflateHuffman lengths, distances;
+
+			memset(sizes, 8, 144);
+			memset(sizes + 144, 9, 112);
+			memset(sizes + 256, 7, 24);
+			memset(sizes + 280, 8, 8);
+			memset(sizes + 288, 5, 30);
+
+			lengths.Build(sizes, 288);
+			distances.Build(sizes + 288, 30);
+
+			if (!InflateBlock(in, lengths, distances, dst, out, end))
+				return false;
+		}
+		else if (type == 2)
+		{
+			InflateHuffman lengths, distances;
+
+			if (!ReadCodes(in, lengths, distances) || !InflateBlock(in, lengths, distances, dst, out, end))
+				return false;
+		}
+		else
+			return false;
+	}
+
+	return out == end;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Headers
+//////////////////////////////////////////////////////////////////////
+
+// The channels of a pixel of each color type
+static int Channels(int colorType)
+{
+	switch (colorType)
+	{
+		case PNG_RGB		: return 3;
+		case PNG_GRAY_ALPHA	: return 2;
+		case PNG_RGBA		: return 4;
+		default				: return 1;
+	}
+}
+
+bool PNGDecoder::ReadInfo(const unsigned char *data, size_t size, Info &info)
+{
+	memset(&info, 0, sizeof(info));
+
+	// The signature then IHDR, which has to come first
+	if (data == NULL || size < 8 + 25 || memcmp(data, signature, 8) != 0 ||
+		ReadU32(data + 8) != 13 || memcmp(data + 12, "IHDR", 4) != 0)
+		return false;
+
+	const unsigned char *h = data + 16;
+
+	info.width = (int)ReadU32(h);
+	info.height = (int)ReadU32(h + 4);
+	info.bitDepth = h[8];
+	info.colorType = h[9];
+	info.interlaced = h[12] == 1;
+
+	if (info.width <= 0 || info.height <= 0 || info.width > PNG_MAX_SIZE || info.height > PNG_MAX_SIZE ||
+		h[10] != 0 || h[11] != 0 || h[12] > 1)
+		return false;
+
+	// Only the combinations the format allows
+	switch (info.colorType)
+	{
+		case PNG_GRAY		:
+			if (info.bitDepth != 1 && info.bitDepth != 2 && info.bitDepth != 4 && info.bitDepth != 8 && info.bitDepth != 16)
+				return false;
+			break;
+		case PNG_PALETTE	:
+			if (info.bitDepth != 1 && info.bitDepth != 2 && info.bitDepth != 4 && info.bitDepth != 8)
+				return false;
+			break;
+		case PNG_RGB		:
+		case PNG_GRAY_ALPHA	:
+		case PNG_RGBA		:
+			if (info.bitDepth != 8 && info.bitDepth != 16)
+				return false;
+			break;
+		default				:
+			return false;
+	}
+
+	// The chunks the pixels need, and at least one with pixels
+	bool pixels = false;
+	size_t pos = 8;
+
+	while (pos + 12 <= size)
+	{
+		size_t length = ReadU32(data + pos);
+		const unsigned char *type = data + pos + 4;
+
+		if (length > size - pos - 12)
+			return false;
+
+		if (memcmp(type, "PLTE", 4) == 0)
+		{
+			info.palette = data + pos + 8;
+			info.paletteSize = (int)(length / 3);
+		}
+		else if (memcmp(type, "tRNS", 4) == 0)
+		{
+			info.transparency = data + pos + 8;
+			info.transparencySize = (int)length;
+		}
+		else if (memcmp(type, "IDAT", 4) == 0)
+			pixels = true;
+		else if (memcmp(type, "IEND", 4) == 0)
+			break;
+
+		pos += length + 12;
+	}
+
+	if (!pixels || (info.colorType == PNG_PALETTE && info.palette == NULL))
+		return false;
+
+	// The color a gray or RGB image leaves transparent is 2 bytes a channel
+	if (info.transparency != NULL && info.transparencySize < (info.colorType == PNG_PALETTE ? 1 : Channels(info.colorType) * 2))
+		info.transparency = NULL;
+
+	info.alpha = info.colorType == PNG_GRAY_ALPHA || info.colorType == PNG_RGBA || info.transparency != NULL;
+
+	return true;
+}
+
+size_t PNGDecoder::ImageSize(const Info &info)
+{
+	return (size_t)info.width * info.height * (info.alpha ? 4 : 3);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Pixels
+//////////////////////////////////////////////////////////////////////
+
+// The bytes of a row of width pixels, without the filter byte
+static size_t RowBytes(const PNGDecoder::Info &info, int width)
+{
+	return ((size_t)width * Channels(info.colorType) * info.bitDepth + 7) / 8;
+}
+
+// Where each Adam7 pass starts and how far apart its pixels are
+static const int passX[7] = { 0, 4, 0, 2, 0, 1, 0 };
+static const int passY[7] = { 0, 0, 4, 0, 2, 0, 1 };
+static const int passStepX[7] = { 8, 8, 4, 4, 2, 2, 1 };
+static const int passStepY[7] = { 8, 8, 8, 4, 4, 2, 2 };
+
+// The size of pass p, one pass of the whole image if it isn't interlaced
+static void PassSize(const PNGDecoder::Info &info, int p, int &width, int &height)
+{
+	if (!info.interlaced)
+	{
+		width = info.width;
+		height = info.height;
+		return;
+	}
+
+	width = info.width > passX[p] ? (info.width - passX[p] + passStepX[p] - 1) / passStepX[p] : 0;
+	height = info.height > passY[p] ? (info.height - passY[p] + passStepY[p] - 1) / passStepY[p] : 0;
+}
+
+static int Paeth(int a, int b, int c)
+{
+	int p = a + b - c;
+	int pa = abs(p - a);
+	int pb = abs(p - b);
+	int pc = abs(p - c);
+
+	if (pa <= pb && pa <= pc)
+		return a;
+
+	return pb <= pc ? b : c;
+}
+
+// Undoes the filter of a row in place. prior is the row above, filtered
+// back already, or zeros for the first row
+static bool Unfilter(int filter, unsigned char *row, const unsigned char *prior, size_t bytes, int pixel)
+{
+	size_t i;
+
+	switch (filter)
+	{
+		case 0	:
+			break;
+		case 1	:
+			for (i = pixel; i < bytes; i++)
+				row[i] = (unsigned char)(row[i] + row[i - pixel]);
+			break;
+		case 2	:
+			for (i = 0; i < bytes; i++)
+				row[i] = (unsigned char)(row[i] + prior[i]);
+			break;
+		case 3	:
+			for (i = 0; i < (size_t)pixel; i++)
+				row[i] = (unsigned char)(row[i] + (prior[i] >> 1));
+			for (; i < bytes; i++)
+				row[i] = (unsigned char)(row[i] + ((row[i - pixel] + prior[i]) >> 1));
+			break;
+		case 4	:
+			for (i = 0; i < (size_t)pixel; i++)
+				row[i] = (unsigned char)(row[i] + prior[i]);
+			for (; i < bytes; i++)
+				row[i] = (unsigned char)(row[i] + Paeth(row[i - pixel], prior[i], prior[i - pixel]));
+			break;
+		default	:
+			return false;
+	}
+
+	return true;
+}
+
+// Sample i of a row of samples of bits each, up to 16
+static unsigned int Sample(const unsigned char *row, int i, int bits)
+{
+	switch (bits)
+	{
+		case 16	: return (row[i * 2] << 8) | row[i * 2 + 1];
+		case 8	: return row[i];
+		default	: return (row[i * bits / 8] >> (8 - bits - (i * bits) % 8)) & ((1 << bits) - 1);
+	}
+}
+
+// count pixels of an unfiltered row to RGB(A)
+static void ConvertRow(const PNGDecoder::Info &info, const unsigned char *src, unsigned char *dst, int count)
+{
+	int channels = Channels(info.colorType);
+	int bits = info.bitDepth;
+
+	// The common 8 bit layouts as they are, or through the kernels
+	if (bits == 8 && info.transparency == NULL)
+	{
+		switch (info.colorType)
+		{
+			case PNG_RGB		: memcpy(dst, src, (size_t)count * 3); return;
+			case PNG_RGBA		: memcpy(dst, src, (size_t)count * 4); return;
+			case PNG_GRAY		: ImageKernels::ExpandGray(src, dst, count); return;
+			case PNG_GRAY_ALPHA	: ImageKernels::ExpandGrayAlpha(src, dst, count); return;
+		}
+	}
+
+	int max = (1 << bits) - 1;
+
+	for (int x = 0; x < count; x++)
+	{
+		unsigned int s[4] = { 0, 0, 0, 0 };
+		unsigned char c[4];
+
+		for (int k = 0; k < channels; k++)
+			s[k] = Sample(src, x * channels + k, bits);
+
+		// 16 bits keep the high byte, fewer than 8 are scaled up
+		for (int k = 0; k < channels; k++)
+			c[k] = (unsigned char)(bits == 16 ? s[k] >> 8 : (bits == 8 ? s[k] : s[k] * 255 / max));
+
+		unsigned char a = 255;
+
+		switch (info.colorType)
+		{
+			case PNG_GRAY		:
+				c[1] = c[2] = c[0];
+				if (info.transparency != NULL && s[0] == Sample(info.transparency, 0, 16))
+					a = 0;
+				break;
+			case PNG_RGB		:
+				if (info.transparency != NULL && s[0] == Sample(info.transparency, 0, 16) &&
+					s[1] == Sample(info.transparency, 1, 16) && s[2] == Sample(info.transparency, 2, 16))
+					a = 0;
+				break;
+			case PNG_PALETTE	:
+				if ((int)s[0] < info.paletteSize)
+					memcpy(c, info.palette + s[0] * 3, 3);
+				else
+					c[0] = c[1] = c[2] = 0;
+
+				if (info.transparency != NULL && (int)s[0] < info.transparencySize)
+					a = info.transparency[s[0]];
+				break;
+			case PNG_GRAY_ALPHA	:
+				a = c[1];
+				c[1] = c[2] = c[0];
+				break;
+			case PNG_RGBA		:
+				a = c[3];
+				break;
+		}
+
+		memcpy(dst, c, 3);
+		dst += 3;
+
+		if (info.alpha)
+			*dst++ = a;
+	}
+}
+
+bool PNGDecoder::Decode(const unsigned char *data, size_t size, const Info &info, unsigned char *out)
+{
+	if (out == NULL)
+		return false;
+
+	// The compressed data, in one piece however many chunks it was split into
+	std::vector<unsigned char> joined;
+	const unsigned char *stream = NULL;
+	size_t streamSize = 0;
+	size_t pos = 8;
+
+	while (pos + 12 <= size)
+	{
+		size_t length = ReadU32(data + pos);
+
+		if (length > size - pos - 12 || memcmp(data + pos + 4, "IEND", 4) == 0)
+			break;
+
+		if (memcmp(data + pos + 4, "IDAT", 4) == 0)
+		{
+			if (stream == NULL)
+			{
+				stream = data + pos + 8;
+				streamSize = length;
+			}
+			else
+			{
+				if (joined.empty())
+					joined.assign(stream, stream + streamSize);
+
+				joined.insert(joined.end(), data + pos + 8, data + pos + 8 + length);
+			}
+		}
+
+		pos += length + 12;
+	}
+
+	if (!joined.empty())
+	{
+		stream = &joined[0];
+		streamSize = joined.size();
+	}
+
+	// Every pass's rows with a filter byte each
+	size_t rawSize = 0;
+
+	for (int p = 0; p < (info.interlaced ? 7 : 1); p++)
+	{
+		int w, h;
+		PassSize(info, p, w, h);
+
+		if (w > 0)
+			rawSize += (RowBytes(info, w) + 1) * h;
+	}
+
+	unsigned char *raw = PixelPool::Alloc(rawSize);
+
+	if (raw == NULL || !Inflate(stream, streamSize, raw, rawSize))
+	{
+		PixelPool::Free(raw);
+		return false;
+	}
+
+	int channels = info.alpha ? 4 : 3;
+	int pixel = (Channels(info.colorType) * info.bitDepth + 7) / 8;
+	size_t outStride = (size_t)info.width * channels;
+	std::vector<unsigned char> zeros(RowBytes(info, info.width));
+	std::vector<unsigned char> pass(info.interlaced ? outStride : 0);
+	unsigned char *row = raw;
+	bool ok = true;
+
+	for (int p = 0; p < (info.interlaced ? 7 : 1) && ok; p++)
+	{
+		int w, h;
+		PassSize(info, p, w, h);
+
+		if (w == 0)
+			continue;
+
+		size_t bytes = RowBytes(info, w);
+		const unsigned char *prior = &zeros[0];
+
+		for (int y = 0; y < h && ok; y++, row += bytes + 1)
+		{
+			ok = Unfilter(row[0], row + 1, prior, bytes, pixel);
+			prior = row + 1;
+
+			// The rows go out bottom first
+			if (!info.interlaced)
+			{
+				ConvertRow(info, row + 1, out + outStride * (info.height - 1 - y), w);
+				continue;
+			}
+
+			// A pass's pixels are spread over the row
+			int iy = passY[p] + y * passStepY[p];
+			unsigned char *dst = out + outStride * (info.height - 1 - iy);
+
+			ConvertRow(info, row + 1, &pass[0], w);
+
+			for (int x = 0; x < w; x++)
+				memcpy(dst + (size_t)(passX[p] + x * passStepX[p]) * channels, &pass[x * channels], channels);
+		}
+	}
+
+	PixelPool::Free(raw);
+
+	return ok;
+}
+
+unsigned char *PNGDecoder::Load(const char *name, int &width, int &height, bool &alpha)
+{
+	MappedFile file;
+	Info info;
+
+	if (!file.Open(name))
+		return NULL;
+
+	if (!ReadInfo(file.data, file.size, info))
+		return NULL;
+
+	unsigned char *pixels = PixelPool::Alloc(ImageSize(info));
+
+	if (!Decode(file.data, file.size, info, pixels))
+	{
+		PixelPool::Free(pixels);
+		return NULL;
+	}
+
+	width = info.width;
+	height = info.height;
+	alpha = info.alpha;
+
+	return pixels;
+}
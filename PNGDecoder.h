@@ -0,0 +1,66 @@
+//////////////////////////////////////////////////////////////////////
+//
+// PNG Decoder Class
+//
+// PNGDecoder.h: interface for the PNGDecoder class.
+// This class reads PNG files without zlib or libpng, the
+// inflate it needs is in PNGDecoder.cpp. It takes every color
+// type and bit depth, interlaced or not, with a tRNS chunk
+// for the transparency of gray, RGB and palette images. The
+// rows come out tightly packed, 8 bits a channel and bottom
+// row first the way OpenGL wants them. Images with alpha or
+// transparency come out as RGBA, the others as RGB. 16 bit
+// channels keep their high byte. The CRCs aren't checked.
+//
+// Load maps the file and decodes it straight into a PixelPool
+// buffer. Decode fills a buffer the caller already has.
+//
+// Usage:
+// int width, height;
+// bool alpha;
+// unsigned char *pixels = PNGDecoder::Load("Coin.png", width, height, alpha);
+// ...
+// PixelPool::Free(pixels);
+//
+// // Or into your own buffer
+// PNGDecoder::Info info;
+// if (PNGDecoder::ReadInfo(data, size, info))
+// {
+//     std::vector<unsigned char> image(PNGDecoder::ImageSize(info));
+//     PNGDecoder::Decode(data, size, info, &image[0]);
+// }
+//
+//////////////////////////////////////////////////////////////////////
+
+#ifndef PNGDECODER_H
+#define PNGDECODER_H
+
+#include <stddef.h>
+
+class PNGDecoder
+{
+public:
+	struct Info {
+		int width;					// The image's width in pixels
+		int height;					// The image's height in pixels
+		int bitDepth;				// 1, 2, 4, 8 or 16 bits a channel
+		int colorType;				// 0 gray, 2 RGB, 3 palette, 4 gray and alpha, 6 RGBA
+		bool interlaced;			// True: the pixels are in the 7 Adam7 passes
+		bool alpha;					// True: the pixels come out as RGBA
+		const unsigned char *palette;	// The RGB entries of the PLTE chunk
+		int paletteSize;			// The entries in it
+		const unsigned char *transparency;	// The tRNS chunk, NULL if there is none
+		int transparencySize;		// Its length in bytes
+	};
+
+	// Checks the chunks and fills info, false if the file is no PNG this can read
+	static bool ReadInfo(const unsigned char *data, size_t size, Info &info);
+	// The bytes Decode writes
+	static size_t ImageSize(const Info &info);
+	// Decodes the pixels into out, which has room for ImageSize bytes
+	static bool Decode(const unsigned char *data, size_t size, const Info &info, unsigned char *out);
+	// Maps and decodes a file into a PixelPool buffer, NULL if it can't
+	static unsigned char *Load(const char *name, int &width, int &height, bool &alpha);
+};
+
+#endif PNGDECODER_H
@@ -0,0 +1,117 @@
+//////////////////////////////////////////////////////////////////////
+//
+// Pixel Pool Class
+//
+// PixelPool.cpp: implementation of the PixelPool class.
+// Each buffer starts with a small header that holds its size,
+// the caller gets the bytes after it.
+//
+//////////////////////////////////////////////////////////////////////
+
+#include "PixelPool.h"
+#include "LoadStats.h"
+
+#include <stdlib.h>
+#include <mutex>
+#include <vector>
+
+#define POOL_HEADER		16					// Keeps the pixels as aligned as malloc left them
+#define POOL_BUFFERS	8					// The most buffers kept
+#define POOL_BYTES		(64 * 1024 * 1024)	// The most bytes kept
+
+static std::mutex poolLock;
+static std::vector<unsigned char *> *kept = NULL;	// The free buffers, by their header
+static size_t keptBytes = 0;
+
+static size_t &Capacity(unsigned char *block)
+{
+	return *(size_t *)block;
+}
+
+unsigned char *PixelPool::Alloc(size_t bytes)
+{
+	{
+		std::lock_guard<std::mutex> guard(poolLock);
+
+		// The smallest kept buffer it fits in
+		int best = -1;
+
+		for (int i = 0; kept && i < (int)kept->size(); i++)
+		{
+			size_t capacity = Capacity((*kept)[i]);
+
+			if (capacity >= bytes && (best < 0 || capacity < Capacity((*kept)[best])))
+				best = i;
+		}
+
+		// Don't hand out a buffer that is a lot too big
+		if (best >= 0 && Capacity((*kept)[best]) / 2 <= bytes)
+		{
+			unsigned char *block = (*kept)[best];
+
+			(*kept)[best] = kept->back();
+			kept->pop_back();
+			keptBytes -= Capacity(block);
+
+			return block + POOL_HEADER;
+		}
+	}
+
+	unsigned char *block = (unsigned char *)malloc(bytes + POOL_HEADER);
+	LoadStats::CountAlloc();
+
+	if (block == NULL)
+		return NULL;
+
+	Capacity(block) = bytes;
+	return block + POOL_HEADER;
+}
+
+void PixelPool::Free(unsigned char *p)
+{
+	if (p == NULL)
+		return;
+
+	unsigned char *block = p - POOL_HEADER;
+	size_t capacity = Capacity(block);
+
+	{
+		std::lock_guard<std::mutex> guard(poolLock);
+
+		// Never destroyed, textures are freed by global destructors too
+		if (kept == NULL)
+			kept = new std::vector<unsigned char *>;
+
+		if (kept->size() < POOL_BUFFERS && keptBytes + capacity <= POOL_BYTES)
+		{
+			kept->push_back(block);
+			keptBytes += capacity;
+			return;
+		}
+	}
+
+	free(block);
+}
+
+void PixelPool::Trim()
+{
+	std::vector<unsigned char *> blocks;
+
+	{
+		std::lock_guard<std::mutex> guard(poolLock);
+
+		if (kept)
+			blocks.swap(*kept);
+
+		keptBytes = 0;
+	}
+
+	for (size_t i = 0; i < blocks.size(); i++)
+		free(blocks[i]);
+}
+
+size_t PixelPool::KeptBytes()
+{
+	std::lock_guard<std::mutex> guard(poolLock);
+	return keptBytes;
+}
@@ -0,0 +1,37 @@
+//////////////////////////////////////////////////////////////////////
+//
+// Pixel Pool Class
+//
+// PixelPool.h: interface for the PixelPool class.
+// This class keeps the big buffers the texture decoders fill.
+// A decoded image only lives until it is uploaded, then its
+// buffer goes back to the pool and the next decode takes it
+// instead of asking the OS for fresh pages of the same size.
+// A few buffers are kept, the rest are freed.
+//
+// Every GLTexture::pixels buffer comes from here and goes back
+// with FreePixels.
+//
+// Usage:
+// unsigned char *p = PixelPool::Alloc(width * height * 3);	// Any thread
+// ...
+// PixelPool::Free(p);			// Kept for the next Alloc
+// PixelPool::Trim();			// Frees whatever is kept
+//
+//////////////////////////////////////////////////////////////////////
+
+#ifndef PIXELPOOL_H
+#define PIXELPOOL_H
+
+#include <stddef.h>
+
+class PixelPool
+{
+public:
+	static unsigned char *Alloc(size_t bytes);	// A buffer of at least bytes, NULL if there is no memory
+	static void Free(unsigned char *p);			// Gives the buffer back, NULL is ignored
+	static void Trim();							// Frees the buffers the pool kept
+	static size_t KeptBytes();					// What the kept buffers take
+};
+
+#endif PIXELPOOL_H
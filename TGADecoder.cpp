@@ -0,0 +1,318 @@
+//////////////////////////////////////////////////////////////////////
+//
+// Targa Decoder Class
+//
+// TGADecoder.cpp: implementation of the TGADecoder class.
+//
+//////////////////////////////////////////////////////////////////////
+
+#include "TGADecoder.h"
+#include "ImageKernels.h"
+#include "MappedFile.h"
+#include "PixelPool.h"
+
+#include <string.h>
+
+#define TGA_TRUECOLOR	2		// Uncompressed true color
+#define TGA_GRAY		3		// Uncompressed grayscale
+#define TGA_RLE			8		// Added to either for the RLE version
+#define TGA_HEADER		18		// The fixed part of the header
+#define TGA_FOOTER		26		// The footer of a version 2 file
+#define TGA_EXTENSION	495		// The extension area the footer points at
+
+// The file is little endian, and may not be aligned
+static unsigned int ReadU16(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static unsigned int ReadU32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+// What the extension area of a version 2 file says about the alpha,
+// -1 if there is none. 3 is alpha, 4 alpha already multiplied in
+static int AttributesType(const unsigned char *data, size_t size)
+{
+	if (size < TGA_HEADER + TGA_FOOTER)
+		return -1;
+
+	const unsigned char *footer = data + size - TGA_FOOTER;
+
+	if (memcmp(footer + 8, "TRUEVISION-XFILE.", 17) != 0)
+		return -1;
+
+	size_t extension = ReadU32(footer);
+
+	if (extension < TGA_HEADER || extension + TGA_EXTENSION > size - TGA_FOOTER ||
+		ReadU16(data + extension) < TGA_EXTENSION)
+		return -1;
+
+	return data[extension + 494];
+}
+
+//////////////////////////////////////////////////////////////////////
+// Headers
+//////////////////////////////////////////////////////////////////////
+
+bool TGADecoder::ReadInfo(const unsigned char *data, size_t size, Info &info)
+{
+	memset(&info, 0, sizeof(info));
+
+	if (data == NULL || size < TGA_HEADER)
+		return false;
+
+	int idLength = data[0];
+	int colorMapType = data[1];
+	int colorMapLength = (int)ReadU16(data + 5);
+	int colorMapBits = data[7];
+	int descriptor = data[17];
+
+	info.imageType = data[2];
+	info.width = (int)ReadU16(data + 12);
+	info.height = (int)ReadU16(data + 14);
+	info.bitsPerPixel = data[16];
+	info.topDown = (descriptor & 0x20) != 0;
+	info.rightToLeft = (descriptor & 0x10) != 0;
+
+	// A true color image may still carry a color map, it is skipped
+	if (colorMapType > 1 || info.width <= 0 || info.height <= 0)
+		return false;
+
+	// Only the combinations this decodes
+	switch (info.imageType & ~TGA_RLE)
+	{
+		case TGA_TRUECOLOR	:
+			if (info.bitsPerPixel != 15 && info.bitsPerPixel != 16 &&
+				info.bitsPerPixel != 24 && info.bitsPerPixel != 32)
+				return false;
+
+			// The alpha bits in the descriptor, or the extension area saying so.
+			// The one alpha bit of 16 bit pixels is left out, few files set it
+			if (info.bitsPerPixel == 32)
+			{
+				int attributes = AttributesType(data, size);
+				info.alpha = (descriptor & 0x0F) != 0 || attributes == 3 || attributes == 4;
+			}
+			break;
+		case TGA_GRAY		:
+			if (info.bitsPerPixel != 8 && info.bitsPerPixel != 16)
+				return false;
+
+			// 16 bit gray is gray then alpha
+			info.alpha = info.bitsPerPixel == 16;
+			break;
+		default				:
+			return false;
+	}
+
+	info.dataOffset = TGA_HEADER + idLength;
+
+	if (colorMapType == 1)
+		info.dataOffset += (size_t)colorMapLength * ((colorMapBits + 7) / 8);
+
+	if (info.dataOffset > size)
+		return false;
+
+	// Uncompressed, all the pixels have to be there. RLE data that stops
+	// short leaves the rest black
+	if ((info.imageType & TGA_RLE) == 0)
+	{
+		size_t bytes = (size_t)info.width * info.height * ((info.bitsPerPixel + 7) / 8);
+
+		if (info.dataOffset + bytes > size)
+			return false;
+	}
+
+	return true;
+}
+
+size_t TGADecoder::ImageSize(const Info &info)
+{
+	return (size_t)info.width * info.height * (info.alpha ? 4 : 3);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Pixels
+//////////////////////////////////////////////////////////////////////
+
+// count pixels as the file has them to RGB(A)
+static void Convert(const TGADecoder::Info &info, const unsigned char *src, unsigned char *dst, int count)
+{
+	if ((info.imageType & ~TGA_RLE) == TGA_GRAY)
+	{
+		if (info.alpha)
+			ImageKernels::ExpandGrayAlpha(src, dst, count);
+		else
+			ImageKernels::ExpandGray(src, dst, count);
+	}
+	else if (info.bitsPerPixel == 24)
+		ImageKernels::SwapRedBlue24(src, dst, count);
+	else if (info.bitsPerPixel == 32)
+	{
+		if (info.alpha)
+			ImageKernels::SwapRedBlue32(src, dst, count);
+		else
+			ImageKernels::DropAlpha32(src, dst, count);
+	}
+	else
+	{
+		// ARRRRRGG GGGBBBBB, each 5 bits widened to 8
+		for (int i = 0; i < count; i++, dst += 3)
+		{
+			unsigned int pixel = ReadU16(src + i * 2);
+			unsigned int r = (pixel >> 10) & 31;
+			unsigned int g = (pixel >> 5) & 31;
+			unsigned int b = pixel & 31;
+
+			dst[0] = (unsigned char)((r << 3) | (r >> 2));
+			dst[1] = (unsigned char)((g << 3) | (g >> 2));
+			dst[2] = (unsigned char)((b << 3) | (b >> 2));
+		}
+	}
+}
+
+// count copies of the pixel already at dst, each copy doubling what is there
+static void Repeat(unsigned char *dst, int pixel, int count)
+{
+	size_t done = pixel;
+	size_t total = (size_t)pixel * count;
+
+	while (done < total)
+	{
+		size_t step = (total - done < done) ? total - done : done;
+
+		memcpy(dst + done, dst, step);
+		done += step;
+	}
+}
+
+// Packets may run on from one row into the next, so the pixels are
+// written a row's worth at a time
+static void DecodeRLE(const unsigned char *p, const unsigned char *end, const TGADecoder::Info &info, unsigned char *out)
+{
+	int bytes = (info.bitsPerPixel + 7) / 8;
+	int channels = info.alpha ? 4 : 3;
+	size_t outStride = (size_t)info.width * channels;
+	int x = 0;
+	int row = 0;
+
+	while (row < info.height && p < end)
+	{
+		int count = (p[0] & 0x7F) + 1;
+		bool run = (p[0] & 0x80) != 0;
+		p++;
+
+		// A packet cut off by the end of the file is dropped
+		if (p + (run ? bytes : (size_t)bytes * count) > end)
+			break;
+
+		const unsigned char *src = p;
+		p += run ? bytes : bytes * count;
+
+		while (count > 0 && row < info.height)
+		{
+			int n = (count < info.width - x) ? count : info.width - x;
+			unsigned char *dst = out + outStride * (info.topDown ? info.height - 1 - row : row) + (size_t)x * channels;
+
+			if (run)
+			{
+				Convert(info, src, dst, 1);
+				Repeat(dst, channels, n);
+			}
+			else
+			{
+				Convert(info, src, dst, n);
+				src += (size_t)bytes * n;
+			}
+
+			count -= n;
+			x += n;
+
+			if (x == info.width)
+			{
+				x = 0;
+				row++;
+			}
+		}
+	}
+
+	// Whatever the data didn't reach
+	for (; row < info.height; row++, x = 0)
+	{
+		unsigned char *dst = out + outStride * (info.topDown ? info.height - 1 - row : row);
+		memset(dst + (size_t)x * channels, 0, (size_t)(info.width - x) * channels);
+	}
+}
+
+bool TGADecoder::Decode(const unsigned char *data, size_t size, const Info &info, unsigned char *out)
+{
+	if (out == NULL)
+		return false;
+
+	int channels = info.alpha ? 4 : 3;
+	size_t outStride = (size_t)info.width * channels;
+
+	if (info.imageType & TGA_RLE)
+		DecodeRLE(data + info.dataOffset, data + size, info, out);
+	else
+	{
+		size_t stride = (size_t)info.width * ((info.bitsPerPixel + 7) / 8);
+
+		for (int r = 0; r < info.height; r++)
+		{
+			// The rows go out bottom first
+			unsigned char *dst = out + outStride * (info.topDown ? info.height - 1 - r : r);
+
+			Convert(info, data + info.dataOffset + stride * r, dst, info.width);
+		}
+	}
+
+	// Hardly any writer stores the rows backwards, so they are turned afterwards
+	if (info.rightToLeft)
+	{
+		for (int r = 0; r < info.height; r++)
+		{
+			unsigned char *left = out + outStride * r;
+			unsigned char *right = left + outStride - channels;
+
+			for (; left < right; left += channels, right -= channels)
+			{
+				unsigned char temp[4];
+
+				memcpy(temp, left, channels);
+				memcpy(left, right, channels);
+				memcpy(right, temp, channels);
+			}
+		}
+	}
+
+	return true;
+}
+
+unsigned char *TGADecoder::Load(const char *name, int &width, int &height, bool &alpha)
+{
+	MappedFile file;
+	Info info;
+
+	if (!file.Open(name))
+		return NULL;
+
+	if (!ReadInfo(file.data, file.size, info))
+		return NULL;
+
+	unsigned char *pixels = PixelPool::Alloc(ImageSize(info));
+
+	if (!Decode(file.data, file.size, info, pixels))
+	{
+		PixelPool::Free(pixels);
+		return NULL;
+	}
+
+	width = info.width;
+	height = info.height;
+	alpha = info.alpha;
+
+	return pixels;
+}
@@ -0,0 +1,65 @@
+//////////////////////////////////////////////////////////////////////
+//
+// Targa Decoder Class
+//
+// TGADecoder.h: interface for the TGADecoder class.
+// This class reads targa files, uncompressed or RLE, in true
+// color (15, 16, 24 or 32 bit) or grayscale (8 bit, or 16 bit
+// with alpha). The rows come out tightly packed, red first and
+// bottom row first the way OpenGL wants them, whichever corner
+// the file starts in. Gray comes out as RGB, or RGBA with its
+// alpha. 32 bit images keep their alpha only if the file says
+// it has one, otherwise they come out as RGB.
+//
+// Load maps the file and decodes it straight into a PixelPool
+// buffer, so the file is read once and the only copy of the
+// image is the one GL gets. Decode fills a buffer the caller
+// already has, e.g. from a resource.
+//
+// Usage:
+// int width, height;
+// bool alpha;
+// unsigned char *pixels = TGADecoder::Load("wall.tga", width, height, alpha);
+// ...
+// PixelPool::Free(pixels);
+//
+// // Or into your own buffer
+// TGADecoder::Info info;
+// if (TGADecoder::ReadInfo(data, size, info))
+// {
+//     std::vector<unsigned char> image(TGADecoder::ImageSize(info));
+//     TGADecoder::Decode(data, size, info, &image[0]);
+// }
+//
+//////////////////////////////////////////////////////////////////////
+
+#ifndef TGADECODER_H
+#define TGADECODER_H
+
+#include <stddef.h>
+
+class TGADecoder
+{
+public:
+	struct Info {
+		int width;					// The image's width in pixels
+		int height;					// The image's height in pixels
+		int imageType;				// 2 true color, 3 gray, 10 and 11 the same with RLE
+		int bitsPerPixel;			// 15, 16, 24 or 32 for true color, 8 or 16 for gray
+		bool topDown;				// True: the file's first row is the top one
+		bool rightToLeft;			// True: the file's rows start at the right
+		bool alpha;					// True: the pixels come out as RGBA
+		size_t dataOffset;			// Where the pixels start in the file
+	};
+
+	// Checks the header and fills info, false if the file is no targa this can read
+	static bool ReadInfo(const unsigned char *data, size_t size, Info &info);
+	// The bytes Decode writes
+	static size_t ImageSize(const Info &info);
+	// Decodes the pixels into out, which has room for ImageSize bytes
+	static bool Decode(const unsigned char *data, size_t size, const Info &info, unsigned char *out);
+	// Maps and decodes a file into a PixelPool buffer, NULL if it can't
+	static unsigned char *Load(const char *name, int &width, int &height, bool &alpha);
+};
+
+#endif TGADECODER_H
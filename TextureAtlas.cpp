@@ -0,0 +1,548 @@
+//////////////////////////////////////////////////////////////////////
+//
+// Texture Atlas Class
+//
+// TextureAtlas.cpp: implementation of the TextureAtlas class.
+//
+//////////////////////////////////////////////////////////////////////
+
+#include "TextureAtlas.h"
+#include "GLTexture.h"
+#include "TextureCache.h"
+#include "BlockCompressor.h"
+#include "MipChain.h"
+#include "PixelPool.h"
+#include "LoadStats.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+// GL 1.2, not in the 1.1 headers Windows has
+#ifndef GL_CLAMP_TO_EDGE
+#define GL_CLAMP_TO_EDGE	0x812F
+#endif
+
+//////////////////////////////////////////////////////////////////////
+// Construction/Destruction
+//////////////////////////////////////////////////////////////////////
+
+TextureAtlas::TextureAtlas(int size, int biggest, int gutterLevels)
+{
+	pageSize = size;
+	maxSize = biggest;
+	gutter = 1 << gutterLevels;
+	holders = 0;
+	memset(&stats, 0, sizeof(stats));
+}
+
+TextureAtlas::~TextureAtlas()
+{
+	// The GL textures are left to Free, the memory is ours
+	for (size_t i = 0; i < pages.size(); i++)
+	{
+		PixelPool::Free(pages[i].pixels);
+		FreeLevels(pages[i].built);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////
+// Packing
+//////////////////////////////////////////////////////////////////////
+
+bool TextureAtlas::FindSpot(const Page &p, int width, int height, int &x, int &y)
+{
+	int bestTop = pageSize + 1;
+
+	// Try the cell's left edge on every segment, it rests on the
+	// highest segment under it. The lowest top wins, then the leftmost
+	for (size_t i = 0; i < p.skyline.size(); i++)
+	{
+		int left = p.skyline[i].x;
+		int top = 0;
+
+		if (left + width > pageSize)
+			break;
+
+		for (size_t j = i; j < p.skyline.size() && p.skyline[j].x < left + width; j++)
+		{
+			if (p.skyline[j].y > top)
+				top = p.skyline[j].y;
+		}
+
+		if (top + height <= pageSize && top + height < bestTop)
+		{
+			bestTop = top + height;
+			x = left;
+			y = top;
+		}
+	}
+
+	return bestTop <= pageSize;
+}
+
+void TextureAtlas::AddCell(Page &p, int x, int y, int width, int height)
+{
+	std::vector<Segment> next;
+	bool added = false;
+
+	// What is left of the cell, the cell, and what is right of it
+	for (size_t i = 0; i < p.skyline.size(); i++)
+	{
+		Segment s = p.skyline[i];
+		int end = s.x + s.width;
+
+		if (s.x < x)
+		{
+			Segment left = { s.x, s.y, (end < x ? end : x) - s.x };
+			next.push_back(left);
+		}
+
+		if (!added && end > x)
+		{
+			Segment cell = { x, y + height, width };
+			next.push_back(cell);
+			added = true;
+		}
+
+		if (end > x + width)
+		{
+			int start = s.x > x + width ? s.x : x + width;
+			Segment right = { start, s.y, end - start };
+			next.push_back(right);
+		}
+	}
+
+	// Neighbours at the same height are one segment
+	p.skyline.clear();
+
+	for (size_t i = 0; i < next.size(); i++)
+	{
+		if (!p.skyline.empty() && p.skyline.back().y == next[i].y)
+			p.skyline.back().width += next[i].width;
+		else
+			p.skyline.push_back(next[i]);
+	}
+}
+
+bool TextureAtlas::Place(const char *name, const float lo[2], const float hi[2], Region &out)
+{
+	// The same file and cut goes where it went before
+	std::string key;
+	char cut[64];
+
+	TextureCache::NormalizePath(name, key);
+	sprintf(cut, "#%g,%g,%g,%g", lo[0], lo[1], hi[0], hi[1]);
+	key += cut;
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		std::map<std::string, Region>::iterator found = placed.find(key);
+
+		if (found != placed.end())
+		{
+			out = found->second;
+			return true;
+		}
+	}
+
+	LOADSTATS_FILE(name);
+	LOADSTATS_SCOPE("atlas", 0);
+
+	// Read the image outside the lock, other threads may be doing the same
+	GLTexture image;
+
+	if (!image.DecodeImage(name))
+		return false;
+
+	int width = image.width;
+	int height = image.height;
+	int channels = (image.format == GL_RGBA) ? 4 : 3;
+
+	// The texels the faces use, and one more each side for the filtering
+	int x0 = (int)floorf(lo[0] * width) - 1;
+	int y0 = (int)floorf(lo[1] * height) - 1;
+	int x1 = (int)ceilf(hi[0] * width) + 1;
+	int y1 = (int)ceilf(hi[1] * height) + 1;
+
+	x0 = x0 < 0 ? 0 : x0;
+	y0 = y0 < 0 ? 0 : y0;
+	x1 = x1 > width ? width : x1;
+	y1 = y1 > height ? height : y1;
+
+	int cutWidth = x1 - x0;
+	int cutHeight = y1 - y0;
+
+	// Gutters each side, rounded up so the next cell starts on a multiple
+	int cellWidth = (cutWidth + 2 * gutter + gutter - 1) / gutter * gutter;
+	int cellHeight = (cutHeight + 2 * gutter + gutter - 1) / gutter * gutter;
+
+	if (cutWidth <= 0 || cutHeight <= 0 || cutWidth > maxSize || cutHeight > maxSize ||
+		cellWidth > pageSize || cellHeight > pageSize)
+		return false;
+
+	LOADSTATS_BYTES((size_t)cellWidth * cellHeight * channels);
+
+	std::lock_guard<std::mutex> guard(lock);
+
+	// Someone may have placed it while we were reading
+	std::map<std::string, Region>::iterator found = placed.find(key);
+
+	if (found != placed.end())
+	{
+		out = found->second;
+		return true;
+	}
+
+	// The first page of the kind with room, or a new one
+	int page = -1;
+	int x = 0, y = 0;
+
+	for (size_t i = 0; i < pages.size() && page < 0; i++)
+	{
+		if (pages[i].channels == channels && FindSpot(pages[i], cellWidth, cellHeight, x, y))
+			page = (int)i;
+	}
+
+	if (page < 0)
+	{
+		Page p;
+		size_t bytes = (size_t)pageSize * pageSize * channels;
+
+		p.channels = channels;
+		p.pixels = PixelPool::Alloc(bytes);
+		p.texture = 0;
+		p.dirty = false;
+		p.building = false;
+		p.version = 0;
+		memset(&p.built, 0, sizeof(p.built));
+
+		if (p.pixels == NULL)
+			return false;
+
+		memset(p.pixels, 0, bytes);
+
+		Segment floor = { 0, 0, pageSize };
+		p.skyline.push_back(floor);
+		pages.push_back(p);
+
+		page = (int)pages.size() - 1;
+		x = 0;
+		y = 0;
+	}
+
+	Page &p = pages[page];
+	AddCell(p, x, y, cellWidth, cellHeight);
+
+	// Copy the cut in, every pixel of the cell outside it repeats the
+	// nearest edge pixel
+	size_t pixel = channels;
+
+	for (int row = 0; row < cellHeight; row++)
+	{
+		int sy = row - gutter;
+		sy = y0 + (sy < 0 ? 0 : (sy >= cutHeight ? cutHeight - 1 : sy));
+
+		const unsigned char *src = image.pixels + ((size_t)sy * width + x0) * pixel;
+		unsigned char *dst = p.pixels + ((size_t)(y + row) * pageSize + x) * pixel;
+		int right = cellWidth - gutter - cutWidth;
+
+		for (int k = 0; k < gutter; k++)
+			memcpy(dst + k * pixel, src, pixel);
+
+		memcpy(dst + gutter * pixel, src, cutWidth * pixel);
+
+		for (int k = 0; k < right; k++)
+			memcpy(dst + (gutter + cutWidth + k) * pixel, src + (cutWidth - 1) * pixel, pixel);
+	}
+
+	p.dirty = true;
+	p.version++;
+
+	// The whole texture's place, so the coordinates move without the cut
+	out.page = page;
+	out.offset[0] = (float)(x + gutter - x0) / pageSize;
+	out.offset[1] = (float)(y + gutter - y0) / pageSize;
+	out.scale[0] = (float)width / pageSize;
+	out.scale[1] = (float)height / pageSize;
+	placed[key] = out;
+
+	stats.textures++;
+	stats.usedPixels += (size_t)cellWidth * cellHeight;
+	stats.savedPixels += (size_t)width * height - (size_t)cutWidth * cutHeight;
+
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Building
+//////////////////////////////////////////////////////////////////////
+
+bool TextureAtlas::IsBuilt(const Page &p)
+{
+	return p.built.version == p.version && (p.built.pixels != NULL || p.built.blocks != NULL);
+}
+
+void TextureAtlas::FreeLevels(Levels &levels)
+{
+	PixelPool::Free(levels.pixels);
+	PixelPool::Free(levels.mipmaps);
+	PixelPool::Free(levels.blocks);
+	levels.pixels = NULL;
+	levels.mipmaps = NULL;
+	levels.blocks = NULL;
+}
+
+bool TextureAtlas::BuildLevels(int page, Levels &out)
+{
+	int channels;
+	size_t bytes;
+
+	memset(&out, 0, sizeof(out));
+
+	// Only the copy is made under the lock, the workers go on placing
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		if (page < 0 || page >= (int)pages.size())
+			return false;
+
+		const Page &p = pages[page];
+
+		channels = p.channels;
+		bytes = (size_t)pageSize * pageSize * channels;
+		out.version = p.version;
+		out.pixels = PixelPool::Alloc(bytes);
+
+		if (out.pixels == NULL)
+			return false;
+
+		memcpy(out.pixels, p.pixels, bytes);
+	}
+
+	LOADSTATS_FILE("atlas");
+	LOADSTATS_SCOPE("build", bytes);
+
+	out.mipmaps = MipChain::Build(out.pixels, pageSize, pageSize, channels);
+
+	// Compressed like the textures it stands in for, when they are. Then
+	// the blocks are all Upload needs
+	if (BlockCompressor::GetQuality() != BlockCompressor::OFF)
+	{
+		out.blocks = BlockCompressor::Compress(out.pixels, out.mipmaps, pageSize, pageSize, channels, BlockCompressor::GetQuality());
+
+		if (out.blocks != NULL)
+		{
+			PixelPool::Free(out.pixels);
+			PixelPool::Free(out.mipmaps);
+			out.pixels = NULL;
+			out.mipmaps = NULL;
+		}
+	}
+
+	return true;
+}
+
+void TextureAtlas::Hold()
+{
+	std::lock_guard<std::mutex> guard(lock);
+
+	holders++;
+}
+
+void TextureAtlas::Release()
+{
+	std::vector<int> changed;
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		if (--holders > 0)
+			return;
+
+		holders = 0;
+
+		// Marked so Upload waits for these rather than build them too
+		for (size_t i = 0; i < pages.size(); i++)
+		{
+			Page &p = pages[i];
+
+			if (p.dirty && !p.building && !IsBuilt(p))
+			{
+				p.building = true;
+				changed.push_back((int)i);
+			}
+		}
+	}
+
+	for (size_t i = 0; i < changed.size(); i++)
+	{
+		Levels levels;
+		bool ok = BuildLevels(changed[i], levels);
+
+		std::lock_guard<std::mutex> guard(lock);
+
+		// Free may have dropped the pages meanwhile
+		if (changed[i] >= (int)pages.size())
+		{
+			FreeLevels(levels);
+			continue;
+		}
+
+		Page &p = pages[changed[i]];
+
+		// A texture placed meanwhile makes them stale, the next
+		// Release or Upload builds the page again
+		if (ok && levels.version == p.version)
+		{
+			FreeLevels(p.built);
+			p.built = levels;
+		}
+		else
+			FreeLevels(levels);
+
+		p.building = false;
+	}
+}
+
+//////////////////////////////////////////////////////////////////////
+// Uploading
+//////////////////////////////////////////////////////////////////////
+
+bool TextureAtlas::UploadReady(int page)
+{
+	std::lock_guard<std::mutex> guard(lock);
+
+	if (page < 0 || page >= (int)pages.size())
+		return true;
+
+	const Page &p = pages[page];
+
+	// Without holders nobody else is going to build it
+	return !p.dirty || IsBuilt(p) || (holders == 0 && !p.building);
+}
+
+void TextureAtlas::Upload(int page)
+{
+	Levels levels;
+	int channels;
+	GLuint texture;
+
+	// Take the built levels, the lock isn't held for any GL work
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		if (page < 0 || page >= (int)pages.size() || !pages[page].dirty)
+			return;
+
+		Page &p = pages[page];
+		bool built = IsBuilt(p);
+
+		levels = p.built;
+		memset(&p.built, 0, sizeof(p.built));
+		channels = p.channels;
+
+		if (built)
+			p.dirty = false;
+		else
+			FreeLevels(levels);
+
+		texture = p.texture;
+	}
+
+	// Only the GL thread sets it, so it can be made outside the lock
+	if (texture == 0)
+	{
+		glGenTextures(1, &texture);
+
+		std::lock_guard<std::mutex> guard(lock);
+		pages[page].texture = texture;
+	}
+
+	// Placed into without a hold, or since the last build
+	if (levels.pixels == NULL && levels.blocks == NULL)
+	{
+		if (!BuildLevels(page, levels))
+			return;
+
+		std::lock_guard<std::mutex> guard(lock);
+
+		if (levels.version == pages[page].version)
+			pages[page].dirty = false;
+	}
+
+	GLenum format = (channels == 4) ? GL_RGBA : GL_RGB;
+
+	LOADSTATS_FILE("atlas");
+	LOADSTATS_SCOPE("upload", levels.blocks ? BlockCompressor::ChainSize(pageSize, pageSize, channels) :
+		(size_t)pageSize * pageSize * channels + MipChain::ChainSize(pageSize, pageSize, channels));
+
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+	// A driver without S3TC gets the blocks decompressed
+	bool done = levels.blocks != NULL && BlockCompressor::Upload(levels.blocks, pageSize, pageSize, format);
+
+	if (!done && levels.blocks != NULL)
+		BlockCompressor::Decompress(levels.blocks, pageSize, pageSize, channels, levels.pixels, levels.mipmaps);
+
+	if (!done && levels.pixels != NULL && !MipChain::Upload(levels.pixels, levels.mipmaps, pageSize, pageSize, format))
+		MipChain::BuildAndUpload(levels.pixels, pageSize, pageSize, format);
+
+	FreeLevels(levels);
+}
+
+size_t TextureAtlas::UploadBytes(int page)
+{
+	std::lock_guard<std::mutex> guard(lock);
+
+	if (page < 0 || page >= (int)pages.size() || !pages[page].dirty)
+		return 0;
+
+	const Page &p = pages[page];
+
+	// The levels go up as they were built, block compressed or not
+	if (IsBuilt(p) && p.built.blocks != NULL)
+		return BlockCompressor::ChainSize(pageSize, pageSize, p.channels);
+
+	return (size_t)pageSize * pageSize * p.channels + MipChain::ChainSize(pageSize, pageSize, p.channels);
+}
+
+GLuint TextureAtlas::Texture(int page)
+{
+	std::lock_guard<std::mutex> guard(lock);
+
+	if (page < 0 || page >= (int)pages.size())
+		return 0;
+
+	return pages[page].texture;
+}
+
+void TextureAtlas::GetStats(Stats &out)
+{
+	std::lock_guard<std::mutex> guard(lock);
+
+	out = stats;
+	out.pages = (int)pages.size();
+}
+
+void TextureAtlas::Free()
+{
+	std::lock_guard<std::mutex> guard(lock);
+
+	for (size_t i = 0; i < pages.size(); i++)
+	{
+		if (pages[i].texture != 0)
+			glDeleteTextures(1, &pages[i].texture);
+
+		PixelPool::Free(pages[i].pixels);
+		FreeLevels(pages[i].built);
+	}
+
+	pages.clear();
+	placed.clear();
+	memset(&stats, 0, sizeof(stats));
+}
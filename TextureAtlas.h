@@ -0,0 +1,152 @@
+//////////////////////////////////////////////////////////////////////
+//
+// Texture Atlas Class
+//
+// TextureAtlas.h: interface for the TextureAtlas class.
+// This class packs the small textures of several models into
+// a few big pages, so the models draw from one texture and
+// their faces can share a batch instead of switching textures.
+// Each texture is cut down to the part its faces use and put
+// on the skyline of a page, the lowest spot it fits in. A page
+// that is full starts another one.
+//
+// Every texture is padded with a gutter of its own edge pixels
+// and starts on a multiple of the gutter, so its mipmaps keep
+// their own pixels down to the gutter level. Further down the
+// neighbours bleed in, that far away it doesn't show.
+//
+// Only textures no bigger than maxSize once cut down go in, and
+// only faces that don't tile the texture. Model_3DS checks that
+// and moves the texture coordinates into the page (see its
+// atlas member).
+//
+// Place may run on any thread, Upload and Free on the GL thread.
+// A page that gets more textures after it was uploaded is
+// uploaded again by the next Upload.
+//
+// The mipmaps and blocks of a page are made off the GL thread.
+// Every model about to place textures holds the atlas (AssetLoader
+// does it when it queues the model), and the worker that releases
+// it last builds the pages that changed from a copy of them. Upload
+// then only sends the levels. A page placed into without a hold is
+// still built by Upload, outside the lock.
+//
+// Usage:
+// TextureAtlas atlas(2048, 1024, 3);	// 2048x2048 pages, 8 pixel gutters
+//
+// float lo[2] = { 0.0f, 0.0f }, hi[2] = { 0.5f, 1.0f };	// What the faces use
+// TextureAtlas::Region r;
+// if (atlas.Place("models/coin/coin.bmp", lo, hi, r))	// On a worker
+//     u = r.offset[0] + u * r.scale[0];	// The same for v
+//
+// atlas.Hold();						// Before the models are queued
+// atlas.Release();					// On the worker, after each one placed
+//
+// if (atlas.UploadReady(r.page))		// Else wait for the build
+//     atlas.Upload(r.page);			// On the GL thread
+// glBindTexture(GL_TEXTURE_2D, atlas.Texture(r.page));
+//
+// atlas.Free();						// Deletes the pages' textures
+//
+//////////////////////////////////////////////////////////////////////
+
+#ifndef TEXTUREATLAS_H
+#define TEXTUREATLAS_H
+
+#ifdef _WIN32
+#include <windows.h>		// Header File For Windows
+#include <gl\gl.h>			// Header File For The OpenGL32 Library
+#else
+#include <GL/gl.h>
+#endif
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+
+class TextureAtlas
+{
+public:
+	// Where a texture went, page coordinates are offset + coordinate * scale
+	struct Region {
+		int page;						// The page it is on
+		float offset[2];				// Where the texture's 0,0 lands on the page
+		float scale[2];					// The size of the whole texture on the page
+	};
+
+	struct Stats {
+		int textures;					// The textures placed so far
+		int pages;						// The pages they take
+		size_t usedPixels;				// The pixels of the pages their cells cover
+		size_t savedPixels;				// The pixels cutting them down left out
+	};
+
+	// Finds room for the part of the texture file between lo and hi (0 to 1)
+	// and copies it in, false if it is too big or the file can't be read
+	bool Place(const char *name, const float lo[2], const float hi[2], Region &out);
+	void Hold();						// Keeps the changed pages from being built until Release
+	void Release();						// The last one builds the changed pages on this thread
+	bool UploadReady(int page);			// False while a worker still has to build the page
+	void Upload(int page);				// Makes or remakes the page's texture if it changed
+	size_t UploadBytes(int page);		// What Upload would send, 0 if the page is up to date
+	GLuint Texture(int page);			// The page's GL texture, 0 until its first Upload
+	void GetStats(Stats &stats);		// How full the pages are
+	void Free();						// Deletes the pages and their textures, GL thread only
+	TextureAtlas(int pageSize = 2048, int maxSize = 1024, int gutterLevels = 3);	// Constructor
+	virtual ~TextureAtlas();			// Destructor
+
+private:
+	// One stretch of the top edge of what is packed, from x to x + width
+	struct Segment {
+		int x;
+		int y;
+		int width;
+	};
+
+	// A page's levels, made from a copy of it off the GL thread
+	struct Levels {
+		unsigned int version;			// The page's version they were made from
+		unsigned char *pixels;			// Level 0, NULL when blocks has them all
+		unsigned char *mipmaps;			// The levels below it
+		unsigned char *blocks;			// Every level block compressed, NULL if that is off
+	};
+
+	struct Page {
+		int channels;					// 3 or 4, a page only holds one kind
+		unsigned char *pixels;			// pageSize * pageSize pixels
+		std::vector<Segment> skyline;	// The top edge, left to right
+		GLuint texture;					// The GL texture, 0 until uploaded
+		bool dirty;						// True: pixels changed since the upload
+		bool building;					// True: a worker is making its levels
+		unsigned int version;			// Counts the textures placed on it
+		Levels built;					// The levels Upload sends, if they are current
+	};
+
+	int pageSize;						// The width and height of every page
+	int maxSize;						// The biggest texture that goes in
+	int gutter;							// The edge pixels around every texture
+	std::vector<Page> pages;			// Every page so far
+	std::map<std::string, Region> placed;	// What each file and cut already got
+	std::mutex lock;					// Guards everything above
+	Stats stats;						// How full the pages are
+	int holders;						// The models that may still place textures
+
+	// The lowest spot on the page's skyline a cell fits, false if none
+	bool FindSpot(const Page &p, int width, int height, int &x, int &y);
+	// Raises the skyline over a cell put at x, y
+	void AddCell(Page &p, int x, int y, int width, int height);
+	// True if the page's built levels match its pixels, lock held
+	static bool IsBuilt(const Page &p);
+	// Makes the page's levels from a copy of it, taking the lock only
+	// for the copy. False if it couldn't
+	bool BuildLevels(int page, Levels &out);
+	// Gives the levels' buffers back to the pool
+	static void FreeLevels(Levels &levels);
+
+	TextureAtlas(const TextureAtlas &);
+	TextureAtlas &operator=(const TextureAtlas &);
+};
+
+#endif TEXTUREATLAS_H
@@ -0,0 +1,324 @@
+//////////////////////////////////////////////////////////////////////
+//
+// Texture Cache Class
+//
+// TextureCache.cpp: implementation of the TextureCache class.
+//
+//////////////////////////////////////////////////////////////////////
+
+#include "TextureCache.h"
+#include "MappedFile.h"
+
+#include <string.h>
+#include <ctype.h>
+#include <algorithm>
+
+//////////////////////////////////////////////////////////////////////
+// Construction/Destruction
+//////////////////////////////////////////////////////////////////////
+
+TextureCache::TextureCache()
+{
+	memset(&stats, 0, sizeof(stats));
+}
+
+TextureCache::~TextureCache()
+{
+	// The GL context is usually gone by now, only the memory is ours
+	std::vector<Entry *> entries;
+
+	for (std::map<std::string, Entry *>::iterator i = byPath.begin(); i != byPath.end(); ++i)
+	{
+		if (std::find(entries.begin(), entries.end(), i->second) == entries.end())
+			entries.push_back(i->second);
+	}
+
+	entries.insert(entries.end(), unused.begin(), unused.end());
+
+	for (size_t i = 0; i < entries.size(); i++)
+		delete entries[i];
+}
+
+TextureCache &TextureCache::Shared()
+{
+	// Never destroyed, the global models release into it on exit
+	static TextureCache *cache = new TextureCache;
+	return *cache;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Keys
+//////////////////////////////////////////////////////////////////////
+
+void TextureCache::NormalizePath(const char *name, std::string &out)
+{
+	std::vector<std::string> parts;
+	std::string part;
+	bool absolute = (name[0] == '/' || name[0] == '\\');
+
+	// Split on either separator, dropping the quotes like GLTexture does
+	for (const char *c = name; ; c++)
+	{
+		if (*c == '/' || *c == '\\' || *c == 0)
+		{
+			if (part == "..")
+			{
+				// A leading .. has nothing to cancel out
+				if (!parts.empty() && parts.back() != "..")
+					parts.pop_back();
+				else if (!absolute)
+					parts.push_back(part);
+			}
+			else if (!part.empty() && part != ".")
+				parts.push_back(part);
+
+			part.clear();
+
+			if (*c == 0)
+				break;
+		}
+		else if (*c != '"')
+			part += (char)tolower((unsigned char)*c);
+	}
+
+	out = absolute ? "/" : "";
+
+	for (size_t i = 0; i < parts.size(); i++)
+	{
+		if (i > 0)
+			out += '/';
+
+		out += parts[i];
+	}
+}
+
+// A 64 bit hash of the bytes, eight at a time
+static unsigned long long HashBytes(const unsigned char *data, size_t size)
+{
+	const unsigned long long k = 0x9E3779B97F4A7C15ull;
+	unsigned long long h = size * k;
+	size_t i = 0;
+
+	for (; i + 8 <= size; i += 8)
+	{
+		unsigned long long w;
+		memcpy(&w, data + i, 8);
+
+		h = (h ^ w) * k;
+		h ^= h >> 32;
+	}
+
+	// The last few bytes
+	unsigned long long w = 0;
+	memcpy(&w, data + i, size - i);
+	h = (h ^ w) * k;
+
+	h ^= h >> 29;
+	h *= 0xBF58476D1CE4E5B9ull;
+	h ^= h >> 32;
+
+	return h;
+}
+
+size_t TextureCache::ImageBytes(const Entry *e)
+{
+	return (size_t)e->tex.width * e->tex.height * (e->tex.format == GL_RGBA ? 4 : 3);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Sharing
+//////////////////////////////////////////////////////////////////////
+
+TextureCache::Entry *TextureCache::Acquire(const char *name)
+{
+	std::string path;
+	NormalizePath(name, path);
+
+	Entry *e = NULL;
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		std::map<std::string, Entry *>::iterator found = byPath.find(path);
+
+		if (found != byPath.end())
+		{
+			e = found->second;
+			e->refs++;
+		}
+	}
+
+	if (e == NULL)
+	{
+		// Hash the file outside the lock, other threads may be doing the same.
+		// It is the one Decode is going to read, not always the one named
+		MappedFile file;
+		std::string source;
+		unsigned long long hash = 0;
+		size_t fileSize = 0;
+
+		GLTexture::SourceFile(name, source);
+
+		if (file.Open(source.c_str()))
+		{
+			hash = HashBytes(file.data, file.size);
+			fileSize = file.size;
+			file.Close();
+		}
+
+		std::unique_lock<std::mutex> guard(lock);
+
+		// Someone may have loaded the path while we were hashing
+		std::map<std::string, Entry *>::iterator found = byPath.find(path);
+
+		if (found != byPath.end())
+		{
+			e = found->second;
+			e->refs++;
+		}
+		else if (fileSize > 0 && byContent.count(ContentKey(hash, fileSize)))
+		{
+			// The same bytes under another name
+			e = byContent[ContentKey(hash, fileSize)];
+			e->paths.push_back(path);
+			e->refs++;
+			byPath[path] = e;
+
+			guard.unlock();
+
+			// Wait for its decode before counting what was saved
+			{
+				std::lock_guard<std::mutex> wait(e->decoding);
+			}
+
+			std::lock_guard<std::mutex> count(lock);
+			stats.contentHits++;
+			stats.bytesSaved += e->imageBytes;
+
+			return e;
+		}
+		else
+		{
+			e = new Entry;
+			e->paths.push_back(path);
+			e->hash = hash;
+			e->fileSize = fileSize;
+			e->refs = 1;
+			e->imageBytes = 0;
+			byPath[path] = e;
+
+			if (fileSize > 0)
+				byContent[ContentKey(hash, fileSize)] = e;
+
+			stats.misses++;
+
+			// Nobody can use it until it is decoded
+			std::lock_guard<std::mutex> decoding(e->decoding);
+			guard.unlock();
+
+			// What every hit saves from now on
+			bool ok = e->tex.Decode(name);
+
+			guard.lock();
+			e->imageBytes = ok ? ImageBytes(e) : 0;
+
+			return e;
+		}
+	}
+
+	// Found by its path, it may still be decoding
+	{
+		std::lock_guard<std::mutex> wait(e->decoding);
+	}
+
+	std::lock_guard<std::mutex> count(lock);
+	stats.pathHits++;
+	stats.bytesSaved += e->imageBytes;
+
+	return e;
+}
+
+void TextureCache::Upload(Entry *e)
+{
+	// Only the GL thread uploads, so there is nobody to race
+	if (e != NULL && e->tex.texture[0] == 0)
+		e->tex.Upload();
+}
+
+void TextureCache::Release(Entry *e)
+{
+	if (e == NULL)
+		return;
+
+	std::lock_guard<std::mutex> guard(lock);
+
+	if (--e->refs > 0)
+		return;
+
+	// Nobody can find it anymore, the next Acquire decodes the file again
+	Forget(e);
+
+	if (e->tex.texture[0] != 0)
+		unused.push_back(e);
+	else
+		delete e;
+}
+
+void TextureCache::Forget(Entry *e)
+{
+	for (size_t i = 0; i < e->paths.size(); i++)
+		byPath.erase(e->paths[i]);
+
+	std::map<ContentKey, Entry *>::iterator found = byContent.find(ContentKey(e->hash, e->fileSize));
+
+	if (found != byContent.end() && found->second == e)
+		byContent.erase(found);
+}
+
+void TextureCache::Purge()
+{
+	std::vector<Entry *> dead;
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		dead.swap(unused);
+	}
+
+	for (size_t i = 0; i < dead.size(); i++)
+	{
+		glDeleteTextures(1, &dead[i]->tex.texture[0]);
+		delete dead[i];
+	}
+}
+
+//////////////////////////////////////////////////////////////////////
+// Reporting
+//////////////////////////////////////////////////////////////////////
+
+void TextureCache::GetStats(Stats &out)
+{
+	std::lock_guard<std::mutex> guard(lock);
+
+	out = stats;
+	out.entries = 0;
+	out.bytes = 0;
+
+	// Every entry is under its first path
+	for (std::map<std::string, Entry *>::const_iterator i = byPath.begin(); i != byPath.end(); ++i)
+	{
+		if (i->first == i->second->paths[0])
+		{
+			out.entries++;
+			out.bytes += i->second->imageBytes;
+		}
+	}
+}
+
+void TextureCache::Report(FILE *out)
+{
+	Stats s;
+	GetStats(s);
+
+	fprintf(out, "texture cache: %d textures, %zu bytes, %d path hits, %d content hits, %d misses, %zu bytes saved\n",
+		s.entries, s.bytes, s.pathHits, s.contentHits, s.misses, s.bytesSaved);
+}
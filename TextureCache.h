@@ -0,0 +1,96 @@
+//////////////////////////////////////////////////////////////////////
+//
+// Texture Cache Class
+//
+// TextureCache.h: interface for the TextureCache class.
+// This class shares texture files between every model that
+// uses them. A texture is looked up first by its path, made
+// lower case with the ./ and ../ parts taken out, and then by
+// a hash of the bytes of the file GLTexture reads for it (see
+// GLTexture::SourceFile), so two materials that name the same
+// file or two files with the same bytes get the same entry.
+// Each distinct image is decoded and uploaded once and the
+// entry is counted, the GL texture goes away once the last
+// user released it and Purge ran.
+//
+// Acquire reads and decodes the file and may run on any thread.
+// Upload and Purge touch GL and have to run on the GL thread.
+//
+// Usage:
+// TextureCache &cache = TextureCache::Shared();	// One cache for the whole game
+//
+// TextureCache::Entry *e = cache.Acquire("models/tree/bark.bmp");	// On a worker
+// cache.Upload(e);							// On the GL thread, makes the texture once
+// glBindTexture(GL_TEXTURE_2D, e->tex.texture[0]);
+//
+// cache.Release(e);							// Once the user is done with it
+// cache.Purge();								// On the GL thread, deletes the unused textures
+//
+// TextureCache::Stats stats;
+// cache.GetStats(stats);						// Hits, misses and the bytes they saved
+// cache.Report(stdout);
+//
+//////////////////////////////////////////////////////////////////////
+
+#ifndef TEXTURECACHE_H
+#define TEXTURECACHE_H
+
+#include "GLTexture.h"
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+
+class TextureCache
+{
+public:
+	// One distinct image, shared by everyone who acquired it
+	struct Entry {
+		GLTexture tex;					// The decoded image, then the GL texture
+		std::vector<std::string> paths;	// The normalized paths that lead here
+		unsigned long long hash;		// The hash of the file's bytes
+		size_t fileSize;				// The size of the file, 0 if it couldn't be read
+		size_t imageBytes;				// The bytes of the decoded image, 0 if it couldn't be decoded
+		int refs;						// The users that haven't released it
+		std::mutex decoding;			// Held while the first user decodes the file
+	};
+
+	struct Stats {
+		int pathHits;					// Acquires that found the path
+		int contentHits;				// Acquires of a new path whose bytes were already loaded
+		int misses;						// Acquires that decoded the file
+		size_t bytesSaved;				// Image bytes the hits didn't decode and upload again
+		int entries;					// The distinct images held right now
+		size_t bytes;					// The image bytes they take
+	};
+
+	Entry *Acquire(const char *name);	// Finds or decodes the texture file, counts a user
+	void Upload(Entry *e);				// Makes the GL texture if it isn't made yet
+	void Release(Entry *e);				// Drops a user, an unused entry waits for Purge
+	void Purge();						// Deletes the GL textures nobody uses anymore
+	void GetStats(Stats &stats);		// The counters so far
+	void Report(FILE *out);				// Prints the counters
+	static void NormalizePath(const char *name, std::string &out);	// The path key of a file name
+	static TextureCache &Shared();		// The cache the models share
+	TextureCache();						// Constructor
+	virtual ~TextureCache();			// Destructor
+
+private:
+	typedef std::pair<unsigned long long, size_t> ContentKey;
+
+	std::map<std::string, Entry *> byPath;		// Every path acquired so far
+	std::map<ContentKey, Entry *> byContent;	// Every file's hash and size
+	std::vector<Entry *> unused;				// Released entries that still have a GL texture
+	std::mutex lock;							// Guards the maps, the counts and the stats
+	Stats stats;								// Hits and misses so far
+
+	static size_t ImageBytes(const Entry *e);	// The bytes the decoded image takes
+	void Forget(Entry *e);						// Takes the entry out of the maps, lock held
+
+	TextureCache(const TextureCache &);
+	TextureCache &operator=(const TextureCache &);
+};
+
+#endif TEXTURECACHE_H
@@ -0,0 +1,167 @@
+//////////////////////////////////////////////////////////////////////
+//
+// Worker Pool Class
+//
+// WorkerPool.cpp: implementation of the WorkerPool class.
+//
+//////////////////////////////////////////////////////////////////////
+
+#include "WorkerPool.h"
+
+#include <atomic>
+#include <memory>
+
+//////////////////////////////////////////////////////////////////////
+// Construction/Destruction
+//////////////////////////////////////////////////////////////////////
+
+WorkerPool::WorkerPool(int threads)
+{
+	running = 0;
+	quit = false;
+
+	// One worker per core, the calling thread helps out in ParallelFor
+	if (threads <= 0)
+		threads = (int)std::thread::hardware_concurrency();
+	if (threads <= 0)
+		threads = 1;
+
+	for (int i = 0; i < threads; i++)
+		workers.push_back(std::thread(&WorkerPool::WorkerMain, this));
+}
+
+WorkerPool::~WorkerPool()
+{
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		quit = true;
+	}
+
+	wake.notify_all();
+
+	for (size_t i = 0; i < workers.size(); i++)
+		workers[i].join();
+}
+
+WorkerPool &WorkerPool::Shared()
+{
+	static WorkerPool pool;
+	return pool;
+}
+
+void WorkerPool::Submit(const std::function<void()> &job)
+{
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		jobs.push_back(job);
+	}
+
+	wake.notify_one();
+}
+
+void WorkerPool::Wait()
+{
+	std::unique_lock<std::mutex> guard(lock);
+
+	while (!jobs.empty() || running > 0)
+		idle.wait(guard);
+}
+
+bool WorkerPool::RunOne()
+{
+	std::function<void()> job;
+
+	{
+		std::unique_lock<std::mutex> guard(lock);
+
+		if (jobs.empty())
+			return false;
+
+		job = jobs.front();
+		jobs.pop_front();
+		running++;
+	}
+
+	job();
+
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		running--;
+
+		if (jobs.empty() && running == 0)
+			idle.notify_all();
+	}
+
+	return true;
+}
+
+void WorkerPool::WorkerMain()
+{
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> guard(lock);
+
+			while (jobs.empty() && !quit)
+				wake.wait(guard);
+
+			if (quit && jobs.empty())
+				return;
+		}
+
+		RunOne();
+	}
+}
+
+void WorkerPool::ParallelFor(int count, const std::function<void(int)> &body)
+{
+	if (count <= 0)
+		return;
+
+	// The state is shared with the helper jobs, a helper that only gets
+	// to run after the loop is over must still find it alive
+	struct Loop {
+		std::function<void(int)> body;
+		std::atomic<int> next;
+		std::atomic<int> done;
+		int count;
+	};
+
+	std::shared_ptr<Loop> loop(new Loop);
+	loop->body = body;
+	loop->next = 0;
+	loop->done = 0;
+	loop->count = count;
+
+	// Takes indices until there are none left
+	std::function<void()> work = [loop]()
+	{
+		for (;;)
+		{
+			int i = loop->next++;
+
+			if (i >= loop->count)
+				return;
+
+			loop->body(i);
+			loop->done++;
+		}
+	};
+
+	// Ask for help from as many workers as can be useful
+	int helpers = (count - 1 < Size()) ? count - 1 : Size();
+
+	for (int h = 0; h < helpers; h++)
+		Submit(work);
+
+	// The calling thread works too, that way a nested loop can't stall
+	// waiting for workers that are all busy with the outer loop
+	work();
+
+	// Wait for the indices the helpers took, running other jobs meanwhile
+	while (loop->done < count)
+	{
+		if (!RunOne())
+			std::this_thread::yield();
+	}
+}
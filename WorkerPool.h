@@ -0,0 +1,61 @@
+//////////////////////////////////////////////////////////////////////
+//
+// Worker Pool Class
+//
+// WorkerPool.h: interface for the WorkerPool class.
+// This class keeps a few threads around to run the CPU
+// side of the asset loaders in parallel. Nothing that runs
+// on the pool may touch OpenGL, the GL context belongs to
+// the thread that created the window.
+//
+// Usage:
+// WorkerPool &pool = WorkerPool::Shared();	// One pool for the whole game
+//
+// pool.Submit(job);						// Runs job() on a worker
+// pool.Wait();							// Waits until every job is done
+//
+// // Calls body(0) to body(count - 1) across the workers and the
+// // calling thread and returns when all of them are done. It is safe
+// // to call this from inside a job that is already on the pool.
+// pool.ParallelFor(count, body);
+//
+//////////////////////////////////////////////////////////////////////
+
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include <functional>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+class WorkerPool
+{
+public:
+	void Submit(const std::function<void()> &job);	// Queues a job for the workers
+	void Wait();									// Waits until the queue is empty and no job is running
+	void ParallelFor(int count, const std::function<void(int)> &body);
+	int Size() const { return (int)workers.size(); }// The number of worker threads
+	static WorkerPool &Shared();					// The pool the loaders share
+	WorkerPool(int threads = 0);					// Constructor, 0 uses one thread per core
+	virtual ~WorkerPool();							// Destructor
+
+private:
+	std::vector<std::thread> workers;				// The worker threads
+	std::deque<std::function<void()> > jobs;		// The jobs waiting for a worker
+	std::mutex lock;								// Guards the queue and the counters
+	std::condition_variable wake;					// Signals the workers that there is work
+	std::condition_variable idle;					// Signals Wait that the queue drained
+	int running;									// The number of jobs being run right now
+	bool quit;										// True: the workers should exit
+
+	void WorkerMain();								// The loop every worker runs
+	bool RunOne();									// Runs one queued job on the calling thread
+
+	WorkerPool(const WorkerPool &);
+	WorkerPool &operator=(const WorkerPool &);
+};
+
+#endif WORKERPOOL_H
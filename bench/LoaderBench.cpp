@@ -0,0 +1,683 @@
+//////////////////////////////////////////////////////////////////////
+//
+// Loader Benchmark
+//
+// LoaderBench.cpp: times the asset loaders without a window.
+// It walks a directory for every .3ds, .bmp, .tga, .jpg and .png file and
+// runs the CPU side of the loader on each one a number of
+// times. Models go through Model_3DS::Decode with the mesh
+// cache turned off (unless -cache is given) and the mesh
+// optimizer turned off (unless -optimize is given), images go through
+// GLTexture::Decode, which builds their mipmaps too (with the
+// Kaiser filter if -kaiser is given) and block compresses them
+// with -compress fast, normal or best. -cache also lets them
+// read and write their baked files. A .bmp or .tga with a .jpg or
+// .png of the same size next to it is read from that file, the way
+// the game does, unless -bmp is given, and only that file gets
+// a row. No GL context is created, nothing is uploaded. A
+// model's time includes decoding its textures, the same as a
+// load in the game.
+//
+// The results are written as CSV to stdout, one row per file:
+// file, kind, runs, min/median/p99 time in ms, the bytes read
+// (of the file actually read),
+// the number of heap allocations one load makes, the vertex
+// and face counts and the vertices/faces per second at the
+// median time, then the ACMR of the model's face groups before
+// and after the optimizer (the same when it is off). A file the
+// loader can't open is reported with
+// status "failed" so it still shows up in the comparison.
+//
+// With -memory it loads every model once with packed vertices
+// instead and writes what the geometry takes: the float arrays,
+// the packed stream that replaces them for drawing, and the
+// index lists of the full meshes and the simplified levels
+// (made with -lods). With -batch the models are also merged into
+// their static batch, the report adds the draw calls of the full
+// mesh before and after and the bytes the batch takes.
+//
+// With -index it lists the objects of every model the way
+// Model_3DS::ReadIndex finds them, with the time the index took
+// next to the time of a full Decode.
+//
+// With -missing every model whose maps are read from a .jpg or
+// .png is copied to a scratch directory with only those files,
+// no bitmaps, and loaded again from there. Each such map gets a
+// row with the file it was read from, so a tree that dropped
+// its .bmp files can be checked to still find every texture.
+//
+// Built with make STATS=1 the loaders record where their time
+// goes (see LoadStats.h). -stats prints that table to stderr
+// after the run along with the texture cache's hits and misses,
+// and -json writes the table to a file.
+//
+// Usage:
+// cd bench && make
+// ./LoaderBench [-n runs] [-cache] [-optimize] [-kaiser] [-compress quality] [-bmp] [directory] > before.csv
+// ./LoaderBench -memory [-optimize] [-lods] [-batch] [directory] > memory.csv
+// ./LoaderBench -index [directory] > objects.csv
+// ./LoaderBench -missing [directory] > missing.csv
+// make clean && make STATS=1
+// ./LoaderBench -n 1 -stats [-json stats.json] [directory] > /dev/null
+//
+// The directory defaults to the repository root.
+//
+//////////////////////////////////////////////////////////////////////
+
+#include "Model_3DS.h"
+#include "BlockCompressor.h"
+#include "GLTexture.h"
+#include "LoadStats.h"
+#include "MipChain.h"
+#include "TextureCache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <string>
+#include <vector>
+
+//////////////////////////////////////////////////////////////////////
+// Allocation counting
+//////////////////////////////////////////////////////////////////////
+
+// Every operator new and every malloc made by the loader sources,
+// the Makefile wraps malloc for the objects it links in
+static std::atomic<long> allocations(0);
+
+extern "C" void *__real_malloc(size_t size);
+extern "C" void *__real_calloc(size_t count, size_t size);
+extern "C" void *__real_realloc(void *ptr, size_t size);
+
+extern "C" void *__wrap_malloc(size_t size)
+{
+	allocations++;
+	return __real_malloc(size);
+}
+
+extern "C" void *__wrap_calloc(size_t count, size_t size)
+{
+	allocations++;
+	return __real_calloc(count, size);
+}
+
+extern "C" void *__wrap_realloc(void *ptr, size_t size)
+{
+	allocations++;
+	return __real_realloc(ptr, size);
+}
+
+// A LOAD_STATS build gets its operator new from LoadStats, it
+// calls malloc so the wrapper above still counts it
+#ifndef LOAD_STATS
+void *operator new(size_t size)
+{
+	allocations++;
+
+	void *p = __real_malloc(size ? size : 1);
+
+	if (p == NULL)
+		throw std::bad_alloc();
+
+	return p;
+}
+
+void *operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+	free(p);
+}
+#endif
+
+//////////////////////////////////////////////////////////////////////
+// Benchmark
+//////////////////////////////////////////////////////////////////////
+
+enum Kind { KIND_3DS, KIND_BMP, KIND_TGA, KIND_JPG, KIND_PNG, KIND_NONE };
+
+static const char *kindNames[] = { "3ds", "bmp", "tga", "jpg", "png" };
+
+struct Result
+{
+	std::vector<double> times;	// Milliseconds per run
+	long allocations;			// Allocations made by one run
+	long long bytes;			// Bytes read by one run
+	int verts;					// Vertices in the model
+	int faces;					// Faces in the model
+	float acmrBefore;			// The face groups' ACMR as loaded
+	float acmrAfter;			// And after the optimizer
+	bool ok;					// The loader accepted the file
+};
+
+static Kind KindOf(const std::string &name)
+{
+	size_t dot = name.rfind('.');
+
+	if (dot == std::string::npos)
+		return KIND_NONE;
+
+	const char *ext = name.c_str() + dot + 1;
+
+	if (strcasecmp(ext, "3ds") == 0)
+		return KIND_3DS;
+	if (strcasecmp(ext, "bmp") == 0)
+		return KIND_BMP;
+	if (strcasecmp(ext, "tga") == 0)
+		return KIND_TGA;
+	if (strcasecmp(ext, "jpg") == 0 || strcasecmp(ext, "jpeg") == 0)
+		return KIND_JPG;
+	if (strcasecmp(ext, "png") == 0)
+		return KIND_PNG;
+
+	return KIND_NONE;
+}
+
+// Collects the files to load below dir in a stable order
+static void FindFiles(const std::string &dir, std::vector<std::string> &files)
+{
+	DIR *d = opendir(dir.c_str());
+
+	if (d == NULL)
+		return;
+
+	std::vector<std::string> names;
+
+	while (dirent *e = readdir(d))
+	{
+		// Skip ., .., .git and the build directories
+		if (e->d_name[0] == '.' || e->d_name[0] == '_')
+			continue;
+
+		names.push_back(e->d_name);
+	}
+
+	closedir(d);
+	std::sort(names.begin(), names.end());
+
+	for (size_t i = 0; i < names.size(); i++)
+	{
+		std::string path = (dir == ".") ? names[i] : dir + "/" + names[i];
+		struct stat st;
+
+		if (stat(path.c_str(), &st) != 0)
+			continue;
+
+		if (S_ISDIR(st.st_mode))
+			FindFiles(path, files);
+		else if (KindOf(path) != KIND_NONE)
+			files.push_back(path);
+	}
+}
+
+// Swaps each image for the file the loader reads in its place, so the
+// rows are named after what was timed, and drops the repeats that leaves
+static void SourceFiles(std::vector<std::string> &files)
+{
+	std::vector<std::string> sources;
+
+	for (size_t f = 0; f < files.size(); f++)
+	{
+		std::string source = files[f];
+
+		if (KindOf(files[f]) != KIND_3DS)
+			GLTexture::SourceFile(files[f].c_str(), source);
+
+		if (std::find(sources.begin(), sources.end(), source) == sources.end())
+			sources.push_back(source);
+	}
+
+	files.swap(sources);
+}
+
+static long long FileSize(const std::string &name)
+{
+	struct stat st;
+
+	if (stat(name.c_str(), &st) != 0)
+		return 0;
+
+	return (long long)st.st_size;
+}
+
+// Loads the file once and returns the time it took in ms
+static double LoadOnce(const std::string &name, Kind kind, bool cache, bool optimize, Result &result)
+{
+	std::chrono::steady_clock::time_point start, end;
+
+	if (kind == KIND_3DS)
+	{
+		Model_3DS *model = new Model_3DS;
+		model->useCache = cache;
+		model->optimize = optimize;
+
+		long before = allocations;
+		start = std::chrono::steady_clock::now();
+		result.ok = model->Decode(name.c_str());
+		end = std::chrono::steady_clock::now();
+		result.allocations = allocations - before;
+
+		result.verts = model->totalVerts;
+		result.faces = model->totalFaces;
+		result.acmrBefore = model->optimizeStats.acmrBefore;
+		result.acmrAfter = model->optimizeStats.acmrAfter;
+
+		delete model;
+	}
+	else
+	{
+		GLTexture *tex = new GLTexture;
+
+		long before = allocations;
+		start = std::chrono::steady_clock::now();
+		result.ok = tex->Decode(name.c_str());
+		end = std::chrono::steady_clock::now();
+		result.allocations = allocations - before;
+
+		result.verts = 0;
+		result.faces = 0;
+		result.acmrBefore = 0.0f;
+		result.acmrAfter = 0.0f;
+
+		tex->FreePixels();
+		delete tex;
+	}
+
+	return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+// Loads each model once and writes what its geometry takes
+static void MemoryReport(const std::vector<std::string> &files, bool optimize, bool lods, bool batch)
+{
+	printf("file,vertices,float_bytes,packed_bytes,saved_bytes,saved_percent,index_bytes,lod_bytes,draws,batched_draws,batch_bytes,status\n");
+
+	for (size_t f = 0; f < files.size(); f++)
+	{
+		if (KindOf(files[f]) != KIND_3DS)
+			continue;
+
+		Model_3DS model;
+		Model_3DS::MemoryStats mem;
+
+		model.useCache = false;
+		model.optimize = optimize;
+		model.generateLods = lods;
+		model.packVertices = true;
+		model.staticBatch = batch;
+
+		bool ok = model.Decode(files[f].c_str());
+		model.GetMemoryStats(mem);
+
+		long long saved = (long long)mem.vertexBytes - (long long)mem.packedBytes;
+
+		// The draw calls of the full mesh, one per non empty group
+		int draws = 0;
+
+		for (int i = 0; i < model.numObjects; i++)
+		{
+			for (int j = 0; j < model.Objects[i].numMatFaces; j++)
+			{
+				if (model.Objects[i].MatFaces[j].numSubFaces > 0)
+					draws++;
+			}
+		}
+
+		int batchedDraws = model.Batch ? model.Batch->numMatFaces : draws;
+
+		printf("\"%s\",%d,%zu,%zu,%lld,%.1f,%zu,%zu,%d,%d,%zu,%s\n",
+			files[f].c_str(), model.totalVerts, mem.vertexBytes, mem.packedBytes, saved,
+			mem.vertexBytes ? 100.0 * saved / mem.vertexBytes : 0.0,
+			mem.indexBytes, mem.lodBytes, draws, batchedDraws, mem.batchBytes, ok ? "ok" : "failed");
+	}
+}
+
+// Lists every model's objects from the chunk index
+static void IndexReport(const std::vector<std::string> &files)
+{
+	printf("file,object,offset,vertices,faces,index_ms,decode_ms\n");
+
+	for (size_t f = 0; f < files.size(); f++)
+	{
+		if (KindOf(files[f]) != KIND_3DS)
+			continue;
+
+		std::vector<Model_3DS::ObjectInfo> index;
+
+		auto start = std::chrono::steady_clock::now();
+		Model_3DS::ReadIndex(files[f].c_str(), index);
+		auto middle = std::chrono::steady_clock::now();
+
+		Model_3DS model;
+		model.useCache = false;
+		model.Decode(files[f].c_str());
+		auto end = std::chrono::steady_clock::now();
+
+		double indexMs = std::chrono::duration<double, std::milli>(middle - start).count();
+		double decodeMs = std::chrono::duration<double, std::milli>(end - middle).count();
+
+		for (size_t i = 0; i < index.size(); i++)
+		{
+			printf("\"%s\",\"%s\",%zu,%d,%d,%.3f,%.3f\n", files[f].c_str(), index[i].name,
+				index[i].offset, index[i].numVerts, index[i].numFaces, indexMs, decodeMs);
+		}
+	}
+}
+
+static bool CopyFile(const std::string &from, const std::string &to)
+{
+	FILE *in = fopen(from.c_str(), "rb");
+
+	if (in == NULL)
+		return false;
+
+	FILE *out = fopen(to.c_str(), "wb");
+	bool ok = out != NULL;
+	char buffer[65536];
+	size_t n;
+
+	while (ok && (n = fread(buffer, 1, sizeof(buffer), in)) > 0)
+		ok = fwrite(buffer, 1, n, out) == n;
+
+	fclose(in);
+
+	if (out != NULL && fclose(out) != 0)
+		ok = false;
+
+	return ok;
+}
+
+static std::string BaseName(const std::string &name)
+{
+	size_t slash = name.find_last_of('/');
+
+	return (slash == std::string::npos) ? name : name.substr(slash + 1);
+}
+
+// Loads the models whose maps come from a .jpg or .png again from a
+// copy that has only those files, the way they load once the .bmp
+// files are gone
+static void MissingReport(const std::vector<std::string> &files)
+{
+	printf("file,material,map,read,width,height,status\n");
+
+	char scratch[] = "/tmp/LoaderBenchXXXXXX";
+
+	if (mkdtemp(scratch) == NULL)
+	{
+		fprintf(stderr, "couldn't make a scratch directory\n");
+		return;
+	}
+
+	for (size_t f = 0; f < files.size(); f++)
+	{
+		if (KindOf(files[f]) != KIND_3DS)
+			continue;
+
+		Model_3DS model;
+		model.useCache = false;
+
+		if (!model.Decode(files[f].c_str()))
+			continue;
+
+		// The maps the model reads from a smaller file
+		std::vector<int> maps;
+		std::vector<std::string> copied;
+
+		for (int i = 0; i < model.numMaterials; i++)
+		{
+			if (!model.Materials[i].textured)
+				continue;
+
+			std::string map = std::string(model.path) + model.Materials[i].mapname;
+			std::string read;
+			GLTexture::SourceFile(map.c_str(), read);
+
+			if (read == map)
+				continue;
+
+			std::string to = std::string(scratch) + "/" + BaseName(read);
+
+			if (CopyFile(read, to))
+			{
+				maps.push_back(i);
+				copied.push_back(to);
+			}
+		}
+
+		if (maps.empty())
+			continue;
+
+		std::string copy = std::string(scratch) + "/" + BaseName(files[f]);
+
+		if (CopyFile(files[f], copy))
+		{
+			copied.push_back(copy);
+
+			Model_3DS stripped;
+			stripped.useCache = false;
+			bool ok = stripped.Decode(copy.c_str());
+
+			for (size_t m = 0; m < maps.size(); m++)
+			{
+				const Model_3DS::Material &mat = stripped.Materials[maps[m]];
+				std::string map = std::string(stripped.path) + mat.mapname;
+				std::string read;
+				GLTexture::SourceFile(map.c_str(), read);
+
+				bool loaded = ok && mat.shared != NULL && mat.shared->imageBytes > 0;
+
+				printf("\"%s\",\"%s\",\"%s\",\"%s\",%d,%d,%s\n",
+					files[f].c_str(), mat.name, mat.mapname, BaseName(read).c_str(),
+					loaded ? mat.shared->tex.width : 0, loaded ? mat.shared->tex.height : 0,
+					loaded ? "ok" : "failed");
+			}
+		}
+
+		for (size_t c = 0; c < copied.size(); c++)
+			remove(copied[c].c_str());
+	}
+
+	rmdir(scratch);
+}
+
+// The value below which p percent of the sorted times fall
+static double Percentile(const std::vector<double> &sorted, double p)
+{
+	size_t rank = (size_t)(p / 100.0 * sorted.size() + 0.5);
+
+	if (rank < 1)
+		rank = 1;
+	if (rank > sorted.size())
+		rank = sorted.size();
+
+	return sorted[rank - 1];
+}
+
+static double Median(const std::vector<double> &sorted)
+{
+	size_t n = sorted.size();
+
+	if (n % 2)
+		return sorted[n / 2];
+
+	return (sorted[n / 2 - 1] + sorted[n / 2]) * 0.5;
+}
+
+int main(int argc, char **argv)
+{
+	int runs = 10;
+	bool cache = false;
+	bool optimize = false;
+	bool memory = false;
+	bool lods = false;
+	bool batch = false;
+	bool listIndex = false;
+	bool missing = false;
+	bool stats = false;
+	bool original = false;
+	const char *json = NULL;
+	std::string dir = "..";
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+			runs = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-cache") == 0)
+			cache = true;
+		else if (strcmp(argv[i], "-bmp") == 0)
+			original = true;
+		else if (strcmp(argv[i], "-optimize") == 0)
+			optimize = true;
+		else if (strcmp(argv[i], "-memory") == 0)
+			memory = true;
+		else if (strcmp(argv[i], "-lods") == 0)
+			lods = true;
+		else if (strcmp(argv[i], "-batch") == 0)
+			batch = true;
+		else if (strcmp(argv[i], "-index") == 0)
+			listIndex = true;
+		else if (strcmp(argv[i], "-missing") == 0)
+			missing = true;
+		else if (strcmp(argv[i], "-kaiser") == 0)
+			MipChain::SetFilter(MipChain::KAISER);
+		else if (strcmp(argv[i], "-compress") == 0 && i + 1 < argc)
+		{
+			const char *quality = argv[++i];
+
+			if (strcmp(quality, "fast") == 0)
+				BlockCompressor::SetQuality(BlockCompressor::FAST);
+			else if (strcmp(quality, "best") == 0)
+				BlockCompressor::SetQuality(BlockCompressor::BEST);
+			else
+				BlockCompressor::SetQuality(BlockCompressor::NORMAL);
+		}
+		else if (strcmp(argv[i], "-stats") == 0)
+			stats = true;
+		else if (strcmp(argv[i], "-json") == 0 && i + 1 < argc)
+			json = argv[++i];
+		else if (argv[i][0] == '-')
+		{
+			fprintf(stderr, "usage: %s [-n runs] [-cache] [-optimize] [-memory] [-lods] [-batch] [-index] [-missing] [-kaiser] [-compress fast|normal|best] [-bmp] [-stats] [-json file] [directory]\n", argv[0]);
+			return 1;
+		}
+		else
+			dir = argv[i];
+	}
+
+	if (runs < 1)
+		runs = 1;
+
+	// The baked textures are a cache like the mesh cache
+	GLTexture::SetBaking(cache);
+	GLTexture::SetPreferCompressed(!original);
+
+	std::vector<std::string> files;
+	FindFiles(dir, files);
+	SourceFiles(files);
+
+	if (files.empty())
+	{
+		fprintf(stderr, "no .3ds, .bmp, .tga, .jpg or .png files under %s\n", dir.c_str());
+		return 1;
+	}
+
+	if (listIndex)
+	{
+		IndexReport(files);
+		return 0;
+	}
+
+	if (missing)
+	{
+		MissingReport(files);
+		return 0;
+	}
+
+	if (memory)
+	{
+		MemoryReport(files, optimize, lods, batch);
+		return 0;
+	}
+
+	printf("file,kind,runs,min_ms,median_ms,p99_ms,bytes_read,allocations,vertices,faces,verts_per_sec,faces_per_sec,acmr_before,acmr_after,status\n");
+
+	for (size_t f = 0; f < files.size(); f++)
+	{
+		Kind kind = KindOf(files[f]);
+		Result result;
+
+		// With the cache on, the first load bakes it and isn't timed
+		if (kind == KIND_3DS && cache)
+			LoadOnce(files[f], kind, cache, optimize, result);
+
+		for (int r = 0; r < runs; r++)
+			result.times.push_back(LoadOnce(files[f], kind, cache, optimize, result));
+
+		// The loader maps or reads the whole file once
+		std::string read = files[f];
+
+		if (kind == KIND_3DS && cache)
+		{
+			long long baked = FileSize(read + ".cache");
+
+			if (baked > 0)
+				read += ".cache";
+		}
+
+		result.bytes = result.ok ? FileSize(read) : 0;
+
+		std::sort(result.times.begin(), result.times.end());
+
+		double median = Median(result.times);
+		double seconds = median / 1000.0;
+
+		printf("\"%s\",%s,%d,%.3f,%.3f,%.3f,%lld,%ld,%d,%d,%.0f,%.0f,%.3f,%.3f,%s\n",
+			files[f].c_str(), kindNames[kind], runs,
+			result.times.front(), median, Percentile(result.times, 99.0),
+			result.bytes, result.allocations, result.verts, result.faces,
+			seconds > 0 ? result.verts / seconds : 0.0,
+			seconds > 0 ? result.faces / seconds : 0.0,
+			result.acmrBefore, result.acmrAfter,
+			result.ok ? "ok" : "failed");
+
+		fflush(stdout);
+	}
+
+	// The loader table is empty unless it was built with LOAD_STATS
+	if (stats)
+	{
+		LoadStats::Report(stderr);
+		TextureCache::Shared().Report(stderr);
+	}
+
+	if (json && !LoadStats::WriteJson(json))
+		fprintf(stderr, "couldn't write %s, build with make STATS=1\n", json);
+
+	return 0;
+}